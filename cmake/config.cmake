@@ -11,6 +11,8 @@ lfos_config(lf_os_sysroot   "${CMAKE_BINARY_DIR}/sysroot" "LF OS sysroot locatio
 lfos_config(kernel_log_max_buffer  "4*1024*1024" "Max size of buffer storing log messages")
 lfos_config(kernel_log_com0        "true"        "Log messages to platform first serial port")
 lfos_config(kernel_log_efi         "false"       "Log messages to EFI firmware variables to be persisted through reboots")
+lfos_config(kernel_max_processes   "32768"       "Max number of processes and threads existing at the same time")
+lfos_config(kernel_debug_mm        "false"       "Check every page freed into the per-CPU page caches against all of them, catches more double frees but is slow")
 
 lfos_config(loader_lfos_path       "LFOS"        "Where shall the loader search for kernel and other files")
 lfos_config(loader_efi_rt_services 1             "Enable EFI runtime services")
@@ -5,7 +5,8 @@ find_program(kvm      NAMES kvm                DOC "QEMU for x86_64 emulation wi
 find_program(gdb      NAMES gdb                DOC "GNU debugger")
 
 set(QEMU_MEMORY 512M)
-set(QEMU_FLAGS      -drive format=qcow2,file=firmware.qcow2,if=pflash,readonly=on -m ${QEMU_MEMORY} -machine q35 -d int,guest_errors --serial file:log.txt -device qemu-xhci --device isa-debugcon,iobase=0x402,chardev=debug -chardev file,id=debug,path=debug.log)
+set(QEMU_CPUS   4)
+set(QEMU_FLAGS      -drive format=qcow2,file=firmware.qcow2,if=pflash,readonly=on -m ${QEMU_MEMORY} -smp ${QEMU_CPUS} -machine q35 -d int,guest_errors --serial file:log.txt -device qemu-xhci --device isa-debugcon,iobase=0x402,chardev=debug -chardev file,id=debug,path=debug.log)
 set(QEMU_FLAGS_NVME -drive format=raw,file=hd.img,if=none,id=boot_drive -device nvme,drive=boot_drive,serial=1234)
 set(QEMU_FLAGS_PXE  -netdev user,id=net0,tftp=${CMAKE_BINARY_DIR}/shared,bootfile=/EFI/LFOS/BOOTX64.efi -device virtio-net,netdev=net0,romfile=)
 
@@ -10,6 +10,7 @@
 #define EAGAIN       11
 #define ENOMEM       12
 #define EACCES       13
+#define EFAULT       14
 #define EBUSY        16
 #define EEXIST       17
 #define ENOTDIR      20
@@ -27,6 +28,7 @@
 #define ENAMETOOLONG 36
 #define ENOSYS       38
 #define ENOMSG       42
+#define EDEADLK      45
 #define EOVERFLOW    75
 #define EFTYPE       79
 #define EILSEQ       84
@@ -64,6 +64,9 @@ struct Message {
 
         struct HardwareInterruptUserData {
             uint16_t interrupt;
+
+            //! Time the kernel received the interrupt, like clock_read
+            uint64_t timestamp_ns;
         } HardwareInterrupt;
 
         struct ServiceDiscoveryData {
@@ -60,7 +60,32 @@ struct PageAllocatorBase {
                         return allocate_bootstrap_pages(n);
                     }
 
-                    return reinterpret_cast<value_type*>(vm_context_alloc_pages(VM_KERNEL_CONTEXT, ALLOCATOR_REGION_KERNEL_HEAP, page_count * n));
+                    if(page_count == 1) {
+                        return reinterpret_cast<value_type*>(vm_context_alloc_pages(VM_KERNEL_CONTEXT, ALLOCATOR_REGION_KERNEL_HEAP, n));
+                    }
+
+                    // users find the page of an address by masking, so pages have to be aligned to
+                    // PageSize: allocate an extra page worth of memory and give back what is not needed
+                    size_t   num   = (page_count * (n + 1)) - 1;
+                    uint64_t start = vm_context_alloc_pages(VM_KERNEL_CONTEXT, ALLOCATOR_REGION_KERNEL_HEAP, num);
+
+                    if(!start) {
+                        return 0;
+                    }
+
+                    uint64_t aligned = (start + PageSize - 1) & ~(PageSize - 1);
+                    size_t   head    = (aligned - start) / 4096;
+                    size_t   tail    = num - head - (page_count * n);
+
+                    if(head) {
+                        vm_context_free_pages(VM_KERNEL_CONTEXT, start, head);
+                    }
+
+                    if(tail) {
+                        vm_context_free_pages(VM_KERNEL_CONTEXT, aligned + (page_count * n * 4096), tail);
+                    }
+
+                    return reinterpret_cast<value_type*>(aligned);
                 }
 
                 static void deallocate_pages(value_type* p, size_t n) {
@@ -71,13 +96,7 @@ struct PageAllocatorBase {
                         return deallocate_bootstrap_pages(p, n);
                     }
 
-
-                    uint64_t vir = reinterpret_cast<uint64_t>(p);
-                    for(size_t i = 0; i < page_count * n; ++i) {
-                        uint64_t phy = vm_context_get_physical_for_virtual(VM_KERNEL_CONTEXT, vir);
-                        vm_context_unmap(VM_KERNEL_CONTEXT, vir + (i * 4096));
-                        mm_mark_physical_pages(phy, 1, MM_FREE);
-                    }
+                    vm_context_free_pages(VM_KERNEL_CONTEXT, reinterpret_cast<uint64_t>(p), page_count * n);
                 }
         };
 };
@@ -3,11 +3,9 @@
 
 #include <stddef.h>
 #include <stdint.h>
-#include <forward_list>
-#include <bitset>
+#include <new>
 
 #include "page.h"
-#include "../bitset_helpers.h"
 
 class SizedAllocatorBase {
     public:
@@ -24,57 +22,106 @@ class SizedAllocatorBase {
                 uint8_t v[S];
             }__attribute__((packed));
 
+            /**
+             * A page full of slots. Pages are aligned to PageSize, so the page
+             * of any slot is found by masking its address.
+             */
             template<size_t PageSize>
             class page_t {
                 private:
-                    struct header_t {
-                        size_t max_continuous_free;
-                    };
-
-                    using bitmap_t = std::bitset<PageSize / S>;
+                    static const size_t bitmap_words = ((PageSize / S) + 63) / 64;
 
                 public:
                     static const size_t max_entries = (
                         PageSize
-                      - sizeof(header_t)
-                      - sizeof(bitmap_t)
-                      - 8 // pages are stored in a std::forward_list, which needs another 8 bytes per entry
+                      - (2 * sizeof(page_t*)) // list pointers
+                      - sizeof(size_t)        // used
+                      - (bitmap_words * 8)
                     ) / S;
 
+                    page_t* prev;
+                    page_t* next;
+
                 private:
-                    header_t _header;
-                    bitmap_t _bitmap;
+                    //! Number of slots in use
+                    size_t   _used;
+
+                    //! Bit set for every slot in use
+                    uint64_t _bitmap[bitmap_words];
                     slot_t   _data[max_entries];
 
                 public:
-                    page_t() {
-                        _header.max_continuous_free = max_entries;
+                    page_t() : prev(0), next(0), _used(0) {
+                        for(size_t i = 0; i < bitmap_words; ++i) {
+                            _bitmap[i] = 0;
+                        }
+
+                        // bits after the last slot are never free
+                        if(max_entries % 64) {
+                            _bitmap[max_entries / 64] = ~0ULL << (max_entries % 64);
+                        }
+
+                        for(size_t i = (max_entries + 63) / 64; i < bitmap_words; ++i) {
+                            _bitmap[i] = ~0ULL;
+                        }
+                    }
+
+                    static page_t* of(const void* p) {
+                        return reinterpret_cast<page_t*>(reinterpret_cast<uint64_t>(p) & ~(PageSize - 1));
                     }
 
                     size_t num_free() const {
-                        return max_entries - _bitmap.count();
+                        return max_entries - _used;
                     }
 
                     bool empty() const {
-                        return _bitmap.none();
+                        return !_used;
+                    }
+
+                    bool full() const {
+                        return _used == max_entries;
                     }
 
                     slot_t* allocate(size_t n) {
-                        if(_header.max_continuous_free < n) {
+                        if(num_free() < n) {
                             return 0;
                         }
 
-                        size_t start = bitset_helpers<PageSize / S>::find_continuous_unset(_bitmap, n);
-                        if(start >= max_entries) {
-                            // can we get here, with the check if we have enough continues
-                            // entries in this page on entry of this method?
+                        if(n == 1) {
+                            for(size_t word = 0; word < bitmap_words; ++word) {
+                                if(~_bitmap[word]) {
+                                    size_t bit = __builtin_ctzll(~_bitmap[word]);
+                                    _bitmap[word] |= 1ULL << bit;
+                                    ++_used;
+
+                                    return &_data[(word * 64) + bit];
+                                }
+                            }
+
                             return 0;
                         }
 
-                        bitset_helpers<PageSize / S>::set_range(_bitmap, start, n);
+                        size_t run = 0;
+                        for(size_t i = 0; i < max_entries;) {
+                            // skip fully used words at once
+                            if(!(i % 64) && _bitmap[i / 64] == ~0ULL) {
+                                run = 0;
+                                i  += 64;
+                                continue;
+                            }
 
-                        update_header();
-                        return &_data[start];
+                            run = test(i) ? 0 : run + 1;
+                            ++i;
+
+                            if(run == n) {
+                                set_range(i - n, n, true);
+                                _used += n;
+
+                                return &_data[i - n];
+                            }
+                        }
+
+                        return 0;
                     }
 
                     bool deallocate(slot_t* p, size_t n) {
@@ -90,36 +137,35 @@ class SizedAllocatorBase {
                             return false;
                         }
 
-                        for(size_t index = 0; index < max_entries; ++index) {
-                            if(&_data[index] == p) {
-                                bitset_helpers<PageSize / S>::set_range(_bitmap, index, n, false);
+                        size_t index = p - _data;
+
+                        for(size_t i = 0; i < n; ++i) {
+                            if(index + i >= max_entries || !test(index + i)) {
+                                loge("SizedAllocator", "Slot %d of page 0x%x is not allocated", index + i, this);
+                                return false;
                             }
                         }
 
+                        set_range(index, n, false);
+                        _used -= n;
 
-                        update_header();
                         return true;
                     }
 
                 private:
-                    void update_header() {
-                        size_t max_free = 0;
-                        size_t current_count = 0;
-                        for(size_t i = 0; i < max_entries; ++i) {
-                            if(_bitmap.test(i)) {
-                                if(current_count > max_free) {
-                                    max_free = current_count;
-                                }
-                                current_count = 0;
-                            } else {
-                                ++current_count;
-                            }
-                        }
+                    bool test(size_t i) const {
+                        return _bitmap[i / 64] & (1ULL << (i % 64));
+                    }
 
-                        if(current_count > max_free) {
-                            max_free = current_count;
+                    void set_range(size_t start, size_t n, bool value) {
+                        for(size_t i = start; i < start + n; ++i) {
+                            if(value) {
+                                _bitmap[i / 64] |=  (1ULL << (i % 64));
+                            }
+                            else {
+                                _bitmap[i / 64] &= ~(1ULL << (i % 64));
+                            }
                         }
-                        _header.max_continuous_free = max_free;
                     }
             };
         };
@@ -132,14 +178,49 @@ template<
       : S > 1 * KiB ? 2 * MiB
       :               4 * KiB
     ),
-    class PageAllocator = ::PageAllocator
+    class PageAllocatorType = PageAllocator
 >
 class SizedAllocator : public SizedAllocatorBase {
-    using page_t     = Helpers<S>::template page_t<PageSize>;
-    using slot_t     = Helpers<S>::slot_t;
-    using list_t     = std::forward_list<page_t, typename PageAllocator::template allocator<page_t, PageSize>>;
+    friend class SizedAllocatorTest;
+
+    using page_t           = Helpers<S>::template page_t<PageSize>;
+    using slot_t           = Helpers<S>::slot_t;
+    using page_allocator_t = typename PageAllocatorType::template allocator<page_t, PageSize>;
+
+    //! Pages with free and used slots, allocations are served from the first one
+    static page_t* partial_pages;
+
+    //! Pages without any free slot
+    static page_t* full_pages;
+
+    //! Empty page kept for the next allocation, so a single slot allocated and freed repeatedly does not map a page each time
+    static page_t* free_page;
 
-    static list_t pages;
+    static void list_push(page_t** list, page_t* page) {
+        page->prev = 0;
+        page->next = *list;
+
+        if(*list) {
+            (*list)->prev = page;
+        }
+
+        *list = page;
+    }
+
+    static void list_remove(page_t** list, page_t* page) {
+        if(page->prev) {
+            page->prev->next = page->next;
+        }
+        else {
+            *list = page->next;
+        }
+
+        if(page->next) {
+            page->next->prev = page->prev;
+        }
+
+        page->prev = page->next = 0;
+    }
 
     public:
         using value_type = slot_t*;
@@ -150,22 +231,49 @@ class SizedAllocator : public SizedAllocatorBase {
 
         template<class T>
         T* allocate(size_t n) {
-            if(n > page_t::max_entries) {
+            if(!n || n > page_t::max_entries) {
                 return 0; // can't allocate more than what fits in a single page
             }
 
-            auto last_page = pages.before_begin();
-            for(auto it = pages.begin(); it != pages.end(); ++it) {
-                slot_t* ret = it->allocate(n);
-                if(ret) {
-                    return reinterpret_cast<T*>(ret);
+            page_t* page = partial_pages;
+            slot_t* ret  = 0;
+
+            if(n == 1) {
+                // every partial page has a free slot
+                if(page) {
+                    ret = page->allocate(1);
+                }
+            }
+            else {
+                // continuous slots might be anywhere
+                for(; page && !(ret = page->allocate(n)); page = page->next) {
                 }
+            }
+
+            if(!ret) {
+                page      = free_page;
+                free_page = 0;
+
+                if(!page) {
+                    page = page_allocator_t().allocate(1);
+
+                    if(!page) {
+                        return 0;
+                    }
 
-                last_page = it;
+                    new(page) page_t();
+                }
+
+                ret = page->allocate(n);
+                list_push(&partial_pages, page);
+            }
+
+            if(page->full()) {
+                list_remove(&partial_pages, page);
+                list_push(&full_pages, page);
             }
 
-            auto new_page = pages.emplace_after(last_page);
-            return reinterpret_cast<T*>(new_page->allocate(n));
+            return reinterpret_cast<T*>(ret);
         }
 
         virtual void* allocate(size_t n) override {
@@ -174,20 +282,30 @@ class SizedAllocator : public SizedAllocatorBase {
 
         template<class T>
         void deallocate(T* p, size_t n) {
-            auto previous = pages.before_begin();
+            page_t* page     = page_t::of(p);
+            bool    was_full = page->full();
 
-            for(auto it = pages.begin(); it != pages.end(); ++it) {
-                if(it->deallocate(reinterpret_cast<slot_t*>(p), n)) {
-                    if(it->empty()) {
-                        pages.erase_after(previous);
-                    }
-                    return;
-                }
+            if(!page->deallocate(reinterpret_cast<slot_t*>(p), n)) {
+                loge("SizedAllocator", "Cannot deallocate allocation of %d entries at 0x%x", n, p);
+                return;
+            }
 
-                previous = it;
+            if(was_full) {
+                list_remove(&full_pages, page);
+                list_push(&partial_pages, page);
             }
 
-            loge("SizedAllocator", "Cannot deallocate allocation of %d entries at 0x%x: page not found!", n, p);
+            if(page->empty()) {
+                list_remove(&partial_pages, page);
+
+                if(!free_page) {
+                    free_page = page;
+                }
+                else {
+                    page->~page_t();
+                    page_allocator_t().deallocate(page, 1);
+                }
+            }
         }
 
         virtual void deallocate(void* ptr, size_t n) override {
@@ -195,11 +313,13 @@ class SizedAllocator : public SizedAllocatorBase {
         }
 };
 
-template<
-    size_t S,
-    size_t PageSize,
-    class PageAllocator
->
-SizedAllocator<S, PageSize, PageAllocator>::list_t SizedAllocator<S, PageSize, PageAllocator>::pages;
+template<size_t S, size_t PageSize, class PageAllocatorType>
+SizedAllocator<S, PageSize, PageAllocatorType>::page_t* SizedAllocator<S, PageSize, PageAllocatorType>::partial_pages = 0;
+
+template<size_t S, size_t PageSize, class PageAllocatorType>
+SizedAllocator<S, PageSize, PageAllocatorType>::page_t* SizedAllocator<S, PageSize, PageAllocatorType>::full_pages = 0;
+
+template<size_t S, size_t PageSize, class PageAllocatorType>
+SizedAllocator<S, PageSize, PageAllocatorType>::page_t* SizedAllocator<S, PageSize, PageAllocatorType>::free_page = 0;
 
 #endif
@@ -0,0 +1,152 @@
+#include "lapic.h"
+#include "msr.h"
+#include "vm.h"
+
+#include <log.h>
+
+extern void sc_handle_clock_read(uint64_t* nanoseconds);
+
+#define LAPIC_MSR_BASE        0x1B
+#define LAPIC_BASE_ENABLE     (1 << 11)
+
+#define LAPIC_REG_ID          0x020
+#define LAPIC_REG_EOI         0x0B0
+#define LAPIC_REG_SVR         0x0F0
+#define LAPIC_REG_ICR_LOW     0x300
+#define LAPIC_REG_ICR_HIGH    0x310
+#define LAPIC_REG_LVT_TIMER   0x320
+#define LAPIC_REG_TIMER_INIT  0x380
+#define LAPIC_REG_TIMER_CUR   0x390
+#define LAPIC_REG_TIMER_DIV   0x3E0
+
+#define LAPIC_SVR_ENABLE      (1 << 8)
+#define LAPIC_LVT_MASKED      (1 << 16)
+
+#define LAPIC_ICR_INIT        (5 << 8)
+#define LAPIC_ICR_STARTUP     (6 << 8)
+#define LAPIC_ICR_PENDING     (1 << 12)
+#define LAPIC_ICR_ASSERT      (1 << 14)
+
+//! Divide configuration for a divisor of 16
+#define LAPIC_TIMER_DIV_16    0x3
+
+//! Time to count timer ticks against the clock for calibration
+static const uint64_t lapic_calibration_ns = 10000000;
+
+static volatile uint32_t* lapic = 0;
+
+//! Timer ticks per millisecond, 0 while the timer is not calibrated
+static uint64_t lapic_ticks_per_ms = 0;
+
+static uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+static void lapic_calibrate(void) {
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+
+    uint64_t start, now;
+    sc_handle_clock_read(&start);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0xFFFFFFFF);
+
+    do {
+        sc_handle_clock_read(&now);
+    } while(now - start < lapic_calibration_ns);
+
+    uint64_t ticks = 0xFFFFFFFF - lapic_read(LAPIC_REG_TIMER_CUR);
+    lapic_write(LAPIC_REG_TIMER_INIT, 0);
+
+    lapic_ticks_per_ms = ticks * 1000000 / (now - start);
+}
+
+//! Enable the local APIC of the calling CPU, every CPU sees its own one at the same address
+static void lapic_enable(void) {
+    write_msr(LAPIC_MSR_BASE, read_msr(LAPIC_MSR_BASE) | LAPIC_BASE_ENABLE);
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+void init_lapic(void) {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid":"=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx):"a"(1), "c"(0));
+
+    if(!(edx & (1 << 9))) {
+        logw("lapic", "No local APIC, staying with the HPET for timer interrupts");
+        return;
+    }
+
+    uint64_t base = read_msr(LAPIC_MSR_BASE);
+
+    lapic = (volatile uint32_t*)vm_context_find_free(VM_KERNEL_CONTEXT, ALLOCATOR_REGION_SLAB_4K, 1);
+    vm_context_map(VM_KERNEL_CONTEXT, (uint64_t)lapic, base & ~0xFFFULL, 6);
+
+    lapic_enable();
+
+    lapic_calibrate();
+
+    if(!lapic_ticks_per_ms) {
+        logw("lapic", "Local APIC timer does not count, staying with the HPET for timer interrupts");
+        return;
+    }
+
+    // one-shot, the scheduler programs every interrupt for the next thing it has to do
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR);
+
+    logi("lapic", "Local APIC timer at %u ticks per ms", lapic_ticks_per_ms);
+}
+
+void init_lapic_ap(void) {
+    lapic_enable();
+
+    lapic_write(LAPIC_REG_TIMER_DIV, LAPIC_TIMER_DIV_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_VECTOR);
+}
+
+uint32_t lapic_id(void) {
+    return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+bool lapic_timer_available(void) {
+    return lapic_ticks_per_ms;
+}
+
+void lapic_timer_oneshot(uint64_t nanoseconds) {
+    uint64_t ticks = 0xFFFFFFFF;
+
+    // longer times fire early, the scheduler then just programs the rest
+    if(nanoseconds < 0xFFFFFFFFULL * 1000000 / lapic_ticks_per_ms) {
+        // the interrupt must not be lost because the time rounds down to 0 ticks
+        ticks = (nanoseconds * lapic_ticks_per_ms + 999999) / 1000000;
+    }
+
+    lapic_write(LAPIC_REG_TIMER_INIT, ticks);
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+static void lapic_send(uint32_t apic_id, uint32_t command) {
+    lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW,  command);
+
+    while(lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING) {
+        asm volatile("pause");
+    }
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    lapic_send(apic_id, LAPIC_ICR_ASSERT | vector);
+}
+
+void lapic_send_init(uint32_t apic_id) {
+    lapic_send(apic_id, LAPIC_ICR_ASSERT | LAPIC_ICR_INIT);
+}
+
+void lapic_send_startup(uint32_t apic_id, uint64_t page) {
+    lapic_send(apic_id, LAPIC_ICR_ASSERT | LAPIC_ICR_STARTUP | (page >> 12));
+}
@@ -0,0 +1,62 @@
+#ifndef _LAPIC_H_INCLUDED
+#define _LAPIC_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//! Interrupt vector of the local APIC timer
+#define LAPIC_TIMER_VECTOR    48
+
+//! Interrupt vector the local APIC delivers spurious interrupts on, needs no EOI
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+
+/**
+ * Enable the local APIC of the calling CPU and calibrate its timer against the
+ * clock. Needs a working sc_handle_clock_read and interrupts disabled.
+ */
+void init_lapic(void);
+
+//! Enable the local APIC of an application processor, using the calibration of the bootstrap processor
+void init_lapic_ap(void);
+
+//! Local APIC ID of the calling CPU
+uint32_t lapic_id(void);
+
+//! Check if the local APIC timer is calibrated and usable
+bool lapic_timer_available(void);
+
+/**
+ * Program the local APIC timer to fire once after the given time, replacing
+ * any earlier one-shot.
+ *
+ * \param nanoseconds Time until the interrupt, 0 to stop the timer
+ */
+void lapic_timer_oneshot(uint64_t nanoseconds);
+
+//! Signal the end of an interrupt delivered by the local APIC
+void lapic_eoi(void);
+
+/**
+ * Send an interrupt to another CPU.
+ *
+ * \param apic_id Local APIC ID of the target CPU
+ * \param vector  Interrupt vector to raise on the target
+ */
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+/**
+ * Reset another CPU, the first step of starting an application processor.
+ *
+ * \param apic_id Local APIC ID of the target CPU
+ */
+void lapic_send_init(uint32_t apic_id);
+
+/**
+ * Make a CPU waiting after lapic_send_init start executing in real mode.
+ *
+ * \param apic_id Local APIC ID of the target CPU
+ * \param page    Physical address of the page to start at, below 1 MiB
+ */
+void lapic_send_startup(uint32_t apic_id, uint64_t page);
+
+#endif
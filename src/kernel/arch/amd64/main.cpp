@@ -13,6 +13,8 @@
 #include <string.h>
 #include <pic.h>
 #include <pit.h>
+#include <lapic.h>
+#include <smp.h>
 #include <slab.h>
 #include <log.h>
 #include <efi.h>
@@ -74,6 +76,8 @@ extern "C" void main(struct LoaderStruct* loaderStruct) {
         "Initialized mutex subsystem",
         init_mutex();
         init_condvar();
+        init_semaphore();
+        init_rwlock();
     )
 
     INIT_STEP(
@@ -96,6 +100,7 @@ extern "C" void main(struct LoaderStruct* loaderStruct) {
         "Initialized interrupt management",
         init_pic();
         init_pit();
+        init_lapic();
     )
 
     INIT_STEP(
@@ -113,6 +118,11 @@ extern "C" void main(struct LoaderStruct* loaderStruct) {
         init_init(loaderStruct);
     )
 
+    INIT_STEP(
+        "Started application processors",
+        init_smp();
+    )
+
     logi("kernel", "Kernel initialization complete");
 
     LAST_INIT_STEP = (char*)"Kernel initialization complete";
@@ -150,6 +160,7 @@ void init_mm(struct LoaderStruct* loaderStruct) {
             desc_status[i % 80] = '-';
             pages_free += desc->num_pages;
             mm_mark_physical_pages(desc->start_address, desc->num_pages, MM_FREE);
+            smp_reserve_trampoline(desc->start_address, desc->num_pages);
         }
         else if(desc->flags & MEMORY_REGION_FIRMWARE) {
             desc_status[i % 80] = 'F';
@@ -2,9 +2,12 @@
 #include "msr.h"
 #include "string.h"
 #include "mm.h"
+#include "kmalloc.h"
 #include "cpu.h"
 #include "scheduler.h"
 #include "pic.h"
+#include "lapic.h"
+#include "smp.h"
 #include "panic.h"
 #include "vm.h"
 #include "mq.h"
@@ -67,12 +70,27 @@ struct tss {
     uint16_t iopb_offset;
 }__attribute__((packed));
 
+//! Data of a single CPU, %gs points here while in the kernel
 typedef struct {
-    uint64_t      kernel_stack;
-    struct tss tss;
+    //! Top of the kernel stack, used by _syscall_handler
+    uint64_t         kernel_stack;
+
+    //! Index of the CPU, see smp_cpu_id
+    uint64_t         id;
+
+    //! IOPB pages currently mapped into the TSS, see enable_iopb
+    uint64_t         iopb_pages[2];
+
+    //! Context and iopb_generation the IOPB pages were last checked for
+    struct vm_table* iopb_context;
+    uint64_t         iopb_generation;
+
+    struct gdt_entry gdt[8];
+    struct tss       tss;
 } cpu_local_data;
 
 extern void sc_handle(cpu_state* cpu);
+extern void sc_handle_clock_read(uint64_t* nanoseconds);
 
 extern "C" void _syscall_handler(void);
 extern "C" void reload_cs(void);
@@ -125,16 +143,23 @@ extern "C" void idt_entry_44(void);
 extern "C" void idt_entry_45(void);
 extern "C" void idt_entry_46(void);
 extern "C" void idt_entry_47(void);
+extern "C" void idt_entry_48(void);
+extern "C" void idt_entry_49(void);
+extern "C" void idt_entry_50(void);
+extern "C" void idt_entry_255(void);
 
-static cpu_local_data*  _cpu0;
+static cpu_local_data*  _cpus[SMP_MAX_CPUS];
 static struct idt_entry _idt[256];
 
 static flexarray_t interrupt_queues[16] = { 0 };
 
+//! Incremented whenever a context gets another IOPB, so CPUs running it map the new one
+static uint64_t iopb_generation = 0;
+
 void set_iopb(struct vm_table* context, uint64_t new_iopb) {
     static uint64_t originalPages[2] = {0, 0};
 
-    uint64_t iopb = (uint64_t)&_cpu0->tss + _cpu0->tss.iopb_offset;
+    uint64_t iopb = (uint64_t)&_cpus[0]->tss + _cpus[0]->tss.iopb_offset;
 
     if(!originalPages[0] && !originalPages[1]) {
         originalPages[0] = vm_context_get_physical_for_virtual(VM_KERNEL_CONTEXT, iopb);
@@ -149,23 +174,37 @@ void set_iopb(struct vm_table* context, uint64_t new_iopb) {
         vm_context_map(context, ALLOCATOR_REGION_USER_IOPERM.start,         new_iopb, 0);
         vm_context_map(context, ALLOCATOR_REGION_USER_IOPERM.start + 4*KiB, new_iopb * 4*KiB, 0);
     }
+
+    ++iopb_generation;
 }
 
-void init_gdt(void) {
-    _cpu0 = (cpu_local_data*)vm_context_alloc_pages(VM_KERNEL_CONTEXT, ALLOCATOR_REGION_KERNEL_HEAP, 4);
-    memset(_cpu0, 0, 4*KiB);
-    memset((char*)_cpu0 + 4*KiB, 0xFF, 12*KiB);
+void release_iopb(struct vm_table* context) {
+    // a new context might get the same address, it must not look like this one
+    for(uint32_t id = 0; id < smp_cpu_count(); ++id) {
+        if(_cpus[id]->iopb_context == context) {
+            _cpus[id]->iopb_context = 0;
+        }
+    }
+}
+
+void sc_prepare_cpu(uint32_t id) {
+    cpu_local_data* cpu = (cpu_local_data*)vm_context_alloc_pages(VM_KERNEL_CONTEXT, ALLOCATOR_REGION_KERNEL_HEAP, 4);
+    memset(cpu, 0, 4*KiB);
+    memset((char*)cpu + 4*KiB, 0xFF, 12*KiB);
 
     uint64_t kernel_stack = vm_context_alloc_pages(VM_KERNEL_CONTEXT, ALLOCATOR_REGION_KERNEL_HEAP, 1) + 4096;
 
-    _cpu0->tss._reserved1  = 0;
-    _cpu0->tss._reserved2  = 0;
-    _cpu0->tss._reserved3  = 0;
-    _cpu0->tss.iopb_offset = 0x1000 - ((uint64_t)&_cpu0->tss & 0xFFF);
-    _cpu0->tss.ist1 = _cpu0->tss.rsp0 = _cpu0->tss.rsp1 = _cpu0->tss.rsp2 = _cpu0->kernel_stack = kernel_stack;
+    cpu->id            = id;
+    cpu->iopb_pages[0] = -1ULL;
+    cpu->iopb_pages[1] = -1ULL;
+
+    cpu->tss._reserved1  = 0;
+    cpu->tss._reserved2  = 0;
+    cpu->tss._reserved3  = 0;
+    cpu->tss.iopb_offset = 0x1000 - ((uint64_t)&cpu->tss & 0xFFF);
+    cpu->tss.ist1 = cpu->tss.rsp0 = cpu->tss.rsp1 = cpu->tss.rsp2 = cpu->kernel_stack = kernel_stack;
 
-    static struct gdt_entry gdt[8];
-    memset((uint8_t*)gdt,  0, sizeof(gdt));
+    struct gdt_entry* gdt = cpu->gdt;
 
     // kernel CS
     gdt[1].type = GDT_SYSTEM | GDT_PRESENT | GDT_RW | GDT_EXECUTE;
@@ -191,16 +230,20 @@ void init_gdt(void) {
     // TSS
     gdt[6].type     = GDT_PRESENT | GDT_ACCESSED | GDT_EXECUTE;
     gdt[6].limitLow = sizeof(struct tss) + (8*KiB) + 1;
-    gdt[6].baseLow  = ((uint64_t)&_cpu0->tss & 0xFFFF);
-    gdt[6].baseMid  = ((uint64_t)&_cpu0->tss >> 16) & 0xFF;
-    gdt[6].baseHigh = ((uint64_t)&_cpu0->tss >> 24) & 0xFF;
+    gdt[6].baseLow  = ((uint64_t)&cpu->tss & 0xFFFF);
+    gdt[6].baseMid  = ((uint64_t)&cpu->tss >> 16) & 0xFF;
+    gdt[6].baseHigh = ((uint64_t)&cpu->tss >> 24) & 0xFF;
     gdt[7].type     = 0;
-    gdt[7].limitLow = ((uint64_t)&_cpu0->tss >> 32) & 0xFFFF;
-    gdt[7].baseLow  = ((uint64_t)&_cpu0->tss >> 48) & 0xFFFF;
+    gdt[7].limitLow = ((uint64_t)&cpu->tss >> 32) & 0xFFFF;
+    gdt[7].baseLow  = ((uint64_t)&cpu->tss >> 48) & 0xFFFF;
 
+    _cpus[id] = cpu;
+}
+
+void init_gdt_cpu(uint32_t id) {
     struct table_pointer gdtp = {
-        .limit = sizeof(gdt) -1,
-        .base  = (uint64_t)gdt,
+        .limit = sizeof(_cpus[id]->gdt) - 1,
+        .base  = (uint64_t)_cpus[id]->gdt,
     };
 
     asm("lgdt %0"::"m"(gdtp));
@@ -208,6 +251,11 @@ void init_gdt(void) {
     asm("ltr %%ax"::"a"(6 << 3));
 }
 
+void init_gdt(void) {
+    sc_prepare_cpu(0);
+    init_gdt_cpu(0);
+}
+
 void interrupt_del_queue(uint8_t interrupt, uint64_t mq) {
     flexarray_t array;
     uint64_t idx;
@@ -298,16 +346,18 @@ static void _setup_idt(void) {
     _set_idt_entry(45, (uint64_t)idt_entry_45);
     _set_idt_entry(46, (uint64_t)idt_entry_46);
     _set_idt_entry(47, (uint64_t)idt_entry_47);
+    _set_idt_entry(LAPIC_TIMER_VECTOR,    (uint64_t)idt_entry_48);
+    _set_idt_entry(SMP_RESCHEDULE_VECTOR, (uint64_t)idt_entry_49);
+    _set_idt_entry(SMP_TLB_VECTOR,        (uint64_t)idt_entry_50);
+    _set_idt_entry(LAPIC_SPURIOUS_VECTOR, (uint64_t)idt_entry_255);
+}
 
+void init_sc_cpu(uint32_t id) {
     struct table_pointer idtp = {
         .limit = sizeof(_idt) - 1,
         .base  = (uint64_t)_idt,
     };
     asm("lidt %0"::"m"(idtp));
-}
-
-void init_sc(void) {
-    _setup_idt();
 
     asm("mov $0xC0000080, %%rcx\n"
         "rdmsr\n"
@@ -317,22 +367,49 @@ void init_sc(void) {
     write_msr(0xC0000081, 0x001B000800000000);
     write_msr(0xC0000082, (uint64_t)_syscall_handler);
     write_msr(0xC0000084, 0x200); // disable interrupts on syscall
-    write_msr(0xC0000102, (uint64_t)(_cpu0));
+
+    // kernel GS base while in the kernel, swapped with the user one on every switch between the two
+    write_msr(0xC0000101, (uint64_t)(_cpus[id]));
+    write_msr(0xC0000102, 0);
+}
+
+void init_sc(void) {
+    _setup_idt();
+    init_sc_cpu(0);
+    smp_enable_cpu_id();
 }
 
 static void enable_iopb(struct vm_table* context) {
+    cpu_local_data* cpu = _cpus[smp_cpu_id()];
+
+    // release_iopb forgets freed contexts, so the same pointer is the same context
+    if(cpu->iopb_context == context && cpu->iopb_generation == iopb_generation) {
+        return;
+    }
+
+    cpu->iopb_context    = context;
+    cpu->iopb_generation = iopb_generation;
+
     uint64_t iopb_pages[2] = {
         vm_context_get_physical_for_virtual(context, ALLOCATOR_REGION_USER_IOPERM.start),
         vm_context_get_physical_for_virtual(context, ALLOCATOR_REGION_USER_IOPERM.start + 4*KiB),
     };
 
-    uint64_t iopb = (uint64_t)&_cpu0->tss + _cpu0->tss.iopb_offset;
+    // the TSS is mapped in the kernel half shared by all contexts, so this only changes with the IOPB
+    uint64_t* mapped_pages = cpu->iopb_pages;
 
-    vm_context_map(context, iopb,         iopb_pages[0], 0);
-    vm_context_map(context, iopb + 4*KiB, iopb_pages[1], 0);
+    if(iopb_pages[0] == mapped_pages[0] && iopb_pages[1] == mapped_pages[1]) {
+        return;
+    }
+
+    uint64_t iopb = (uint64_t)&cpu->tss + cpu->tss.iopb_offset;
 
-    asm("invlpg (%0)"::"r"(iopb));
-    asm("invlpg (%0)"::"r"(iopb + (4*KiB)));
+    // global mapping, invalidated for every PCID; only this CPU uses its TSS
+    vm_context_map_local(context, iopb,         iopb_pages[0], 0);
+    vm_context_map_local(context, iopb + 4*KiB, iopb_pages[1], 0);
+
+    mapped_pages[0] = iopb_pages[0];
+    mapped_pages[1] = iopb_pages[1];
 }
 
 static cpu_state* schedule_process(cpu_state* old_cpu) {
@@ -358,7 +435,7 @@ static bool handle_userspace_exception(cpu_state* cpu) {
         }
     }
 
-    logw("sc", "Process %d caused exception %u for reason %u at 0x%x, cpu dump below", scheduler_current_process, cpu->interrupt,cpu->error_code, cpu->rip);
+    logw("sc", "Process %d caused exception %u for reason %u at 0x%x, cpu dump below", scheduler_current(), cpu->interrupt,cpu->error_code, cpu->rip);
     DUMP_CPU(cpu);
 
     // exception in user space
@@ -373,7 +450,7 @@ static bool handle_userspace_exception(cpu_state* cpu) {
 }
 
 __attribute__ ((force_align_arg_pointer))
-extern "C" cpu_state* interrupt_handler(cpu_state* cpu) {
+static cpu_state* interrupt_dispatch(cpu_state* cpu) {
     scheduler_process_save(cpu);
 
     if(cpu->interrupt < 32) {
@@ -397,45 +474,91 @@ extern "C" cpu_state* interrupt_handler(cpu_state* cpu) {
 
         uint8_t irq = cpu->interrupt - 0x20;
         if(interrupt_queues[irq]) {
+            uint64_t now;
+            sc_handle_clock_read(&now);
+
             size_t len             = flexarray_length(interrupt_queues[irq]);
             const uint64_t* queues = (uint64_t*)flexarray_getall(interrupt_queues[irq]);
 
             size_t user_size    = sizeof(Message::UserData::HardwareInterruptUserData);
             size_t size         = sizeof(Message) + user_size;
-            Message* msg        = (Message*)vm_alloc(size);
+            Message* msg        = (Message*)kmalloc(size);
 
-            msg->size                                  = size;
-            msg->user_size                             = user_size;
-            msg->type                                  = MT_HardwareInterrupt;
-            msg->sender                                = -1;
-            msg->user_data.HardwareInterrupt.interrupt = irq;
+            msg->size                                     = size;
+            msg->user_size                                = user_size;
+            msg->type                                     = MT_HardwareInterrupt;
+            msg->sender                                   = -1;
+            msg->user_data.HardwareInterrupt.interrupt    = irq;
+            msg->user_data.HardwareInterrupt.timestamp_ns = now;
 
             for(size_t i = 0; i < len; ++i) {
                 mq_push(queues[i], msg);
             }
 
-            vm_free(msg);
+            kfree(msg);
         }
     }
+    else if(cpu->interrupt == LAPIC_TIMER_VECTOR || cpu->interrupt == SMP_RESCHEDULE_VECTOR) {
+        lapic_eoi();
+    }
 
     return schedule_process(cpu);
 }
 
-__attribute__ ((force_align_arg_pointer))
-extern "C" cpu_state* syscall_handler(cpu_state* cpu) {
+extern "C" cpu_state* interrupt_handler(cpu_state* cpu) {
+    // the sender of a shootdown holds the kernel lock while waiting for us
+    if(cpu->interrupt == SMP_TLB_VECTOR) {
+        smp_handle_tlb_ipi();
+        return cpu;
+    }
+    else if(cpu->interrupt == LAPIC_SPURIOUS_VECTOR) {
+        return cpu;
+    }
+
+    smp_enter_kernel();
+    cpu_state* new_cpu = interrupt_dispatch(cpu);
+    scheduler_resume();
+    smp_leave_kernel(new_cpu->cs & 3);
+
+    return new_cpu;
+}
+
+/**
+ * Handle a syscall. Returns cpu itself when the calling process continues,
+ * which _syscall_handler then returns to with sysretq.
+ */
+static cpu_state* syscall_dispatch(cpu_state* cpu) {
+    // clone copies the registers of the calling process
     scheduler_process_save(cpu);
     sc_handle(cpu);
-    scheduler_process_save(cpu);
-
-    cpu_state*  new_cpu = cpu; // for idle task we only change some fields,
-                               // allocating a new cpu for that is ..
-                               // correct but slow, so we just reuse the old one
-    struct vm_table* new_context = vm_current_context();
 
-    if(schedule_next_if_needed(&new_cpu, &new_context)) {
-        vm_context_activate(new_context);
+    if(!scheduler_switch_needed()) {
+        // ioperm may have given the process another IOPB
+        enable_iopb(vm_current_context());
+        return cpu;
     }
 
+    // keep the results of the syscall for when the process runs again
+    scheduler_process_save(cpu);
+
+    cpu_state*       new_cpu = cpu; // for idle task we only change some fields,
+                                    // allocating a new cpu for that is ..
+                                    // correct but slow, so we just reuse the old one
+    struct vm_table* new_context;
+
+    schedule_next(&new_cpu, &new_context);
+    vm_context_activate(new_context);
     enable_iopb(new_context);
+    scheduler_resume();
+
+    return new_cpu;
+}
+
+__attribute__ ((force_align_arg_pointer))
+extern "C" cpu_state* syscall_handler(cpu_state* cpu) {
+    smp_enter_kernel();
+    cpu_state* new_cpu = syscall_dispatch(cpu);
+    smp_leave_kernel(new_cpu->cs & 3);
+
     return new_cpu;
 }
@@ -7,9 +7,26 @@
 void init_gdt(void);
 void init_sc(void);
 
+/**
+ * Allocate the per-CPU data of a CPU: TSS, GDT and kernel stack. Called by
+ * the bootstrap processor for every CPU before starting it.
+ *
+ * \param id Index of the CPU, see smp_cpu_id
+ */
+void sc_prepare_cpu(uint32_t id);
+
+//! Load the GDT and TSS prepared by sc_prepare_cpu on the calling CPU
+void init_gdt_cpu(uint32_t id);
+
+//! Load the IDT and set up syscalls and %gs on the calling CPU
+void init_sc_cpu(uint32_t id);
+
 void interrupt_add_queue(uint8_t interrupt, uint64_t mq);
 void interrupt_del_queue(uint8_t interrupt, uint64_t mq);
 
 void set_iopb(struct vm_table* context, uint64_t task_iopb);
 
+//! Forget the IOPB state cached for a context that is about to be freed
+void release_iopb(struct vm_table* context);
+
 #endif
@@ -1,7 +1,9 @@
+#include <config.h>
 #include <scheduler.h>
 #include <string.h>
 #include <errno.h>
 #include <mm.h>
+#include <kmalloc.h>
 #include <sc.h>
 #include <bitmap.h>
 #include <panic.h>
@@ -10,12 +12,17 @@
 #include <mq.h>
 #include <signal.h>
 #include <sd.h>
+#include <timer.h>
+#include <lapic.h>
+#include <smp.h>
+#include <slab.h>
+#include <vm.h>
 #include <unused_param.h>
 
 extern void sc_handle_clock_read(uint64_t* nanoseconds);
+extern void hpet_set_deadline(uint64_t timestamp_ns_since_boot);
 
 typedef enum {
-    process_state_empty = 0,
     process_state_waiting,
     process_state_runnable,
     process_state_running,
@@ -23,113 +30,882 @@ typedef enum {
     process_state_killed,
 } process_state;
 
+//! Stack region of an exited thread, kept for the next thread of the same address space
+struct scheduler_free_stack {
+    uint64_t                     limit;
+    struct scheduler_free_stack* next;
+};
+
+//! Address space of a process, shared by all of its threads
 typedef struct {
-    char name[1024];
+    struct vm_table* context;
+
+    //! Number of threads using this address space
+    uint64_t refcount;
+
+    region_t heap;
+    region_t hw;
+
+    //! Top of the stack region for the next thread
+    uint64_t next_stack;
+
+    //! Stack regions of exited threads, reused before taking a new one at next_stack
+    struct scheduler_free_stack* free_stacks;
+
+    //! Physical address of the first of two IOPB pages, 0 if no IO privilege granted
+    uint64_t iopb;
+} process_memory_t;
+
+struct scheduler_slab;
+
+typedef struct process {
+    pid_t         pid;
+    char*         name;
 
     pid_t         parent;
     uint8_t       exit_code;
     process_state state;
 
+    //! Nice value between SCHEDULER_NICE_MIN and SCHEDULER_NICE_MAX, lower gets more CPU time
+    int8_t        nice;
+
+    //! Share of CPU time relative to other processes, derived from nice
+    uint32_t      weight;
+
+    //! Real-time priority, higher runs first and before every process with 0, which is the fair class
+    uint8_t       rt_priority;
+
+    //! CPU time used, scaled by SCHEDULER_WEIGHT_DEFAULT / weight. The runnable process with the lowest runs next
+    uint64_t      vruntime;
+
+    //! CPU time used in nanoseconds
+    uint64_t      runtime;
+
+    //! Time the process was last put on a CPU, valid while running
+    uint64_t      run_start;
+
+    //! CPU whose ready heap this process is in while runnable, the one it ran on last otherwise
+    uint32_t      cpu_index;
+
+    //! Position in the ready heap of its CPU while runnable in the fair class
+    size_t        ready_index;
+
+    //! Links in the real-time queue of its priority while runnable or in the wait queue of waiting_queue
+    struct process* queue_prev;
+    struct process* queue_next;
+
+    //! Wait queue of the object this process waits for, 0 if not waiting or waiting for time
+    struct scheduler_queue* waiting_queue;
+
+    //! Armed while waiting for time
+    struct timer sleep_timer;
+
+    //! Mutexes locked by this process, linked through the mutexes, see mutex.cpp
+    struct mutex_data* held_mutexes;
+
+    //! Reader-writer locks held by this process, see rwlock.cpp
+    struct rwlock_hold* held_rwlocks;
+
+    //! Finishes the syscall the process waits in when it runs again, see scheduler_wait_resume
+    scheduler_resume_t resume;
+    void*              resume_data;
+
     enum wait_reason waiting_for;
     union wait_data  waiting_data;
 
-    region_t         heap;
-    region_t         stack;
-    region_t         hw;
-    mq_id_t          mq;
-    struct vm_table* context;
-    cpu_state        cpu;
+    region_t          stack;
+    mq_id_t           mq;
 
-    //! Physical address of the first of two IOPB pages, 0 if no IO privilege granted
-    uint64_t iopb;
+    //! Lowest address the stack of this thread may grow to
+    uint64_t          stack_limit;
+
+    process_memory_t* memory;
+    cpu_state         cpu;
 
     allocator_t allocator;
     size_t allocatedMemory;
+
+    //! Slab this object was allocated from
+    struct scheduler_slab* slab;
 } process_t;
 
+//! Stack size of the first thread of a process
+#define SCHEDULER_MAIN_STACK_SIZE   (1*GiB)
+
+//! Stack size of every other thread
+#define SCHEDULER_THREAD_STACK_SIZE (16*MiB)
+
 #define INVALID_PID (pid_t)-1
-pid_t scheduler_current_process = INVALID_PID;
 
-// TODO: better data structure here. A binary tree with prev/next pointers should be great
-#define MAX_PROCS 4096
-static process_t processes[MAX_PROCS];
+//! PIDs per leaf of the PID map, a leaf is about a page of pointers
+#define SCHEDULER_PID_LEAF_SIZE 512
+#define SCHEDULER_PID_LEAVES    ((SCHEDULER_MAX_PROCESSES + SCHEDULER_PID_LEAF_SIZE - 1) / SCHEDULER_PID_LEAF_SIZE)
+
+//! Part of the PID map, allocated when the first PID in its range is used and freed with the last one
+struct scheduler_pid_leaf {
+    size_t     used;
+    process_t* processes[SCHEDULER_PID_LEAF_SIZE];
+};
+
+//! Two level radix tree from PID to process, the only way to find a process by its PID
+static struct scheduler_pid_leaf* scheduler_pid_map[SCHEDULER_PID_LEAVES];
+
+//! Bit set for every PID in use. PID 0 is never handed out, clone returns it to the new process
+static uint8_t scheduler_pid_bitmap[(SCHEDULER_MAX_PROCESSES + 63) / 64 * 8] = { 1 };
+
+//! Where to start looking for a free PID, PIDs are handed out in ascending order to not reuse them right away
+static pid_t scheduler_next_pid = 1;
+
+//! Pages per slab of process objects
+#define SCHEDULER_SLAB_PAGES 4
+
+/**
+ * Header of a slab of process objects, followed by the slab.h region. Slabs
+ * with free objects are kept in a list, full ones are only found through
+ * their objects.
+ */
+struct scheduler_slab {
+    struct scheduler_slab* prev;
+    struct scheduler_slab* next;
+
+    //! Number of processes allocated from this slab
+    size_t used;
+} __attribute__((aligned(64)));
+
+static struct scheduler_slab* scheduler_slabs_partial = 0;
+
+//! Longest time a process runs before others get their turn
+#define SCHEDULER_TIMESLICE_NS (10*1000*1000)
+
+//! Range of nice values, 0 is the default
+#define SCHEDULER_NICE_MIN -20
+#define SCHEDULER_NICE_MAX  19
+
+//! Weight of a process with nice 0, its vruntime advances in real time
+#define SCHEDULER_WEIGHT_DEFAULT 1024
+
+//! Weight per nice value, each step is about 10% more or less CPU time relative to another process
+static const uint32_t scheduler_nice_weights[SCHEDULER_NICE_MAX - SCHEDULER_NICE_MIN + 1] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
+/**
+ * How far behind the CPU's min_vruntime a waking process is placed. Processes
+ * that sleep a lot, like interactive ones, run before busy ones when woken up,
+ * but cannot save up CPU time by sleeping for long.
+ */
+#define SCHEDULER_WAKEUP_CREDIT_NS (SCHEDULER_TIMESLICE_NS / 2)
+
+/**
+ * Number of real-time priorities, 0 not being one of them. Real-time processes
+ * run first in, first out within their priority until they block or yield,
+ * without a time slice.
+ */
+#define SCHEDULER_RT_PRIORITIES 64
+
+/**
+ * Real-time processes get at most SCHEDULER_RT_RUNTIME_NS of every
+ * SCHEDULER_RT_PERIOD_NS on a CPU while fair processes are runnable there, so
+ * a busy one cannot starve everything else. They run on unthrottled if
+ * nothing else wants the CPU.
+ */
+#define SCHEDULER_RT_PERIOD_NS  (1000*1000*1000)
+#define SCHEDULER_RT_RUNTIME_NS (SCHEDULER_RT_PERIOD_NS / 100 * 95)
+
+//! Scheduling state of a single CPU
+struct scheduler_cpu {
+    //! Process running on this CPU, INVALID_PID while idle
+    pid_t current;
+
+    //! Min-heap of runnable processes ordered by vruntime, the running process is not queued
+    struct process** ready;
+
+    //! Number of processes in the ready heap, idle CPUs steal from the busiest one
+    size_t ready_count;
+    size_t ready_capacity;
+
+    //! Lower bound of the vruntime on this CPU, only ever increases
+    uint64_t min_vruntime;
+
+    //! Runnable real-time processes per priority, served before the ready heap
+    struct scheduler_queue rt_ready[SCHEDULER_RT_PRIORITIES];
+
+    //! Bit set for every real-time priority with a non-empty queue
+    uint64_t rt_levels;
+
+    //! Number of processes in the real-time queues
+    size_t rt_count;
+
+    //! Start of the current real-time period and time real-time processes ran in it, see SCHEDULER_RT_RUNTIME_NS
+    uint64_t rt_period_start;
+    uint64_t rt_used;
+
+    //! A process was woken that has to replace the running one right away
+    bool preempt;
+
+    //! Time spent in the idle task since boot, not counting the current idle period
+    uint64_t idle_ns;
+
+    //! Number of times the idle task was entered
+    uint64_t idle_entries;
+
+    //! Time the idle task was entered, valid while idling is set
+    uint64_t idle_since;
+    bool     idling;
+
+    //! Page the idle task clears for the pre-zeroed pool, 0 if none. Kept when it is interrupted, as it restarts from scratch
+    void* zero_page;
+
+    //! Stack the idle task runs on, enough for clearing pages and handing them to mm
+    uint8_t idle_stack[1024] __attribute__((aligned(16)));
+};
+
+static struct scheduler_cpu scheduler_cpus[SMP_MAX_CPUS];
+
+//! Bit set for every CPU in its idle task that was not asked to look for work yet
+static uint64_t scheduler_idle_cpus = 0;
+
+static struct scheduler_cpu* scheduler_local(void) {
+    return &scheduler_cpus[smp_cpu_id()];
+}
+
+pid_t scheduler_current(void) {
+    return scheduler_local()->current;
+}
+
+//! Process with the given PID, 0 if there is none
+static process_t* scheduler_process(pid_t pid) {
+    if(pid >= SCHEDULER_MAX_PROCESSES) {
+        return 0;
+    }
+
+    struct scheduler_pid_leaf* leaf = scheduler_pid_map[pid / SCHEDULER_PID_LEAF_SIZE];
+    return leaf ? leaf->processes[pid % SCHEDULER_PID_LEAF_SIZE] : 0;
+}
+
+//! Process running on the calling CPU, must not be called from the idle task
+static process_t* scheduler_current_process(void) {
+    return scheduler_process(scheduler_local()->current);
+}
+
+//! Give the process a PID and enter it into the PID map, false if all are in use or out of memory
+static bool scheduler_pid_alloc(process_t* process) {
+    pid_t pid = bitmap_find_clear_from(scheduler_pid_bitmap, scheduler_next_pid, SCHEDULER_MAX_PROCESSES);
+
+    if(pid == SCHEDULER_MAX_PROCESSES) {
+        pid = bitmap_find_clear(scheduler_pid_bitmap, scheduler_next_pid);
+
+        if(pid == scheduler_next_pid) {
+            return false;
+        }
+    }
+
+    struct scheduler_pid_leaf** leaf = &scheduler_pid_map[pid / SCHEDULER_PID_LEAF_SIZE];
+
+    if(!*leaf) {
+        *leaf = (struct scheduler_pid_leaf*)kmalloc(sizeof(struct scheduler_pid_leaf));
+
+        if(!*leaf) {
+            return false;
+        }
+
+        memset(*leaf, 0, sizeof(struct scheduler_pid_leaf));
+    }
+
+    (*leaf)->processes[pid % SCHEDULER_PID_LEAF_SIZE] = process;
+    ++(*leaf)->used;
+
+    bitmap_set(scheduler_pid_bitmap, pid);
+    scheduler_next_pid = pid + 1 < SCHEDULER_MAX_PROCESSES ? pid + 1 : 1;
+    process->pid       = pid;
+
+    return true;
+}
+
+static void scheduler_pid_free(pid_t pid) {
+    struct scheduler_pid_leaf** leaf = &scheduler_pid_map[pid / SCHEDULER_PID_LEAF_SIZE];
+
+    (*leaf)->processes[pid % SCHEDULER_PID_LEAF_SIZE] = 0;
+
+    if(!--(*leaf)->used) {
+        kfree(*leaf);
+        *leaf = 0;
+    }
+
+    bitmap_clear(scheduler_pid_bitmap, pid);
+}
+
+static SlabHeader* scheduler_slab_region(struct scheduler_slab* slab) {
+    return (SlabHeader*)(slab + 1);
+}
+
+static void scheduler_slab_link(struct scheduler_slab* slab) {
+    slab->prev = 0;
+    slab->next = scheduler_slabs_partial;
+
+    if(slab->next) {
+        slab->next->prev = slab;
+    }
+
+    scheduler_slabs_partial = slab;
+}
+
+static void scheduler_slab_unlink(struct scheduler_slab* slab) {
+    if(slab->prev) {
+        slab->prev->next = slab->next;
+    }
+    else {
+        scheduler_slabs_partial = slab->next;
+    }
+
+    if(slab->next) {
+        slab->next->prev = slab->prev;
+    }
+
+    slab->prev = slab->next = 0;
+}
+
+//! Allocate a zeroed process object, 0 if out of memory
+static process_t* scheduler_process_new(void) {
+    struct scheduler_slab* slab = scheduler_slabs_partial;
+
+    if(!slab) {
+        slab = (struct scheduler_slab*)vm_context_alloc_pages(VM_KERNEL_CONTEXT, ALLOCATOR_REGION_KERNEL_HEAP, SCHEDULER_SLAB_PAGES);
+
+        if(!slab) {
+            return 0;
+        }
+
+        slab->used = 0;
+        init_slab((uint64_t)scheduler_slab_region(slab), (uint64_t)slab + (SCHEDULER_SLAB_PAGES * 4*KiB), sizeof(process_t));
+        scheduler_slab_link(slab);
+    }
+
+    process_t* process = (process_t*)slab_alloc(scheduler_slab_region(slab));
+    memset((void*)process, 0, sizeof(process_t));
+    process->slab = slab;
+
+    if(++slab->used == scheduler_slab_region(slab)->num_entries) {
+        scheduler_slab_unlink(slab);
+    }
+
+    return process;
+}
+
+static void scheduler_process_delete(process_t* process) {
+    struct scheduler_slab* slab   = process->slab;
+    SlabHeader*            region = scheduler_slab_region(slab);
+
+    slab_free(region, (uint64_t)process);
+
+    if(slab->used-- == region->num_entries) {
+        scheduler_slab_link(slab);
+    }
+
+    // keep the last one, so starting and exiting a single process does not map and unmap pages every time
+    if(!slab->used && (slab->prev || slab->next)) {
+        scheduler_slab_unlink(slab);
+        vm_context_free_pages(VM_KERNEL_CONTEXT, (uint64_t)slab, SCHEDULER_SLAB_PAGES);
+    }
+}
+
+//! Replace the name of a process with a copy of the given one
+static void scheduler_set_name(process_t* process, const char* name) {
+    size_t len = strlen(name);
+
+    if(process->name) {
+        kfree(process->name);
+    }
+
+    process->name = (char*)kmalloc(len + 1);
+    memcpy(process->name, name, len + 1);
+}
+
+static void scheduler_queue_push(struct scheduler_queue* queue, process_t* process) {
+    process->queue_prev = queue->tail;
+    process->queue_next = 0;
+
+    if(queue->tail) {
+        queue->tail->queue_next = process;
+    }
+    else {
+        queue->head = process;
+    }
+
+    queue->tail = process;
+}
+
+static void scheduler_queue_push_front(struct scheduler_queue* queue, process_t* process) {
+    process->queue_prev = 0;
+    process->queue_next = queue->head;
+
+    if(queue->head) {
+        queue->head->queue_prev = process;
+    }
+    else {
+        queue->tail = process;
+    }
+
+    queue->head = process;
+}
+
+static void scheduler_queue_remove(struct scheduler_queue* queue, process_t* process) {
+    if(process->queue_prev) {
+        process->queue_prev->queue_next = process->queue_next;
+    }
+    else {
+        queue->head = process->queue_next;
+    }
+
+    if(process->queue_next) {
+        process->queue_next->queue_prev = process->queue_prev;
+    }
+    else {
+        queue->tail = process->queue_prev;
+    }
+
+    process->queue_prev = process->queue_next = 0;
+}
+
+static void scheduler_ready_place(struct scheduler_cpu* cpu, process_t* process, size_t index) {
+    cpu->ready[index]    = process;
+    process->ready_index = index;
+}
+
+static void scheduler_ready_sift_up(struct scheduler_cpu* cpu, size_t index) {
+    process_t* process = cpu->ready[index];
+
+    while(index) {
+        size_t parent = (index - 1) / 2;
+
+        if(cpu->ready[parent]->vruntime <= process->vruntime) {
+            break;
+        }
+
+        scheduler_ready_place(cpu, cpu->ready[parent], index);
+        index = parent;
+    }
+
+    scheduler_ready_place(cpu, process, index);
+}
+
+static void scheduler_ready_sift_down(struct scheduler_cpu* cpu, size_t index) {
+    process_t* process = cpu->ready[index];
+
+    while(true) {
+        size_t child = (index * 2) + 1;
+
+        if(child >= cpu->ready_count) {
+            break;
+        }
+
+        if(child + 1 < cpu->ready_count && cpu->ready[child + 1]->vruntime < cpu->ready[child]->vruntime) {
+            ++child;
+        }
+
+        if(process->vruntime <= cpu->ready[child]->vruntime) {
+            break;
+        }
+
+        scheduler_ready_place(cpu, cpu->ready[child], index);
+        index = child;
+    }
+
+    scheduler_ready_place(cpu, process, index);
+}
+
+static void scheduler_ready_push(struct scheduler_cpu* cpu, process_t* process) {
+    if(cpu->ready_count == cpu->ready_capacity) {
+        size_t      capacity = cpu->ready_capacity ? cpu->ready_capacity * 2 : 64;
+        process_t** ready    = (process_t**)kmalloc(capacity * sizeof(process_t*));
+
+        if(!ready) {
+            panic_message("Out of memory for the ready heap");
+        }
+
+        if(cpu->ready) {
+            memcpy(ready, cpu->ready, cpu->ready_count * sizeof(process_t*));
+            kfree(cpu->ready);
+        }
+
+        cpu->ready          = ready;
+        cpu->ready_capacity = capacity;
+    }
+
+    scheduler_ready_place(cpu, process, cpu->ready_count++);
+    scheduler_ready_sift_up(cpu, process->ready_index);
+}
+
+static void scheduler_ready_remove(struct scheduler_cpu* cpu, process_t* process) {
+    size_t index = process->ready_index;
+
+    if(index == --cpu->ready_count) {
+        return;
+    }
+
+    // fill the hole with the last process, which may belong above or below it
+    process_t* last = cpu->ready[cpu->ready_count];
+
+    scheduler_ready_place(cpu, last, index);
+    scheduler_ready_sift_up(cpu, index);
+    scheduler_ready_sift_down(cpu, last->ready_index);
+}
+
+static void scheduler_rt_push(struct scheduler_cpu* cpu, process_t* process, bool front) {
+    struct scheduler_queue* queue = &cpu->rt_ready[process->rt_priority];
+
+    if(front) {
+        scheduler_queue_push_front(queue, process);
+    }
+    else {
+        scheduler_queue_push(queue, process);
+    }
+
+    cpu->rt_levels |= 1ULL << process->rt_priority;
+    ++cpu->rt_count;
+}
+
+static void scheduler_rt_remove(struct scheduler_cpu* cpu, process_t* process) {
+    struct scheduler_queue* queue = &cpu->rt_ready[process->rt_priority];
+    scheduler_queue_remove(queue, process);
+    --cpu->rt_count;
+
+    if(!queue->head) {
+        cpu->rt_levels &= ~(1ULL << process->rt_priority);
+    }
+}
+
+//! Take a process out of the queue its current state puts it in
+static void scheduler_dequeue(process_t* process) {
+    if(process->state == process_state_runnable) {
+        struct scheduler_cpu* cpu = &scheduler_cpus[process->cpu_index];
+
+        if(process->rt_priority) {
+            scheduler_rt_remove(cpu, process);
+        }
+        else {
+            scheduler_ready_remove(cpu, process);
+        }
+    }
+    else if(process->state == process_state_waiting && process->waiting_for == wait_reason_time) {
+        timer_cancel(&process->sleep_timer);
+    }
+    else if(process->state == process_state_waiting && process->waiting_queue) {
+        scheduler_queue_remove(process->waiting_queue, process);
+        process->waiting_queue = 0;
+    }
+}
+
+//! Put a process into the queue its current state puts it in, at the end for FIFO queues
+static void scheduler_enqueue(process_t* process) {
+    if(process->state == process_state_runnable) {
+        struct scheduler_cpu* cpu = &scheduler_cpus[process->cpu_index];
+
+        if(process->rt_priority) {
+            scheduler_rt_push(cpu, process, false);
+        }
+        else {
+            scheduler_ready_push(cpu, process);
+        }
+    }
+    else if(process->state == process_state_waiting && process->waiting_for == wait_reason_time) {
+        timer_arm(&process->sleep_timer, process->waiting_data.timestamp_ns_since_boot);
+    }
+    else if(process->state == process_state_waiting && process->waiting_queue) {
+        scheduler_queue_push(process->waiting_queue, process);
+    }
+}
+
+static void scheduler_set_state(process_t* process, process_state state) {
+    scheduler_dequeue(process);
+    process->state = state;
+    scheduler_enqueue(process);
+}
+
+/**
+ * Get an idle CPU to look for work after a process became runnable. Prefers
+ * the CPU the process is queued on, any other idle one steals it otherwise.
+ */
+static void scheduler_kick(process_t* process) {
+    uint32_t self = smp_cpu_id();
+    uint64_t idle = scheduler_idle_cpus & ~(1ULL << self);
+
+    // an idle CPU waking its own process picks it up itself in a moment
+    if(!idle || (process->cpu_index == self && scheduler_cpus[self].current == INVALID_PID)) {
+        return;
+    }
+
+    uint32_t target = (idle & (1ULL << process->cpu_index)) ? process->cpu_index : __builtin_ctzll(idle);
+
+    // asked once is enough, it marks itself idle again if it finds nothing to do
+    scheduler_idle_cpus &= ~(1ULL << target);
+    smp_send_reschedule(target);
+}
+
+//! True if real-time processes used up their time of the period on the given CPU and fair ones are waiting
+static bool scheduler_rt_throttled(struct scheduler_cpu* cpu) {
+    return cpu->rt_used >= SCHEDULER_RT_RUNTIME_NS && cpu->ready_count;
+}
+
+/**
+ * Have the CPU a runnable real-time process is queued on switch to it right
+ * away if it runs something less important. Idle CPUs are woken by
+ * scheduler_kick instead.
+ */
+static void scheduler_preempt(process_t* process) {
+    struct scheduler_cpu* cpu = &scheduler_cpus[process->cpu_index];
+
+    if(!process->rt_priority || cpu->current == INVALID_PID || scheduler_process(cpu->current)->rt_priority >= process->rt_priority) {
+        return;
+    }
+
+    // out of real-time budget, it would not be picked anyway
+    if(scheduler_rt_throttled(cpu)) {
+        return;
+    }
+
+    // interrupts reschedule anyway, syscalls check this before returning
+    if(cpu == scheduler_local()) {
+        cpu->preempt = true;
+    }
+    else {
+        smp_send_reschedule(process->cpu_index);
+    }
+}
+
+//! Make a process runnable and find a CPU for it
+static void scheduler_make_runnable(process_t* process) {
+    struct scheduler_cpu* cpu = &scheduler_cpus[process->cpu_index];
+
+    // a short wait gives a bit of priority, a long one does not put it ahead of everything else for long
+    if(cpu->min_vruntime > SCHEDULER_WAKEUP_CREDIT_NS && process->vruntime < cpu->min_vruntime - SCHEDULER_WAKEUP_CREDIT_NS) {
+        process->vruntime = cpu->min_vruntime - SCHEDULER_WAKEUP_CREDIT_NS;
+    }
+
+    scheduler_set_state(process, process_state_runnable);
+    scheduler_preempt(process);
+    scheduler_kick(process);
+}
+
+//! Move a process to the real-time class with the given priority or back to the fair class with 0
+static void scheduler_set_rt_priority(process_t* process, uint8_t rt_priority) {
+    scheduler_dequeue(process);
+
+    // start level with the fair processes of its CPU, the vruntime is stale after running real-time
+    if(process->rt_priority && !rt_priority) {
+        process->vruntime = scheduler_cpus[process->cpu_index].min_vruntime;
+    }
+
+    process->rt_priority = rt_priority;
+    scheduler_enqueue(process);
+
+    if(process->state == process_state_runnable) {
+        scheduler_preempt(process);
+    }
+}
+
+static void scheduler_sleep_expired(struct timer* timer) {
+    scheduler_make_runnable((process_t*)timer->data);
+}
+
+//! Runnable process to run next on the given CPU: real-time ones by priority, then the lowest vruntime. 0 if none
+static process_t* scheduler_ready_first(struct scheduler_cpu* cpu) {
+    if(cpu->rt_levels && !scheduler_rt_throttled(cpu)) {
+        return cpu->rt_ready[63 - __builtin_clzll(cpu->rt_levels)].head;
+    }
+
+    return cpu->ready_count ? cpu->ready[0] : 0;
+}
+
+//! Number of runnable processes queued on the given CPU
+static size_t scheduler_ready_total(struct scheduler_cpu* cpu) {
+    return cpu->ready_count + cpu->rt_count;
+}
+
+//! Take work from the CPU with the most runnable processes, 0 if there is none anywhere
+static process_t* scheduler_steal(struct scheduler_cpu* local) {
+    struct scheduler_cpu* busiest = 0;
+
+    for(uint32_t i = 0; i < smp_cpu_count(); ++i) {
+        size_t ready = scheduler_ready_total(&scheduler_cpus[i]);
+
+        if(ready && (!busiest || ready > scheduler_ready_total(busiest))) {
+            busiest = &scheduler_cpus[i];
+        }
+    }
+
+    if(!busiest) {
+        return 0;
+    }
+
+    process_t* process = scheduler_ready_first(busiest);
+    scheduler_dequeue(process);
+
+    // vruntime is relative to the CPU, keep the distance to the min_vruntime of the old one
+    if(!process->rt_priority) {
+        int64_t lag = (int64_t)(process->vruntime - busiest->min_vruntime);
+        process->vruntime = (lag < 0 && (uint64_t)-lag > local->min_vruntime) ? 0 : local->min_vruntime + lag;
+    }
+
+    process->cpu_index = local - scheduler_cpus;
+    scheduler_enqueue(process);
+
+    return process;
+}
 
 void* process_alloc(allocator_t* alloc, size_t size) {
-    if(!alloc                                               ||
-        processes[alloc->tag].state == process_state_exited ||
-        processes[alloc->tag].state == process_state_killed ||
-        processes[alloc->tag].state == process_state_empty
+    process_t* process = alloc ? scheduler_process(alloc->tag) : 0;
+
+    if(!process                                 ||
+        process->state == process_state_exited ||
+        process->state == process_state_killed
     ) {
         logw("scheduler", "process_alloc called for invalid process %u\n", alloc->tag);
         return 0;
     }
 
-    processes[alloc->tag].allocatedMemory += size;
+    process->allocatedMemory += size;
+
+    return kmalloc(size);
+}
+
+void process_dealloc(allocator_t* alloc, void* ptr) {
+    process_t* process = alloc ? scheduler_process(alloc->tag) : 0;
+
+    if(!process) {
+        logw("scheduler", "process_dealloc called for invalid process %u\n", alloc->tag);
+        return;
+    }
+
+    size_t size = *((size_t*)ptr - 1);
+    kfree(ptr);
+
+    process->allocatedMemory -= size;
+}
+
+/* Clears pages for the pre-zeroed pool with interrupts enabled and without
+ * the kernel lock, which it only takes to hand the page over and get the
+ * next. Any interrupt may replace it with a process or restart it. */
+static void __attribute__((noreturn)) idle_task(void) {
+    struct scheduler_cpu* local = scheduler_local();
+
+    while(local->zero_page) {
+        uint64_t* page  = (uint64_t*)(ALLOCATOR_REGION_DIRECT_MAPPING.start + (uint64_t)local->zero_page);
+        uint64_t  count = 4096 / sizeof(uint64_t);
+
+        // general purpose registers only, interrupts do not save the SSE state
+        asm volatile("rep stosq":"+D"(page), "+c"(count):"a"(0ULL):"memory");
+
+        // an interrupt taking the kernel lock while we hold it would never get it
+        asm volatile("cli");
+        smp_enter_kernel();
+
+        mm_zero_pool_add(local->zero_page);
+        local->zero_page = mm_zero_pool_reserve();
+
+        smp_leave_kernel(false);
+        asm volatile("sti");
+    }
+
+    while(true) {
+        asm volatile("hlt");
+    }
+}
+
+void init_scheduler(void) {
+    for(size_t i = 0; i < SMP_MAX_CPUS; ++i) {
+        scheduler_cpus[i].current = INVALID_PID;
+    }
+}
+
+static process_memory_t* scheduler_memory_new(struct vm_table* context) {
+    process_memory_t* memory = (process_memory_t*)kmalloc(sizeof(process_memory_t));
+    memset(memory, 0, sizeof(process_memory_t));
+
+    memory->context  = context;
+    memory->refcount = 1;
+
+    memory->hw.start = ALLOCATOR_REGION_USER_HARDWARE.start;
+    memory->hw.end   = ALLOCATOR_REGION_USER_HARDWARE.start;
 
-    return vm_alloc(size);
+    memory->next_stack = (ALLOCATOR_REGION_USER_STACK.end & ~0xFFFULL) - SCHEDULER_MAIN_STACK_SIZE;
+
+    return memory;
 }
 
-void process_dealloc(allocator_t* alloc, void* ptr) {
-    if(!alloc || processes[alloc->tag].state == process_state_empty) {
-        logw("scheduler", "process_dealloc called for invalid process %u\n", alloc->tag);
+static void scheduler_memory_release(process_memory_t* memory) {
+    if(--memory->refcount) {
         return;
     }
 
-    size_t size = *((size_t*)ptr - 1);
-    vm_free(ptr);
+    while(memory->free_stacks) {
+        struct scheduler_free_stack* free_stack = memory->free_stacks;
+        memory->free_stacks = free_stack->next;
+        kfree(free_stack);
+    }
 
-    processes[alloc->tag].allocatedMemory -= size;
-}
+    if(memory->iopb) {
+        mm_mark_physical_pages(memory->iopb, 2, MM_FREE);
+    }
 
-__attribute__((naked)) static void idle_task(void) {
-    asm("jmp .");
+    release_iopb(memory->context);
+    vm_context_free(memory->context);
+    kfree(memory);
 }
 
-void init_scheduler(void) {
-    memset((uint8_t*)processes, 0, sizeof(process_t) * MAX_PROCS);
-}
+//! Create a runnable process with default settings, 0 if at the process limit or out of memory
+static process_t* setup_process(const char* name) {
+    process_t* process = scheduler_process_new();
 
-pid_t free_pid(void) {
-    pid_t i;
-    for(i = 0; i < MAX_PROCS; ++i) {
-        if(processes[i].state == process_state_empty) {
-            return i;
-        }
+    if(!process) {
+        return 0;
     }
 
-    return INVALID_PID;
-}
-
-pid_t setup_process(void) {
-    pid_t pid = free_pid();
-    if(pid == INVALID_PID) {
-        panic_message("Out of PIDs!");
+    if(!scheduler_pid_alloc(process)) {
+        scheduler_process_delete(process);
+        return 0;
     }
 
-    process_t* process = &processes[pid];
-    memset((void*)&process->cpu, 0, sizeof(cpu_state));
+    scheduler_set_name(process, name);
+
+    process->weight      = SCHEDULER_WEIGHT_DEFAULT;
+    process->cpu_index   = smp_cpu_id();
+
+    // start level with everything else on this CPU, neither ahead nor behind
+    process->vruntime    = scheduler_cpus[process->cpu_index].min_vruntime;
+    timer_init(&process->sleep_timer, scheduler_sleep_expired, process);
 
-    process->state       = process_state_runnable;
     process->cpu.cs      = 0x2B;
     process->cpu.ss      = 0x23;
     process->cpu.rflags  = 0x200;
 
-    process->heap.start = 0;
-    process->heap.end   = 0;
-
     process->stack.start = ALLOCATOR_REGION_USER_STACK.end;
     process->stack.end   = ALLOCATOR_REGION_USER_STACK.end;
-
-    process->hw.start = ALLOCATOR_REGION_USER_HARDWARE.start;
-    process->hw.end   = ALLOCATOR_REGION_USER_HARDWARE.start;
+    process->stack_limit = (ALLOCATOR_REGION_USER_STACK.end & ~0xFFFULL) - SCHEDULER_MAIN_STACK_SIZE;
 
     process->allocator.alloc   = process_alloc;
     process->allocator.dealloc = process_dealloc;
-    process->allocator.tag     = pid;
+    process->allocator.tag     = process->pid;
 
     process->mq = mq_create(&process->allocator);
 
-    return pid;
+    scheduler_make_runnable(process);
+
+    return process;
+}
+
+//! Free a process that exited or got killed, once it is not running anymore
+static void scheduler_process_free(process_t* process) {
+    scheduler_pid_free(process->pid);
+    kfree(process->name);
+    scheduler_process_delete(process);
 }
 
 void start_task(struct vm_table* context, uint64_t entry, uint64_t data_start, uint64_t data_end, const char* name) {
@@ -137,89 +913,193 @@ void start_task(struct vm_table* context, uint64_t entry, uint64_t data_start, u
         panic_message("Tried to start process without entry");
     }
 
-    pid_t pid          = setup_process();
-    process_t* process = &processes[pid];
+    process_t* process = setup_process(name);
+
+    if(!process) {
+        panic_message("Out of memory for the first processes");
+    }
 
     process->parent  = INVALID_PID;
-    process->context = context;
+    process->memory  = scheduler_memory_new(context);
     process->cpu.rip = entry;
     process->cpu.rsp = ALLOCATOR_REGION_USER_STACK.end;
 
-    process->heap.start = data_start;
-    process->heap.end   = data_end;
-
-    strncpy(process->name, name, 1023);
+    process->memory->heap.start = data_start;
+    process->memory->heap.end   = data_end;
 }
 
 void scheduler_process_save(cpu_state* cpu) {
-    if(scheduler_current_process >= 0 &&
-        (processes[scheduler_current_process].state == process_state_running ||
-         processes[scheduler_current_process].state == process_state_waiting)
+    if(scheduler_current() == INVALID_PID) {
+        return;
+    }
+
+    process_t* current = scheduler_current_process();
+
+    if(current->state == process_state_running ||
+       current->state == process_state_waiting
     ) {
-        memcpy(&processes[scheduler_current_process].cpu, cpu, sizeof(cpu_state));
+        memcpy(&current->cpu, cpu, sizeof(cpu_state));
+    }
+}
+
+//! Program the next timer interrupt of this CPU, TIMER_NEVER for none at all
+static void scheduler_set_deadline(uint64_t now, uint64_t deadline) {
+    if(lapic_timer_available()) {
+        lapic_timer_oneshot(deadline == TIMER_NEVER ? 0 : deadline - now);
+    }
+    else if(deadline != TIMER_NEVER) {
+        hpet_set_deadline(deadline);
     }
 }
 
-bool scheduler_idle_if_needed(cpu_state** cpu, struct vm_table** context) {
-    if(processes[scheduler_current_process].state != process_state_runnable &&
-        processes[scheduler_current_process].state != process_state_running) {
-        *context = VM_KERNEL_CONTEXT;
-        (*cpu)->rip    = (uint64_t)idle_task;
-        (*cpu)->cs     = 0x2B;
-        (*cpu)->ss     = 0x23;
-        (*cpu)->rflags = 0x200;
+static void scheduler_idle(cpu_state** cpu, struct vm_table** context, uint64_t now) {
+    struct scheduler_cpu* local = scheduler_local();
+    *context = VM_KERNEL_CONTEXT;
+
+    // ring 0, hlt is privileged
+    (*cpu)->rip    = (uint64_t)idle_task;
+    (*cpu)->cs     = 0x08;
+    (*cpu)->ss     = 0x10;
+    (*cpu)->rsp    = (uint64_t)local->idle_stack + sizeof(local->idle_stack) - 8; // like after a call
+    (*cpu)->rflags = 0x200;
+
+    if(!local->idling) {
+        local->idling     = true;
+        local->idle_since = now;
+        ++local->idle_entries;
+    }
 
-        scheduler_current_process = INVALID_PID;
+    local->current       = INVALID_PID;
+    scheduler_idle_cpus |= 1ULL << smp_cpu_id();
 
-        return true;
+    // nothing to run, use the time to prepare zeroed pages for later
+    if(!local->zero_page) {
+        local->zero_page = mm_zero_pool_reserve();
+    }
+}
+
+//! Charge the process running on this CPU for the time since it was put on it or last charged
+static void scheduler_account(struct scheduler_cpu* local, uint64_t now) {
+    if(local->current == INVALID_PID) {
+        return;
     }
 
-    return false;
+    process_t* process = scheduler_process(local->current);
+    uint64_t   ran     = now - process->run_start;
+
+    process->runtime   += ran;
+    process->run_start  = now;
+
+    // real-time processes are not ordered by it, they get a fresh one when leaving their class
+    if(!process->rt_priority) {
+        process->vruntime += ran * SCHEDULER_WEIGHT_DEFAULT / process->weight;
+    }
+    else {
+        local->rt_used += ran;
+    }
 }
 
 void schedule_next(cpu_state** cpu, struct vm_table** context) {
-    if(scheduler_current_process >= 0 && processes[scheduler_current_process].state == process_state_running) {
-        processes[scheduler_current_process].state = process_state_runnable;
-    }
+    struct scheduler_cpu* local = scheduler_local();
 
-    uint64_t timestamp_ns_since_boot = 0;
+    uint64_t now = 0;
+    sc_handle_clock_read(&now); // the kernel calling a syscall handler ... oh deer, but why not? :>
 
-    static pid_t last_scheduled = INVALID_PID;
-    for(int i = 1; i <= MAX_PROCS; ++i) {
-        pid_t pid = (last_scheduled + i) % MAX_PROCS;
+    if(now - local->rt_period_start >= SCHEDULER_RT_PERIOD_NS) {
+        local->rt_period_start = now;
+        local->rt_used         = 0;
+    }
 
-        process_t* process = &processes[pid];
+    scheduler_account(local, now);
+    local->preempt = false;
 
-        if(process->state == process_state_waiting && process->waiting_for == wait_reason_time) {
-            if(process->waiting_data.timestamp_ns_since_boot && !timestamp_ns_since_boot) {
-                sc_handle_clock_read(&timestamp_ns_since_boot); // the kernel calling a syscall handler ... oh deer, but why not? :>
-            }
+    if(local->current != INVALID_PID) {
+        process_t* current = scheduler_process(local->current);
 
-            if(process->waiting_data.timestamp_ns_since_boot <= timestamp_ns_since_boot) {
-                process->state = process_state_runnable;
+        if(current->state == process_state_running) {
+            scheduler_set_state(current, process_state_runnable);
+
+            // preempted real-time processes keep their place, the order only changes when one blocks or yields
+            if(current->rt_priority) {
+                scheduler_rt_remove(local, current);
+                scheduler_rt_push(local, current, true);
             }
         }
-
-        if(processes[pid].state == process_state_runnable) {
-            scheduler_current_process = pid;
-            break;
+        else if(current->state == process_state_exited || current->state == process_state_killed) {
+            // nothing refers to it anymore now that we switch away from it
+            scheduler_process_free(current);
+            local->current = INVALID_PID;
         }
     }
 
-    if(scheduler_idle_if_needed(cpu, context)) {
+    timer_expire(now);
+
+    process_t* next     = scheduler_ready_first(local);
+    uint64_t   deadline = timer_next_deadline();
+
+    if(!next) {
+        next = scheduler_steal(local);
+    }
+
+    if(!next) {
+        // no time slice to end, sleep until the next sleeper wakes up or some other interrupt arrives
+        scheduler_set_deadline(now, deadline);
+        scheduler_idle(cpu, context, now);
         return;
     }
 
-    last_scheduled = scheduler_current_process;
+    // next interrupt at the end of the time slice or when the next sleeper wakes up, whatever is first
+    if(!next->rt_priority && deadline > now + SCHEDULER_TIMESLICE_NS) {
+        deadline = now + SCHEDULER_TIMESLICE_NS;
+    }
+
+    // real-time processes have no time slice, but fair ones may get the CPU once the budget is used up
+    if(next->rt_priority) {
+        uint64_t budget_end = local->rt_used < SCHEDULER_RT_RUNTIME_NS ? now + SCHEDULER_RT_RUNTIME_NS - local->rt_used
+                                                                       : local->rt_period_start + SCHEDULER_RT_PERIOD_NS;
+
+        if(deadline > budget_end) {
+            deadline = budget_end;
+        }
+    }
+
+    scheduler_set_deadline(now, deadline);
+
+    if(local->idling) {
+        local->idling   = false;
+        local->idle_ns += now - local->idle_since;
+    }
+
+    scheduler_idle_cpus &= ~(1ULL << smp_cpu_id());
+    local->current       = next->pid;
 
-    processes[scheduler_current_process].state = process_state_running;
-    *cpu     = &processes[scheduler_current_process].cpu;
-    *context =  processes[scheduler_current_process].context;
+    // nothing runnable here has a lower vruntime than the process we picked
+    if(!next->rt_priority && next->vruntime > local->min_vruntime) {
+        local->min_vruntime = next->vruntime;
+    }
+
+    scheduler_set_state(next, process_state_running);
+    next->run_start = now;
+
+    // more work than this CPU can do right now, let an idle one take some
+    if(scheduler_ready_total(local)) {
+        scheduler_kick(scheduler_ready_first(local));
+    }
+
+    *cpu     = &next->cpu;
+    *context =  next->memory->context;
+}
+
+bool scheduler_switch_needed(void) {
+    process_t* current = scheduler_current_process();
+
+    return scheduler_local()->preempt ||
+        (current->state != process_state_runnable &&
+         current->state != process_state_running);
 }
 
 bool schedule_next_if_needed(cpu_state** cpu, struct vm_table** context) {
-    if(processes[scheduler_current_process].state != process_state_runnable &&
-        processes[scheduler_current_process].state != process_state_running) {
+    if(scheduler_switch_needed()) {
         schedule_next(cpu, context);
         return true;
     }
@@ -228,20 +1108,49 @@ bool schedule_next_if_needed(cpu_state** cpu, struct vm_table** context) {
 }
 
 
+//! Unmap and free the stack of an exited thread and keep its region for the next thread
+static void scheduler_release_thread_stack(process_t* process) {
+    process_memory_t* memory = process->memory;
+
+    // the main thread stack stays with the address space
+    if(process->stack_limit >= (ALLOCATOR_REGION_USER_STACK.end & ~0xFFFULL) - SCHEDULER_MAIN_STACK_SIZE) {
+        return;
+    }
+
+    // other threads may have mapped pages below stack.start, so check the whole region
+    uint64_t end = process->stack_limit + SCHEDULER_THREAD_STACK_SIZE;
+
+    for(uint64_t page = process->stack_limit; page < end; page += 4*KiB) {
+        if(!vm_context_page_present(memory->context, page)) {
+            continue;
+        }
+
+        uint64_t physical = vm_context_get_physical_for_virtual(memory->context, page);
+        vm_context_unmap(memory->context, page);
+        vm_page_release(physical);
+    }
+
+    struct scheduler_free_stack* free_stack = (struct scheduler_free_stack*)kmalloc(sizeof(struct scheduler_free_stack));
+    free_stack->limit   = process->stack_limit;
+    free_stack->next    = memory->free_stacks;
+    memory->free_stacks = free_stack;
+}
+
 void scheduler_process_cleanup(pid_t pid) {
+    process_t* process = scheduler_process(pid);
     mutex_unlock_holder(pid);
+    rwlock_unlock_holder(pid);
 
-    if(processes[pid].parent >= 0) {
-        process_t* parent = &processes[processes[pid].parent];
+    process_t* parent = scheduler_process(process->parent);
 
-        if(parent->state != process_state_empty  &&
-           parent->state != process_state_exited &&
+    if(parent) {
+        if(parent->state != process_state_exited &&
            parent->state != process_state_killed
         ) {
             size_t user_size = sizeof(struct Message::UserData::SignalUserData);
             size_t size      = sizeof(struct Message) + user_size;
 
-            Message* signal = (Message*)vm_alloc(size);
+            Message* signal = (Message*)kmalloc(size);
             signal->size                    = size;
             signal->user_size               = user_size,
             signal->sender                  = INVALID_PID,
@@ -250,171 +1159,304 @@ void scheduler_process_cleanup(pid_t pid) {
 
             mq_push(parent->mq, signal);
 
-            vm_free(signal);
+            kfree(signal);
         }
     }
 
-    mq_destroy(processes[pid].mq);
+    mq_destroy(process->mq);
+    scheduler_release_thread_stack(process);
+    scheduler_memory_release(process->memory);
 }
 
 void scheduler_kill_current(enum kill_reason reason) {
-    processes[scheduler_current_process].state     = process_state_killed;
-    processes[scheduler_current_process].exit_code = (int)reason;
-    logd("scheduler", "'%s' (PID %d) killed for reason: %d)", processes[scheduler_current_process].name, scheduler_current_process, (int)reason);
+    process_t* current = scheduler_current_process();
+
+    scheduler_set_state(current, process_state_killed);
+    current->exit_code = (int)reason;
+    logd("scheduler", "'%s' (PID %d) killed for reason: %d)", current->name, current->pid, (int)reason);
 
-    scheduler_process_cleanup(scheduler_current_process);
+    scheduler_process_cleanup(current->pid);
 }
 
 void sc_handle_scheduler_exit(uint8_t exit_code) {
-    processes[scheduler_current_process].state     = process_state_exited;
-    processes[scheduler_current_process].exit_code = exit_code;
-    logd("scheduler", "'%s' (PID %d) exited (status: %d)", processes[scheduler_current_process].name, scheduler_current_process, exit_code);
+    process_t* current = scheduler_current_process();
 
-    scheduler_process_cleanup(scheduler_current_process);
+    scheduler_set_state(current, process_state_exited);
+    current->exit_code = exit_code;
+    logd("scheduler", "'%s' (PID %d) exited (status: %d)", current->name, current->pid, exit_code);
+
+    scheduler_process_cleanup(current->pid);
 }
 
-void sc_handle_scheduler_clone(bool share_memory, void* entry, pid_t* newPid) {
-    process_t* old = &processes[scheduler_current_process];
+void sc_handle_scheduler_clone(bool share_memory, void* entry, void* argument, pid_t* newPid) {
+    process_t* old = scheduler_current_process();
+
+    // a thread starts on an empty stack, it cannot continue where the old one was
+    if(share_memory && !entry) {
+        *newPid = -EINVAL;
+        return;
+    }
+
+    if(share_memory && !old->memory->free_stacks &&
+       old->memory->next_stack - SCHEDULER_THREAD_STACK_SIZE < ALLOCATOR_REGION_USER_STACK.start
+    ) {
+        *newPid = -ENOMEM;
+        return;
+    }
 
     // make new process
-    pid_t pid = setup_process();
+    process_t* new_process = setup_process(old->name);
 
-    if(pid < 0) {
+    if(!new_process) {
         *newPid = -ENOMEM;
         return;
     }
 
-    process_t* new_process = &processes[pid];
-    strncpy(new_process->name, old->name, 1023);
+    // copy cpu state
+    memcpy(&new_process->cpu, &old->cpu, sizeof(cpu_state));
+    new_process->cpu.rax = 0;
+
+    new_process->parent = old->pid;
+
+    // children keep the scheduling class and CPU share of their parent
+    new_process->nice   = old->nice;
+    new_process->weight = old->weight;
+    scheduler_set_rt_priority(new_process, old->rt_priority);
+
+    if(share_memory) {
+        // same address space, but a stack region of its own
+        process_memory_t* memory = old->memory;
+        ++memory->refcount;
+
+        // region of an exited thread if there is one, a new one otherwise
+        uint64_t stack_limit;
+
+        if(memory->free_stacks) {
+            struct scheduler_free_stack* free_stack = memory->free_stacks;
+            memory->free_stacks = free_stack->next;
+
+            stack_limit = free_stack->limit;
+            kfree(free_stack);
+        }
+        else {
+            memory->next_stack -= SCHEDULER_THREAD_STACK_SIZE;
+            stack_limit         = memory->next_stack;
+        }
 
-    // new memory context ...
-    new_process->context = vm_context_new();
+        // same misalignment as the main thread stack, see ALLOCATOR_REGION_USER_STACK
+        uint64_t stack_top = stack_limit + SCHEDULER_THREAD_STACK_SIZE - 8;
 
-    new_process->heap.start  = old->heap.start;
-    new_process->heap.end    = old->heap.end;
-    new_process->stack.start = old->stack.start;
-    new_process->stack.end   = old->stack.end;
-    new_process->hw.start    = old->hw.start;
-    new_process->hw.end      = old->hw.end;
+        new_process->memory      = memory;
+        new_process->stack.start = stack_top;
+        new_process->stack.end   = stack_top;
+        new_process->stack_limit = stack_limit;
 
-    // .. copy heap ..
-    if(!share_memory) {
-        vm_copy_range(new_process->context, old->context, old->heap.start, old->heap.end - old->heap.start);
+        new_process->cpu.rsp = stack_top;
+        new_process->cpu.rbp = 0;
     }
     else {
-        // make heap shared
-    }
+        // new memory context ...
+        process_memory_t* memory = scheduler_memory_new(vm_context_new());
+        memory->heap       = old->memory->heap;
+        memory->hw         = old->memory->hw;
+        memory->next_stack = old->memory->next_stack;
+
+        new_process->memory      = memory;
+        new_process->stack       = old->stack;
+        new_process->stack_limit = old->stack_limit;
+
+        // .. copy heap ..
+        vm_copy_range(memory->context, old->memory->context, memory->heap.start, memory->heap.end - memory->heap.start);
 
-    // .. and stack ..
-    vm_copy_range(new_process->context, old->context, old->stack.start, old->stack.end - old->stack.start);
+        // .. and stack ..
+        vm_copy_range(memory->context, old->memory->context, old->stack.start, old->stack.end - old->stack.start);
 
-    // .. and remap hardware resources
-    for(uint64_t i = old->hw.start; i < old->hw.end; i += 4096) {
-        uint64_t hw = vm_context_get_physical_for_virtual(old->context, i);
+        // .. and remap hardware resources
+        for(uint64_t i = memory->hw.start; i < memory->hw.end; i += 4096) {
+            uint64_t hw = vm_context_get_physical_for_virtual(old->memory->context, i);
 
-        if(hw) {
-            vm_context_map(new_process->context, i, hw, 0x07);
+            if(hw) {
+                vm_context_map(memory->context, i, hw, 0x07);
+            }
         }
     }
 
-    if(share_memory && entry) {
+    // entry is called like a function taking argument
+    if(entry) {
         new_process->cpu.rip = (uint64_t)entry;
+        new_process->cpu.rdi = (uint64_t)argument;
     }
 
-    *newPid = pid;
+    *newPid = new_process->pid;
+}
 
-    // copy cpu state
-    memcpy(&new_process->cpu, &old->cpu, sizeof(cpu_state));
-    new_process->cpu.rax = 0;
+//! Map the stack page of a process at address on first use, returns false if address is not on a stack
+static bool scheduler_map_stack_page(process_t* process, uint64_t address) {
+    if(address < ALLOCATOR_REGION_USER_STACK.start || address >= ALLOCATOR_REGION_USER_STACK.end) {
+        return false;
+    }
+
+    uint64_t page_v = address & ~0xFFF;
+    uint64_t page_p = (uint64_t)mm_alloc_zeroed();
+    vm_context_map(process->memory->context, page_v, page_p, 0);
+
+    // only track the stack of this thread, other threads may touch each others stacks
+    if(page_v < process->stack.start && page_v >= process->stack_limit) {
+        process->stack.start = page_v;
+    }
 
-    new_process->parent = scheduler_current_process;
+    return true;
 }
 
 bool scheduler_handle_pf(uint64_t fault_address, uint64_t error_code) {
-    if(fault_address >= ALLOCATOR_REGION_USER_STACK.start && fault_address < ALLOCATOR_REGION_USER_STACK.end) {
-        uint64_t page_v = fault_address & ~0xFFF;
-        uint64_t page_p = (uint64_t)mm_alloc_pages(1);
-        memset((void*)(page_p + ALLOCATOR_REGION_DIRECT_MAPPING.start), 0, 0x1000);
-        vm_context_map(processes[scheduler_current_process].context, page_v, page_p, 0);
+    process_t* current = scheduler_current_process();
 
-        if(page_v < processes[scheduler_current_process].stack.start) {
-            processes[scheduler_current_process].stack.start = page_v;
-        }
+    // write to a present page, might be shared copy-on-write after clone
+    if((error_code & 3) == 3 && vm_context_resolve_cow(current->memory->context, fault_address)) {
+        return true;
+    }
 
+    if(scheduler_map_stack_page(current, fault_address)) {
         return true;
     }
 
-    logw("scheduler", "Not handling page fault for %s (PID %d) at 0x%x (RIP: 0x%x, error 0x%x)", processes[scheduler_current_process].name, scheduler_current_process, fault_address, processes[scheduler_current_process].cpu.rip, error_code);
+    logw("scheduler", "Not handling page fault for %s (PID %d) at 0x%x (RIP: 0x%x, error 0x%x)", current->name, current->pid, fault_address, current->cpu.rip, error_code);
 
     return false;
 }
 
-void scheduler_wait_for(pid_t pid, enum wait_reason reason, union wait_data data) {
-    if(pid == INVALID_PID) {
-        pid = scheduler_current_process;
-    }
-
-    processes[pid].state        = process_state_waiting;
-    processes[pid].waiting_for  = reason;
-    processes[pid].waiting_data = data;
-}
-
-void scheduler_waitable_done(enum wait_reason reason, union wait_data data, size_t max_amount) {
-    for(int i = 0; i < MAX_PROCS; ++i) {
-        pid_t pid = (scheduler_current_process + i) % MAX_PROCS;
-
-        process_t* p = &processes[pid];
-
-        if(p->state == process_state_waiting && p->waiting_for == reason) {
-            switch(reason) {
-                case wait_reason_mutex:
-                    if(p->waiting_data.mutex == data.mutex) {
-                        if(mutex_lock(data.mutex, pid)) {
-                            p->state = process_state_runnable;
-                        }
-                    }
-                    break;
-                case wait_reason_condvar:
-                    if(p->waiting_data.condvar == data.condvar && max_amount--) {
-                        p->state = process_state_runnable;
-                    }
-                    break;
-                case wait_reason_message:
-                    if(p->waiting_data.message_queue == data.message_queue) {
-                        p->state = process_state_runnable;
-                    }
-                    break;
-                case wait_reason_time:
-                    // handled in schedule_next instead
-                    break;
-            }
+bool scheduler_user_writeable(void* address, size_t size) {
+    process_t*       current = scheduler_current_process();
+    struct vm_table* context = current->memory->context;
+
+    uint64_t start = (uint64_t)address;
+    uint64_t end   = start + size;
+
+    if(!start || end < start || end > 0x0000800000000000) {
+        return false;
+    }
+
+    for(uint64_t page = start & ~0xFFFULL; page < end; page += 4*KiB) {
+        if(!vm_context_page_present(context, page) && !scheduler_map_stack_page(current, page)) {
+            return false;
+        }
+
+        if(!vm_context_prepare_user_write(context, page)) {
+            return false;
         }
     }
+
+    return true;
+}
+
+void scheduler_wait_for(pid_t pid, enum wait_reason reason, union wait_data data, struct scheduler_queue* queue) {
+    if(pid == INVALID_PID) {
+        pid = scheduler_current();
+    }
+
+    process_t* process = scheduler_process(pid);
+
+    scheduler_dequeue(process);
+
+    process->state         = process_state_waiting;
+    process->waiting_for   = reason;
+    process->waiting_data  = data;
+    process->waiting_queue = reason == wait_reason_time ? 0 : queue;
+
+    scheduler_enqueue(process);
+}
+
+void scheduler_wait_resume(enum wait_reason reason, union wait_data data, struct scheduler_queue* queue, scheduler_resume_t resume, void* user_data) {
+    process_t* process = scheduler_current_process();
+
+    scheduler_wait_for(process->pid, reason, data, queue);
+    process->resume      = resume;
+    process->resume_data = user_data;
+}
+
+void scheduler_resume(void) {
+    if(scheduler_current() == INVALID_PID) {
+        return;
+    }
+
+    process_t* process = scheduler_current_process();
+
+    if(process->resume) {
+        scheduler_resume_t resume = process->resume;
+        process->resume = 0;
+
+        resume(&process->cpu, process->waiting_data, process->resume_data);
+    }
+}
+
+struct mutex_data** scheduler_held_mutexes(pid_t pid) {
+    process_t* process = scheduler_process(pid);
+    return process ? &process->held_mutexes : 0;
+}
+
+struct rwlock_hold** scheduler_held_rwlocks(pid_t pid) {
+    process_t* process = scheduler_process(pid);
+    return process ? &process->held_rwlocks : 0;
+}
+
+pid_t scheduler_wake_one(struct scheduler_queue* queue) {
+    process_t* process = queue->head;
+
+    if(!process) {
+        return INVALID_PID;
+    }
+
+    scheduler_make_runnable(process);
+
+    return process->pid;
+}
+
+pid_t scheduler_requeue(struct scheduler_queue* from, enum wait_reason reason, union wait_data data, struct scheduler_queue* to) {
+    process_t* process = from->head;
+
+    if(!process) {
+        return INVALID_PID;
+    }
+
+    scheduler_wait_for(process->pid, reason, data, to);
+
+    return process->pid;
+}
+
+size_t scheduler_wake(struct scheduler_queue* queue, size_t max_amount) {
+    size_t woken = 0;
+
+    for(; woken < max_amount && queue->head; ++woken) {
+        scheduler_wake_one(queue);
+    }
+
+    return woken;
 }
 
 void sc_handle_memory_sbrk(int64_t inc, void** data_end) {
-    uint64_t old_end = processes[scheduler_current_process].heap.end;
+    process_memory_t* memory = scheduler_current_process()->memory;
+
+    uint64_t old_end = memory->heap.end;
     uint64_t new_end = old_end + inc;
 
     if(inc > 0) {
         for(uint64_t i = old_end & ~0xFFF; i < new_end; i += 0x1000) {
-            if(!vm_context_get_physical_for_virtual(processes[scheduler_current_process].context, i)) {
-                uint64_t phys = (uint64_t)mm_alloc_pages(1);
-                memset((void*)(phys + ALLOCATOR_REGION_DIRECT_MAPPING.start), 0, 0x1000);
-                vm_context_map(processes[scheduler_current_process].context, i, phys, 0);
+            if(!vm_context_get_physical_for_virtual(memory->context, i)) {
+                uint64_t phys = (uint64_t)mm_alloc_zeroed();
+                vm_context_map(memory->context, i, phys, 0);
             }
         }
     }
     if(inc < 0) {
         for(uint64_t i = old_end; i > new_end; i -= 0x1000) {
             if(!(i & ~0xFFF)) {
-                mm_mark_physical_pages(vm_context_get_physical_for_virtual(processes[scheduler_current_process].context, i), 1, MM_FREE);
-                vm_context_unmap(processes[scheduler_current_process].context, i);
+                vm_page_release(vm_context_get_physical_for_virtual(memory->context, i));
+                vm_context_unmap(memory->context, i);
             }
         }
     }
 
-    processes[scheduler_current_process].heap.end = new_end;
+    memory->heap.end = new_end;
     *data_end = (void*)old_end;
 }
 
@@ -429,24 +1471,26 @@ void sc_handle_scheduler_sleep(uint64_t nanoseconds) {
         wait_data.timestamp_ns_since_boot = current_timestamp + nanoseconds;
     }
 
-    scheduler_wait_for(scheduler_current_process, wait_reason_time, wait_data);
+    scheduler_wait_for(scheduler_current(), wait_reason_time, wait_data, 0);
 }
 
 void sc_handle_hardware_ioperm(uint16_t from, uint16_t num, bool turn_on, uint64_t* error) {
     *error = 0;
-    process_t* process = &processes[scheduler_current_process];
+    process_t* process = scheduler_current_process();
 
-    if(!process->iopb) {
+    process_memory_t* memory = process->memory;
+
+    if(!memory->iopb) {
         if(!turn_on) {
             return;
         }
 
-        process->iopb = (uint64_t)mm_alloc_pages(2);
-        set_iopb(process->context, process->iopb);
-        memset((void*)(ALLOCATOR_REGION_DIRECT_MAPPING.start + process->iopb), 0xFF, 8*KiB);
+        memory->iopb = (uint64_t)mm_alloc_pages(2);
+        set_iopb(memory->context, memory->iopb);
+        memset((void*)(ALLOCATOR_REGION_DIRECT_MAPPING.start + memory->iopb), 0xFF, 8*KiB);
     }
 
-    bitmap_t bitmap = (bitmap_t)(ALLOCATOR_REGION_DIRECT_MAPPING.start + process->iopb);
+    bitmap_t bitmap = (bitmap_t)(ALLOCATOR_REGION_DIRECT_MAPPING.start + memory->iopb);
     for(size_t i = 0; i < num; ++i) {
         if(turn_on) {
             bitmap_clear(bitmap, from + i);
@@ -467,9 +1511,9 @@ void sc_handle_hardware_ioperm(uint16_t from, uint16_t num, bool turn_on, uint64
         }
 
         if(!some_enabled) {
-            mm_mark_physical_pages(process->iopb, 2, MM_FREE);
-            process->iopb = 0;
-            set_iopb(process->context, process->iopb);
+            mm_mark_physical_pages(memory->iopb, 2, MM_FREE);
+            memory->iopb = 0;
+            set_iopb(memory->context, memory->iopb);
         }
     }
 }
@@ -481,7 +1525,7 @@ void sc_handle_hardware_interrupt_notify(uint8_t interrupt, bool enable, uint64_
     }
 
     if(!mq) {
-        mq = processes[scheduler_current_process].mq;
+        mq = scheduler_current_process()->mq;
     }
 
     if(enable) {
@@ -510,53 +1554,79 @@ void sc_handle_ipc_mq_destroy(uint64_t mq, uint64_t* error) {
     *error = -ENOSYS;
 }
 
-void sc_handle_ipc_mq_poll(uint64_t mq, bool wait, struct Message* msg, uint64_t* error) {
-    if(!mq) {
-        mq = processes[scheduler_current_process].mq;
+//! Take the first message from the queue if it fits into msg, telling the size needed otherwise
+static uint64_t scheduler_mq_receive(uint64_t mq, struct Message* msg) {
+    // header first, it has the size of the whole buffer
+    if(!scheduler_user_writeable(msg, sizeof(struct Message)) || !scheduler_user_writeable(msg, msg->size)) {
+        return EFAULT;
     }
 
     struct Message peeked;
-    peeked.size = sizeof(struct Message);
-    *error = mq_peek(mq, &peeked);
+    peeked.size    = sizeof(struct Message);
+    uint64_t error = mq_peek(mq, &peeked);
 
-    if(*error == ENOMSG && wait) {
-        union wait_data data;
-        data.message_queue = mq;
-        scheduler_wait_for(scheduler_current_process, wait_reason_message, data);
-        // this makes the syscall return EAGAIN as soon as a message is available,
-        // making the process poll again and then receive the message.
-        // TODO: implement a way to deliver syscall results when a process is
-        //       scheduled the next time, so we don't have to poll twice
-        *error = EAGAIN;
-    }
-    else if(*error == EMSGSIZE) {
+    if(error == EMSGSIZE) {
         if(peeked.size > msg->size) {
             msg->size = peeked.size;
             msg->type = MT_Invalid;
-        }
-        else {
-            *error = 0;
+            return EMSGSIZE;
         }
     }
+    else if(error) {
+        return error;
+    }
 
-    if(*error) {
-        return;
+    return mq_pop(mq, msg);
+}
+
+//! Second half of a blocking mq_poll, see scheduler_wait_resume
+static void scheduler_mq_poll_resume(cpu_state* cpu, union wait_data data, void* msg) {
+    uint64_t error = scheduler_mq_receive(data.message_queue, (struct Message*)msg);
+
+    // another thread waiting on the same queue was faster, have the caller poll again
+    if(error == ENOMSG) {
+        error = EAGAIN;
+    }
+
+    // error return of ipc_mq_poll, see syscalls.yml
+    cpu->rax = error;
+}
+
+void sc_handle_ipc_mq_poll(uint64_t mq, bool wait, struct Message* msg, uint64_t* error) {
+    if(!mq) {
+        mq = scheduler_current_process()->mq;
     }
 
-    *error = mq_pop(mq, msg);
+    *error = scheduler_mq_receive(mq, msg);
+
+    if(*error == ENOMSG && wait) {
+        union wait_data data;
+        data.message_queue = mq;
+        scheduler_wait_resume(wait_reason_message, data, mq_waiters(mq), scheduler_mq_poll_resume, msg);
+
+        // replaced once a message arrived
+        *error = EAGAIN;
+    }
 }
 
 void sc_handle_ipc_mq_send(uint64_t mq, pid_t pid, struct Message* msg, uint64_t* error) {
-    msg->sender = scheduler_current_process;
+    if(!scheduler_user_writeable(msg, sizeof(struct Message))) {
+        *error = EFAULT;
+        return;
+    }
+
+    msg->sender = scheduler_current();
 
     if(!mq) {
         if(pid != INVALID_PID) {
-            if(pid < MAX_PROCS && processes[pid].state != process_state_empty) {
-                mq = processes[pid].mq;
+            process_t* process = scheduler_process(pid);
+
+            if(process) {
+                mq = process->mq;
             }
         }
         else {
-            mq = processes[scheduler_current_process].mq;
+            mq = scheduler_current_process()->mq;
         }
     }
 
@@ -567,7 +1637,7 @@ void sc_handle_ipc_mq_send(uint64_t mq, pid_t pid, struct Message* msg, uint64_t
 
 void sc_handle_ipc_service_register(const uuid_t* uuid, uint64_t mq, uint64_t* error) {
     if(!mq) {
-        mq = processes[scheduler_current_process].mq;
+        mq = scheduler_current_process()->mq;
     }
 
     *error = sd_register(uuid, mq);
@@ -575,7 +1645,12 @@ void sc_handle_ipc_service_register(const uuid_t* uuid, uint64_t mq, uint64_t* e
 
 void sc_handle_ipc_service_discover(const uuid_t* uuid, uint64_t mq, struct Message* msg, uint64_t* error) {
     if(!mq) {
-        mq = processes[scheduler_current_process].mq;
+        mq = scheduler_current_process()->mq;
+    }
+
+    if(msg && !scheduler_user_writeable(msg, sizeof(struct Message))) {
+        *error = EFAULT;
+        return;
     }
 
     if(!msg || msg->type != MT_ServiceDiscovery) {
@@ -583,7 +1658,7 @@ void sc_handle_ipc_service_discover(const uuid_t* uuid, uint64_t mq, struct Mess
         return;
     }
 
-    msg->sender = scheduler_current_process;
+    msg->sender = scheduler_current();
     msg->user_data.ServiceDiscovery.mq = mq;
     memcpy(msg->user_data.ServiceDiscovery.serviceIdentifier.data, uuid, sizeof(uuid_t));
 
@@ -598,16 +1673,121 @@ void sc_handle_ipc_service_discover(const uuid_t* uuid, uint64_t mq, struct Mess
 }
 
 void sc_handle_scheduler_get_pid(bool parent, pid_t* pid) {
-    *pid = parent ? processes[scheduler_current_process].parent
-                  : scheduler_current_process;
+    *pid = parent ? scheduler_current_process()->parent
+                  : scheduler_current();
+}
+
+void sc_handle_scheduler_idle_stats(uint64_t* idle_ns, uint64_t* entries, uint64_t* cpus) {
+    uint64_t now;
+    sc_handle_clock_read(&now);
+
+    *idle_ns = 0;
+    *entries = 0;
+    *cpus    = smp_cpu_count();
+
+    // the calling CPU runs a process, but others might be idle right now
+    for(uint32_t i = 0; i < smp_cpu_count(); ++i) {
+        struct scheduler_cpu* cpu = &scheduler_cpus[i];
+
+        *idle_ns += cpu->idle_ns + (cpu->idling ? now - cpu->idle_since : 0);
+        *entries += cpu->idle_entries;
+    }
+}
+
+//! Process a syscall refers to, -1 meaning the caller. 0 if there is no such process
+static process_t* scheduler_process_for(pid_t pid) {
+    if(pid == INVALID_PID) {
+        pid = scheduler_current();
+    }
+
+    return scheduler_process(pid);
+}
+
+void sc_handle_scheduler_set_nice(pid_t pid, int8_t nice, uint64_t* error) {
+    process_t* process = scheduler_process_for(pid);
+
+    if(!process) {
+        *error = ESRCH;
+        return;
+    }
+
+    if(process->pid != scheduler_current() && process->parent != scheduler_current()) {
+        *error = EPERM;
+        return;
+    }
+
+    if(nice < SCHEDULER_NICE_MIN || nice > SCHEDULER_NICE_MAX) {
+        *error = EINVAL;
+        return;
+    }
+
+    // time run so far is charged with the old weight
+    if(process->pid == scheduler_current()) {
+        uint64_t now;
+        sc_handle_clock_read(&now);
+        scheduler_account(scheduler_local(), now);
+    }
+
+    // the vruntime is kept, so a runnable process stays where it is in the ready heap
+    process->nice   = nice;
+    process->weight = scheduler_nice_weights[nice - SCHEDULER_NICE_MIN];
+    *error          = 0;
+}
+
+void sc_handle_scheduler_set_realtime(pid_t pid, uint8_t priority, uint64_t* error) {
+    process_t* process = scheduler_process_for(pid);
+
+    if(!process) {
+        *error = ESRCH;
+        return;
+    }
+
+    if(process->pid != scheduler_current() && process->parent != scheduler_current()) {
+        *error = EPERM;
+        return;
+    }
+
+    if(priority >= SCHEDULER_RT_PRIORITIES) {
+        *error = EINVAL;
+        return;
+    }
+
+    scheduler_set_rt_priority(process, priority);
+    *error = 0;
+}
+
+void sc_handle_scheduler_process_stats(pid_t pid, uint64_t* runtime_ns, uint64_t* vruntime_ns, uint64_t* error) {
+    process_t* process = scheduler_process_for(pid);
+
+    if(!process) {
+        *error = ESRCH;
+        return;
+    }
+
+    // include the time since the caller was put on the CPU
+    if(process->pid == scheduler_current()) {
+        uint64_t now;
+        sc_handle_clock_read(&now);
+        scheduler_account(scheduler_local(), now);
+    }
+
+    *runtime_ns  = process->runtime;
+    *vruntime_ns = process->vruntime;
+    *error       = 0;
 }
 
 uint64_t scheduler_map_hardware(uint64_t hw, size_t len) {
-    uint64_t res = vm_map_hardware(hw, len);
+    process_memory_t* memory = scheduler_current_process()->memory;
+
+    // hardware mappings are never removed, so the region is just filled up
+    uint64_t res = (memory->hw.end + 4095) & ~0xFFFULL;
 
-    if(res + len > processes[scheduler_current_process].hw.end) {
-        processes[scheduler_current_process].hw.end = res + len;
+    if(res + len - 1 > ALLOCATOR_REGION_USER_HARDWARE.end) {
+        return 0;
     }
 
+    vm_map_hardware(memory->context, res, hw, len);
+    memory->hw.end = res + len;
+
     return res;
 }
@@ -17,32 +17,138 @@ enum wait_reason {
     wait_reason_condvar,
     wait_reason_message,
     wait_reason_time,
+    wait_reason_futex,
+    wait_reason_semaphore,
+    wait_reason_rwlock,
 };
 
-extern pid_t scheduler_current_process;
+//! Process running on the calling CPU, -1 while it is idle
+pid_t scheduler_current(void);
+
+struct process;
+
+/**
+ * Intrusive FIFO of processes, embedded in everything processes can wait
+ * for. A process is in at most one queue.
+ */
+struct scheduler_queue {
+    struct process* head;
+    struct process* tail;
+};
 
 #include <mutex.h>
 #include <condvar.h>
+#include <futex.h>
+#include <sem.h>
+#include <rwlock.h>
 
 union wait_data {
-    mutex_t   mutex;
-    condvar_t condvar;
-    uint64_t  message_queue;
-    uint64_t  timestamp_ns_since_boot;
+    mutex_t     mutex;
+    condvar_t   condvar;
+    uint64_t    message_queue;
+    uint64_t    timestamp_ns_since_boot;
+    futex_t     futex;
+    semaphore_t semaphore;
+    rwlock_t    rwlock;
 };
 
 void init_scheduler(void);
 void start_task(struct vm_table* context, uint64_t entry, uint64_t data_start, uint64_t data_end, const char* name);
 
 void schedule_next(cpu_state** cpu, struct vm_table** context);
+//! True if the current process cannot continue, because it blocked, exited or is preempted
+bool scheduler_switch_needed(void);
 bool schedule_next_if_needed(cpu_state** cpu, struct vm_table** context);
 void scheduler_process_save(cpu_state* cpu);
 
 bool scheduler_handle_pf(uint64_t fault_address, uint64_t error_code);
+
+/**
+ * Prepare user memory of the current process for a write by the kernel,
+ * mapping stack pages on first use and copying pages shared copy-on-write.
+ * Writing to them directly would fault in the kernel or change the memory of
+ * the process sharing the page.
+ *
+ * \param address Start of the range in user space
+ * \param size Size of the range in bytes
+ * \returns false if the range is not writeable user memory
+ */
+bool scheduler_user_writeable(void* address, size_t size);
 void scheduler_kill_current(enum kill_reason kill_reason);
 
-void scheduler_wait_for(pid_t pid, enum wait_reason reason, union wait_data data);
-void scheduler_waitable_done(enum wait_reason reason, union wait_data data, size_t max_amount);
+/**
+ * Block a process.
+ *
+ * \param pid    Process to block, -1 for the current one
+ * \param reason What the process waits for
+ * \param data   Details for reason, the deadline for wait_reason_time
+ * \param queue  Wait queue of the object waited for, appended to its end. 0 for wait_reason_time
+ */
+void scheduler_wait_for(pid_t pid, enum wait_reason reason, union wait_data data, struct scheduler_queue* queue);
+
+/**
+ * Finishes a syscall once the process that blocked in it runs again.
+ *
+ * \param cpu       Saved registers of the process, results go there
+ * \param data      What the process waited for, as given to scheduler_wait_resume
+ * \param user_data Argument given to scheduler_wait_resume
+ */
+typedef void (*scheduler_resume_t)(cpu_state* cpu, union wait_data data, void* user_data);
+
+/**
+ * Block the current process in a syscall and finish the syscall when it runs
+ * again, instead of returning early and having it call again. Like
+ * scheduler_wait_for otherwise.
+ *
+ * \param reason    What the process waits for
+ * \param data      Details for reason
+ * \param queue     Wait queue of the object waited for
+ * \param resume    Called with the address space of the process active, right before it continues
+ * \param user_data Passed to resume, for example a user space pointer from the syscall arguments
+ */
+void scheduler_wait_resume(enum wait_reason reason, union wait_data data, struct scheduler_queue* queue, scheduler_resume_t resume, void* user_data);
+
+//! Finish the blocked syscall of the process continuing on this CPU, if any. Its address space has to be active
+void scheduler_resume(void);
+
+struct mutex_data;
+
+//! Head of the list of mutexes a process holds, 0 if there is no such process
+struct mutex_data** scheduler_held_mutexes(pid_t pid);
+
+struct rwlock_hold;
+
+//! Head of the list of reader-writer locks a process holds, 0 if there is no such process
+struct rwlock_hold** scheduler_held_rwlocks(pid_t pid);
+
+/**
+ * Make the first process in a wait queue runnable again.
+ *
+ * \param queue Wait queue of the object waited for
+ * \returns PID of the woken process, -1 if nobody was waiting
+ */
+pid_t scheduler_wake_one(struct scheduler_queue* queue);
+
+/**
+ * Make the first processes in a wait queue runnable again.
+ *
+ * \param queue      Wait queue of the object waited for
+ * \param max_amount Maximum number of processes to wake
+ * \returns Number of woken processes
+ */
+size_t scheduler_wake(struct scheduler_queue* queue, size_t max_amount);
+
+/**
+ * Move the first process of a wait queue to another one without waking it,
+ * making it wait for something else.
+ *
+ * \param from   Wait queue to take the process from
+ * \param reason What the process waits for now
+ * \param data   Details for reason
+ * \param to     Wait queue to append the process to
+ * \returns PID of the moved process, -1 if nobody was waiting
+ */
+pid_t scheduler_requeue(struct scheduler_queue* from, enum wait_reason reason, union wait_data data, struct scheduler_queue* to);
 
 //! Map a given memory area in the currently running userspace process at a random location
 uint64_t scheduler_map_hardware(uint64_t hw, size_t len);
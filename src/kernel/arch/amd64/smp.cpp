@@ -0,0 +1,334 @@
+#include "smp.h"
+#include "lapic.h"
+#include "msr.h"
+#include "sc.h"
+#include "vm.h"
+#include "mm.h"
+
+#include <log.h>
+#include <string.h>
+
+extern void sc_handle_clock_read(uint64_t* nanoseconds);
+
+extern "C" char smp_trampoline_start[];
+extern "C" char smp_trampoline_data[];
+extern "C" char smp_trampoline_end[];
+
+//! Layout of the data block at the end of smp_trampoline.S
+struct smp_trampoline_data {
+    uint64_t cr0;
+    uint64_t cr3;
+    uint64_t cr4;
+    uint64_t efer;
+    uint64_t stack;
+    uint64_t cpu;
+    uint64_t entry;
+};
+
+//! Time to wait for an application processor to come up before giving up on it
+static const uint64_t smp_startup_timeout_ns = 100000000;
+
+#define SMP_MSR_EFER 0xC0000080
+#define SMP_MSR_PAT  0x277
+
+#define SMP_EFER_LMA (1 << 10)
+#define SMP_CR4_PGE  (1 << 7)
+#define SMP_CR4_PCID (1 << 17)
+
+//! APIC IDs from the MADT, the bootstrap processor among them
+static uint32_t smp_registered[SMP_MAX_CPUS];
+static uint32_t smp_registered_count = 0;
+
+//! APIC ID of every running CPU by index
+static uint32_t smp_apic_ids[SMP_MAX_CPUS];
+static volatile uint32_t smp_online = 1;
+
+//! Set once %gs points to the cpu_local_data of the bootstrap processor, see smp_cpu_id
+static bool smp_cpu_id_ready = false;
+
+//! Physical address of the two pages reserved for starting CPUs: code and data, then the page table
+static uint64_t smp_trampoline_page = 0;
+
+//! Set by an application processor once it is initialized, init_smp waits for it
+static volatile bool smp_ap_started;
+
+//! PAT of the bootstrap processor, every CPU has to use the same memory types
+static uint64_t smp_pat;
+
+//! Kernel lock, a ticket lock to have CPUs enter the kernel in the order they arrived
+static volatile uint32_t smp_lock_next    = 0;
+static volatile uint32_t smp_lock_serving = 0;
+
+//! CPUs currently in the kernel, they do not need a TLB shootdown IPI
+static volatile uint64_t smp_in_kernel = 0;
+
+//! CPUs that have to flush their TLB before touching user memory again
+static volatile uint64_t smp_tlb_stale = 0;
+
+void smp_register_cpu(uint32_t apic_id) {
+    if(smp_registered_count >= SMP_MAX_CPUS) {
+        logw("smp", "Ignoring CPU with APIC ID %u, only %u CPUs supported", apic_id, SMP_MAX_CPUS);
+        return;
+    }
+
+    smp_registered[smp_registered_count++] = apic_id;
+}
+
+void smp_reserve_trampoline(uint64_t start, uint64_t pages) {
+    if(smp_trampoline_page) {
+        return;
+    }
+
+    // page 0 holds the real mode IVT and BIOS data, keep away from it
+    if(start < 4*KiB) {
+        if(pages <= 1) {
+            return;
+        }
+
+        start += 4*KiB;
+        --pages;
+    }
+
+    if(pages < 2 || start + 2*4*KiB > 1*MiB) {
+        return;
+    }
+
+    smp_trampoline_page = start;
+    mm_mark_physical_pages(start, 2, MM_RESERVED);
+}
+
+void smp_enable_cpu_id(void) {
+    smp_cpu_id_ready = true;
+}
+
+uint32_t smp_cpu_id(void) {
+    // application processors set up %gs before anything asks them for their index
+    if(!smp_cpu_id_ready) {
+        return 0;
+    }
+
+    // id member of cpu_local_data in sc.cpp
+    uint64_t id;
+    asm volatile("mov %%gs:8, %0":"=r"(id));
+    return id;
+}
+
+uint32_t smp_cpu_count(void) {
+    return smp_online;
+}
+
+void smp_send_reschedule(uint32_t cpu) {
+    lapic_send_ipi(smp_apic_ids[cpu], SMP_RESCHEDULE_VECTOR);
+}
+
+//! Flush the whole TLB of the calling CPU, including global pages and all PCIDs
+static void smp_flush_tlb(void) {
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0":"=r"(cr4));
+
+    if(cr4 & SMP_CR4_PGE) {
+        asm volatile("mov %0, %%cr4"::"r"(cr4 & ~SMP_CR4_PGE):"memory");
+        asm volatile("mov %0, %%cr4"::"r"(cr4):"memory");
+    }
+    else {
+        uint64_t cr3;
+        asm volatile("mov %%cr3, %0":"=r"(cr3));
+        asm volatile("mov %0, %%cr3"::"r"(cr3):"memory");
+    }
+}
+
+//! Flush the TLB if a shootdown is pending for the calling CPU
+static void smp_flush_if_stale(uint64_t self) {
+    if(__atomic_load_n(&smp_tlb_stale, __ATOMIC_ACQUIRE) & self) {
+        smp_flush_tlb();
+        __atomic_fetch_and(&smp_tlb_stale, ~self, __ATOMIC_RELEASE);
+    }
+}
+
+void smp_tlb_shootdown(uint64_t cpus) {
+    __atomic_fetch_or(&smp_tlb_stale, cpus, __ATOMIC_SEQ_CST);
+
+    uint64_t outside = cpus & ~__atomic_load_n(&smp_in_kernel, __ATOMIC_SEQ_CST);
+
+    for(uint32_t cpu = 0; cpu < smp_online; ++cpu) {
+        if(outside & (1ULL << cpu)) {
+            lapic_send_ipi(smp_apic_ids[cpu], SMP_TLB_VECTOR);
+        }
+    }
+
+    // CPUs entering the kernel meanwhile wait for the lock we hold and flush after taking it
+    while(cpus & __atomic_load_n(&smp_tlb_stale, __ATOMIC_SEQ_CST) & ~__atomic_load_n(&smp_in_kernel, __ATOMIC_SEQ_CST)) {
+        asm volatile("pause");
+    }
+}
+
+void smp_handle_tlb_ipi(void) {
+    smp_flush_if_stale(1ULL << smp_cpu_id());
+    lapic_eoi();
+}
+
+void smp_enter_kernel(void) {
+    uint64_t self = 1ULL << smp_cpu_id();
+    __atomic_fetch_or(&smp_in_kernel, self, __ATOMIC_SEQ_CST);
+
+    uint32_t ticket = __atomic_fetch_add(&smp_lock_next, 1, __ATOMIC_RELAXED);
+    while(__atomic_load_n(&smp_lock_serving, __ATOMIC_ACQUIRE) != ticket) {
+        asm volatile("pause");
+    }
+
+    smp_flush_if_stale(self);
+}
+
+void smp_leave_kernel(bool to_user) {
+    // the idle task stays in the kernel and never touches user memory, it catches up on shootdowns when leaving it
+    if(to_user) {
+        __atomic_fetch_and(&smp_in_kernel, ~(1ULL << smp_cpu_id()), __ATOMIC_SEQ_CST);
+    }
+
+    __atomic_store_n(&smp_lock_serving, smp_lock_serving + 1, __ATOMIC_RELEASE);
+}
+
+//! Entry point of the application processors in the kernel, called from the trampoline
+static void __attribute__((noreturn)) smp_ap_main(uint32_t cpu) {
+    write_msr(SMP_MSR_PAT, smp_pat);
+
+    init_gdt_cpu(cpu);
+    init_sc_cpu(cpu);
+
+    vm_init_cpu();
+    vm_context_activate(VM_KERNEL_CONTEXT);
+
+    init_lapic_ap();
+
+    smp_apic_ids[cpu] = lapic_id();
+    __atomic_store_n(&smp_online,     cpu + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&smp_ap_started, true,    __ATOMIC_RELEASE);
+
+    // the first timer interrupt enters the scheduler, which replaces this with the idle task of this CPU
+    lapic_timer_oneshot(1000000);
+
+    while(true) {
+        asm volatile("sti; hlt");
+    }
+}
+
+static void smp_wait(uint64_t nanoseconds) {
+    uint64_t start, now;
+    sc_handle_clock_read(&start);
+
+    do {
+        sc_handle_clock_read(&now);
+    } while(now - start < nanoseconds);
+}
+
+static bool smp_wait_started(uint64_t nanoseconds) {
+    uint64_t start, now;
+    sc_handle_clock_read(&start);
+
+    do {
+        if(__atomic_load_n(&smp_ap_started, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+
+        sc_handle_clock_read(&now);
+    } while(now - start < nanoseconds);
+
+    return false;
+}
+
+//! Prepare the trampoline page and its page table, returns the data block to fill for each CPU
+static struct smp_trampoline_data* smp_prepare_trampoline(void) {
+    char*            page = (char*)(ALLOCATOR_REGION_DIRECT_MAPPING.start + smp_trampoline_page);
+    struct vm_table* pml4 = (struct vm_table*)(page + 4*KiB);
+
+    memcpy(page, smp_trampoline_start, smp_trampoline_end - smp_trampoline_start);
+
+    // kernel mappings plus the trampoline itself, as it enables paging while running from there
+    memcpy(pml4, VM_KERNEL_CONTEXT, 4*KiB);
+    vm_context_map(pml4, smp_trampoline_page, smp_trampoline_page, 0);
+
+    struct smp_trampoline_data* data = (struct smp_trampoline_data*)(page + (smp_trampoline_data - smp_trampoline_start));
+
+    uint64_t cr0, cr4;
+    asm volatile("mov %%cr0, %0":"=r"(cr0));
+    asm volatile("mov %%cr4, %0":"=r"(cr4));
+
+    // PCIDs can only be enabled in long mode, vm_init_cpu does that
+    data->cr0   = cr0;
+    data->cr3   = smp_trampoline_page + 4*KiB;
+    data->cr4   = cr4 & ~SMP_CR4_PCID;
+    data->efer  = read_msr(SMP_MSR_EFER) & ~SMP_EFER_LMA;
+    data->entry = (uint64_t)smp_ap_main;
+
+    smp_pat = read_msr(SMP_MSR_PAT);
+
+    return data;
+}
+
+static bool smp_start_cpu(struct smp_trampoline_data* data, uint32_t apic_id, uint32_t cpu) {
+    sc_prepare_cpu(cpu);
+
+    data->stack = vm_context_alloc_pages(VM_KERNEL_CONTEXT, ALLOCATOR_REGION_KERNEL_HEAP, 1) + 4*KiB;
+    data->cpu   = cpu;
+
+    __atomic_store_n(&smp_ap_started, false, __ATOMIC_RELEASE);
+
+    lapic_send_init(apic_id);
+    smp_wait(10000000);
+
+    lapic_send_startup(apic_id, smp_trampoline_page);
+    smp_wait(200000);
+
+    if(!__atomic_load_n(&smp_ap_started, __ATOMIC_ACQUIRE)) {
+        lapic_send_startup(apic_id, smp_trampoline_page);
+    }
+
+    if(!smp_wait_started(smp_startup_timeout_ns)) {
+        // park it again, so it does not start later on the data of the next one
+        lapic_send_init(apic_id);
+        return false;
+    }
+
+    return true;
+}
+
+void init_smp(void) {
+    smp_apic_ids[0] = lapic_id();
+
+    if(smp_registered_count < 2) {
+        logi("smp", "Single CPU system");
+        return;
+    }
+
+    if(!lapic_timer_available()) {
+        logw("smp", "No usable local APIC, not starting other CPUs");
+        return;
+    }
+
+    if(!smp_trampoline_page) {
+        logw("smp", "No memory below 1 MiB to start other CPUs from");
+        return;
+    }
+
+    // started CPUs enter the scheduler right away, keep them out until we are done
+    smp_enter_kernel();
+
+    struct smp_trampoline_data* data = smp_prepare_trampoline();
+
+    for(uint32_t i = 0; i < smp_registered_count; ++i) {
+        uint32_t apic_id = smp_registered[i];
+
+        if(apic_id == smp_apic_ids[0]) {
+            continue;
+        }
+
+        if(!smp_start_cpu(data, apic_id, smp_online)) {
+            logw("smp", "CPU with APIC ID %u did not start", apic_id);
+        }
+    }
+
+    logi("smp", "%u of %u CPUs running", smp_online, smp_registered_count);
+
+    // we continue in kernel mode until the first interrupt schedules a process
+    smp_leave_kernel(false);
+}
@@ -0,0 +1,78 @@
+#ifndef _SMP_H_INCLUDED
+#define _SMP_H_INCLUDED
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//! Maximum number of CPUs brought up, one bit per CPU in a uint64_t
+#define SMP_MAX_CPUS 64
+
+//! Interrupt vector making an idle CPU look for work
+#define SMP_RESCHEDULE_VECTOR 49
+
+//! Interrupt vector making a CPU flush its TLB, see smp_tlb_shootdown
+#define SMP_TLB_VECTOR        50
+
+/**
+ * Remember a CPU found in the ACPI MADT, to be started by init_smp.
+ *
+ * \param apic_id Local APIC ID of the CPU
+ */
+void smp_register_cpu(uint32_t apic_id);
+
+/**
+ * Reserve the pages the application processors start in, they begin in real
+ * mode and need their first code below 1 MiB. Call for every usable region of
+ * the memory map while they are still added to the physical memory management.
+ *
+ * \param start Physical address of the usable region
+ * \param pages Number of pages in the region
+ */
+void smp_reserve_trampoline(uint64_t start, uint64_t pages);
+
+//! Start all application processors found, they wait for work in their idle task afterwards
+void init_smp(void);
+
+//! Make smp_cpu_id read the CPU index from %gs, called once it is set up on the bootstrap processor
+void smp_enable_cpu_id(void);
+
+//! Index of the calling CPU, the bootstrap processor is 0
+uint32_t smp_cpu_id(void);
+
+//! Number of CPUs running, CPU indices are below that
+uint32_t smp_cpu_count(void);
+
+/**
+ * Make another CPU run the scheduler, used to wake it when there is work for
+ * it while it is idle.
+ *
+ * \param cpu Index of the CPU
+ */
+void smp_send_reschedule(uint32_t cpu);
+
+/**
+ * Make other CPUs flush their TLB after page tables were changed. Waits until
+ * every given CPU either flushed or is in the kernel, where it flushes before
+ * touching user memory again.
+ *
+ * \param cpus Bit mask of CPU indices
+ */
+void smp_tlb_shootdown(uint64_t cpus);
+
+/**
+ * Enter the kernel from an interrupt or syscall: take the kernel lock and
+ * catch up on TLB shootdowns that happened while waiting for it.
+ */
+void smp_enter_kernel(void);
+
+/**
+ * Leave the kernel again, releasing the kernel lock.
+ *
+ * \param to_user Whether the CPU continues in user mode, kernel mode otherwise
+ */
+void smp_leave_kernel(bool to_user);
+
+//! Handle SMP_TLB_VECTOR, must not take the kernel lock as the sender holds it
+void smp_handle_tlb_ipi(void);
+
+#endif
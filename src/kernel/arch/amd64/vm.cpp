@@ -6,6 +6,9 @@
 #include <panic.h>
 #include <tpa.h>
 #include <msr.h>
+#include <smp.h>
+#include <vrange.h>
+#include <kmalloc.h>
 
 #include <unused_param.h>
 
@@ -43,6 +46,36 @@ static bool vm_direct_mapping_initialized = false;
 static TPA<page_descriptor>* page_descriptors = 0;
 struct vm_table* VM_KERNEL_CONTEXT;
 
+//! Number of address space IDs, ASID n is loaded as PCID n+1 as PCID 0 is what we booted with
+#define VM_ASID_COUNT 32
+
+//! Bit in CR3 telling the CPU to keep the TLB entries tagged with the new PCID
+#define VM_CR3_NOFLUSH (1ULL << 63)
+
+//! An address space ID, tagging the TLB entries of a context with a PCID
+struct vm_asid {
+    struct vm_table* context;
+
+    //! Value of vm_asid_clock at the last activation, least recently used ASID is recycled first
+    uint64_t last_used;
+
+    //! TLB entries for this ASID may be outdated, flush them on next activation
+    bool stale;
+};
+
+//! Free virtual address ranges of the kernel regions, shared by all contexts
+static bool          vm_ranges_initialized = false;
+static struct vrange vm_kernel_heap_ranges;
+static struct vrange vm_slab_ranges;
+
+//! Every CPU has its own TLB, so also its own set of ASIDs
+static bool           vm_pcid_enabled = false;
+static struct vm_asid vm_asids[SMP_MAX_CPUS][VM_ASID_COUNT];
+static uint64_t       vm_asid_clock[SMP_MAX_CPUS];
+
+//! Context loaded on each CPU, changes to these have to be shot down right away
+static struct vm_table* vm_active_contexts[SMP_MAX_CPUS];
+
 #define BASE_TO_PHYS(x)          ((char*)(x << 12))
 #define BASE_TO_DIRECT_MAPPED(x) ((vm_direct_mapping_initialized ? ALLOCATOR_REGION_DIRECT_MAPPING.start : 0) + BASE_TO_PHYS(x))
 #define BASE_TO_TABLE(x)         ((struct vm_table*)BASE_TO_DIRECT_MAPPED(x))
@@ -144,6 +177,8 @@ void vm_setup_direct_mapping_init(struct vm_table* context) {
     }
 
     vm_direct_mapping_initialized = true;
+    mm_init_buddy(ALLOCATOR_REGION_DIRECT_MAPPING.start);
+
     page_descriptors = (TPA<page_descriptor>*)slab_alloc(scratchpad_allocator);
     memset(page_descriptors, 0, 4*KiB);
 }
@@ -203,10 +238,10 @@ void* vm_page_alloc(uint32_t flags, uint8_t size) {
             ret = mm_alloc_pages(1);
             break;
         case PageSize2MiB:
-            ret = mm_alloc_pages(2*MiB / 4*KiB);
+            ret = mm_alloc_pages(2*MiB / (4*KiB));
             break;
         case PageSize1GiB:
-            ret = mm_alloc_pages(1*GiB / 4*KiB);
+            ret = mm_alloc_pages(1*GiB / (4*KiB));
             break;
     }
 
@@ -217,6 +252,131 @@ void* vm_page_alloc(uint32_t flags, uint8_t size) {
     return ret;
 }
 
+void vm_init_cpu(void) {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid":"=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx):"a"(1), "c"(0));
+
+    uint64_t cr3, cr4;
+    asm volatile("mov %%cr3, %0":"=r"(cr3));
+    asm volatile("mov %%cr4, %0":"=r"(cr4));
+
+    // kernel mappings are the same in every context, global pages keep them in the TLB on context switches
+    if(edx & (1 << 13)) {
+        cr4 |= (1 << 7);
+    }
+
+    // PCIDE can only be set while running with PCID 0
+    if((ecx & (1 << 17)) && !(cr3 & 0xFFF)) {
+        cr4 |= (1 << 17);
+        vm_pcid_enabled = true;
+    }
+
+    asm volatile("mov %0, %%cr4"::"r"(cr4));
+}
+
+static void* vm_range_page(void) {
+    return ALLOCATOR_REGION_DIRECT_MAPPING.start + (char*)mm_alloc_pages(1);
+}
+
+//! Mark everything already mapped in the given region as allocated
+static void vm_ranges_reserve_mapped(struct vrange* range, region_t region) {
+    uint64_t run_start = 0;
+    size_t   run_pages = 0;
+
+    for(uint64_t virt = region.start; virt >= region.start && virt <= region.end;) {
+        uint64_t step = 4*KiB;
+        bool     used = false;
+
+        struct vm_table_entry* pml4_entry = &VM_KERNEL_CONTEXT->entries[PML4_INDEX(virt)];
+
+        if(!pml4_entry->present) {
+            step = 512*GiB;
+        }
+        else {
+            struct vm_table_entry* pdp_entry = &BASE_TO_TABLE(pml4_entry->next_base)->entries[PDP_INDEX(virt)];
+
+            if(!pdp_entry->present || pdp_entry->huge) {
+                step = 1*GiB;
+                used = pdp_entry->present;
+            }
+            else {
+                struct vm_table_entry* pd_entry = &BASE_TO_TABLE(pdp_entry->next_base)->entries[PD_INDEX(virt)];
+
+                if(!pd_entry->present || pd_entry->huge) {
+                    step = 2*MiB;
+                    used = pd_entry->present;
+                }
+                else {
+                    used = BASE_TO_TABLE(pd_entry->next_base)->entries[PT_INDEX(virt)].present;
+                }
+            }
+        }
+
+        // skip to the next table boundary, but not beyond the region
+        step -= virt & (step - 1);
+
+        if(step - 1 > region.end - virt) {
+            step = region.end - virt + 1;
+        }
+
+        if(used) {
+            if(!run_pages) {
+                run_start = virt;
+            }
+
+            run_pages += step / (4*KiB);
+        }
+        else if(run_pages) {
+            vrange_reserve(range, run_start, run_pages);
+            run_pages = 0;
+        }
+
+        virt += step;
+    }
+
+    if(run_pages) {
+        vrange_reserve(range, run_start, run_pages);
+    }
+}
+
+static void vm_setup_ranges(void) {
+    vrange_init(&vm_kernel_heap_ranges, ALLOCATOR_REGION_KERNEL_HEAP.start, ALLOCATOR_REGION_KERNEL_HEAP.end, vm_range_page);
+    vm_ranges_reserve_mapped(&vm_kernel_heap_ranges, ALLOCATOR_REGION_KERNEL_HEAP);
+
+    vrange_init(&vm_slab_ranges, ALLOCATOR_REGION_SLAB_4K.start, ALLOCATOR_REGION_SLAB_4K.end, vm_range_page);
+    vm_ranges_reserve_mapped(&vm_slab_ranges, ALLOCATOR_REGION_SLAB_4K);
+
+    vm_ranges_initialized = true;
+}
+
+//! Range allocator managing the given region, 0 if free space has to be searched in the paging structures
+static struct vrange* vm_region_ranges(region_t region) {
+    if(!vm_ranges_initialized) {
+        return 0;
+    }
+
+    if(region.start == ALLOCATOR_REGION_KERNEL_HEAP.start) {
+        return &vm_kernel_heap_ranges;
+    }
+    else if(region.start == ALLOCATOR_REGION_SLAB_4K.start) {
+        return &vm_slab_ranges;
+    }
+
+    return 0;
+}
+
+//! Range allocator managing the given address, 0 if none
+static struct vrange* vm_address_ranges(uint64_t virt) {
+    if(virt >= ALLOCATOR_REGION_KERNEL_HEAP.start && virt <= ALLOCATOR_REGION_KERNEL_HEAP.end) {
+        return vm_region_ranges(ALLOCATOR_REGION_KERNEL_HEAP);
+    }
+    else if(virt >= ALLOCATOR_REGION_SLAB_4K.start && virt <= ALLOCATOR_REGION_SLAB_4K.end) {
+        return vm_region_ranges(ALLOCATOR_REGION_SLAB_4K);
+    }
+
+    return 0;
+}
+
 void init_vm(void) {
     vm_setup_direct_mapping_init(VM_KERNEL_CONTEXT);
     logd("vm", "direct mapping set up");
@@ -225,6 +385,9 @@ void init_vm(void) {
     page_descriptors = TPA<page_descriptor>::create(&kernel_alloc, 4080, page_descriptors); // vm_alloc needs 16 bytes
     logd("vm", "page descriptor structure initialized");
 
+    vm_setup_ranges();
+    logd("vm", "virtual address ranges initialized");
+
     struct vm_table* new_kernel_context = (struct vm_table*)vm_context_alloc_pages(VM_KERNEL_CONTEXT, ALLOCATOR_REGION_KERNEL_HEAP, 1);
     memcpy(new_kernel_context, VM_KERNEL_CONTEXT, 4*KiB);
 
@@ -245,6 +408,9 @@ void init_vm(void) {
         }
     }
 
+    vm_init_cpu();
+    logi("vm", "PCID %s, %u address space IDs", vm_pcid_enabled ? "enabled" : "not supported", vm_pcid_enabled ? VM_ASID_COUNT : 0);
+
     // set up PAT table, especially setting PAT 7 to write combine and PAT 6 to uncachable
     uint64_t pat = read_msr(0x0277);
     pat &= ~(0xFFULL << 56);
@@ -370,23 +536,225 @@ void cleanup_boot_vm(void) {
     logi("vm", "Cleaned %B", ret);
 }
 
+static uint64_t vm_read_cr3(void) {
+    uint64_t cr3;
+    asm volatile("mov %%cr3, %0":"=r"(cr3));
+
+    return cr3;
+}
+
+//! Check if the given context is the one currently loaded in CR3
+static bool vm_context_is_active(struct vm_table* context) {
+    return (vm_read_cr3() & ~0xFFFULL) == vm_context_get_physical_for_virtual(VM_KERNEL_CONTEXT, (uint64_t)context);
+}
+
+static struct vm_asid* vm_asid_find(uint32_t cpu, struct vm_table* context) {
+    for(size_t i = 0; i < VM_ASID_COUNT; ++i) {
+        if(vm_asids[cpu][i].context == context) {
+            return &vm_asids[cpu][i];
+        }
+    }
+
+    return 0;
+}
+
+//! Kernel mappings are global or shared by all contexts, everything below is per context
+static bool vm_is_kernel_address(uint64_t virt) {
+    return virt >= ALLOCATOR_REGION_DIRECT_MAPPING.start;
+}
+
+/**
+ * Make the other CPUs drop their TLB entries for a change in the given
+ * context. CPUs having it loaded, or any CPU for kernel addresses, get a
+ * shootdown; on the others the ASID of the context is marked as stale.
+ */
+static void vm_invalidate_remote(struct vm_table* context, bool kernel) {
+    uint32_t self = smp_cpu_id();
+    uint64_t cpus = 0;
+
+    for(uint32_t cpu = 0; cpu < smp_cpu_count(); ++cpu) {
+        if(cpu == self) {
+            continue;
+        }
+
+        if(kernel || vm_active_contexts[cpu] == context) {
+            cpus |= 1ULL << cpu;
+            continue;
+        }
+
+        struct vm_asid* asid;
+        if(vm_pcid_enabled && (asid = vm_asid_find(cpu, context))) {
+            asid->stale = true;
+        }
+    }
+
+    if(cpus) {
+        smp_tlb_shootdown(cpus);
+    }
+}
+
+/**
+ * Drop the TLB entry for a single page of a context. For contexts not
+ * currently loaded this marks their ASID as stale, as invlpg only works on
+ * the current PCID and global pages.
+ */
+static void vm_context_invalidate(struct vm_table* context, uint64_t virt) {
+    bool kernel = vm_is_kernel_address(virt);
+
+    if(kernel || vm_context_is_active(context)) {
+        asm volatile("invlpg (%0)"::"r"(virt & ~0xFFFULL):"memory");
+    }
+    else {
+        struct vm_asid* asid;
+        if(vm_pcid_enabled && (asid = vm_asid_find(smp_cpu_id(), context))) {
+            asid->stale = true;
+        }
+    }
+
+    vm_invalidate_remote(context, kernel);
+}
+
+//! Drop all non-global TLB entries of the given context
+static void vm_context_flush(struct vm_table* context) {
+    if(vm_context_is_active(context)) {
+        // without VM_CR3_NOFLUSH this flushes the current PCID
+        load_cr3(vm_read_cr3());
+    }
+    else {
+        struct vm_asid* asid;
+        if(vm_pcid_enabled && (asid = vm_asid_find(smp_cpu_id(), context))) {
+            asid->stale = true;
+        }
+    }
+
+    vm_invalidate_remote(context, false);
+}
+
 struct vm_table* vm_context_new(void) {
     struct vm_table* context = (struct vm_table*)vm_context_alloc_pages(VM_KERNEL_CONTEXT, ALLOCATOR_REGION_KERNEL_HEAP, 1);
     memcpy((void*)context, VM_KERNEL_CONTEXT, 4096);
 
+    // page might have been a context before, the TLB entries of that one are not ours
+    for(uint32_t cpu = 0; cpu < smp_cpu_count(); ++cpu) {
+        struct vm_asid* asid;
+        if((asid = vm_asid_find(cpu, context))) {
+            asid->context = 0;
+        }
+    }
+
     return context;
 }
 
+//! Check if a userspace page is backed by memory of the context, not by hardware or the TSS
+static bool vm_is_owned_user_page(uint64_t virt) {
+    return virt < ALLOCATOR_REGION_USER_HARDWARE.start;
+}
+
+void vm_context_free(struct vm_table* context) {
+    if(vm_context_is_active(context)) {
+        vm_context_activate(VM_KERNEL_CONTEXT);
+    }
+
+    // the kernel half is shared by all contexts, only the userspace half is ours
+    for(uint16_t pml4_idx = 0; pml4_idx < 256; ++pml4_idx) {
+        if(!context->entries[pml4_idx].present) {
+            continue;
+        }
+
+        struct vm_table* pdp = BASE_TO_TABLE(context->entries[pml4_idx].next_base);
+
+        for(uint16_t pdp_idx = 0; pdp_idx < 512; ++pdp_idx) {
+            if(!pdp->entries[pdp_idx].present || pdp->entries[pdp_idx].huge) {
+                continue;
+            }
+
+            struct vm_table* pd = BASE_TO_TABLE(pdp->entries[pdp_idx].next_base);
+
+            for(uint16_t pd_idx = 0; pd_idx < 512; ++pd_idx) {
+                if(!pd->entries[pd_idx].present || pd->entries[pd_idx].huge) {
+                    continue;
+                }
+
+                struct vm_table* pt = BASE_TO_TABLE(pd->entries[pd_idx].next_base);
+
+                for(uint16_t pt_idx = 0; pt_idx < 512; ++pt_idx) {
+                    uint64_t virt = ((uint64_t)pml4_idx << 39) | ((uint64_t)pdp_idx << 30) | ((uint64_t)pd_idx << 21) | ((uint64_t)pt_idx << 12);
+
+                    if(pt->entries[pt_idx].present && vm_is_owned_user_page(virt)) {
+                        vm_page_release((uint64_t)BASE_TO_PHYS((uint64_t)pt->entries[pt_idx].next_base));
+                    }
+                }
+
+                mm_mark_physical_pages((uint64_t)BASE_TO_PHYS((uint64_t)pd->entries[pd_idx].next_base), 1, MM_FREE);
+            }
+
+            mm_mark_physical_pages((uint64_t)BASE_TO_PHYS((uint64_t)pdp->entries[pdp_idx].next_base), 1, MM_FREE);
+        }
+
+        mm_mark_physical_pages((uint64_t)BASE_TO_PHYS((uint64_t)context->entries[pml4_idx].next_base), 1, MM_FREE);
+    }
+
+    // TLB entries left under its ASIDs are flushed when the ASIDs are recycled
+    for(uint32_t cpu = 0; cpu < smp_cpu_count(); ++cpu) {
+        struct vm_asid* asid;
+        if((asid = vm_asid_find(cpu, context))) {
+            asid->context = 0;
+        }
+
+        if(vm_active_contexts[cpu] == context) {
+            vm_active_contexts[cpu] = 0;
+        }
+    }
+
+    vm_context_free_pages(VM_KERNEL_CONTEXT, (uint64_t)context, 1);
+}
+
 void vm_context_activate(struct vm_table* context) {
-    load_cr3(vm_context_get_physical_for_virtual(VM_KERNEL_CONTEXT, (uint64_t)context));
+    uint64_t physical = vm_context_get_physical_for_virtual(VM_KERNEL_CONTEXT, (uint64_t)context);
+    uint32_t cpu      = smp_cpu_id();
+
+    vm_active_contexts[cpu] = context;
+
+    // threads of the same process share their context, no need to throw away the TLB
+    if((vm_read_cr3() & ~0xFFFULL) == physical) {
+        return;
+    }
+
+    if(!vm_pcid_enabled) {
+        load_cr3(physical);
+        return;
+    }
+
+    struct vm_asid* asids = vm_asids[cpu];
+    struct vm_asid* asid  = vm_asid_find(cpu, context);
+    bool            flush = !asid;
+
+    if(!asid) {
+        // recycle the least recently used ASID, its TLB entries are flushed with the CR3 write below
+        asid = &asids[0];
+
+        for(size_t i = 1; i < VM_ASID_COUNT; ++i) {
+            if(asids[i].last_used < asid->last_used) {
+                asid = &asids[i];
+            }
+        }
+
+        asid->context = context;
+    }
+
+    flush          |= asid->stale;
+    asid->stale     = false;
+    asid->last_used = ++vm_asid_clock[cpu];
+
+    uint64_t pcid = (asid - asids) + 1;
+    load_cr3(physical | pcid | (flush ? 0 : VM_CR3_NOFLUSH));
 }
 
 static void vm_ensure_table(struct vm_table* table, uint16_t index) {
     struct vm_table_entry* entry = &table->entries[index];
 
     if(!entry->present) {
-        uint64_t nt = (uint64_t)(ALLOCATOR_REGION_DIRECT_MAPPING.start + (char*)vm_page_alloc(PageUsageKernel|PageUsagePagingStructure, PageSize4KiB));
-        memset((void*)nt, 0, 4096);
+        uint64_t nt = (uint64_t)(ALLOCATOR_REGION_DIRECT_MAPPING.start + (char*)mm_alloc_zeroed());
 
         entry->next_base = (nt - ALLOCATOR_REGION_DIRECT_MAPPING.start) >> 12;
         entry->present   = 1;
@@ -395,7 +763,8 @@ static void vm_ensure_table(struct vm_table* table, uint16_t index) {
     }
 }
 
-void vm_context_map(struct vm_table* pml4, uint64_t virt, uint64_t physical, uint8_t pat) {
+//! Write the page table entry for virt, returns if a previous mapping changed and might still be cached
+static bool vm_context_set_entry(struct vm_table* pml4, uint64_t virt, uint64_t physical, uint8_t pat) {
     vm_ensure_table(pml4, PML4_INDEX(virt));
 
     struct vm_table* pdp = BASE_TO_TABLE(pml4->entries[PML4_INDEX(virt)].next_base);
@@ -406,14 +775,32 @@ void vm_context_map(struct vm_table* pml4, uint64_t virt, uint64_t physical, uin
 
     struct vm_table* pt = BASE_TO_TABLE(pd->entries[PD_INDEX(virt)].next_base);
 
+    struct vm_table_entry old = pt->entries[PT_INDEX(virt)];
+
     pt->entries[PT_INDEX(virt)].next_base = physical >> 12;
     pt->entries[PT_INDEX(virt)].present   = 1;
     pt->entries[PT_INDEX(virt)].writeable = 1;
     pt->entries[PT_INDEX(virt)].userspace = 1;
+    pt->entries[PT_INDEX(virt)].global    = vm_is_kernel_address(virt);
 
     pt->entries[PT_INDEX(virt)].pat0 = !!(pat & 1);
     pt->entries[PT_INDEX(virt)].pat1 = !!(pat & 2);
     pt->entries[PT_INDEX(virt)].huge = !!(pat & 4); // huge bit is pat2 bit in PT
+
+    // not-present entries are never cached, changed ones might be
+    return old.present && memcmp(&old, &pt->entries[PT_INDEX(virt)], sizeof(old)) != 0;
+}
+
+void vm_context_map(struct vm_table* pml4, uint64_t virt, uint64_t physical, uint8_t pat) {
+    if(vm_context_set_entry(pml4, virt, physical, pat)) {
+        vm_context_invalidate(pml4, virt);
+    }
+}
+
+void vm_context_map_local(struct vm_table* pml4, uint64_t virt, uint64_t physical, uint8_t pat) {
+    if(vm_context_set_entry(pml4, virt, physical, pat)) {
+        asm volatile("invlpg (%0)"::"r"(virt & ~0xFFFULL):"memory");
+    }
 }
 
 void vm_context_unmap(struct vm_table* context, uint64_t virt) {
@@ -448,6 +835,8 @@ void vm_context_unmap(struct vm_table* context, uint64_t virt) {
     pt_entry->present   = 0;
     pt_entry->writeable = 0;
     pt_entry->userspace = 0;
+
+    vm_context_invalidate(context, virt);
 }
 
 int vm_table_get_free_index1(struct vm_table *table) {
@@ -521,6 +910,12 @@ bool vm_context_page_present(struct vm_table* context, uint64_t virt) {
 }
 
 uint64_t vm_context_find_free(struct vm_table* context, region_t region, size_t num) {
+    struct vrange* ranges = vm_region_ranges(region);
+
+    if(ranges) {
+        return vrange_alloc(ranges, num);
+    }
+
     uint64_t current = region.start;
 
     while(current <= region.end) {
@@ -558,14 +953,27 @@ uint64_t vm_context_alloc_pages(struct vm_table* context, region_t region, size_
     for(size_t i = 0; i < num; ++i) {
         uint64_t physical = (uint64_t)mm_alloc_pages(1);
         vm_context_map(context, vdest + (i * 4096), physical, 0);
-
-        // in case of rapid alloc/dealloc/alloc we might run into trouble?
-        asm("invlpg (%0)"::"r"(vdest + (i * 4096)));
     }
 
     return vdest;
 }
 
+void vm_context_free_pages(struct vm_table* context, uint64_t virt, size_t num) {
+    for(size_t i = 0; i < num; ++i) {
+        uint64_t page     = virt + (i * 4096);
+        uint64_t physical = vm_context_get_physical_for_virtual(context, page);
+
+        vm_context_unmap(context, page);
+        mm_mark_physical_pages(physical, 1, MM_FREE);
+    }
+
+    struct vrange* ranges = vm_address_ranges(virt);
+
+    if(ranges) {
+        vrange_free(ranges, virt, num);
+    }
+}
+
 void vm_copy_page(struct vm_table* dst_ctx, uint64_t dst, struct vm_table* src_ctx, uint64_t src) {
     // XXX: make some copy-on-write here
     // XXX: incompatible with non-4k pages!
@@ -593,6 +1001,7 @@ void vm_copy_range(struct vm_table* dst, struct vm_table* src, uint64_t addr, si
     uint16_t  pml4_l = 0,     pdp_l = 0,      pd_l = 0;
     struct vm_table      *src_pdp   = 0, *src_pd   = 0, *src_pt   = 0;
     struct vm_table      *dst_pdp   = 0, *dst_pd   = 0, *dst_pt   = 0;
+    bool                  write_protected = false;
 
     for(uint64_t i = addr; i < addr + size; ) {
         uint16_t pml4_i = PML4_INDEX(i);
@@ -624,7 +1033,7 @@ void vm_copy_range(struct vm_table* dst, struct vm_table* src, uint64_t addr, si
             }
 
             dst_pdp->entries[pdp_i]           = src_pdp->entries[pdp_i];
-            dst_pdp->entries[pdp_i].next_base = (uint64_t)(mm_alloc_pages(1*GiB/4*KiB)) >> 12;
+            dst_pdp->entries[pdp_i].next_base = (uint64_t)(mm_alloc_pages(1*GiB/(4*KiB))) >> 12;
             memcpy(BASE_TO_DIRECT_MAPPED(dst_pdp->entries[pdp_i].next_base), BASE_TO_DIRECT_MAPPED(src_pdp->entries[pdp_i].next_base), 1*GiB);
 
             i += 1*GiB;
@@ -655,7 +1064,7 @@ void vm_copy_range(struct vm_table* dst, struct vm_table* src, uint64_t addr, si
             }
 
             dst_pd->entries[pd_i]           = src_pd->entries[pd_i];
-            dst_pd->entries[pd_i].next_base = (uint64_t)(mm_alloc_pages(2*MiB/4*KiB)) >> 12;
+            dst_pd->entries[pd_i].next_base = (uint64_t)(mm_alloc_pages(2*MiB/(4*KiB))) >> 12;
             memcpy(BASE_TO_DIRECT_MAPPED(dst_pd->entries[pd_i].next_base), BASE_TO_DIRECT_MAPPED(src_pd->entries[pd_i].next_base), 2*MiB);
 
             i += 2*MiB;
@@ -680,17 +1089,138 @@ void vm_copy_range(struct vm_table* dst, struct vm_table* src, uint64_t addr, si
                 panic_message("vm_copy_range/pt: unaligned page address!");
             }
 
-            dst_pt->entries[pt_i]           = src_pt->entries[pt_i];
-            dst_pt->entries[pt_i].next_base = (uint64_t)mm_alloc_pages(1) >> 12;
-            memcpy(BASE_TO_DIRECT_MAPPED(dst_pt->entries[pt_i].next_base), BASE_TO_DIRECT_MAPPED(src_pt->entries[pt_i].next_base), 4*KiB);
+            // share writeable pages read-only, the first write copies them in vm_context_resolve_cow.
+            // Read-only pages are just shared, they have to stay read-only for both contexts
+            struct page_descriptor* page = vm_page_descriptor(src_pt->entries[pt_i].next_base << 12);
+            bool copy_on_write           = src_pt->entries[pt_i].writeable || (page->flags & PageCoW);
+
+            if(!(page->flags & (PageCoW | PageSharedMemory))) {
+                page->flags    = copy_on_write ? PageCoW : PageSharedMemory;
+                page->size     = PageSize4KiB;
+                page->refcount = 1;
+            }
+
+            ++page->refcount;
+
+            if(copy_on_write) {
+                src_pt->entries[pt_i].writeable = 0;
+                write_protected                 = true;
+            }
+
+            dst_pt->entries[pt_i] = src_pt->entries[pt_i];
         }
 
         i += 4*KiB;
     }
+
+    // drop the now stale writeable TLB entries of the source context
+    if(write_protected) {
+        vm_context_flush(src);
+    }
+}
+
+bool vm_context_resolve_cow(struct vm_table* context, uint64_t virt) {
+    struct vm_table_entry* pml4_entry = &context->entries[PML4_INDEX(virt)];
+
+    if(!pml4_entry->present) {
+        return false;
+    }
+
+    struct vm_table_entry* pdp_entry = &BASE_TO_TABLE(pml4_entry->next_base)->entries[PDP_INDEX(virt)];
+
+    if(!pdp_entry->present || pdp_entry->huge) {
+        return false;
+    }
+
+    struct vm_table_entry* pd_entry = &BASE_TO_TABLE(pdp_entry->next_base)->entries[PD_INDEX(virt)];
+
+    if(!pd_entry->present || pd_entry->huge) {
+        return false;
+    }
+
+    struct vm_table_entry* pt_entry = &BASE_TO_TABLE(pd_entry->next_base)->entries[PT_INDEX(virt)];
+
+    if(!pt_entry->present || pt_entry->writeable) {
+        return false;
+    }
+
+    uint64_t                physical = pt_entry->next_base << 12;
+    struct page_descriptor* page     = page_descriptors->get(physical >> 12);
+
+    if(!page || !(page->flags & PageCoW)) {
+        return false;
+    }
+
+    if(page->refcount > 1) {
+        uint64_t copy = (uint64_t)mm_alloc_pages(1);
+        memcpy((void*)(copy + ALLOCATOR_REGION_DIRECT_MAPPING.start), BASE_TO_DIRECT_MAPPED(pt_entry->next_base), 4*KiB);
+
+        pt_entry->next_base = copy >> 12;
+        vm_ref_dec(physical);
+    }
+    else {
+        // every other mapping already got its own copy
+        page_descriptors->set(physical >> 12, 0);
+    }
+
+    pt_entry->writeable = 1;
+    vm_context_invalidate(context, virt);
+
+    return true;
+}
+
+bool vm_context_prepare_user_write(struct vm_table* context, uint64_t virt) {
+    vm_context_resolve_cow(context, virt);
+
+    struct vm_table_entry* entry = &context->entries[PML4_INDEX(virt)];
+
+    if(!entry->present || !entry->userspace) {
+        return false;
+    }
+
+    entry = &BASE_TO_TABLE(entry->next_base)->entries[PDP_INDEX(virt)];
+
+    if(!entry->present || !entry->userspace) {
+        return false;
+    }
+
+    if(!entry->huge) {
+        entry = &BASE_TO_TABLE(entry->next_base)->entries[PD_INDEX(virt)];
+
+        if(!entry->present || !entry->userspace) {
+            return false;
+        }
+
+        if(!entry->huge) {
+            entry = &BASE_TO_TABLE(entry->next_base)->entries[PT_INDEX(virt)];
+        }
+    }
+
+    return entry->present && entry->userspace && entry->writeable;
+}
+
+void vm_page_release(uint64_t physical) {
+    struct page_descriptor* page = page_descriptors->get(physical >> 12);
+
+    if(page && (page->flags & (PageCoW | PageSharedMemory))) {
+        if(page->refcount > 1) {
+            vm_ref_dec(physical);
+            return;
+        }
+
+        page_descriptors->set(physical >> 12, 0);
+    }
+
+    mm_mark_physical_pages(physical, 1, MM_FREE);
+}
+
+//! Pages used by a vm_alloc allocation of the given size
+static size_t vm_alloc_pages_for(size_t size) {
+    return (size + 4095 /* for rounding */ + 16 /* overhead */) / 4096;
 }
 
 void* vm_alloc(size_t size) {
-    size_t pages = (size + 4095 /* for rounding */ + 16 /* overhead */) / 4096;
+    size_t pages = vm_alloc_pages_for(size);
 
     void* ptr                    = (uint64_t*)vm_context_alloc_pages(VM_KERNEL_CONTEXT, ALLOCATOR_REGION_KERNEL_HEAP, pages);
     *(uint64_t*)ptr              = size;
@@ -700,7 +1230,6 @@ void* vm_alloc(size_t size) {
 }
 
 void vm_free(void* ptr) {
-    //! \todo clear and unmap pages
     uint64_t size       = *(uint64_t*)((char*)ptr - 8);
     uint64_t validation = *(uint64_t*)((char*)ptr + size);
 
@@ -708,25 +1237,18 @@ void vm_free(void* ptr) {
         panic_message("VM corruption detected!");
     }
 
-    uint64_t pages = (size + 4095) / 4096;
-
-    for(uint64_t i = 0; i < pages; ++i) {
-        uint64_t vir = ((uint64_t)ptr - 8) + (i * 0x1000);
-        uint64_t phy = vm_context_get_physical_for_virtual(VM_KERNEL_CONTEXT, vir);
-        vm_context_unmap(VM_KERNEL_CONTEXT, vir);
-        mm_mark_physical_pages(phy, 1, MM_FREE);
-    }
+    vm_context_free_pages(VM_KERNEL_CONTEXT, (uint64_t)ptr - 8, vm_alloc_pages_for(size));
 }
 
 static void* kernel_alloc_fn(allocator_t* alloc, size_t size) {
     alloc->tag += size;
-    return vm_alloc(size);
+    return kmalloc(size);
 }
 
 static void kernel_dealloc_fn(allocator_t* alloc, void* ptr) {
     size_t size = *((size_t*)ptr-1);
     alloc->tag -= size;
-    vm_free(ptr);
+    kfree(ptr);
 }
 
 allocator_t kernel_alloc{
@@ -736,8 +1258,8 @@ allocator_t kernel_alloc{
 };
 
 struct vm_table* vm_current_context(void) {
-    struct vm_table* current;
-    asm("mov %%cr3, %0":"=r"(current));
+    // lower bits are the PCID
+    struct vm_table* current = (struct vm_table*)(vm_read_cr3() & ~0xFFFULL);
 
     if(vm_direct_mapping_initialized) {
         return (struct vm_table*)((char*)current + ALLOCATOR_REGION_DIRECT_MAPPING.start);
@@ -747,15 +1269,10 @@ struct vm_table* vm_current_context(void) {
     }
 }
 
-uint64_t vm_map_hardware(uint64_t hw, size_t len) {
-    struct vm_table* context = vm_current_context();
-
+void vm_map_hardware(struct vm_table* context, uint64_t virt, uint64_t hw, size_t len) {
     size_t pages = (len + 4095) / 4096;
-    uint64_t  dest  = vm_context_find_free(context, ALLOCATOR_REGION_USER_HARDWARE, pages);
 
     for(size_t page = 0; page < pages; ++page) {
-        vm_context_map(context, dest + (page * 4096), hw + (page * 4096), 0x07);
+        vm_context_map(context, virt + (page * 4096), hw + (page * 4096), 0x07);
     }
-
-    return dest;
 }
@@ -45,6 +45,9 @@ struct vm_table;
 extern struct vm_table* VM_KERNEL_CONTEXT;
 
 void init_vm(void);
+
+//! Enable global pages and PCIDs if the CPU supports them, done for every CPU
+void vm_init_cpu(void);
 void cleanup_boot_vm(void);
 
 //! Like malloc but allocates full pages only. 16 byte data overhead.
@@ -55,25 +58,87 @@ void  vm_free(void* ptr);
 
 struct vm_table* vm_context_new(void);
 
+/**
+ * Free a context created by vm_context_new together with its page tables and
+ * the userspace pages mapped in it. Hardware mappings and the IOPB are left
+ * to their owners. The context must not be in use by any thread anymore.
+ *
+ * \param context Context to free
+ */
+void vm_context_free(struct vm_table* context);
+
 struct vm_table* vm_current_context(void);
 
 void vm_context_activate(struct vm_table* context);
 
 void vm_context_map(struct vm_table* context, uint64_t virt, uint64_t physical, uint8_t pat);
+
+/**
+ * Like vm_context_map, but only drops the old mapping from the TLB of the
+ * calling CPU. For kernel addresses only ever used by one CPU, like its TSS.
+ */
+void vm_context_map_local(struct vm_table* context, uint64_t virt, uint64_t physical, uint8_t pat);
 void vm_context_unmap(struct vm_table* context, uint64_t virt);
 
+/**
+ * Find num free pages in the given region. Kernel heap and slab region are
+ * managed by a range allocator, in these the pages are reserved right away
+ * and have to be given back with vm_context_free_pages.
+ *
+ * \param context Context to search in
+ * \param region Region to search in
+ * \param num Number of continuous pages
+ * \returns Address of the first page, 0 if no space is left
+ */
 uint64_t vm_context_find_free(struct vm_table* context, region_t region, size_t num);
 
 int   vm_table_get_free_index1(struct vm_table* table);
 int   vm_table_get_free_index3(struct vm_table* table, int start, int end);
 
 uint64_t vm_context_get_physical_for_virtual(struct vm_table* context, uint64_t virt);
+bool     vm_context_page_present(struct vm_table* context, uint64_t virt);
 
 uint64_t vm_context_alloc_pages(struct vm_table* context, region_t region, size_t num);
 
+//! Unmap and free pages from vm_context_alloc_pages, giving the address range back
+void vm_context_free_pages(struct vm_table* context, uint64_t virt, size_t num);
+
+/**
+ * Copy the mappings of a range from one context to another. Writeable 4 KiB
+ * pages are shared copy-on-write, read-only ones stay read-only and are just
+ * shared. Huge pages are copied right away.
+ *
+ * \param dst_ctx Context to copy into
+ * \param src_ctx Context to copy from
+ * \param addr Start of the range
+ * \param size Size of the range in bytes
+ */
 void vm_copy_range(struct vm_table* dst_ctx, struct vm_table* src_ctx, uint64_t addr, size_t size);
 
-//! Map a given memory area in the currently running userspace process at a random location
-uint64_t vm_map_hardware(uint64_t hw, size_t len);
+/**
+ * Handle a write fault to a copy-on-write page by giving the context its own
+ * writeable copy of the page.
+ *
+ * \param context Context the fault happened in
+ * \param virt Faulting address
+ * \returns true if virt was a copy-on-write page and is now writeable
+ */
+bool vm_context_resolve_cow(struct vm_table* context, uint64_t virt);
+
+/**
+ * Make a mapped userspace page writeable for the kernel, resolving
+ * copy-on-write like a write fault from userspace would.
+ *
+ * \param context Context the page is mapped in
+ * \param virt Address in the page
+ * \returns true if the page is mapped writeable for userspace now
+ */
+bool vm_context_prepare_user_write(struct vm_table* context, uint64_t virt);
+
+//! Drop a reference to a userspace page, marking it as free when it was the last one
+void vm_page_release(uint64_t physical);
+
+//! Map a given memory area in the given context at virt
+void vm_map_hardware(struct vm_table* context, uint64_t virt, uint64_t hw, size_t len);
 
 #endif
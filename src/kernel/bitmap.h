@@ -36,4 +36,147 @@ static inline void bitmap_clear(bitmap_t bitmap, uint64_t entry) {
     bitmap[bitmap_idx(entry)] &= ~bitmap_bit(entry);
 }
 
+/**
+ * Find the first unset entry in the bitmap, testing 64 entries at a time.
+ *
+ * \param bitmap      Bitmap to search
+ * \param num_entries Number of entries in the bitmap
+ * \returns Index of the first unset entry, num_entries if all are set
+ */
+static inline uint64_t bitmap_find_clear(bitmap_t bitmap, uint64_t num_entries) {
+    uint64_t entry = 0;
+
+    // entries are stored LSB first, so on little endian a loaded word holds 64 consecutive entries
+    for(; entry + 64 <= num_entries; entry += 64) {
+        uint64_t word;
+        __builtin_memcpy(&word, bitmap + bitmap_idx(entry), sizeof(word));
+
+        if(~word) {
+            return entry + __builtin_ctzll(~word);
+        }
+    }
+
+    for(; entry < num_entries && bitmap_get(bitmap, entry); ++entry);
+
+    return entry;
+}
+
+/**
+ * Find the first unset entry at or after a given one, testing 64 entries at a time.
+ *
+ * \param bitmap      Bitmap to search
+ * \param start       First entry to consider
+ * \param num_entries Number of entries in the bitmap
+ * \returns Index of the first unset entry not below start, num_entries if all of them are set
+ */
+static inline uint64_t bitmap_find_clear_from(bitmap_t bitmap, uint64_t start, uint64_t num_entries) {
+    uint64_t entry = start & ~63ULL;
+
+    if(start >= num_entries) {
+        return num_entries;
+    }
+
+    if(entry + 64 > num_entries) {
+        for(entry = start; entry < num_entries && bitmap_get(bitmap, entry); ++entry);
+        return entry;
+    }
+
+    // entries below start in the first word count as set
+    uint64_t word;
+    __builtin_memcpy(&word, bitmap + bitmap_idx(entry), sizeof(word));
+    word |= (1ULL << (start - entry)) - 1;
+
+    if(~word) {
+        return entry + __builtin_ctzll(~word);
+    }
+
+    entry += 64;
+    return entry + bitmap_find_clear(bitmap + bitmap_idx(entry), num_entries - entry);
+}
+
+/**
+ * Find the first set entry in the bitmap, testing 64 entries at a time.
+ *
+ * \param bitmap      Bitmap to search
+ * \param num_entries Number of entries in the bitmap
+ * \returns Index of the first set entry, num_entries if none is set
+ */
+static inline uint64_t bitmap_find_set(bitmap_t bitmap, uint64_t num_entries) {
+    uint64_t entry = 0;
+
+    for(; entry + 64 <= num_entries; entry += 64) {
+        uint64_t word;
+        __builtin_memcpy(&word, bitmap + bitmap_idx(entry), sizeof(word));
+
+        if(word) {
+            return entry + __builtin_ctzll(word);
+        }
+    }
+
+    for(; entry < num_entries && !bitmap_get(bitmap, entry); ++entry);
+
+    return entry;
+}
+
+/**
+ * Find the first set entry at or after a given one, testing 64 entries at a time.
+ *
+ * \param bitmap      Bitmap to search
+ * \param start       First entry to consider
+ * \param num_entries Number of entries in the bitmap
+ * \returns Index of the first set entry not below start, num_entries if none of them is set
+ */
+static inline uint64_t bitmap_find_set_from(bitmap_t bitmap, uint64_t start, uint64_t num_entries) {
+    uint64_t entry = start & ~63ULL;
+
+    if(start >= num_entries) {
+        return num_entries;
+    }
+
+    if(entry + 64 > num_entries) {
+        for(entry = start; entry < num_entries && !bitmap_get(bitmap, entry); ++entry);
+        return entry;
+    }
+
+    // entries below start in the first word count as unset
+    uint64_t word;
+    __builtin_memcpy(&word, bitmap + bitmap_idx(entry), sizeof(word));
+    word &= ~((1ULL << (start - entry)) - 1);
+
+    if(word) {
+        return entry + __builtin_ctzll(word);
+    }
+
+    entry += 64;
+    return entry + bitmap_find_set(bitmap + bitmap_idx(entry), num_entries - entry);
+}
+
+/**
+ * Find the last set entry in the bitmap, testing 64 entries at a time.
+ *
+ * \param bitmap      Bitmap to search
+ * \param num_entries Number of entries in the bitmap
+ * \returns Index of the last set entry, num_entries if none is set
+ */
+static inline uint64_t bitmap_find_last_set(bitmap_t bitmap, uint64_t num_entries) {
+    uint64_t entry = num_entries;
+
+    for(; entry % 64; --entry) {
+        if(bitmap_get(bitmap, entry - 1)) {
+            return entry - 1;
+        }
+    }
+
+    for(; entry; entry -= 64) {
+        uint64_t word;
+        __builtin_memcpy(&word, bitmap + bitmap_idx(entry - 64), sizeof(word));
+
+        if(word) {
+            return entry - 1 - __builtin_clzll(word);
+        }
+    }
+
+    return num_entries;
+}
+
 #endif
@@ -13,29 +13,45 @@ struct bitset_helpers {
      * \returns index of first bit in the streak or Bits+1 if none found
      */
     static size_t find_continuous_unset(const std::bitset<Bits>& bitset, size_t n) {
-        for(size_t candidate = 0; candidate < Bits - n; ++candidate) {
-            bool success = true;
-            for(size_t i = 0; i < n; ++i) {
-                if(bitset.test(candidate + i)) {
-                    success = false;
-                    candidate += i;
-                    break;
-                }
-            }
+        // jump from one run of unset bits to the next, each jump skips whole words
+        for(size_t start = find_first(bitset, 0, false); start + n <= Bits;) {
+            size_t end = find_first(bitset, start, true);
 
-            if(success) {
-                return candidate;
+            if(end - start >= n) {
+                return start;
             }
+
+            start = find_first(bitset, end, false);
         }
 
-        // can we get here, with the check if we have enough continues
-        // entries in this page on entry of this method?
         return Bits + 1;
     }
 
     static void set_range(std::bitset<Bits>& bitset, size_t start, size_t n, bool value = true) {
-        for(size_t i = 0; i < n; ++i) {
-            bitset.set(start + i, value);
+        if constexpr(requires { bitset.set_range(start, n, value); }) {
+            bitset.set_range(start, n, value);
+        }
+        else {
+            for(size_t i = 0; i < n; ++i) {
+                bitset.set(start + i, value);
+            }
+        }
+    }
+
+    /**
+     * Finds the first bit with the given value at or after from.
+     * \returns index of the bit or Bits if none found
+     */
+    static size_t find_first(const std::bitset<Bits>& bitset, size_t from, bool value) {
+        // word-wide search with tiny-stl, host builds for tests use the bit-by-bit fallback
+        if constexpr(requires { bitset.find_first_set(from); }) {
+            return value ? bitset.find_first_set(from) : bitset.find_first_unset(from);
+        }
+        else {
+            for(; from < Bits && bitset.test(from) != value; ++from) {
+            }
+
+            return from;
         }
     }
 };
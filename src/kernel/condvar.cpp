@@ -8,6 +8,12 @@
 struct condvar_data {
     //! Number of processes currently waiting on this condvar
     uint64_t wait_count;
+
+    //! Processes waiting on this condvar
+    struct scheduler_queue waiters;
+
+    //! Mutex the waiters get when signaled, 0 to only wake them
+    mutex_t mutex;
 };
 
 static TPA<condvar_data>* condvars;
@@ -26,6 +32,8 @@ void sc_handle_locking_create_condvar(uint64_t* cv, uint64_t* e) {
 
     struct condvar_data data = {
         .wait_count = 0,
+        .waiters    = { 0, 0 },
+        .mutex      = 0,
     };
 
     condvars->set(next_condvar, &data);
@@ -59,30 +67,50 @@ void sc_handle_locking_signal_condvar(uint64_t condvar, uint64_t amount, uint64_
         *e = 22; // EINVAL
         return;
     }
-    else if(data->wait_count) {
-        *e = 0;
 
-        union wait_data wd;
-        wd.condvar = condvar;
-        scheduler_waitable_done(wait_reason_condvar, wd, amount);
-        //XXX: update wait_count
+    *e = 0;
+
+    for(; amount && data->waiters.head; --amount) {
+        // instead of waking them to fight for the mutex, make them wait for it directly
+        if(data->mutex) {
+            mutex_requeue(data->mutex, &data->waiters);
+        }
+        else {
+            scheduler_wake_one(&data->waiters);
+        }
+
+        --data->wait_count;
     }
 }
 
-void sc_handle_locking_wait_condvar(uint64_t condvar, uint64_t timeout, uint64_t* e) {
+void sc_handle_locking_wait_condvar(uint64_t condvar, uint64_t timeout, uint64_t mutex, uint64_t* e) {
     UNUSED_PARAM(timeout);
 
     struct condvar_data* data = condvars->get(condvar);
+    pid_t                pid  = scheduler_current();
 
     if(!data) {
         *e = 22; // EINVAL
         return;
     }
+    else if(data->wait_count && data->mutex != mutex) {
+        *e = 22; // EINVAL, all waiters have to use the same mutex
+        return;
+    }
+    else if(mutex && !mutex_held_by(mutex, pid)) {
+        *e = 1; // EPERM
+        return;
+    }
 
     *e = 0;
     ++data->wait_count;
+    data->mutex = mutex;
+
+    if(mutex) {
+        mutex_unlock(mutex, pid);
+    }
 
     union wait_data wd;
     wd.condvar = condvar;
-    scheduler_wait_for(-1, wait_reason_condvar, wd);
+    scheduler_wait_for(-1, wait_reason_condvar, wd, &data->waiters);
 }
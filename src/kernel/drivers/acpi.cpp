@@ -1,6 +1,7 @@
 #include <log.h>
 #include <acpi.h>
 #include <hpet.h>
+#include <madt.h>
 #include <string.h>
 #include <vm.h>
 
@@ -65,6 +66,9 @@ static void acpi_process_table(struct acpi_table_header* table) {
     if(memcmp(table->signature, "HPET", 4) == 0) {
         init_hpet(table);
     }
+    else if(memcmp(table->signature, "APIC", 4) == 0) {
+        init_madt(table);
+    }
 }
 
 static void init_acpi_rsdp(void* rsdp_ptr) {
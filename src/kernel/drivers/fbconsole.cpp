@@ -337,11 +337,11 @@ void sc_handle_hardware_framebuffer(uint32_t **fb, uint16_t *width, uint16_t *he
             fbconsole_clear(0, 0, 0);
             fbconsole_active = false;
 
-            logd("fbconsole", "Gave up control of framebuffer, now process %d is in charge", scheduler_current_process);
+            logd("fbconsole", "Gave up control of framebuffer, now process %d is in charge", scheduler_current());
         } else {
             *fb = 0;
 
-            logd("fbconsole", "Would have gave up control of framebuffer to process %d, but we don't have one", scheduler_current_process);
+            logd("fbconsole", "Would have gave up control of framebuffer to process %d, but we don't have one", scheduler_current());
         }
 
     }
@@ -103,6 +103,12 @@ static struct hpet_mmio* volatile hpet;
 static uint64_t initialization_ticks = 0;
 static uint16_t ticks_to_ns_multiplier = 1;
 
+//! Shortest distance of a deadline from the current counter, see hpet_set_deadline
+static const uint64_t hpet_min_deadline_ns = 2000;
+
+//! Time until the first timer interrupt after initialization
+static const uint64_t hpet_first_deadline_ns = 10000000;
+
 static void dump_hpet_caps(struct hpet_mmio* hpet) {
     logi(
         "hpet", "capabilities: rev_id=0x%x, num_tim_cap=%d, count_size_cap=%d, leg_route_cap=%d, vendor_id=0x%04x, counter_clk_period=%d",
@@ -166,15 +172,14 @@ void init_hpet(struct acpi_table_header* header) {
     hpet->configuration = configuration;
     hpet->main_counter_register = 0;
 
+    // one-shot, the scheduler programs every interrupt for the next thing it has to do
     auto config_and_caps = hpet->timers[0].config_and_caps;
     config_and_caps.tn_int_enb_cnf = 1;
-    config_and_caps.tn_type_cnf = 1;
+    config_and_caps.tn_type_cnf = 0;
     config_and_caps.tn_fsb_en_cnf = 0;
-    config_and_caps.tn_val_set_cnf = 1;
 
     hpet->timers[0].config_and_caps = config_and_caps;
-    hpet->timers[0].comparator_value.val64 = 0;
-    hpet->timers[0].comparator_value.val64 = 100000 * ticks_to_ns_multiplier;
+    hpet->timers[0].comparator_value.val64 = hpet_first_deadline_ns / ticks_to_ns_multiplier;
 
     configuration.enable_cnf = 1;
     hpet->configuration = configuration;
@@ -190,3 +195,27 @@ void sc_handle_clock_read(uint64_t* nanoseconds) {
                      initialization_ticks;
     *nanoseconds   = ticks * ticks_to_ns_multiplier;
 }
+
+void hpet_set_deadline(uint64_t timestamp_ns_since_boot) {
+    uint64_t min_ticks = hpet_min_deadline_ns / ticks_to_ns_multiplier;
+    uint64_t ticks     = initialization_ticks + (timestamp_ns_since_boot / ticks_to_ns_multiplier);
+
+    // the comparator only fires when the counter matches it, a value the counter
+    // already passed would fire only after wrapping around - retry further away
+    // until the counter did not pass it while programming
+    while(true) {
+        uint64_t counter = hpet->main_counter_register;
+
+        if(ticks < counter + min_ticks) {
+            ticks = counter + min_ticks;
+        }
+
+        hpet->timers[0].comparator_value.val64 = ticks;
+
+        if(hpet->main_counter_register < ticks) {
+            return;
+        }
+
+        min_ticks *= 2;
+    }
+}
@@ -5,4 +5,13 @@
 
 void init_hpet(struct acpi_table_header* table);
 
+/**
+ * Program the next timer interrupt. The timer is one-shot, so this has to be
+ * called again for every interrupt wanted. Deadlines in the past result in an
+ * interrupt as soon as possible.
+ *
+ * \param timestamp_ns_since_boot Time of the interrupt, like sc_handle_clock_read
+ */
+void hpet_set_deadline(uint64_t timestamp_ns_since_boot);
+
 #endif // _HPET_H_INCLUDED
@@ -0,0 +1,58 @@
+#include <log.h>
+#include <madt.h>
+#include <smp.h>
+
+struct madt {
+    struct acpi_table_header header;
+    uint32_t                 lapic_address;
+    uint32_t                 flags;
+    uint8_t                  entries[0];
+}__attribute__((packed));
+
+struct madt_entry_header {
+    uint8_t type;
+    uint8_t length;
+}__attribute__((packed));
+
+//! Entry type describing a CPU with its local APIC
+static const uint8_t madt_type_lapic = 0;
+
+static const uint32_t madt_lapic_enabled        = 1 << 0;
+static const uint32_t madt_lapic_online_capable = 1 << 1;
+
+struct madt_lapic {
+    struct madt_entry_header header;
+    uint8_t                  acpi_processor_id;
+    uint8_t                  apic_id;
+    uint32_t                 flags;
+}__attribute__((packed));
+
+void init_madt(struct acpi_table_header* table) {
+    struct madt* madt = (struct madt*)table;
+
+    uint8_t* entry = madt->entries;
+    uint8_t* end   = (uint8_t*)madt + madt->header.length;
+    size_t   cpus  = 0;
+
+    while(entry + sizeof(struct madt_entry_header) <= end) {
+        struct madt_entry_header* header = (struct madt_entry_header*)entry;
+
+        if(header->length < sizeof(struct madt_entry_header) || entry + header->length > end) {
+            loge("madt", "Malformed entry at offset %u, ignoring the rest", entry - (uint8_t*)madt);
+            break;
+        }
+
+        if(header->type == madt_type_lapic && header->length >= sizeof(struct madt_lapic)) {
+            struct madt_lapic* lapic = (struct madt_lapic*)entry;
+
+            if(lapic->flags & (madt_lapic_enabled | madt_lapic_online_capable)) {
+                smp_register_cpu(lapic->apic_id);
+                ++cpus;
+            }
+        }
+
+        entry += header->length;
+    }
+
+    logd("madt", "%u CPUs listed", cpus);
+}
@@ -0,0 +1,9 @@
+#ifndef _MADT_H_INCLUDED
+#define _MADT_H_INCLUDED
+
+#include <acpi.h>
+
+//! Register the CPUs listed in the ACPI MADT ("APIC" table) for init_smp
+void init_madt(struct acpi_table_header* table);
+
+#endif // _MADT_H_INCLUDED
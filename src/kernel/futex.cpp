@@ -0,0 +1,185 @@
+#include <futex.h>
+#include <vm.h>
+#include <log.h>
+#include <kmalloc.h>
+#include <scheduler.h>
+#include <errno.h>
+
+//! Number of hash buckets
+#define FUTEX_BUCKETS 256
+
+struct futex_data {
+    //! Futex this waits on
+    futex_t key;
+
+    //! Processes waiting on this futex
+    struct scheduler_queue waiters;
+
+    //! Next futex in the same bucket
+    struct futex_data* next;
+};
+
+//! Futexes somebody waits on, hashed by their key. Empty ones are freed on wake
+static struct futex_data* futex_buckets[FUTEX_BUCKETS] = { 0 };
+
+static struct futex_data** futex_bucket(futex_t key) {
+    // futex words are 8 byte aligned, the lower bits carry no information
+    return &futex_buckets[(((key >> 3) * 0x9E3779B97F4A7C15ULL) >> 56) % FUTEX_BUCKETS];
+}
+
+//! Look up the futex for key in its bucket, setting *prev to the link pointing to it
+static struct futex_data* futex_find(futex_t key, struct futex_data*** prev) {
+    struct futex_data** link = futex_bucket(key);
+
+    while(*link && (*link)->key != key) {
+        link = &(*link)->next;
+    }
+
+    if(prev) {
+        *prev = link;
+    }
+
+    return *link;
+}
+
+//! Look up the futex for key, creating it if nobody waits on it yet. 0 if out of memory
+static struct futex_data* futex_get(futex_t key) {
+    struct futex_data** link;
+    struct futex_data*  data = futex_find(key, &link);
+
+    if(!data) {
+        data = (struct futex_data*)kmalloc(sizeof(struct futex_data));
+
+        if(!data) {
+            return 0;
+        }
+
+        data->key     = key;
+        data->waiters = { 0, 0 };
+        data->next    = 0;
+        *link         = data;
+    }
+
+    return data;
+}
+
+//! Free a futex once nobody waits on it anymore
+static void futex_put(struct futex_data* data) {
+    if(data->waiters.head) {
+        return;
+    }
+
+    struct futex_data** link;
+    futex_find(data->key, &link);
+
+    *link = data->next;
+    kfree(data);
+}
+
+/**
+ * Resolve the futex word at a user space address of the current process.
+ *
+ * \param addr User space address of the futex word
+ * \param key  Filled with the key of the futex
+ * \returns 0 on success, EINVAL for unaligned and EFAULT for unmapped addresses
+ */
+static uint64_t futex_key(uint64_t* addr, futex_t* key) {
+    uint64_t virt = (uint64_t)addr;
+
+    if(virt & 7) {
+        return EINVAL;
+    }
+    else if(!virt || virt & 0xFFFF800000000000) {
+        return EFAULT;
+    }
+
+    struct vm_table* context = vm_current_context();
+
+    // a page shared copy-on-write still belongs to another process, too
+    vm_context_resolve_cow(context, virt);
+
+    *key = vm_context_get_physical_for_virtual(context, virt);
+
+    return *key ? 0 : EFAULT;
+}
+
+void sc_handle_locking_futex_wait(uint64_t* addr, uint64_t expected, uint64_t* error) {
+    futex_t key;
+
+    if((*error = futex_key(addr, &key))) {
+        return;
+    }
+
+    // wakers take the kernel lock, too, so nobody can change it and wake before we wait
+    if(*addr != expected) {
+        *error = EAGAIN;
+        return;
+    }
+
+    struct futex_data* data = futex_get(key);
+
+    if(!data) {
+        *error = ENOMEM;
+        return;
+    }
+
+    union wait_data wd;
+    wd.futex = key;
+    scheduler_wait_for(-1, wait_reason_futex, wd, &data->waiters);
+}
+
+void sc_handle_locking_futex_wake(uint64_t* addr, uint64_t amount, uint64_t* woken, uint64_t* error) {
+    futex_t key;
+    *woken = 0;
+
+    if((*error = futex_key(addr, &key))) {
+        return;
+    }
+
+    struct futex_data* data = futex_find(key, 0);
+
+    if(!data) {
+        return;
+    }
+
+    *woken = scheduler_wake(&data->waiters, amount);
+
+    // also catches waiters that left because they were killed
+    futex_put(data);
+}
+
+void sc_handle_locking_futex_requeue(uint64_t* addr, uint64_t amount, uint64_t* target, uint64_t* moved, uint64_t* error) {
+    futex_t key, target_key;
+    *moved = 0;
+
+    if((*error = futex_key(addr, &key)) || (*error = futex_key(target, &target_key))) {
+        return;
+    }
+
+    struct futex_data* data = futex_find(key, 0);
+
+    if(!data) {
+        return;
+    }
+
+    scheduler_wake_one(&data->waiters);
+
+    if(data->waiters.head && key != target_key) {
+        struct futex_data* target_data = futex_get(target_key);
+
+        if(!target_data) {
+            *error = ENOMEM;
+            return;
+        }
+
+        union wait_data wd;
+        wd.futex = target_key;
+
+        // they would only wake up to wait for target anyway
+        for(; *moved < amount && data->waiters.head; ++*moved) {
+            scheduler_requeue(&data->waiters, wait_reason_futex, wd, &target_data->waiters);
+        }
+    }
+
+    futex_put(data);
+}
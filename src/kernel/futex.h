@@ -0,0 +1,12 @@
+#ifndef _FUTEX_H_INCLUDED
+#define _FUTEX_H_INCLUDED
+
+#include <stdint.h>
+
+/**
+ * Identifies a futex word: its physical address, so every mapping of the
+ * same memory refers to the same futex.
+ */
+typedef uint64_t futex_t;
+
+#endif
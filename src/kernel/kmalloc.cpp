@@ -0,0 +1,78 @@
+#include <kmalloc.h>
+#include <vm.h>
+#include <allocator/sized.h>
+
+// Size classes, power-of-two and one in between. Each slot also holds the
+// size_t in front of the allocation, larger ones are not worth it in 4 KiB pages.
+static SizedAllocator<16>   kmalloc_16;
+static SizedAllocator<32>   kmalloc_32;
+static SizedAllocator<48>   kmalloc_48;
+static SizedAllocator<64>   kmalloc_64;
+static SizedAllocator<96>   kmalloc_96;
+static SizedAllocator<128>  kmalloc_128;
+static SizedAllocator<192>  kmalloc_192;
+static SizedAllocator<256>  kmalloc_256;
+static SizedAllocator<384>  kmalloc_384;
+static SizedAllocator<512>  kmalloc_512;
+static SizedAllocator<768>  kmalloc_768;
+static SizedAllocator<1024> kmalloc_1024;
+
+static SizedAllocatorBase* kmalloc_classes[] = {
+    &kmalloc_16,
+    &kmalloc_32,
+    &kmalloc_48,
+    &kmalloc_64,
+    &kmalloc_96,
+    &kmalloc_128,
+    &kmalloc_192,
+    &kmalloc_256,
+    &kmalloc_384,
+    &kmalloc_512,
+    &kmalloc_768,
+    &kmalloc_1024,
+};
+
+//! Size class for an allocation of the given size including the header, 0 if too large for any
+static SizedAllocatorBase* kmalloc_class(size_t size) {
+    size += sizeof(size_t);
+
+    for(size_t i = 0; i < sizeof(kmalloc_classes) / sizeof(kmalloc_classes[0]); ++i) {
+        if(kmalloc_classes[i]->size() >= size) {
+            return kmalloc_classes[i];
+        }
+    }
+
+    return 0;
+}
+
+void* kmalloc(size_t size) {
+    SizedAllocatorBase* size_class = kmalloc_class(size);
+
+    if(!size_class) {
+        return vm_alloc(size);
+    }
+
+    size_t* slot = (size_t*)size_class->allocate(1);
+
+    if(!slot) {
+        return 0;
+    }
+
+    *slot = size;
+    return slot + 1;
+}
+
+void kfree(void* ptr) {
+    if(!ptr) {
+        return;
+    }
+
+    size_t*             slot       = (size_t*)ptr - 1;
+    SizedAllocatorBase* size_class = kmalloc_class(*slot);
+
+    if(!size_class) {
+        return vm_free(ptr);
+    }
+
+    size_class->deallocate(slot, 1);
+}
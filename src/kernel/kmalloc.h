@@ -0,0 +1,24 @@
+#ifndef _KMALLOC_H_INCLUDED
+#define _KMALLOC_H_INCLUDED
+
+#include <stddef.h>
+
+/**
+ * Allocate kernel memory. Small allocations are served from slots of the
+ * next larger size class, everything larger than the largest class gets
+ * whole pages from vm_alloc. Like with vm_alloc, the size of the allocation
+ * is stored right in front of the returned pointer.
+ *
+ * \param size Number of bytes to allocate
+ * \returns Pointer to the allocated memory, 0 if out of memory
+ */
+void* kmalloc(size_t size);
+
+/**
+ * Free memory allocated with kmalloc.
+ *
+ * \param ptr Pointer returned by kmalloc
+ */
+void kfree(void* ptr);
+
+#endif
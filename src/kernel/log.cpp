@@ -136,7 +136,7 @@ void sc_handle_debug_print(char* message) {
     }
 
     char buffer[20];
-    ksnprintf(buffer, sizeof(buffer), "process %d", scheduler_current_process);
+    ksnprintf(buffer, sizeof(buffer), "process %d", scheduler_current());
 
     logd(buffer, "%s", message);
 }
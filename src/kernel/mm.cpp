@@ -2,91 +2,615 @@
 #include "vm.h"
 #include "log.h"
 #include "panic.h"
+#include "bitmap.h"
+#include "string.h"
+#include "smp.h"
 
-#define PRESENT_BIT 1
+//! Highest order managed by the buddy allocator, 2^18 pages are 1 GiB
+#define MM_MAX_ORDER 18
 
-struct mm_page_list_entry_t {
-    uint64_t                start;
-    uint64_t                count;
-    mm_page_list_entry_t*   next;
-    mm_page_status_t        status;
+//! Maximum number of pages cached per CPU, freeing more flushes the magazine down to MM_MAGAZINE_LOW
+#define MM_MAGAZINE_HIGH 64
+
+//! Number of pages an empty magazine is refilled with and a full one is flushed down to
+#define MM_MAGAZINE_LOW  32
+
+//! Order of the block used for refilling a magazine in one go
+#define MM_MAGAZINE_REFILL_ORDER 5
+
+//! Maximum number of CPUs with their own magazine
+#define MM_MAX_CPUS SMP_MAX_CPUS
+
+//! Maximum number of pre-zeroed pages kept around for mm_alloc_zeroed
+#define MM_ZERO_POOL_SIZE 256
+
+//! Look for every page freed through a magazine in all magazines and the zero pool, see kernel_debug_mm
+#ifndef MM_DEBUG_MAGAZINE
+#define MM_DEBUG_MAGAZINE 0
+#endif
+
+//! A region of free physical memory as reported by the loader
+struct mm_boot_region {
+    uint64_t start;
+    uint64_t count;
+};
+
+//! Free list entry, stored in the first page of every free block
+struct mm_free_block {
+    mm_free_block* next;
+    mm_free_block* prev;
 };
 
-mm_page_list_entry_t* mm_physical_page_list = 0;
+//! Free regions until the buddy allocator takes over, lives in the page given to mm_bootstrap
+static mm_boot_region* mm_boot_regions      = 0;
+static size_t          mm_boot_region_count = 0;
+static const size_t    mm_boot_region_max   = 4096 / sizeof(mm_boot_region);
+
+static bool           mm_buddy_ready    = false;
+static uint64_t       mm_direct_mapping = 0;
+
+//! First page frame number not managed by the buddy allocator
+static uint64_t       mm_max_pfn        = 0;
+
+//! Number of pages currently free
+static uint64_t       mm_pages_free     = 0;
+
+static mm_free_block* mm_free_lists[MM_MAX_ORDER + 1];
+
+//! One bit per block of the given order, set if the block is the head of a free block of that order
+static bitmap_t       mm_free_maps[MM_MAX_ORDER + 1];
+
+//! Stack of free single pages for one CPU
+struct mm_magazine {
+    uint64_t count;
+    uint64_t pages[MM_MAGAZINE_HIGH];
+
+    uint64_t alloc_hits;
+    uint64_t alloc_misses;
+    uint64_t free_hits;
+    uint64_t free_misses;
+};
 
-void mm_del_page_list_entry(mm_page_list_entry_t* entry) {
-    entry->start  = 0;
-    entry->count  = 0;
-    entry->status = MM_UNKNOWN;
+static mm_magazine mm_magazines[MM_MAX_CPUS];
+
+//! Magazine of the calling CPU
+static inline mm_magazine* mm_local_magazine(void) {
+    return &mm_magazines[smp_cpu_id()];
 }
 
-void* mm_alloc_pages(uint64_t count) {
-    mm_page_list_entry_t* current = mm_physical_page_list;
+//! Page frame numbers of pages already cleared, refilled from the idle loop
+static uint64_t mm_zero_pool[MM_ZERO_POOL_SIZE];
+static uint64_t mm_zero_pool_count  = 0;
+static uint64_t mm_zero_pool_hits   = 0;
+static uint64_t mm_zero_pool_misses = 0;
+
+static inline mm_free_block* mm_block(uint64_t pfn) {
+    return (mm_free_block*)(mm_direct_mapping + (pfn << 12));
+}
+
+static inline uint64_t mm_block_pfn(mm_free_block* block) {
+    return ((uint64_t)block - mm_direct_mapping) >> 12;
+}
+
+static void mm_buddy_push(uint8_t order, uint64_t pfn) {
+    mm_free_block* block = mm_block(pfn);
+    block->prev = 0;
+    block->next = mm_free_lists[order];
+
+    if(block->next) {
+        block->next->prev = block;
+    }
+
+    mm_free_lists[order] = block;
+    bitmap_set(mm_free_maps[order], pfn >> order);
+}
+
+static void mm_buddy_remove(uint8_t order, uint64_t pfn) {
+    mm_free_block* block = mm_block(pfn);
+
+    if(block->prev) {
+        block->prev->next = block->next;
+    }
+    else {
+        mm_free_lists[order] = block->next;
+    }
+
+    if(block->next) {
+        block->next->prev = block->prev;
+    }
+
+    bitmap_clear(mm_free_maps[order], pfn >> order);
+}
+
+/**
+ * Find the free block containing the given page
+ *
+ * \param pfn Page frame number to look for
+ * \param head Set to the first page of the free block, if found
+ * \returns Order of the free block containing pfn, -1 if pfn is not free
+ */
+static int mm_buddy_find(uint64_t pfn, uint64_t* head) {
+    for(int order = 0; order <= MM_MAX_ORDER; ++order) {
+        uint64_t candidate = pfn & ~((1ULL << order) - 1);
+
+        if(bitmap_get(mm_free_maps[order], candidate >> order)) {
+            *head = candidate;
+            return order;
+        }
+    }
+
+    return -1;
+}
+
+//! True if any page of the given block is in a free block already
+static bool mm_buddy_overlaps_free(uint64_t pfn, uint8_t order) {
+    uint64_t head;
+
+    // free blocks containing the first page, which includes all bigger ones overlapping it
+    if(mm_buddy_find(pfn, &head) >= 0) {
+        return true;
+    }
+
+    // smaller free blocks anywhere inside it
+    for(uint8_t smaller = 0; smaller < order; ++smaller) {
+        uint64_t first = pfn >> smaller;
+        uint64_t end   = first + (1ULL << (order - smaller));
+
+        if(bitmap_find_set_from(mm_free_maps[smaller], first, end) < end) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void mm_buddy_free(uint64_t pfn, uint8_t order) {
+    while(order < MM_MAX_ORDER) {
+        uint64_t buddy = pfn ^ (1ULL << order);
+
+        if(buddy >= mm_max_pfn || !bitmap_get(mm_free_maps[order], buddy >> order)) {
+            break;
+        }
+
+        mm_buddy_remove(order, buddy);
+        pfn &= ~(1ULL << order);
+        ++order;
+    }
+
+    mm_buddy_push(order, pfn);
+}
+
+static void mm_buddy_free_range(uint64_t pfn, uint64_t count) {
+    while(count) {
+        // biggest naturally aligned block starting at pfn and fitting in count
+        uint8_t order = 0;
+        while(order < MM_MAX_ORDER && !(pfn & (1ULL << order)) && (2ULL << order) <= count) {
+            ++order;
+        }
+
+        if(mm_buddy_overlaps_free(pfn, order)) {
+            panic_message("Double free in mm_buddy_free_range");
+        }
+
+        mm_buddy_free(pfn, order);
+        mm_pages_free += 1ULL << order;
 
-    while(current) {
-        if(current->status == MM_FREE && current->count >= count) {
-            current->count -= count;
-            void* ret = (void*)current->start;
+        pfn   += 1ULL << order;
+        count -= 1ULL << order;
+    }
+}
+
+//! Allocate a block of the given order, returns its page frame number or 0 if out of memory
+static uint64_t mm_buddy_alloc(uint8_t order) {
+    uint8_t current = order;
+    while(current <= MM_MAX_ORDER && !mm_free_lists[current]) {
+        ++current;
+    }
+
+    if(current > MM_MAX_ORDER) {
+        return 0;
+    }
+
+    uint64_t pfn = mm_block_pfn(mm_free_lists[current]);
+    mm_buddy_remove(current, pfn);
+
+    // split, keeping the lower half and returning the upper one to the free lists
+    while(current > order) {
+        --current;
+        mm_buddy_push(current, pfn + (1ULL << current));
+    }
+
+    mm_pages_free -= 1ULL << order;
+    return pfn;
+}
+
+//! Take a single page out of the free lists, no-op if the page is not free
+static void mm_buddy_take(uint64_t pfn) {
+    for(size_t cpu = 0; cpu < MM_MAX_CPUS; ++cpu) {
+        mm_magazine* magazine = &mm_magazines[cpu];
 
-            if(current->count) {
-                current->start += 4096 * count;
+        for(uint64_t i = 0; i < magazine->count; ++i) {
+            if(magazine->pages[i] == pfn) {
+                magazine->pages[i] = magazine->pages[--magazine->count];
+                return;
             }
-            else {
-                mm_del_page_list_entry(current);
+        }
+    }
+
+    for(uint64_t i = 0; i < mm_zero_pool_count; ++i) {
+        if(mm_zero_pool[i] == pfn) {
+            mm_zero_pool[i] = mm_zero_pool[--mm_zero_pool_count];
+            return;
+        }
+    }
+
+    uint64_t head;
+    int order = mm_buddy_find(pfn, &head);
+
+    if(order < 0) {
+        return;
+    }
+
+    mm_buddy_remove(order, head);
+
+    while(order) {
+        --order;
+        uint64_t half = head + (1ULL << order);
+
+        if(pfn >= half) {
+            mm_buddy_push(order, head);
+            head = half;
+        }
+        else {
+            mm_buddy_push(order, half);
+        }
+    }
+
+    --mm_pages_free;
+}
+
+static void mm_magazine_refill(mm_magazine* magazine) {
+    uint64_t pfn = mm_buddy_alloc(MM_MAGAZINE_REFILL_ORDER);
+
+    if(pfn) {
+        for(uint64_t i = 0; i < (1ULL << MM_MAGAZINE_REFILL_ORDER); ++i) {
+            magazine->pages[magazine->count++] = pfn + i;
+        }
+
+        return;
+    }
+
+    // no block big enough, collect what single pages are left
+    while(magazine->count < MM_MAGAZINE_LOW && (pfn = mm_buddy_alloc(0))) {
+        magazine->pages[magazine->count++] = pfn;
+    }
+}
+
+static void mm_magazine_flush(mm_magazine* magazine, uint64_t target) {
+    while(magazine->count > target) {
+        mm_buddy_free_range(magazine->pages[--magazine->count], 1);
+    }
+}
+
+//! Give every cached page back to the buddy allocator, last resort before running out of memory
+static void mm_reclaim(void) {
+    mm_magazine_drain();
+
+    while(mm_zero_pool_count) {
+        mm_buddy_free_range(mm_zero_pool[--mm_zero_pool_count], 1);
+    }
+}
+
+static uint64_t mm_magazine_alloc(void) {
+    mm_magazine* magazine = mm_local_magazine();
+
+    if(magazine->count) {
+        ++magazine->alloc_hits;
+    }
+    else {
+        ++magazine->alloc_misses;
+        mm_magazine_refill(magazine);
+
+        if(!magazine->count) {
+            mm_reclaim();
+            mm_magazine_refill(magazine);
+        }
+
+        if(!magazine->count) {
+            panic_message("Out of memory in mm_alloc_pages");
+        }
+    }
+
+    return magazine->pages[--magazine->count];
+}
+
+//! True if the page is cached in a magazine or the zero pool, which makes it free already
+static bool mm_page_cached(uint64_t pfn) {
+    for(size_t cpu = 0; cpu < MM_MAX_CPUS; ++cpu) {
+        mm_magazine* magazine = &mm_magazines[cpu];
+
+        for(uint64_t i = 0; i < magazine->count; ++i) {
+            if(magazine->pages[i] == pfn) {
+                return true;
             }
+        }
+    }
 
-            return ret;
+    for(uint64_t i = 0; i < mm_zero_pool_count; ++i) {
+        if(mm_zero_pool[i] == pfn) {
+            return true;
         }
+    }
 
-        current = current->next;
+    return false;
+}
+
+static void mm_magazine_free(uint64_t pfn) {
+    uint64_t head;
+
+    // the caches are only scanned for debugging, that is too slow for every free
+    if(mm_buddy_find(pfn, &head) >= 0 || (MM_DEBUG_MAGAZINE && mm_page_cached(pfn))) {
+        panic_message("Double free in mm_magazine_free");
+    }
+
+    mm_magazine* magazine = mm_local_magazine();
+
+    if(magazine->count < MM_MAGAZINE_HIGH) {
+        ++magazine->free_hits;
     }
+    else {
+        ++magazine->free_misses;
+        mm_magazine_flush(magazine, MM_MAGAZINE_LOW);
+    }
+
+    magazine->pages[magazine->count++] = pfn;
+}
 
-    panic_message("Out of memory in mm_alloc_pages");
+void mm_magazine_drain(void) {
+    for(size_t cpu = 0; cpu < MM_MAX_CPUS; ++cpu) {
+        mm_magazine_flush(&mm_magazines[cpu], 0);
+    }
 }
 
-mm_page_list_entry_t* mm_get_page_list_entry(mm_page_list_entry_t* start) {
-    mm_page_list_entry_t* previous = 0;
+static void mm_boot_region_add(uint64_t start, uint64_t count) {
+    uint64_t end = start + (count * 4096);
 
-    while(start) {
-        if(start->status == MM_UNKNOWN && start->start == 0 && start->count == 0) {
-            return start;
+    for(size_t i = 0; i < mm_boot_region_count; ++i) {
+        mm_boot_region* region = &mm_boot_regions[i];
+
+        if(region->start + (region->count * 4096) == start) {
+            region->count += count;
+            return;
+        }
+        else if(region->start == end) {
+            region->start  = start;
+            region->count += count;
+            return;
         }
+    }
 
-        previous = start;
-        start    = start->next;
+    if(mm_boot_region_count == mm_boot_region_max) {
+        logw("mm", "Boot region list full, ignoring %u free pages at 0x%x", count, start);
+        return;
     }
 
-    mm_page_list_entry_t* new_entry = (mm_page_list_entry_t*)vm_context_alloc_pages(VM_KERNEL_CONTEXT, ALLOCATOR_REGION_KERNEL_HEAP, 1);
+    mm_boot_regions[mm_boot_region_count].start = start;
+    mm_boot_regions[mm_boot_region_count].count = count;
+    ++mm_boot_region_count;
+}
+
+static void mm_boot_region_remove(uint64_t start, uint64_t count) {
+    uint64_t end = start + (count * 4096);
 
-    for(unsigned long i = 0; i < 4096 / sizeof(mm_page_list_entry_t); i++) {
-        new_entry[i].start  = 0;
-        new_entry[i].count  = 0;
-        new_entry[i].status = MM_UNKNOWN;
+    for(size_t i = 0; i < mm_boot_region_count; ++i) {
+        mm_boot_region* region = &mm_boot_regions[i];
+        uint64_t region_end    = region->start + (region->count * 4096);
 
-        if(i) {
-            new_entry[i - 1].next = new_entry + i;
+        if(end <= region->start || start >= region_end) {
+            continue;
+        }
+
+        if(start > region->start && end < region_end) {
+            // split, the second half is appended to the list
+            region->count = (start - region->start) / 4096;
+            mm_boot_region_add(end, (region_end - end) / 4096);
+        }
+        else if(start > region->start) {
+            region->count = (start - region->start) / 4096;
+        }
+        else if(end < region_end) {
+            region->count = (region_end - end) / 4096;
+            region->start = end;
+        }
+        else {
+            region->count = 0;
         }
     }
+}
 
-    previous->next = new_entry;
-    return new_entry;
+void* mm_alloc_pages(uint64_t count) {
+    if(!mm_buddy_ready) {
+        for(size_t i = 0; i < mm_boot_region_count; ++i) {
+            mm_boot_region* region = &mm_boot_regions[i];
+
+            if(region->count >= count) {
+                void* ret = (void*)region->start;
+                region->start += count * 4096;
+                region->count -= count;
+                return ret;
+            }
+        }
+
+        panic_message("Out of memory in mm_alloc_pages");
+    }
+
+    uint8_t order = 0;
+    while((1ULL << order) < count) {
+        ++order;
+    }
+
+    if(order > MM_MAX_ORDER) {
+        panic_message("mm_alloc_pages: allocation bigger than the largest buddy block");
+    }
+
+    if(!order) {
+        return (void*)(mm_magazine_alloc() << 12);
+    }
+
+    uint64_t pfn = mm_buddy_alloc(order);
+
+    if(!pfn) {
+        // cached pages might coalesce into what we need
+        mm_reclaim();
+        pfn = mm_buddy_alloc(order);
+    }
+
+    if(!pfn) {
+        panic_message("Out of memory in mm_alloc_pages");
+    }
+
+    // give back what we don't need of the power-of-two block
+    if((1ULL << order) > count) {
+        mm_buddy_free_range(pfn + count, (1ULL << order) - count);
+    }
+
+    return (void*)(pfn << 12);
+}
+
+void* mm_alloc_zeroed(void) {
+    if(!mm_buddy_ready) {
+        panic_message("mm_alloc_zeroed called before the direct mapping is available");
+    }
+
+    if(mm_zero_pool_count) {
+        ++mm_zero_pool_hits;
+        return (void*)(mm_zero_pool[--mm_zero_pool_count] << 12);
+    }
+
+    ++mm_zero_pool_misses;
+
+    void* page = mm_alloc_pages(1);
+    memset((void*)(mm_direct_mapping + (uint64_t)page), 0, 4096);
+    return page;
+}
+
+void* mm_zero_pool_reserve(void) {
+    if(!mm_buddy_ready || mm_zero_pool_count >= MM_ZERO_POOL_SIZE) {
+        return 0;
+    }
+
+    // don't steal the last pages from real allocations
+    mm_magazine* magazine = mm_local_magazine();
+    if(!magazine->count && !mm_pages_free) {
+        return 0;
+    }
+
+    return mm_alloc_pages(1);
+}
+
+void mm_zero_pool_add(void* page) {
+    // other CPUs might have filled the pool while this page was cleared
+    if(mm_zero_pool_count >= MM_ZERO_POOL_SIZE) {
+        mm_magazine_free((uint64_t)page >> 12);
+        return;
+    }
+
+    mm_zero_pool[mm_zero_pool_count++] = (uint64_t)page >> 12;
+}
+
+size_t mm_zero_pool_refill(size_t max) {
+    size_t done = 0;
+    void*  page;
+
+    while(done < max && (page = mm_zero_pool_reserve())) {
+        memset((void*)(mm_direct_mapping + (uint64_t)page), 0, 4096);
+        mm_zero_pool_add(page);
+        ++done;
+    }
+
+    return done;
 }
 
 void mm_bootstrap(uint64_t usable_page) {
     while(usable_page % 4096);
 
     // bootstrap memory management with the first page given to us
-    mm_page_list_entry_t* page_list = (mm_page_list_entry_t*)usable_page;
-    mm_physical_page_list = page_list;
+    mm_boot_regions      = (mm_boot_region*)usable_page;
+    mm_boot_region_count = 0;
+
+    mm_buddy_ready    = false;
+    mm_direct_mapping = 0;
+    mm_max_pfn        = 0;
+    mm_pages_free     = 0;
+
+    for(int order = 0; order <= MM_MAX_ORDER; ++order) {
+        mm_free_lists[order] = 0;
+        mm_free_maps[order]  = 0;
+    }
+
+    memset(mm_magazines, 0, sizeof(mm_magazines));
+
+    mm_zero_pool_count  = 0;
+    mm_zero_pool_hits   = 0;
+    mm_zero_pool_misses = 0;
+}
+
+void mm_init_buddy(uint64_t direct_mapping) {
+    mm_direct_mapping = direct_mapping;
+    mm_max_pfn        = mm_highest_address() / 4096;
+
+    size_t   map_sizes[MM_MAX_ORDER + 1];
+    uint64_t metadata_size = 0;
+
+    for(int order = 0; order <= MM_MAX_ORDER; ++order) {
+        map_sizes[order] = bitmap_size((mm_max_pfn >> order) + 1);
+        metadata_size   += map_sizes[order];
+    }
+
+    uint64_t metadata_pages = (metadata_size + 4095) / 4096;
+
+    // take the bitmaps from the smallest region they fit in, keeping big regions intact for big blocks
+    mm_boot_region* metadata_region = 0;
+    for(size_t i = 0; i < mm_boot_region_count; ++i) {
+        mm_boot_region* region = &mm_boot_regions[i];
 
-    for(unsigned long i = 0; i < 4096 / sizeof(mm_page_list_entry_t); i++) {
-        page_list[i].start  = 0;
-        page_list[i].count  = 0;
-        page_list[i].status = MM_UNKNOWN;
-        page_list[i].next   = &page_list[i + 1];
+        if(region->count >= metadata_pages && (!metadata_region || region->count < metadata_region->count)) {
+            metadata_region = region;
+        }
+    }
+
+    if(!metadata_region) {
+        panic_message("No physical memory region big enough for buddy allocator bitmaps");
+    }
+
+    uint8_t* metadata = (uint8_t*)(mm_direct_mapping + metadata_region->start);
+    metadata_region->start += metadata_pages * 4096;
+    metadata_region->count -= metadata_pages;
+
+    memset(metadata, 0, metadata_size);
+
+    for(int order = 0; order <= MM_MAX_ORDER; ++order) {
+        mm_free_maps[order] = metadata;
+        metadata += map_sizes[order];
     }
 
-    page_list[(4096 / sizeof(mm_page_list_entry_t)) - 1].next = 0;
+    for(size_t i = 0; i < mm_boot_region_count; ++i) {
+        uint64_t pfn   = mm_boot_regions[i].start / 4096;
+        uint64_t count = mm_boot_regions[i].count;
+
+        // never hand out physical page 0, a physical address of 0 means "not mapped" in a lot of places
+        if(!pfn && count) {
+            ++pfn;
+            --count;
+        }
+
+        mm_buddy_free_range(pfn, count);
+    }
+
+    mm_boot_region_count = 0;
+    mm_buddy_ready       = true;
+
+    logi("mm", "buddy allocator initialized, %u pages free, %u pages used for bitmaps", mm_pages_free, metadata_pages);
 }
 
 void mm_mark_physical_pages(uint64_t start, uint64_t count, mm_page_status_t status) {
@@ -94,85 +618,104 @@ void mm_mark_physical_pages(uint64_t start, uint64_t count, mm_page_status_t sta
         return;
     }
 
-    if(!mm_physical_page_list && status == MM_FREE) {
-        mm_bootstrap(start);
-        return;
-    }
-    else if(!mm_physical_page_list && status != MM_FREE) {
+    if(!mm_boot_regions && !mm_buddy_ready) {
         panic_message("mm not bootstrapped with free page first!");
     }
 
-    mm_page_list_entry_t* current = mm_physical_page_list;
-    while(current) {
-        if(start >= current->start && start + (count * 4096) <= current->start + (current->count * 4096)) {
-            if(current->status == status) {
-                return;
-            }
-            else {
-                mm_page_status_t old_status = current->status;
-
-                uint64_t start_first  = current->start;
-                uint64_t count_first  = (start - start_first) / 4096;
-
-                if(count_first == 0) {
-                    mm_del_page_list_entry(current);
-                }
-                else {
-                    current->start = start_first;
-                    current->count = count_first;
-                }
-
-                uint64_t start_second = start + (count * 4096);
-                uint64_t count_second = (current->start + (current->count * 4096)) - (start + (count * 4096));
-
-                if(count_second) {
-                    mm_page_list_entry_t* entry = mm_get_page_list_entry(mm_physical_page_list);
-                    entry->start  = start_second;
-                    entry->count  = count_second;
-                    entry->status = old_status;
-                }
-
-                mm_page_list_entry_t* entry = mm_get_page_list_entry(mm_physical_page_list);
-                entry->start  = start;
-                entry->count  = count;
-                entry->status = status;
-
-                return;
-            }
+    if(!mm_buddy_ready) {
+        if(status == MM_FREE) {
+            mm_boot_region_add(start, count);
+        }
+        else {
+            mm_boot_region_remove(start, count);
         }
 
-        current = current->next;
+        return;
     }
 
-    mm_page_list_entry_t* new_entry = mm_get_page_list_entry(mm_physical_page_list);
-    new_entry->start  = start;
-    new_entry->count  = count;
-    new_entry->status = status;
+    if(start / 4096 + count > mm_max_pfn) {
+        logw("mm", "Ignoring %u pages at 0x%x outside of the managed physical memory", count, start);
+        return;
+    }
+
+    if(status == MM_FREE && count == 1) {
+        mm_magazine_free(start / 4096);
+    }
+    else if(status == MM_FREE) {
+        mm_buddy_free_range(start / 4096, count);
+    }
+    else {
+        for(uint64_t i = 0; i < count; ++i) {
+            mm_buddy_take(start / 4096 + i);
+        }
+    }
 }
 
 void mm_print_physical_free_regions(void) {
-    mm_page_list_entry_t* current = mm_physical_page_list;
+    if(!mm_buddy_ready) {
+        for(size_t i = 0; i < mm_boot_region_count; ++i) {
+            logd("mm", "%d free pages starting at 0x%x\n", mm_boot_regions[i].count, mm_boot_regions[i].start);
+        }
 
-    while(current) {
-        if(current->status == MM_FREE) {
-            logd("mm", "%d free pages starting at 0x%x\n", current->count, current->start);
+        return;
+    }
+
+    for(int order = 0; order <= MM_MAX_ORDER; ++order) {
+        size_t blocks = 0;
+
+        for(mm_free_block* block = mm_free_lists[order]; block; block = block->next) {
+            ++blocks;
         }
 
-        current = current->next;
+        if(blocks) {
+            logd("mm", "%d free blocks of order %d (%d pages each)", blocks, order, 1ULL << order);
+        }
     }
+
+    struct mm_statistics stats;
+    mm_get_statistics(&stats);
+
+    logd("mm", "%d pages cached in magazines, alloc hits/misses %d/%d, free hits/misses %d/%d",
+        stats.magazine_pages,
+        stats.magazine_alloc_hits, stats.magazine_alloc_misses,
+        stats.magazine_free_hits,  stats.magazine_free_misses
+    );
+    logd("mm", "%d pre-zeroed pages, hits/misses %d/%d",
+        stats.zero_pool_pages, stats.zero_pool_hits, stats.zero_pool_misses
+    );
 }
 
 uint64_t mm_highest_address(void) {
+    if(mm_buddy_ready) {
+        return mm_max_pfn * 4096;
+    }
+
     uint64_t res = 0;
-    mm_page_list_entry_t* current = mm_physical_page_list;
 
-    while(current) {
-        if(current->start + current->count > res) {
-            res = current->start + (current->count * 4096);
-        }
+    for(size_t i = 0; i < mm_boot_region_count; ++i) {
+        uint64_t end = mm_boot_regions[i].start + (mm_boot_regions[i].count * 4096);
 
-        current = current->next;
+        if(end > res) {
+            res = end;
+        }
     }
 
     return res;
 }
+
+void mm_get_statistics(struct mm_statistics* stats) {
+    memset(stats, 0, sizeof(struct mm_statistics));
+    stats->pages_free = mm_pages_free;
+
+    for(size_t cpu = 0; cpu < MM_MAX_CPUS; ++cpu) {
+        stats->magazine_pages        += mm_magazines[cpu].count;
+        stats->magazine_alloc_hits   += mm_magazines[cpu].alloc_hits;
+        stats->magazine_alloc_misses += mm_magazines[cpu].alloc_misses;
+        stats->magazine_free_hits    += mm_magazines[cpu].free_hits;
+        stats->magazine_free_misses  += mm_magazines[cpu].free_misses;
+    }
+
+    stats->zero_pool_pages  = mm_zero_pool_count;
+    stats->zero_pool_hits   = mm_zero_pool_hits;
+    stats->zero_pool_misses = mm_zero_pool_misses;
+}
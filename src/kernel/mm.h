@@ -22,8 +22,76 @@ typedef enum {
     MM_WRITEBACK,
 } mm_caching_mode_t;
 
+//! Statistics of the physical memory management
+struct mm_statistics {
+    //! Pages free in the buddy allocator
+    uint64_t pages_free;
+
+    //! Free pages cached in the per-CPU magazines
+    uint64_t magazine_pages;
+
+    //! Single page allocations served from a magazine
+    uint64_t magazine_alloc_hits;
+
+    //! Single page allocations that had to refill a magazine first
+    uint64_t magazine_alloc_misses;
+
+    //! Single page frees put into a magazine
+    uint64_t magazine_free_hits;
+
+    //! Single page frees that had to flush a magazine first
+    uint64_t magazine_free_misses;
+
+    //! Pre-zeroed pages ready for mm_alloc_zeroed
+    uint64_t zero_pool_pages;
+
+    //! mm_alloc_zeroed calls served from the pre-zeroed pool
+    uint64_t zero_pool_hits;
+
+    //! mm_alloc_zeroed calls that had to clear a page synchronously
+    uint64_t zero_pool_misses;
+};
+
+/**
+ * Allocate continuous physical pages. Single pages are served from a per-CPU
+ * magazine without touching the buddy allocator most of the time.
+ *
+ * \param count Number of pages to allocate
+ * \returns Physical address of the first page
+ */
 void* mm_alloc_pages(uint64_t count);
 
+/**
+ * Allocate a single physical page filled with zeros. Takes a page from the
+ * pool of pre-zeroed pages if possible, clearing one synchronously otherwise.
+ *
+ * \returns Physical address of the page
+ */
+void* mm_alloc_zeroed(void);
+
+/**
+ * Take a free page to be cleared for the pre-zeroed pool. Clearing it can be
+ * done without holding any lock, mm_zero_pool_add puts it into the pool then.
+ *
+ * \returns Physical address of the page, 0 if the pool is full or memory is low
+ */
+void* mm_zero_pool_reserve(void);
+
+/**
+ * Add a page taken with mm_zero_pool_reserve to the pre-zeroed pool.
+ *
+ * \param page Physical address of the page, cleared by the caller
+ */
+void mm_zero_pool_add(void* page);
+
+/**
+ * Clear free pages for the pre-zeroed pool in one go.
+ *
+ * \param max Maximum number of pages to clear in this call
+ * \returns Number of pages added to the pool
+ */
+size_t mm_zero_pool_refill(size_t max);
+
 /**
  * set the caching mode for the pages starting at start until start + len
  *
@@ -52,8 +120,35 @@ void mm_make_writeable(uint64_t address, int writeable);
 
 void mm_print_physical_free_regions(void);
 
+/**
+ * Start physical memory management, using the given page to track the free
+ * regions reported by the loader until the buddy allocator is initialized.
+ *
+ * \param usable_page Virtual address of a page usable for bookkeeping
+ */
 void mm_bootstrap(uint64_t usable_page);
 
+/**
+ * Hand all free regions to the buddy allocator. Must be called once physical
+ * memory is reachable via the direct mapping, as the free lists are stored in
+ * the free pages themselves.
+ *
+ * \param direct_mapping Virtual address at which physical address 0 is mapped
+ */
+void mm_init_buddy(uint64_t direct_mapping);
+
 uint64_t mm_highest_address(void);
 
+/**
+ * Give all pages cached in the per-CPU magazines back to the buddy allocator
+ */
+void mm_magazine_drain(void);
+
+/**
+ * Retrieve statistics of the physical memory management
+ *
+ * \param stats Where to store the statistics
+ */
+void mm_get_statistics(struct mm_statistics* stats);
+
 #endif
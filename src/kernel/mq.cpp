@@ -58,6 +58,9 @@ struct MessageQueue {
     struct MessageQueuePage* last_page;
 
     flexarray_t notify_teardown;
+
+    //! Processes waiting for a message
+    struct scheduler_queue waiters;
 };
 
 static TPA<MessageQueue>*   mqs;
@@ -84,6 +87,7 @@ uint64_t mq_create(allocator_t* alloc) {
         .first_page = 0,
         .last_page  = 0,
         .notify_teardown = new_flexarray(sizeof(mq_notifier), 0, alloc),
+        .waiters         = { 0, 0 },
     };
 
     mqs->set(next_mq, &mq);
@@ -116,6 +120,9 @@ void mq_destroy(uint64_t mq) {
 
     delete_flexarray(data->notify_teardown);
 
+    // let waiters find out the queue is gone
+    scheduler_wake(&data->waiters, (size_t)-1);
+
     mqs->set(mq, 0);
 }
 
@@ -181,9 +188,8 @@ uint64_t mq_push(uint64_t mq, struct Message* message) {
     data->bytes += message->size;
     ++data->items;
 
-    union wait_data wd;
-    wd.message_queue = mq;
-    scheduler_waitable_done(wait_reason_message, wd, 1);
+    // one message is enough for one waiter
+    scheduler_wake_one(&data->waiters);
 
     return 0;
 }
@@ -259,3 +265,13 @@ uint64_t mq_notify_teardown(mq_id_t mq, mq_notifier notifier) {
     flexarray_append(data->notify_teardown, &notifier);
     return 0;
 }
+
+struct scheduler_queue* mq_waiters(mq_id_t mq) {
+    struct MessageQueue* data = mqs->get(mq);
+
+    if(!data) {
+        return 0;
+    }
+
+    return &data->waiters;
+}
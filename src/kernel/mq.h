@@ -7,6 +7,8 @@
 
 typedef uint64_t mq_id_t;
 
+struct scheduler_queue;
+
 typedef void (*mq_notifier)(mq_id_t mq);
 
 void init_mq(allocator_t* alloc);
@@ -20,4 +22,7 @@ uint64_t mq_peek(mq_id_t mq, struct Message* message);
 
 uint64_t mq_notify_teardown(mq_id_t mq, mq_notifier notifier);
 
+//! Wait queue of processes waiting for a message in the given queue, 0 if the queue does not exist
+struct scheduler_queue* mq_waiters(mq_id_t mq);
+
 #endif
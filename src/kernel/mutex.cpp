@@ -12,6 +12,16 @@ struct mutex_data {
 
     //! PID of the process who holds the current lock
     pid_t holder;
+
+    //! Processes waiting to get the lock
+    struct scheduler_queue waiters;
+
+    //! ID of this mutex
+    mutex_t id;
+
+    //! Links in the list of mutexes held by holder, see scheduler_held_mutexes
+    struct mutex_data* held_prev;
+    struct mutex_data* held_next;
 };
 
 static TPA<mutex_data>* mutexes;
@@ -21,6 +31,42 @@ void init_mutex(void) {
     mutexes = TPA<mutex_data>::create(&kernel_alloc, 4080, 0);
 }
 
+//! Add a mutex that just got locked to the list of its holder
+static void mutex_held_link(struct mutex_data* data) {
+    struct mutex_data** head = scheduler_held_mutexes(data->holder);
+
+    if(!head) {
+        return;
+    }
+
+    data->held_prev = 0;
+    data->held_next = *head;
+
+    if(*head) {
+        (*head)->held_prev = data;
+    }
+
+    *head = data;
+}
+
+//! Remove a mutex that just got unlocked from the list of its holder
+static void mutex_held_unlink(struct mutex_data* data) {
+    struct mutex_data** head = scheduler_held_mutexes(data->holder);
+
+    if(data->held_prev) {
+        data->held_prev->held_next = data->held_next;
+    }
+    else if(head) {
+        *head = data->held_next;
+    }
+
+    if(data->held_next) {
+        data->held_next->held_prev = data->held_prev;
+    }
+
+    data->held_prev = data->held_next = 0;
+}
+
 mutex_t mutex_create(void) {
     if(!next_mutex) {
         panic_message("Mutex namespace overflow!");
@@ -29,6 +75,10 @@ mutex_t mutex_create(void) {
     struct mutex_data data = {
         .state      = 0,
         .holder     = 0,
+        .waiters    = { 0, 0 },
+        .id         = next_mutex,
+        .held_prev  = 0,
+        .held_next  = 0,
     };
 
     mutexes->set(next_mutex, &data);
@@ -59,8 +109,11 @@ bool mutex_lock(mutex_t mutex, pid_t holder) {
         return false;
     }
     else {
-        ++data->state;
-        data->holder = holder;
+        if(!data->state++) {
+            data->holder = holder;
+            mutex_held_link(data);
+        }
+
         return true;
     }
 }
@@ -83,9 +136,14 @@ bool mutex_unlock(mutex_t mutex, pid_t holder) {
         --data->state;
 
         if(!data->state) {
-            union wait_data wd;
-            wd.mutex = mutex;
-            scheduler_waitable_done(wait_reason_mutex, wd, 1);
+            mutex_held_unlink(data);
+
+            // hand the lock over to the first waiter
+            pid_t next = scheduler_wake_one(&data->waiters);
+
+            if(next != (pid_t)-1) {
+                mutex_lock(mutex, next);
+            }
         }
 
         return true;
@@ -93,25 +151,49 @@ bool mutex_unlock(mutex_t mutex, pid_t holder) {
 }
 
 void mutex_unlock_holder(pid_t pid) {
-    size_t prev = 0;
-    size_t mutex = 1;
-    do {
-        logd("mutex", "Looking at the holder of %d", mutex);
-        struct mutex_data* data = mutexes->get(mutex);
-
-        // we have to check if the mutex is valid since the first
-        // iteration of this loop always looks at mutex 1 which could
-        // be invalid by now. Following iterations should be validity-
-        // checked by the condition of the loop
-        if(data && data->state && data->holder == pid) {
-            logw("mutex", "Mutex %d was held by %d but we are unlocking, probably because the process is dead - mutex leak possible",
-                    mutex, pid);
-
-            mutex_unlock(mutex, pid);
+    struct mutex_data** head = scheduler_held_mutexes(pid);
+
+    if(!head) {
+        return;
+    }
+
+    // unlocking removes the mutex from the list and maybe adds it to the one of the next holder
+    while(*head) {
+        struct mutex_data* data = *head;
+
+        logw("mutex", "Mutex %d was held by %d but we are unlocking, probably because the process is dead - mutex leak possible",
+                data->id, pid);
+
+        data->state = 1;
+        mutex_unlock(data->id, pid);
+    }
+}
+
+bool mutex_held_by(mutex_t mutex, pid_t holder) {
+    struct mutex_data* data = mutexes->get(mutex);
+    return data && data->state && data->holder == holder;
+}
+
+bool mutex_requeue(mutex_t mutex, struct scheduler_queue* queue) {
+    struct mutex_data* data = mutexes->get(mutex);
+
+    if(!data || !data->state) {
+        pid_t next = scheduler_wake_one(queue);
+
+        if(next == (pid_t)-1) {
+            return false;
         }
 
-        prev = mutex;
-    } while((mutex = mutexes->next(prev)) > prev);
+        if(data) {
+            mutex_lock(mutex, next);
+        }
+
+        return true;
+    }
+
+    union wait_data wd;
+    wd.mutex = mutex;
+    return scheduler_requeue(queue, wait_reason_mutex, wd, &data->waiters) != (pid_t)-1;
 }
 
 void sc_handle_locking_create_mutex(uint64_t* mutex, uint64_t* error) {
@@ -144,7 +226,7 @@ void sc_handle_locking_destroy_mutex(uint64_t mutex, uint64_t* error) {
 void sc_handle_locking_lock_mutex(uint64_t mutex, bool trylock, uint64_t* error) {
     struct mutex_data* data = mutexes->get(mutex);
 
-    pid_t holder = scheduler_current_process;
+    pid_t holder = scheduler_current();
 
     if(!data) {
         *error = EINVAL;
@@ -158,7 +240,7 @@ void sc_handle_locking_lock_mutex(uint64_t mutex, bool trylock, uint64_t* error)
         else {
             union wait_data wd;
             wd.mutex = mutex;
-            scheduler_wait_for(-1, wait_reason_mutex, wd);
+            scheduler_wait_for(-1, wait_reason_mutex, wd, &data->waiters);
         }
     }
     else {
@@ -173,7 +255,7 @@ void sc_handle_locking_lock_mutex(uint64_t mutex, bool trylock, uint64_t* error)
             else {
                 union wait_data wd;
                 wd.mutex = mutex;
-                scheduler_wait_for(-1, wait_reason_mutex, wd);
+                scheduler_wait_for(-1, wait_reason_mutex, wd, &data->waiters);
             }
         }
     }
@@ -184,7 +266,7 @@ void sc_handle_locking_lock_mutex(uint64_t mutex, bool trylock, uint64_t* error)
 void sc_handle_locking_unlock_mutex(uint64_t mutex, uint64_t* error) {
     struct mutex_data* data = mutexes->get(mutex);
 
-    pid_t holder = scheduler_current_process;
+    pid_t holder = scheduler_current();
 
     if(!data) {
         *error = EINVAL;
@@ -16,4 +16,17 @@ bool mutex_lock(mutex_t mutex, pid_t holder);
 bool mutex_unlock(mutex_t mutex, pid_t holder);
 void mutex_unlock_holder(pid_t holder);
 
+//! True if the mutex exists and is locked by holder
+bool mutex_held_by(mutex_t mutex, pid_t holder);
+
+/**
+ * Make the first process waiting in a queue wait for the mutex instead,
+ * handing the mutex to it right away if it is unlocked.
+ *
+ * \param mutex Mutex the process continues with
+ * \param queue Wait queue to take the process from
+ * \returns false if nobody was waiting in queue
+ */
+bool mutex_requeue(mutex_t mutex, struct scheduler_queue* queue);
+
 #endif
@@ -0,0 +1,270 @@
+#include <rwlock.h>
+#include <tpa.h>
+#include <vm.h>
+#include <kmalloc.h>
+#include <log.h>
+#include <scheduler.h>
+#include <errno.h>
+
+struct rwlock_data {
+    //! Number of processes holding a read lock
+    uint64_t readers;
+
+    //! Process holding the write lock, -1 if none
+    pid_t writer;
+
+    //! Processes waiting for a read lock
+    struct scheduler_queue waiting_readers;
+
+    //! Processes waiting for the write lock, preferred over new readers
+    struct scheduler_queue waiting_writers;
+};
+
+//! Locks a process holds on one rwlock, in the list of the process, see scheduler_held_rwlocks
+struct rwlock_hold {
+    rwlock_t rwlock;
+
+    //! Number of read locks the process holds
+    uint64_t reads;
+
+    //! True if the process holds the write lock
+    bool write;
+
+    struct rwlock_hold* prev;
+    struct rwlock_hold* next;
+};
+
+static TPA<rwlock_data>* rwlocks;
+static uint64_t          next_rwlock = 1;
+
+void init_rwlock(void) {
+    rwlocks = TPA<rwlock_data>::create(&kernel_alloc, 4080, 0);
+}
+
+//! Locks holder has on rwlock, a new empty record if none and create is set, 0 otherwise
+static struct rwlock_hold* rwlock_hold_find(pid_t holder, rwlock_t rwlock, bool create) {
+    struct rwlock_hold** head = scheduler_held_rwlocks(holder);
+
+    if(!head) {
+        return 0;
+    }
+
+    for(struct rwlock_hold* hold = *head; hold; hold = hold->next) {
+        if(hold->rwlock == rwlock) {
+            return hold;
+        }
+    }
+
+    if(!create) {
+        return 0;
+    }
+
+    struct rwlock_hold* hold = (struct rwlock_hold*)kmalloc(sizeof(struct rwlock_hold));
+    hold->rwlock = rwlock;
+    hold->reads  = 0;
+    hold->write  = false;
+    hold->prev   = 0;
+    hold->next   = *head;
+
+    if(*head) {
+        (*head)->prev = hold;
+    }
+
+    *head = hold;
+    return hold;
+}
+
+//! Remove a record from the list of holder once it holds nothing anymore
+static void rwlock_hold_drop(pid_t holder, struct rwlock_hold* hold) {
+    if(hold->reads || hold->write) {
+        return;
+    }
+
+    struct rwlock_hold** head = scheduler_held_rwlocks(holder);
+
+    if(hold->prev) {
+        hold->prev->next = hold->next;
+    }
+    else if(head) {
+        *head = hold->next;
+    }
+
+    if(hold->next) {
+        hold->next->prev = hold->prev;
+    }
+
+    kfree(hold);
+}
+
+//! Take the lock for holder, the caller checked it is free for it
+static void rwlock_take(struct rwlock_data* data, rwlock_t rwlock, pid_t holder, bool write) {
+    struct rwlock_hold* hold = rwlock_hold_find(holder, rwlock, true);
+
+    if(write) {
+        data->writer = holder;
+
+        if(hold) {
+            hold->write = true;
+        }
+    }
+    else {
+        ++data->readers;
+
+        if(hold) {
+            ++hold->reads;
+        }
+    }
+}
+
+//! Hand a now free lock to the first waiting writer or, if none, all waiting readers
+static void rwlock_hand_over(struct rwlock_data* data, rwlock_t rwlock) {
+    if(data->readers || data->writer != (pid_t)-1) {
+        return;
+    }
+
+    pid_t writer = scheduler_wake_one(&data->waiting_writers);
+
+    if(writer != (pid_t)-1) {
+        rwlock_take(data, rwlock, writer, true);
+        return;
+    }
+
+    pid_t reader;
+
+    while((reader = scheduler_wake_one(&data->waiting_readers)) != (pid_t)-1) {
+        rwlock_take(data, rwlock, reader, false);
+    }
+}
+
+void sc_handle_locking_create_rwlock(uint64_t* rwlock, uint64_t* error) {
+    if(!next_rwlock) {
+        *error = ENOMEM;
+        logw("rwlock", "RWLock namespace overflow!");
+        return;
+    }
+
+    struct rwlock_data data = {
+        .readers         = 0,
+        .writer          = (pid_t)-1,
+        .waiting_readers = { 0, 0 },
+        .waiting_writers = { 0, 0 },
+    };
+
+    rwlocks->set(next_rwlock, &data);
+
+    *rwlock = next_rwlock++;
+    *error  = 0;
+}
+
+void sc_handle_locking_destroy_rwlock(uint64_t rwlock, uint64_t* error) {
+    struct rwlock_data* data = rwlocks->get(rwlock);
+
+    if(!data) {
+        *error = EINVAL;
+        return;
+    }
+    else if(data->readers || data->writer != (pid_t)-1) {
+        *error = EBUSY;
+        return;
+    }
+
+    rwlocks->set(rwlock, 0);
+    *error = 0;
+}
+
+void sc_handle_locking_lock_rwlock(uint64_t rwlock, bool write, bool trylock, uint64_t* error) {
+    struct rwlock_data* data = rwlocks->get(rwlock);
+    pid_t               pid  = scheduler_current();
+
+    if(!data) {
+        *error = EINVAL;
+        return;
+    }
+    else if(data->writer == pid) {
+        *error = EDEADLK;
+        return;
+    }
+
+    *error = 0;
+
+    // readers queue up behind waiting writers, so a steady stream of them cannot starve writers
+    bool free = write ? !data->readers && data->writer == (pid_t)-1
+                      : data->writer == (pid_t)-1 && !data->waiting_writers.head;
+
+    if(free) {
+        rwlock_take(data, rwlock, pid, write);
+    }
+    else if(trylock) {
+        *error = EBUSY;
+    }
+    else {
+        // rwlock_hand_over takes the lock for us before waking us up
+        union wait_data wd;
+        wd.rwlock = rwlock;
+        scheduler_wait_for(-1, wait_reason_rwlock, wd, write ? &data->waiting_writers : &data->waiting_readers);
+    }
+}
+
+void sc_handle_locking_unlock_rwlock(uint64_t rwlock, uint64_t* error) {
+    struct rwlock_data* data = rwlocks->get(rwlock);
+    pid_t               pid  = scheduler_current();
+
+    if(!data) {
+        *error = EINVAL;
+        return;
+    }
+
+    struct rwlock_hold* hold = rwlock_hold_find(pid, rwlock, false);
+
+    if(data->writer == pid) {
+        data->writer = (pid_t)-1;
+
+        if(hold) {
+            hold->write = false;
+        }
+    }
+    else if(hold && hold->reads) {
+        --hold->reads;
+        --data->readers;
+    }
+    else {
+        *error = EPERM;
+        return;
+    }
+
+    if(hold) {
+        rwlock_hold_drop(pid, hold);
+    }
+
+    *error = 0;
+    rwlock_hand_over(data, rwlock);
+}
+
+void rwlock_unlock_holder(pid_t holder) {
+    struct rwlock_hold** head = scheduler_held_rwlocks(holder);
+
+    if(!head) {
+        return;
+    }
+
+    while(*head) {
+        struct rwlock_hold* hold = *head;
+        struct rwlock_data* data = rwlocks->get(hold->rwlock);
+
+        *head = hold->next;
+
+        if(data) {
+            logw("rwlock", "RWLock %d was held by %d but we are unlocking, probably because the process is dead",
+                    hold->rwlock, holder);
+
+            if(hold->write && data->writer == holder) {
+                data->writer = (pid_t)-1;
+            }
+
+            data->readers -= hold->reads;
+            rwlock_hand_over(data, hold->rwlock);
+        }
+
+        kfree(hold);
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef _RWLOCK_H_INCLUDED
+#define _RWLOCK_H_INCLUDED
+
+#include <stdint.h>
+
+typedef uint64_t rwlock_t;
+
+#include <scheduler.h>
+
+void init_rwlock(void);
+
+//! Release all locks a process holds on reader-writer locks, for when it exits
+void rwlock_unlock_holder(pid_t holder);
+
+#endif
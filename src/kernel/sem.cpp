@@ -0,0 +1,100 @@
+#include <sem.h>
+#include <tpa.h>
+#include <vm.h>
+#include <log.h>
+#include <scheduler.h>
+#include <errno.h>
+
+struct semaphore_data {
+    //! Number of times the semaphore can be taken without waiting
+    uint64_t value;
+
+    //! Processes waiting for the value to become positive
+    struct scheduler_queue waiters;
+};
+
+static TPA<semaphore_data>* semaphores;
+static uint64_t             next_semaphore = 1;
+
+void init_semaphore(void) {
+    semaphores = TPA<semaphore_data>::create(&kernel_alloc, 4080, 0);
+}
+
+void sc_handle_locking_create_semaphore(uint64_t value, uint64_t* semaphore, uint64_t* error) {
+    if(!next_semaphore) {
+        *error = ENOMEM;
+        logw("semaphore", "Semaphore namespace overflow!");
+        return;
+    }
+
+    struct semaphore_data data = {
+        .value   = value,
+        .waiters = { 0, 0 },
+    };
+
+    semaphores->set(next_semaphore, &data);
+
+    *semaphore = next_semaphore++;
+    *error     = 0;
+}
+
+void sc_handle_locking_destroy_semaphore(uint64_t semaphore, uint64_t* error) {
+    struct semaphore_data* data = semaphores->get(semaphore);
+
+    if(!data) {
+        *error = EINVAL;
+        return;
+    }
+    else if(data->waiters.head) {
+        *error = EBUSY;
+        return;
+    }
+
+    semaphores->set(semaphore, 0);
+    *error = 0;
+}
+
+void sc_handle_locking_wait_semaphore(uint64_t semaphore, bool trywait, uint64_t* error) {
+    struct semaphore_data* data = semaphores->get(semaphore);
+
+    if(!data) {
+        *error = EINVAL;
+        return;
+    }
+
+    *error = 0;
+
+    if(data->value) {
+        --data->value;
+    }
+    else if(trywait) {
+        *error = EAGAIN;
+    }
+    else {
+        // post hands its increment directly to us, nobody else can take it in between
+        union wait_data wd;
+        wd.semaphore = semaphore;
+        scheduler_wait_for(-1, wait_reason_semaphore, wd, &data->waiters);
+    }
+}
+
+void sc_handle_locking_post_semaphore(uint64_t semaphore, uint64_t* error) {
+    struct semaphore_data* data = semaphores->get(semaphore);
+
+    if(!data) {
+        *error = EINVAL;
+        return;
+    }
+
+    *error = 0;
+
+    if(scheduler_wake_one(&data->waiters) != (pid_t)-1) {
+        return;
+    }
+    else if(data->value == UINT64_MAX) {
+        *error = EOVERFLOW;
+        return;
+    }
+
+    ++data->value;
+}
@@ -0,0 +1,10 @@
+#ifndef _SEM_H_INCLUDED
+#define _SEM_H_INCLUDED
+
+#include <stdint.h>
+
+typedef uint64_t semaphore_t;
+
+void init_semaphore(void);
+
+#endif
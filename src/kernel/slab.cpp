@@ -22,8 +22,7 @@ void init_slab(uint64_t mem_start, uint64_t mem_end, size_t allocation_size) {
 uint64_t slab_alloc(SlabHeader* slab) {
     bitmap_t bitmap = (bitmap_t)((uint64_t)slab + sizeof(SlabHeader));
 
-    SlabIndexType idx;
-    for(idx = 0; idx < slab->num_entries && bitmap_get(bitmap, idx); ++idx);
+    SlabIndexType idx = bitmap_find_clear(bitmap, slab->num_entries);
 
     if(idx < slab->num_entries) {
         bitmap_set(bitmap, idx);
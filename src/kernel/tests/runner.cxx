@@ -12,7 +12,8 @@
 #include "../allocator.h"
 
 namespace LFOS {
-    LFOS_API uint64_t scheduler_current_process = 0;
+    LFOS_API uint64_t scheduler_current(void) { return 0; }
+    LFOS_API uint32_t smp_cpu_id(void)        { return 0; }
 
     extern "C" {
         LFOS_API void panic_message(const char* message) {
@@ -0,0 +1,62 @@
+#include <lfostest.h>
+
+namespace LFOS {
+    #include <bitmap.h>
+
+    TEST(KernelBitmap, FindClear) {
+        uint8_t bitmap[32];
+        memset(bitmap, 0xFF, sizeof(bitmap));
+
+        EXPECT_EQ(bitmap_find_clear(bitmap, 256), 256) << "full bitmap";
+
+        bitmap_clear(bitmap, 200);
+        EXPECT_EQ(bitmap_find_clear(bitmap, 256), 200) << "found in a later word";
+        EXPECT_EQ(bitmap_find_clear(bitmap, 199), 199) << "not found past the end";
+
+        bitmap_clear(bitmap, 3);
+        EXPECT_EQ(bitmap_find_clear(bitmap, 256), 3) << "first one is found";
+    }
+
+    TEST(KernelBitmap, FindClearFrom) {
+        uint8_t bitmap[32];
+        memset(bitmap, 0xFF, sizeof(bitmap));
+
+        bitmap_clear(bitmap, 3);
+        bitmap_clear(bitmap, 10);
+        bitmap_clear(bitmap, 130);
+        bitmap_clear(bitmap, 250);
+
+        EXPECT_EQ(bitmap_find_clear_from(bitmap, 0,   256), 3)   << "same as bitmap_find_clear from 0";
+        EXPECT_EQ(bitmap_find_clear_from(bitmap, 3,   256), 3)   << "start itself is found";
+        EXPECT_EQ(bitmap_find_clear_from(bitmap, 4,   256), 10)  << "entries below start in the same word are skipped";
+        EXPECT_EQ(bitmap_find_clear_from(bitmap, 11,  256), 130) << "later words are searched";
+        EXPECT_EQ(bitmap_find_clear_from(bitmap, 131, 256), 250) << "partial last word";
+        EXPECT_EQ(bitmap_find_clear_from(bitmap, 251, 256), 256) << "none left";
+        EXPECT_EQ(bitmap_find_clear_from(bitmap, 300, 256), 256) << "start past the end";
+        EXPECT_EQ(bitmap_find_clear_from(bitmap, 131, 200), 200) << "not found past the end";
+    }
+
+    TEST(KernelBitmap, FindSet) {
+        uint8_t bitmap[32];
+        memset(bitmap, 0, sizeof(bitmap));
+
+        EXPECT_EQ(bitmap_find_set(bitmap, 256),      256) << "empty bitmap";
+        EXPECT_EQ(bitmap_find_last_set(bitmap, 256), 256) << "empty bitmap, searching backwards";
+
+        bitmap_set(bitmap, 3);
+        bitmap_set(bitmap, 10);
+        bitmap_set(bitmap, 130);
+        bitmap_set(bitmap, 250);
+
+        EXPECT_EQ(bitmap_find_set(bitmap, 256),           3)   << "first one is found";
+        EXPECT_EQ(bitmap_find_set_from(bitmap, 4,   256), 10)  << "entries below start in the same word are skipped";
+        EXPECT_EQ(bitmap_find_set_from(bitmap, 11,  256), 130) << "later words are searched";
+        EXPECT_EQ(bitmap_find_set_from(bitmap, 131, 256), 250) << "partial last word";
+        EXPECT_EQ(bitmap_find_set_from(bitmap, 251, 256), 256) << "none left";
+        EXPECT_EQ(bitmap_find_set_from(bitmap, 11,  100), 100) << "not found past the end";
+
+        EXPECT_EQ(bitmap_find_last_set(bitmap, 256), 250) << "last one is found";
+        EXPECT_EQ(bitmap_find_last_set(bitmap, 200), 130) << "entries past the end are ignored";
+        EXPECT_EQ(bitmap_find_last_set(bitmap, 128), 10)  << "found in an earlier word";
+    }
+}
@@ -0,0 +1,248 @@
+#include <bitset>
+#include <chrono>
+#include <forward_list>
+#include <random>
+#include <set>
+#include <vector>
+#include <sys/mman.h>
+
+#include <lfostest.h>
+
+namespace LFOS {
+    #include <vm.h>
+
+    struct vm_table* VM_KERNEL_CONTEXT = 0;
+
+    static std::set<void*> vm_allocations;
+
+    void* vm_alloc(size_t size) {
+        size_t* data = (size_t*)malloc(size + sizeof(size_t));
+        *data = size;
+
+        vm_allocations.insert(data + 1);
+        return data + 1;
+    }
+
+    void vm_free(void* ptr) {
+        vm_allocations.erase(ptr);
+        free((size_t*)ptr - 1);
+    }
+
+    //! Pages currently "mapped" by vm_context_alloc_pages
+    static size_t mapped_pages = 0;
+
+    uint64_t vm_context_alloc_pages(struct vm_table*, region_t, size_t num) {
+        mapped_pages += num;
+        return (uint64_t)aligned_alloc(4096, num * 4096);
+    }
+
+    void vm_context_free_pages(struct vm_table*, uint64_t virt, size_t num) {
+        mapped_pages -= num;
+        free((void*)virt);
+    }
+
+    #include <allocator/page.cpp>
+    #include <kmalloc.cpp>
+    #include <mm.cpp>
+    #include <vrange.cpp>
+
+    class KmallocTest : public ::testing::Test {
+        public:
+            KmallocTest() {
+                PageAllocatorBase::memory_management_bootstrapped = true;
+            }
+    };
+
+    TEST_F(KmallocTest, SizeClasses) {
+        EXPECT_EQ(kmalloc_class(1)->size(),    16)   << "smallest class";
+        EXPECT_EQ(kmalloc_class(8)->size(),    16)   << "header fits in smallest class";
+        EXPECT_EQ(kmalloc_class(9)->size(),    32)   << "header does not fit anymore";
+        EXPECT_EQ(kmalloc_class(40)->size(),   48)   << "intermediate class";
+        EXPECT_EQ(kmalloc_class(1016)->size(), 1024) << "largest class";
+        EXPECT_EQ(kmalloc_class(1017),         (void*)0) << "too large for any class";
+    }
+
+    TEST_F(KmallocTest, Small) {
+        std::vector<uint8_t*> allocations;
+
+        for(size_t size = 1; size <= 1016; size += 7) {
+            uint8_t* ptr = (uint8_t*)kmalloc(size);
+
+            ASSERT_NE(ptr, (void*)0);
+            EXPECT_EQ(*((size_t*)ptr - 1), size) << "size stored in front of the allocation";
+            EXPECT_EQ(vm_allocations.count(ptr), 0) << "not a vm_alloc allocation";
+
+            memset(ptr, size & 0xFF, size);
+            allocations.push_back(ptr);
+        }
+
+        for(uint8_t* ptr : allocations) {
+            size_t size = *((size_t*)ptr - 1);
+
+            for(size_t i = 0; i < size; ++i) {
+                ASSERT_EQ(ptr[i], size & 0xFF) << "no overlapping allocations";
+            }
+
+            kfree(ptr);
+        }
+    }
+
+    TEST_F(KmallocTest, Large) {
+        void* ptr = kmalloc(4000);
+
+        EXPECT_EQ(vm_allocations.count(ptr), 1) << "large allocations use vm_alloc";
+        EXPECT_EQ(*((size_t*)ptr - 1), 4000)    << "size stored in front of the allocation";
+
+        kfree(ptr);
+        EXPECT_EQ(vm_allocations.count(ptr), 0) << "given back to vm_free";
+    }
+
+    TEST_F(KmallocTest, Reuse) {
+        void* a = kmalloc(40);
+        kfree(a);
+
+        EXPECT_EQ(kmalloc(40), a) << "freed slot reused";
+        kfree(a);
+    }
+
+    //! Heap address ranges of the vm_alloc model, like ALLOCATOR_REGION_KERNEL_HEAP in the kernel
+    static struct vrange heap_range;
+
+    static void* heap_range_page() {
+        return aligned_alloc(4096, 4096);
+    }
+
+    //! Pages vm_alloc takes for an allocation of the given size, like vm_alloc_pages_for in the kernel
+    static size_t vm_alloc_pages(size_t size) {
+        return (size + 4095 + 16) / 4096;
+    }
+
+    //! vm_alloc as the kernel does it, except for mapping the pages: an address range and a physical page per page
+    static uint64_t vm_alloc_model(size_t size, std::vector<uint64_t>& physical) {
+        size_t   pages = vm_alloc_pages(size);
+        uint64_t virt  = vrange_alloc(&heap_range, pages);
+
+        for(size_t i = 0; i < pages; ++i) {
+            physical.push_back((uint64_t)mm_alloc_pages(1));
+        }
+
+        return virt;
+    }
+
+    static void vm_free_model(uint64_t virt, std::vector<uint64_t>& physical) {
+        for(uint64_t page : physical) {
+            mm_mark_physical_pages(page, 1, MM_FREE);
+        }
+
+        vrange_free(&heap_range, virt, physical.size());
+        physical.clear();
+    }
+
+    /* Replace random allocations out of a set of live ones, measuring a pair of
+     * allocate and free. Small allocations are what kmalloc was added for: a
+     * 40 byte message, also the size of a flexarray header, and the initial
+     * data of a flexarray of 8 pointers. */
+    TEST_F(KmallocTest, Benchmark) {
+        const size_t live   = 1000;
+        const size_t rounds = 200000;
+        const size_t sizes[] = { 40, 64 };
+
+        // physical memory for the buddy allocator, only touched pages are backed
+        const uint64_t physical_size = 256 * MiB;
+        void* memory         = mmap(0, physical_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        void* bootstrap_page = aligned_alloc(4096, 4096);
+
+        mm_bootstrap((uint64_t)bootstrap_page);
+        mm_mark_physical_pages(1 * MiB, (physical_size - 1 * MiB) / 4096, MM_FREE);
+        mm_init_buddy((uint64_t)memory);
+
+        vrange_init(&heap_range, 0xFFFFFFFF90000000, 0xFFFFFFFFFFFFFFFF, heap_range_page);
+
+        std::mt19937_64 rng(0x1F05);
+
+        for(size_t size : sizes) {
+            std::vector<void*> allocations(live);
+
+            for(void*& ptr : allocations) {
+                ptr = kmalloc(size);
+            }
+
+            auto start = std::chrono::steady_clock::now();
+
+            for(size_t i = 0; i < rounds; ++i) {
+                size_t idx = rng() % live;
+
+                kfree(allocations[idx]);
+                allocations[idx] = kmalloc(size);
+            }
+
+            auto end = std::chrono::steady_clock::now();
+
+            for(void* ptr : allocations) {
+                kfree(ptr);
+            }
+
+            size_t kmalloc_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / rounds;
+
+            std::vector<uint64_t>              addresses(live);
+            std::vector<std::vector<uint64_t>> physical(live);
+
+            for(size_t i = 0; i < live; ++i) {
+                addresses[i] = vm_alloc_model(size, physical[i]);
+            }
+
+            start = std::chrono::steady_clock::now();
+
+            for(size_t i = 0; i < rounds; ++i) {
+                size_t idx = rng() % live;
+
+                vm_free_model(addresses[idx], physical[idx]);
+                addresses[idx] = vm_alloc_model(size, physical[idx]);
+            }
+
+            end = std::chrono::steady_clock::now();
+
+            for(size_t i = 0; i < live; ++i) {
+                vm_free_model(addresses[i], physical[i]);
+            }
+
+            size_t vm_alloc_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / rounds;
+
+            printf("%zu bytes with %zu live allocations: kmalloc %zu ns, vm_alloc without mapping %zu ns per allocate/free\n",
+                   size, live, kmalloc_ns, vm_alloc_ns);
+            RecordProperty("kmalloc_ns_" + std::to_string(size), kmalloc_ns);
+            RecordProperty("vm_alloc_ns_" + std::to_string(size), vm_alloc_ns);
+        }
+
+        munmap(memory, physical_size);
+        free(bootstrap_page);
+    }
+
+    /* Memory mapped for many small allocations, before kmalloc every one of
+     * them took vm_alloc pages of its own. */
+    TEST_F(KmallocTest, Footprint) {
+        const size_t count = 10000;
+        const size_t size  = 40;
+
+        std::vector<void*> allocations(count);
+        size_t             mapped_before = mapped_pages;
+
+        for(void*& ptr : allocations) {
+            ptr = kmalloc(size);
+        }
+
+        size_t kmalloc_bytes  = (mapped_pages - mapped_before) * 4096;
+        size_t vm_alloc_bytes = count * vm_alloc_pages(size) * 4096;
+
+        for(void* ptr : allocations) {
+            kfree(ptr);
+        }
+
+        printf("%zu allocations of %zu bytes: %zu bytes mapped with kmalloc, %zu bytes with vm_alloc\n",
+               count, size, kmalloc_bytes, vm_alloc_bytes);
+        RecordProperty("kmalloc_bytes", kmalloc_bytes);
+        RecordProperty("vm_alloc_bytes", vm_alloc_bytes);
+
+        EXPECT_LT(kmalloc_bytes, vm_alloc_bytes / 10) << "allocations share pages";
+    }
+}
@@ -0,0 +1,270 @@
+#include <algorithm>
+#include <random>
+#include <vector>
+#include <sys/mman.h>
+
+#include <lfostest.h>
+
+namespace LFOS {
+    #define MM_DEBUG_MAGAZINE 1
+    #include <mm.cpp>
+
+    class MmTest : public ::testing::Test {
+        public:
+            MmTest() {
+                // "physical" memory from 0 to _physical_size, only touched pages are backed by real memory
+                _memory = mmap(0, _physical_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+                _bootstrap_page = aligned_alloc(4096, 4096);
+
+                mm_bootstrap((uint64_t)_bootstrap_page);
+            }
+
+            virtual ~MmTest() {
+                munmap(_memory, _physical_size);
+                free(_bootstrap_page);
+            }
+
+        protected:
+            static const uint64_t _physical_size = 3 * GiB;
+
+            void*    _memory;
+            void*    _bootstrap_page;
+
+            void init_buddy() {
+                mm_init_buddy((uint64_t)_memory);
+            }
+
+            //! Free pages in the buddy allocator and the magazines
+            uint64_t pages_free() {
+                struct mm_statistics stats;
+                mm_get_statistics(&stats);
+
+                return stats.pages_free + stats.magazine_pages;
+            }
+
+            size_t free_blocks(uint8_t order) {
+                size_t res = 0;
+
+                for(mm_free_block* block = mm_free_lists[order]; block; block = block->next) {
+                    ++res;
+                }
+
+                return res;
+            }
+    };
+
+    TEST_F(MmTest, BootRegions) {
+        mm_mark_physical_pages(1 * MiB, 256, MM_FREE);
+        mm_mark_physical_pages(2 * MiB, 256, MM_FREE);
+
+        EXPECT_EQ(mm_boot_region_count, 1)       << "Adjacent regions merged";
+        EXPECT_EQ(mm_highest_address(), 3 * MiB) << "Highest address from boot regions";
+
+        mm_mark_physical_pages(2 * MiB, 16, MM_RESERVED);
+        EXPECT_EQ(mm_boot_region_count, 2)       << "Reserving inside a region splits it";
+
+        void* page = mm_alloc_pages(1);
+        EXPECT_EQ((uint64_t)page, 1 * MiB)       << "Boot allocation from the first region";
+    }
+
+    TEST_F(MmTest, SingleHugeBlock) {
+        mm_mark_physical_pages(16 * MiB, 4 * KiB,   MM_FREE);
+        mm_mark_physical_pages(1 * GiB,  256 * KiB, MM_FREE);
+        init_buddy();
+
+        EXPECT_EQ(free_blocks(MM_MAX_ORDER), 1) << "Big region is a single 1 GiB block";
+
+        uint64_t pages_free = mm_pages_free;
+        void* block = mm_alloc_pages(256 * KiB);
+
+        EXPECT_EQ((uint64_t)block, 1 * GiB)                 << "1 GiB allocation returned the 1 GiB block";
+        EXPECT_EQ(mm_pages_free, pages_free - (256 * KiB))  << "Free pages accounted";
+
+        mm_mark_physical_pages((uint64_t)block, 256 * KiB, MM_FREE);
+        EXPECT_EQ(free_blocks(MM_MAX_ORDER), 1) << "1 GiB block is back";
+        EXPECT_EQ(mm_pages_free, pages_free)    << "Free pages accounted";
+    }
+
+    TEST_F(MmTest, Alignment) {
+        mm_mark_physical_pages(1 * GiB, 256 * KiB, MM_FREE);
+        init_buddy();
+
+        uint64_t pages_free = this->pages_free();
+
+        void* small = mm_alloc_pages(1);
+        void* huge  = mm_alloc_pages(512);
+        void* odd   = mm_alloc_pages(3);
+
+        EXPECT_EQ((uint64_t)huge % (2 * MiB), 0)      << "2 MiB allocation is 2 MiB aligned";
+        EXPECT_EQ((uint64_t)odd  % (16 * KiB), 0)     << "3 page allocation is aligned to 4 pages";
+        EXPECT_EQ(this->pages_free(), pages_free - 516) << "Unused tail of the 3 page allocation freed";
+
+        mm_mark_physical_pages((uint64_t)small, 1,   MM_FREE);
+        mm_mark_physical_pages((uint64_t)huge,  512, MM_FREE);
+        mm_mark_physical_pages((uint64_t)odd,   3,   MM_FREE);
+
+        EXPECT_EQ(this->pages_free(), pages_free) << "Everything freed";
+    }
+
+    TEST_F(MmTest, DoubleFree) {
+        mm_mark_physical_pages(1 * GiB, 256 * KiB, MM_FREE);
+        init_buddy();
+
+        uint64_t block = (uint64_t)mm_alloc_pages(4);
+        mm_mark_physical_pages(block + 8 * KiB, 2, MM_FREE);
+
+        EXPECT_DEATH(mm_mark_physical_pages(block, 4, MM_FREE), "Double free") << "second half of the block is free already";
+
+        mm_mark_physical_pages(block, 2, MM_FREE);
+    }
+
+    TEST_F(MmTest, DoubleFreePage) {
+        mm_mark_physical_pages(1 * GiB, 256 * KiB, MM_FREE);
+        init_buddy();
+
+        // start of the region holds the bitmaps, the rest is free
+        EXPECT_DEATH(mm_mark_physical_pages(1 * GiB + 512 * MiB, 1, MM_FREE), "Double free") << "page is in the buddy allocator";
+
+        uint64_t page = (uint64_t)mm_alloc_pages(1);
+        mm_mark_physical_pages(page, 1, MM_FREE);
+
+        EXPECT_DEATH(mm_mark_physical_pages(page, 1, MM_FREE), "Double free") << "page is in a magazine";
+    }
+
+    TEST_F(MmTest, Coalescing) {
+        mm_mark_physical_pages(16 * MiB, 4 * KiB,   MM_FREE);
+        mm_mark_physical_pages(1 * GiB,  256 * KiB, MM_FREE);
+        init_buddy();
+
+        const size_t count = 4096;
+        RecordProperty("Allocations", count);
+
+        uint64_t pages_free = this->pages_free();
+        std::vector<uint64_t> pages;
+
+        for(size_t i = 0; i < count; ++i) {
+            uint64_t page = (uint64_t)mm_alloc_pages(1);
+
+            EXPECT_EQ(page % 4096, 0) << "Page aligned";
+            EXPECT_TRUE(std::find(pages.begin(), pages.end(), page) == pages.end()) << "No page handed out twice";
+
+            pages.push_back(page);
+        }
+
+        EXPECT_EQ(this->pages_free(), pages_free - count) << "Free pages accounted";
+
+        std::shuffle(pages.begin(), pages.end(), std::mt19937());
+
+        for(uint64_t page : pages) {
+            mm_mark_physical_pages(page, 1, MM_FREE);
+        }
+
+        EXPECT_EQ(this->pages_free(), pages_free) << "Free pages accounted";
+
+        mm_magazine_drain();
+        EXPECT_EQ(mm_pages_free, pages_free)    << "Magazine drained";
+        EXPECT_EQ(free_blocks(MM_MAX_ORDER), 1) << "Single pages coalesced back into the 1 GiB block";
+    }
+
+    TEST_F(MmTest, Reserve) {
+        mm_mark_physical_pages(1 * MiB, 64, MM_FREE);
+        init_buddy();
+
+        uint64_t reserved = (1 * MiB) + (13 * 4096);
+        mm_mark_physical_pages(reserved, 1, MM_RESERVED);
+
+        uint64_t pages_free = this->pages_free();
+
+        for(uint64_t i = 0; i < pages_free; ++i) {
+            EXPECT_NE((uint64_t)mm_alloc_pages(1), reserved) << "Reserved page not handed out";
+        }
+
+        EXPECT_EQ(this->pages_free(), 0) << "All pages allocated";
+    }
+
+    TEST_F(MmTest, Magazine) {
+        mm_mark_physical_pages(1 * GiB, 256 * KiB, MM_FREE);
+        init_buddy();
+
+        const size_t rounds = 1000;
+        RecordProperty("Rounds", rounds);
+
+        uint64_t pages_free = this->pages_free();
+        std::vector<uint64_t> pages;
+
+        for(size_t round = 0; round < rounds; ++round) {
+            for(size_t i = 0; i < 16; ++i) {
+                pages.push_back((uint64_t)mm_alloc_pages(1));
+            }
+
+            for(uint64_t page : pages) {
+                mm_mark_physical_pages(page, 1, MM_FREE);
+            }
+
+            pages.clear();
+        }
+
+        struct mm_statistics stats;
+        mm_get_statistics(&stats);
+
+        EXPECT_EQ(stats.magazine_alloc_misses, 1) << "Only the first allocation refilled the magazine";
+        EXPECT_EQ(stats.magazine_alloc_hits, (rounds * 16) - 1) << "All other allocations served from the magazine";
+        EXPECT_EQ(stats.magazine_free_misses, 0) << "Magazine never overflowed";
+        EXPECT_EQ(this->pages_free(), pages_free) << "Free pages accounted";
+
+        // free more pages than a magazine holds
+        void* block = mm_alloc_pages(256);
+        for(uint64_t i = 0; i < 256; ++i) {
+            mm_mark_physical_pages((uint64_t)block + (i * 4096), 1, MM_FREE);
+        }
+
+        mm_get_statistics(&stats);
+        EXPECT_LE(stats.magazine_pages, MM_MAGAZINE_HIGH) << "Magazine flushed when full";
+        EXPECT_GT(stats.magazine_free_misses, 0)          << "Flushes counted";
+        EXPECT_EQ(this->pages_free(), pages_free)         << "Free pages accounted";
+
+        mm_magazine_drain();
+        EXPECT_EQ(mm_pages_free, pages_free) << "Everything back in the buddy allocator after draining";
+    }
+
+    TEST_F(MmTest, ZeroPool) {
+        mm_mark_physical_pages(1 * GiB, 256 * KiB, MM_FREE);
+        init_buddy();
+
+        uint64_t pages_free = this->pages_free();
+
+        // dirty some pages and give them back
+        std::vector<uint64_t> pages;
+        for(size_t i = 0; i < 64; ++i) {
+            uint64_t page = (uint64_t)mm_alloc_pages(1);
+            memset((char*)_memory + page, 0xAA, 4096);
+            pages.push_back(page);
+        }
+
+        for(uint64_t page : pages) {
+            mm_mark_physical_pages(page, 1, MM_FREE);
+        }
+
+        uint8_t zero[4096] = { 0 };
+
+        uint64_t page = (uint64_t)mm_alloc_zeroed();
+        EXPECT_EQ(memcmp((char*)_memory + page, zero, 4096), 0) << "Page zeroed without pool";
+
+        EXPECT_EQ(mm_zero_pool_refill(32),   32)                     << "Pool refilled";
+        EXPECT_EQ(mm_zero_pool_refill(1024), MM_ZERO_POOL_SIZE - 32) << "Pool filled up to its size";
+        EXPECT_EQ(mm_zero_pool_refill(1),    0)                      << "Full pool not refilled";
+
+        for(size_t i = 0; i < MM_ZERO_POOL_SIZE; ++i) {
+            uint64_t page = (uint64_t)mm_alloc_zeroed();
+            EXPECT_EQ(memcmp((char*)_memory + page, zero, 4096), 0) << "Page from pool zeroed";
+        }
+
+        struct mm_statistics stats;
+        mm_get_statistics(&stats);
+
+        EXPECT_EQ(stats.zero_pool_pages, 0)                  << "Pool emptied";
+        EXPECT_EQ(stats.zero_pool_hits, MM_ZERO_POOL_SIZE)   << "Hits counted";
+        EXPECT_EQ(stats.zero_pool_misses, 1)                 << "Misses counted";
+        EXPECT_EQ(this->pages_free(), pages_free - MM_ZERO_POOL_SIZE - 1) << "Free pages accounted";
+    }
+}
@@ -1,3 +1,5 @@
+#include <vector>
+
 #include <lfostest.h>
 
 namespace LFOS {
@@ -6,7 +8,15 @@ namespace LFOS {
     #include <mq.cpp>
     #include <flexarray.cpp>
 
-    void scheduler_waitable_done(enum wait_reason r, union wait_data d, size_t m) {
+    static std::vector<struct scheduler_queue*> woken_queues;
+
+    pid_t scheduler_wake_one(struct scheduler_queue* queue) {
+        woken_queues.push_back(queue);
+        return -1;
+    }
+
+    size_t scheduler_wake(struct scheduler_queue* queue, size_t max_amount) {
+        return 0;
     }
 
     class MessageQueueTest : public ::testing::Test {
@@ -114,6 +124,18 @@ namespace LFOS {
         }
     }
 
+    TEST_F(MessageQueueTest, WakeWaiters) {
+        woken_queues.clear();
+
+        EXPECT_NE(mq_waiters(_messageQueue), (void*)0)     << "existing queue has a wait queue";
+        EXPECT_EQ(mq_waiters(_messageQueue + 1), (void*)0) << "no wait queue for a queue that does not exist";
+
+        mq_push(_messageQueue, _message);
+        mq_push(_messageQueue, _message);
+
+        EXPECT_EQ(woken_queues, std::vector<struct scheduler_queue*>(2, mq_waiters(_messageQueue))) << "one waiter woken per message";
+    }
+
     // TODO: build new interface for limitting queues and test the functionality here
     /*TEST_F(MessageQueueTest, LimitedQueue) {
         //mq.max_items = 0;
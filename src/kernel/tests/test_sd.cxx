@@ -11,7 +11,12 @@ namespace LFOS {
     #include "../uuid.cpp"
     #include "../flexarray.cpp"
 
-    void scheduler_waitable_done(enum wait_reason r, union wait_data d, size_t m) {
+    pid_t scheduler_wake_one(struct scheduler_queue* queue) {
+        return -1;
+    }
+
+    size_t scheduler_wake(struct scheduler_queue* queue, size_t max_amount) {
+        return 0;
     }
 
     TEST(KernelServiceDiscovery, Basic) {
@@ -0,0 +1,201 @@
+#include <bitset>
+#include <chrono>
+#include <random>
+#include <set>
+#include <vector>
+
+#include <lfostest.h>
+
+namespace LFOS {
+    #include <allocator/sized.h>
+
+    //! Hands out PageSize-aligned pages from the host heap and counts them
+    struct TestPageAllocator {
+        static size_t allocated;
+
+        template<class T, size_t PageSize>
+        struct allocator {
+            T* allocate(size_t n) {
+                allocated += n;
+                return reinterpret_cast<T*>(aligned_alloc(PageSize, PageSize * n));
+            }
+
+            void deallocate(T* p, size_t n) {
+                allocated -= n;
+                free(p);
+            }
+        };
+    };
+
+    size_t TestPageAllocator::allocated = 0;
+
+    class SizedAllocatorTest : public ::testing::Test {
+        protected:
+            template<class A>
+            static size_t partial_pages() {
+                return count(A::partial_pages);
+            }
+
+            template<class A>
+            static size_t full_pages() {
+                return count(A::full_pages);
+            }
+
+            template<class A>
+            static bool has_free_page() {
+                return A::free_page;
+            }
+
+            template<class A>
+            static size_t max_entries() {
+                return A::page_t::max_entries;
+            }
+
+        private:
+            template<class P>
+            static size_t count(P* page) {
+                size_t ret = 0;
+
+                for(; page; page = page->next) {
+                    ++ret;
+                }
+
+                return ret;
+            }
+    };
+
+    using Small = SizedAllocator<32,  4096, TestPageAllocator>;
+    using Odd   = SizedAllocator<24,  4096, TestPageAllocator>;
+    using Large = SizedAllocator<512, 4096, TestPageAllocator>;
+
+    TEST_F(SizedAllocatorTest, PageLayout) {
+        EXPECT_EQ(max_entries<Small>(), 126) << "4 KiB minus header and bitmap";
+        EXPECT_EQ(max_entries<Odd>(),   168) << "slots not a power of two";
+        EXPECT_EQ(max_entries<Large>(), 7)   << "header does not fit a whole slot";
+    }
+
+    TEST_F(SizedAllocatorTest, FillAndDrain) {
+        Odd allocator;
+        std::vector<void*> allocations;
+
+        size_t entries = max_entries<Odd>();
+
+        for(size_t i = 0; i < entries * 3; ++i) {
+            void* ptr = allocator.allocate(1);
+            ASSERT_NE(ptr, (void*)0);
+
+            EXPECT_EQ(reinterpret_cast<uint64_t>(ptr) % 4096 % 24, reinterpret_cast<uint64_t>(allocations.empty() ? ptr : allocations.front()) % 4096 % 24) << "slots on the same grid";
+
+            memset(ptr, i & 0xFF, 24);
+            allocations.push_back(ptr);
+        }
+
+        EXPECT_EQ(std::set<void*>(allocations.begin(), allocations.end()).size(), allocations.size()) << "no slot handed out twice";
+        EXPECT_EQ(full_pages<Odd>(),    3) << "all pages full";
+        EXPECT_EQ(partial_pages<Odd>(), 0) << "no page partially used";
+
+        allocator.deallocate(allocations[entries + 5], 1);
+        EXPECT_EQ(full_pages<Odd>(),    2) << "page with a free slot is not full anymore";
+        EXPECT_EQ(partial_pages<Odd>(), 1) << "page with a free slot is partial";
+
+        EXPECT_EQ(allocator.allocate(1), allocations[entries + 5]) << "freed slot used again";
+        EXPECT_EQ(full_pages<Odd>(),     3)                         << "page full again";
+
+        for(size_t i = 0; i < allocations.size(); ++i) {
+            for(size_t j = 0; j < 24; ++j) {
+                ASSERT_EQ(reinterpret_cast<uint8_t*>(allocations[i])[j], i & 0xFF) << "no overlapping slots";
+            }
+
+            allocator.deallocate(allocations[i], 1);
+        }
+
+        EXPECT_EQ(full_pages<Odd>(),    0);
+        EXPECT_EQ(partial_pages<Odd>(), 0);
+        EXPECT_TRUE(has_free_page<Odd>())          << "one empty page kept around";
+        EXPECT_EQ(TestPageAllocator::allocated, 1)      << "other empty pages given back";
+    }
+
+    TEST_F(SizedAllocatorTest, Continuous) {
+        Large allocator;
+
+        void* a = allocator.allocate(2);
+        void* b = allocator.allocate(1);
+        void* c = allocator.allocate(3);
+
+        EXPECT_EQ(b, (uint8_t*)a + 2 * 512) << "directly after the first allocation";
+        EXPECT_EQ(c, (uint8_t*)b + 1 * 512) << "directly after the second allocation";
+
+        allocator.deallocate(b, 1);
+
+        void* d = allocator.allocate(2);
+        EXPECT_NE(d, b)                      << "hole too small";
+        EXPECT_EQ(partial_pages<Large>(), 2) << "hole left in first page, second page partially used";
+        EXPECT_EQ(full_pages<Large>(),    0);
+
+        EXPECT_EQ(allocator.allocate(8), (void*)0) << "more than fits in a page";
+        EXPECT_EQ(allocator.allocate(0), (void*)0) << "nothing to allocate";
+
+        allocator.deallocate(a, 2);
+        allocator.deallocate(b, 1);
+        allocator.deallocate(c, 3);
+        allocator.deallocate(d, 2);
+
+        EXPECT_EQ(partial_pages<Large>(), 0) << "everything given back";
+    }
+
+    TEST_F(SizedAllocatorTest, InvalidDeallocate) {
+        Small allocator;
+
+        uint8_t* a = reinterpret_cast<uint8_t*>(allocator.allocate(1));
+        uint8_t* b = reinterpret_cast<uint8_t*>(allocator.allocate(1));
+
+        allocator.deallocate(a + 1, 1);
+        allocator.deallocate(b, 1);
+        allocator.deallocate(b, 1);
+
+        EXPECT_EQ(allocator.allocate(1), b) << "double free did not release anything else";
+        EXPECT_EQ(allocator.allocate(1), (uint8_t*)b + 32) << "unaligned free did not release the first slot";
+
+        allocator.deallocate(a, 1);
+        allocator.deallocate(b, 1);
+        allocator.deallocate(b + 32, 1);
+    }
+
+    TEST_F(SizedAllocatorTest, Benchmark) {
+        const size_t live   = 10000;
+        const size_t rounds = 1000000;
+
+        Small allocator;
+        std::vector<void*> allocations;
+        std::mt19937_64 rng(0x1F05);
+
+        allocations.reserve(live);
+
+        for(size_t i = 0; i < live; ++i) {
+            allocations.push_back(allocator.allocate(1));
+        }
+
+        auto start = std::chrono::steady_clock::now();
+
+        for(size_t i = 0; i < rounds; ++i) {
+            size_t idx = rng() % live;
+
+            allocator.deallocate(allocations[idx], 1);
+            allocations[idx] = allocator.allocate(1);
+        }
+
+        auto end = std::chrono::steady_clock::now();
+
+        EXPECT_EQ(std::set<void*>(allocations.begin(), allocations.end()).size(), live) << "no slot handed out twice";
+
+        for(void* ptr : allocations) {
+            allocator.deallocate(ptr, 1);
+        }
+
+        size_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / (2 * rounds);
+        printf("SizedAllocator with %zu live objects: %zu ns per allocate/deallocate\n", live, ns);
+        RecordProperty("ns_per_op", ns);
+
+        EXPECT_EQ(partial_pages<Small>() + full_pages<Small>(), 0) << "everything given back";
+    }
+}
@@ -19,4 +19,26 @@ namespace LFOS {
 
         free((void*)memory);
     }
+
+    TEST(KernelSlab, Reuse) {
+        const size_t size = 1024 * 1024;
+
+        void* memory = malloc(size);
+        init_slab((ptr_t)memory, (uint64_t)memory + size, 64);
+
+        SlabHeader* slab = (SlabHeader*)memory;
+
+        for(size_t i = 0; i < 1000; ++i) {
+            EXPECT_EQ(slab_alloc(slab), slab_mem(slab, i)) << "lowest free entry allocated";
+        }
+
+        slab_free(slab, slab_mem(slab, 700));
+        slab_free(slab, slab_mem(slab, 130));
+
+        EXPECT_EQ(slab_alloc(slab), slab_mem(slab, 130))  << "first hole found";
+        EXPECT_EQ(slab_alloc(slab), slab_mem(slab, 700))  << "second hole found";
+        EXPECT_EQ(slab_alloc(slab), slab_mem(slab, 1000)) << "after the last allocation";
+
+        free((void*)memory);
+    }
 }
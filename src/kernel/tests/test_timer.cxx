@@ -0,0 +1,130 @@
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <lfostest.h>
+
+namespace LFOS {
+    void* kmalloc(size_t size) {
+        return malloc(size);
+    }
+
+    void kfree(void* ptr) {
+        free(ptr);
+    }
+
+    #include <timer.cpp>
+
+    static std::vector<uint64_t> expired;
+
+    static void record_expiry(struct timer* timer) {
+        EXPECT_FALSE(timer_armed(timer)) << "disarmed before expiry";
+        expired.push_back(timer->deadline);
+    }
+
+    class TimerTest : public ::testing::Test {
+        public:
+            TimerTest() {
+                expired.clear();
+            }
+
+            virtual ~TimerTest() {
+                while(timer_count) {
+                    timer_cancel(timer_heap[0]);
+                }
+            }
+    };
+
+    TEST_F(TimerTest, Order) {
+        struct timer timers[4];
+        uint64_t deadlines[] = { 300, 100, 400, 200 };
+
+        for(size_t i = 0; i < 4; ++i) {
+            timer_init(&timers[i], record_expiry, 0);
+            EXPECT_FALSE(timer_armed(&timers[i]));
+
+            timer_arm(&timers[i], deadlines[i]);
+            EXPECT_TRUE(timer_armed(&timers[i]));
+        }
+
+        EXPECT_EQ(timer_next_deadline(), 100) << "earliest deadline first";
+
+        EXPECT_EQ(timer_expire(99),  0) << "nothing expired yet";
+        EXPECT_EQ(timer_expire(250), 2) << "two expired";
+        EXPECT_EQ(timer_next_deadline(), 300);
+
+        EXPECT_EQ(timer_expire(1000), 2) << "rest expired";
+        EXPECT_EQ(timer_next_deadline(), TIMER_NEVER) << "nothing armed anymore";
+
+        EXPECT_EQ(expired, std::vector<uint64_t>({ 100, 200, 300, 400 })) << "expired in order";
+    }
+
+    TEST_F(TimerTest, RearmAndCancel) {
+        struct timer a, b, c;
+        timer_init(&a, record_expiry, 0);
+        timer_init(&b, record_expiry, 0);
+        timer_init(&c, record_expiry, 0);
+
+        timer_arm(&a, 100);
+        timer_arm(&b, 200);
+        timer_arm(&c, 300);
+
+        timer_arm(&c, 50);
+        EXPECT_EQ(timer_next_deadline(), 50) << "moved to front";
+
+        timer_arm(&c, 500);
+        EXPECT_EQ(timer_next_deadline(), 100) << "moved to back";
+
+        timer_cancel(&a);
+        timer_cancel(&a);
+        EXPECT_FALSE(timer_armed(&a));
+        EXPECT_EQ(timer_next_deadline(), 200) << "cancelled timer gone";
+
+        EXPECT_EQ(timer_expire(1000), 2);
+        EXPECT_EQ(expired, std::vector<uint64_t>({ 200, 500 }));
+    }
+
+    static void rearm_expiry(struct timer* timer) {
+        expired.push_back(timer->deadline);
+
+        if(expired.size() < 3) {
+            timer_arm(timer, timer->deadline + 10);
+        }
+    }
+
+    TEST_F(TimerTest, RearmOnExpiry) {
+        struct timer a;
+        timer_init(&a, rearm_expiry, 0);
+        timer_arm(&a, 10);
+
+        EXPECT_EQ(timer_expire(100), 3) << "rearmed timer expires again in the same call";
+        EXPECT_EQ(expired, std::vector<uint64_t>({ 10, 20, 30 }));
+    }
+
+    TEST_F(TimerTest, Random) {
+        std::mt19937_64 rng(0x1F05);
+        std::vector<struct timer> timers(5000);
+
+        for(auto& timer : timers) {
+            timer_init(&timer, record_expiry, 0);
+            timer_arm(&timer, rng() % 100000);
+        }
+
+        for(size_t i = 0; i < timers.size(); i += 3) {
+            timer_cancel(&timers[i]);
+        }
+
+        for(size_t i = 1; i < timers.size(); i += 3) {
+            timer_arm(&timers[i], rng() % 100000);
+        }
+
+        size_t armed = std::count_if(timers.begin(), timers.end(), [](auto& timer) { return timer_armed(&timer); });
+
+        for(uint64_t now = 0; now <= 100000; now += 1000) {
+            timer_expire(now);
+        }
+
+        EXPECT_EQ(expired.size(), armed) << "every armed timer expired";
+        EXPECT_TRUE(std::is_sorted(expired.begin(), expired.end())) << "expired in order";
+    }
+}
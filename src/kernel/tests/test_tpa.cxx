@@ -1,4 +1,6 @@
+#include <chrono>
 #include <cstdint>
+#include <random>
 
 #include <lfostest.h>
 
@@ -20,8 +22,33 @@ namespace LFOS {
             TPA<uint64_t>*       _tpa;
 
             size_t _tpa_entries_per_page() { return _tpa->entries_per_page(); }
-            //size_t tpa_entries_per_page() { return _tpa->entries_per_page(); }
-            //size_t tpa_entries_per_page() { return _tpa->entries_per_page(); }
+            size_t _tpa_children_per_node() { return _tpa->children_per_node(); }
+
+            //! Nodes of a tree holding just the given index, one per level
+            size_t _tpa_nodes_for_idx(size_t idx) {
+                size_t nodes  = 1;
+                size_t leaves = 1;
+
+                while(idx / _tpa_entries_per_page() >= leaves) {
+                    leaves *= _tpa_children_per_node();
+                    ++nodes;
+                }
+
+                return nodes;
+            }
+
+            //! Nodes of a tree holding the indices 0 to count - 1
+            size_t _tpa_nodes_for_count(size_t count) {
+                size_t level = (count + _tpa_entries_per_page() - 1) / _tpa_entries_per_page();
+                size_t nodes = level;
+
+                while(level > 1) {
+                    level  = (level + _tpa_children_per_node() - 1) / _tpa_children_per_node();
+                    nodes += level;
+                }
+
+                return nodes;
+            }
     };
 
     TEST_F(TpaTest, Empty) {
@@ -41,7 +68,7 @@ namespace LFOS {
             size_t page_num = (idx + _tpa_entries_per_page() - 1) / _tpa_entries_per_page();
             size_t len      = _tpa_entries_per_page() * page_num;
 
-            EXPECT_EQ(_tpa->size(),    8192) << "Size of TPA with a single entry correct";
+            EXPECT_EQ(_tpa->size(),    _tpa_page_size * (1 + _tpa_nodes_for_idx(idx))) << "Size of TPA with a single entry correct";
             EXPECT_EQ(_tpa->entries(), 1)    << "Entrycount of TPA with a single entry correct";
             EXPECT_EQ(_tpa->length(),  len)  << "Length of TPA with no entries correct";
         }
@@ -81,8 +108,8 @@ namespace LFOS {
 
         const size_t num_pages         = (entry_count + _tpa_entries_per_page() - 1)
                                        / _tpa_entries_per_page();
-        const size_t expected_tpa_size = _tpa_page_size                 // page for the tpa_t header
-                                       + (num_pages * _tpa_page_size);  // all the pages
+        const size_t expected_tpa_size = _tpa_page_size                                           // page for the tpa_t header
+                                       + (_tpa_nodes_for_count(entry_count) * _tpa_page_size);  // all the nodes
         const size_t expected_tpa_len  = num_pages * _tpa_entries_per_page();
 
         for(size_t i = 0; i < entry_count; ++i) {
@@ -93,4 +120,99 @@ namespace LFOS {
         EXPECT_EQ(_tpa->entries(), entry_count)       << "Entrycount of TPA with lots of entries";
         EXPECT_EQ(_tpa->length(),  expected_tpa_len)  << "Length of TPA with lots of entries";
     }
+
+    TEST_F(TpaTest, Next) {
+        const size_t leaf = _tpa_entries_per_page();
+        const size_t tree = leaf * _tpa_children_per_node();
+
+        // spread over leaves and inner nodes, with whole empty subtrees in between
+        const size_t indices[] = { 3, 5, leaf - 1, leaf, 3 * leaf + 7, tree + 1, 5 * tree * _tpa_children_per_node() + 2 };
+
+        for(size_t idx : indices) {
+            uint64_t val = idx * 2;
+            _tpa->set(idx, &val);
+        }
+
+        EXPECT_EQ(_tpa->next(0), 3) << "first entry found from the start";
+
+        size_t cur = 0;
+        for(size_t idx : indices) {
+            cur = _tpa->next(cur);
+            EXPECT_EQ(cur, idx) << "entries visited in order";
+            EXPECT_EQ(*_tpa->get(cur), idx * 2) << "entry has its value";
+        }
+
+        EXPECT_EQ(_tpa->next(cur), 0) << "nothing after the last entry";
+        EXPECT_EQ(_tpa->next(4), 5)   << "next entry in the same leaf";
+        EXPECT_EQ(_tpa->next(leaf + 1), 3 * leaf + 7) << "empty leaves skipped";
+        EXPECT_EQ(_tpa->next(3 * leaf + 7), tree + 1) << "empty subtree skipped";
+        EXPECT_EQ(_tpa->next(-1), 0)  << "no overflow at the highest index";
+
+        EXPECT_EQ(_tpa->entries(), sizeof(indices) / sizeof(indices[0]));
+    }
+
+    TEST_F(TpaTest, SparseDelete) {
+        const size_t far = 7 * _tpa_entries_per_page() * _tpa_children_per_node() + 11;
+        uint64_t val = 1;
+
+        _tpa->set(1,   &val);
+        _tpa->set(far, &val);
+
+        EXPECT_EQ(_tpa->length(), (far / _tpa_entries_per_page() + 1) * _tpa_entries_per_page()) << "length up to the last leaf";
+
+        _tpa->set(far, 0);
+
+        EXPECT_EQ(_tpa->get(far), (void*)0) << "deleted entry gone";
+        EXPECT_NE(_tpa->get(1),   (void*)0) << "other entry still there";
+        EXPECT_EQ(_tpa->length(), _tpa_entries_per_page()) << "length back to the first leaf";
+        EXPECT_EQ(_tpa->size(),   _tpa_page_size * (1 + _tpa_nodes_for_idx(far)))
+            << "nodes only used by the deleted entry freed, the path to the first entry stays at the height reached";
+
+        _tpa->set(1, 0);
+
+        EXPECT_EQ(_tpa->size(),    _tpa_page_size) << "everything freed";
+        EXPECT_EQ(_tpa->entries(), 0);
+    }
+
+    /* IDs of kernel objects are looked up on every syscall using them, so get
+     * has to stay fast no matter how many of them exist. */
+    TEST_F(TpaTest, Benchmark) {
+        const size_t rounds = 1000000;
+
+        std::mt19937_64 rng(0x1F05);
+
+        for(size_t live = 1000; live <= 1000000; live *= 10) {
+            TPA<uint64_t>* tpa = TPA<uint64_t>::create(&kernel_alloc, _tpa_page_size, 0);
+
+            for(uint64_t i = 1; i <= live; ++i) {
+                tpa->set(i, &i);
+            }
+
+            auto start = std::chrono::steady_clock::now();
+
+            uint64_t sum = 0;
+            for(size_t i = 0; i < rounds; ++i) {
+                sum += *tpa->get(rng() % live + 1);
+            }
+
+            auto end = std::chrono::steady_clock::now();
+
+            size_t visited = 0;
+            for(size_t cur = 0; (cur = tpa->next(cur)); ++visited);
+
+            auto end_next = std::chrono::steady_clock::now();
+
+            EXPECT_NE(sum, 0);
+            EXPECT_EQ(visited, live) << "next visits every entry";
+
+            size_t get_ns  = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / rounds;
+            size_t next_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end_next - end).count() / live;
+
+            printf("TPA with %zu live IDs: %zu ns per get, %zu ns per next\n", live, get_ns, next_ns);
+            RecordProperty("ns_per_get_" + std::to_string(live), get_ns);
+            RecordProperty("ns_per_next_" + std::to_string(live), next_ns);
+
+            tpa->destroy();
+        }
+    }
 }
@@ -0,0 +1,146 @@
+#include <random>
+#include <vector>
+
+#include <lfostest.h>
+
+namespace LFOS {
+    #include <vrange.cpp>
+
+    class VRangeTest : public ::testing::Test {
+        public:
+            virtual ~VRangeTest() {
+                for(void* page : _pages) {
+                    free(page);
+                }
+
+                _pages.clear();
+            }
+
+        protected:
+            static constexpr uint64_t _start = 0xFFFFFFFF90000000;
+            static constexpr uint64_t _end   = 0xFFFFFFFFFFFFFFFF;
+
+            static std::vector<void*> _pages;
+
+            static void* alloc_page() {
+                void* page = aligned_alloc(4096, 4096);
+                _pages.push_back(page);
+                return page;
+            }
+
+            struct vrange _range;
+
+            void init() {
+                vrange_init(&_range, _start, _end, alloc_page);
+            }
+
+            size_t count_nodes(struct vrange_node* node) {
+                return node ? 1 + count_nodes(node->left) + count_nodes(node->right) : 0;
+            }
+    };
+
+    std::vector<void*> VRangeTest::_pages;
+
+    TEST_F(VRangeTest, Init) {
+        init();
+
+        EXPECT_EQ(_range.free_pages, (_end - _start + 1) / 4096) << "whole region free";
+        EXPECT_EQ(count_nodes(_range.root), 1)                   << "single free range";
+    }
+
+    TEST_F(VRangeTest, FirstFit) {
+        init();
+
+        uint64_t a = vrange_alloc(&_range, 1);
+        uint64_t b = vrange_alloc(&_range, 4);
+        uint64_t c = vrange_alloc(&_range, 2);
+
+        EXPECT_EQ(a, _start)                  << "lowest address first";
+        EXPECT_EQ(b, _start + 1 * 4096)       << "directly after first allocation";
+        EXPECT_EQ(c, _start + 5 * 4096)       << "directly after second allocation";
+
+        vrange_free(&_range, b, 4);
+        EXPECT_EQ(count_nodes(_range.root), 2) << "hole is a range of its own";
+
+        EXPECT_EQ(vrange_alloc(&_range, 8), _start + 7 * 4096) << "too large for the hole";
+        EXPECT_EQ(vrange_alloc(&_range, 3), _start + 1 * 4096) << "fits into the hole";
+        EXPECT_EQ(vrange_alloc(&_range, 1), _start + 4 * 4096) << "fills the hole";
+        EXPECT_EQ(count_nodes(_range.root), 1)                  << "hole is gone";
+    }
+
+    TEST_F(VRangeTest, Coalesce) {
+        init();
+
+        uint64_t a = vrange_alloc(&_range, 2);
+        uint64_t b = vrange_alloc(&_range, 2);
+        uint64_t c = vrange_alloc(&_range, 2);
+        vrange_alloc(&_range, 2);
+
+        vrange_free(&_range, a, 2);
+        vrange_free(&_range, c, 2);
+        EXPECT_EQ(count_nodes(_range.root), 3) << "two holes and the rest";
+
+        vrange_free(&_range, b, 2);
+        EXPECT_EQ(count_nodes(_range.root), 2) << "holes merged";
+
+        EXPECT_EQ(vrange_alloc(&_range, 6), a) << "merged hole usable as a whole";
+    }
+
+    TEST_F(VRangeTest, Reserve) {
+        init();
+
+        EXPECT_TRUE(vrange_reserve(&_range, _start + 16 * 4096, 16));
+        EXPECT_FALSE(vrange_reserve(&_range, _start + 20 * 4096, 1)) << "already reserved";
+        EXPECT_FALSE(vrange_reserve(&_range, _start + 8 * 4096, 16)) << "partially reserved";
+
+        EXPECT_EQ(vrange_alloc(&_range, 32), _start + 32 * 4096) << "allocated after reserved range";
+        EXPECT_EQ(vrange_alloc(&_range, 16), _start)             << "allocated before reserved range";
+
+        EXPECT_TRUE(vrange_reserve(&_range, _end - 4095, 1))     << "last page of the region";
+        EXPECT_EQ(_range.free_pages, (_end - _start + 1) / 4096 - 65);
+    }
+
+    TEST_F(VRangeTest, Random) {
+        init();
+
+        std::mt19937_64 rng(0x1F05);
+        std::vector<std::pair<uint64_t, size_t>> allocations;
+
+        uint64_t total = _range.free_pages;
+
+        for(size_t i = 0; i < 100000; ++i) {
+            if(allocations.empty() || rng() % 3) {
+                size_t   pages = 1 + rng() % 64;
+                uint64_t addr  = vrange_alloc(&_range, pages);
+
+                ASSERT_NE(addr, 0);
+
+                for(auto& alloc : allocations) {
+                    ASSERT_TRUE(addr + pages * 4096 <= alloc.first || alloc.first + alloc.second * 4096 <= addr) << "no overlap";
+                }
+
+                allocations.push_back({ addr, pages });
+            }
+            else {
+                size_t idx = rng() % allocations.size();
+                vrange_free(&_range, allocations[idx].first, allocations[idx].second);
+
+                allocations[idx] = allocations.back();
+                allocations.pop_back();
+            }
+
+            // keep the overlap check above cheap
+            if(allocations.size() > 256) {
+                vrange_free(&_range, allocations.back().first, allocations.back().second);
+                allocations.pop_back();
+            }
+        }
+
+        for(auto& alloc : allocations) {
+            vrange_free(&_range, alloc.first, alloc.second);
+        }
+
+        EXPECT_EQ(_range.free_pages, total)    << "everything given back";
+        EXPECT_EQ(count_nodes(_range.root), 1) << "merged into a single range again";
+    }
+}
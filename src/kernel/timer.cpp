@@ -0,0 +1,142 @@
+#include <timer.h>
+#include <kmalloc.h>
+#include <string.h>
+#include <panic.h>
+
+//! Armed timers, timer_heap[0] has the earliest deadline
+static struct timer** timer_heap     = 0;
+static size_t         timer_count    = 0;
+static size_t         timer_capacity = 0;
+
+static void timer_heap_place(struct timer* timer, size_t index) {
+    timer_heap[index] = timer;
+    timer->heap_index = index;
+}
+
+static void timer_sift_up(size_t index) {
+    struct timer* timer = timer_heap[index];
+
+    while(index) {
+        size_t parent = (index - 1) / 2;
+
+        if(timer_heap[parent]->deadline <= timer->deadline) {
+            break;
+        }
+
+        timer_heap_place(timer_heap[parent], index);
+        index = parent;
+    }
+
+    timer_heap_place(timer, index);
+}
+
+static void timer_sift_down(size_t index) {
+    struct timer* timer = timer_heap[index];
+
+    while(true) {
+        size_t child = (index * 2) + 1;
+
+        if(child >= timer_count) {
+            break;
+        }
+
+        if(child + 1 < timer_count && timer_heap[child + 1]->deadline < timer_heap[child]->deadline) {
+            ++child;
+        }
+
+        if(timer->deadline <= timer_heap[child]->deadline) {
+            break;
+        }
+
+        timer_heap_place(timer_heap[child], index);
+        index = child;
+    }
+
+    timer_heap_place(timer, index);
+}
+
+static void timer_heap_grow(void) {
+    size_t         capacity = timer_capacity ? timer_capacity * 2 : 64;
+    struct timer** heap     = (struct timer**)kmalloc(capacity * sizeof(struct timer*));
+
+    if(!heap) {
+        panic_message("Out of memory for timers");
+    }
+
+    if(timer_heap) {
+        memcpy(heap, timer_heap, timer_count * sizeof(struct timer*));
+        kfree(timer_heap);
+    }
+
+    timer_heap     = heap;
+    timer_capacity = capacity;
+}
+
+void timer_init(struct timer* timer, void (*expire)(struct timer* timer), void* data) {
+    timer->deadline   = TIMER_NEVER;
+    timer->heap_index = TIMER_INACTIVE;
+    timer->expire     = expire;
+    timer->data       = data;
+}
+
+void timer_arm(struct timer* timer, uint64_t deadline) {
+    if(timer_armed(timer)) {
+        uint64_t old    = timer->deadline;
+        timer->deadline = deadline;
+
+        if(deadline < old) {
+            timer_sift_up(timer->heap_index);
+        }
+        else {
+            timer_sift_down(timer->heap_index);
+        }
+
+        return;
+    }
+
+    if(timer_count == timer_capacity) {
+        timer_heap_grow();
+    }
+
+    timer->deadline = deadline;
+    timer_heap_place(timer, timer_count++);
+    timer_sift_up(timer->heap_index);
+}
+
+void timer_cancel(struct timer* timer) {
+    if(!timer_armed(timer)) {
+        return;
+    }
+
+    size_t index      = timer->heap_index;
+    timer->heap_index = TIMER_INACTIVE;
+
+    if(index == --timer_count) {
+        return;
+    }
+
+    // fill the hole with the last timer, which may belong above or below it
+    struct timer* last = timer_heap[timer_count];
+
+    timer_heap_place(last, index);
+    timer_sift_up(index);
+    timer_sift_down(last->heap_index);
+}
+
+uint64_t timer_next_deadline(void) {
+    return timer_count ? timer_heap[0]->deadline : TIMER_NEVER;
+}
+
+size_t timer_expire(uint64_t now) {
+    size_t expired = 0;
+
+    while(timer_count && timer_heap[0]->deadline <= now) {
+        struct timer* timer = timer_heap[0];
+        timer_cancel(timer);
+
+        timer->expire(timer);
+        ++expired;
+    }
+
+    return expired;
+}
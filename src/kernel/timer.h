@@ -0,0 +1,67 @@
+#ifndef _TIMER_H_INCLUDED
+#define _TIMER_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+//! heap_index of a timer that is not armed
+#define TIMER_INACTIVE ((size_t)-1)
+
+//! No timer armed, returned by timer_next_deadline
+#define TIMER_NEVER ((uint64_t)-1)
+
+/**
+ * A deadline, embedded in whatever waits for it. Armed timers are kept in a
+ * min-heap ordered by deadline, so finding the next one is O(1) and arming,
+ * cancelling and expiring are O(log n).
+ */
+struct timer {
+    //! Timestamp in nanoseconds since boot at which the timer expires
+    uint64_t deadline;
+
+    //! Position in the heap, TIMER_INACTIVE if not armed
+    size_t heap_index;
+
+    //! Called when the timer expired, it is not armed anymore at that point
+    void (*expire)(struct timer* timer);
+
+    //! Free for use by the owner of the timer
+    void* data;
+};
+
+/**
+ * Initialize a timer, not armed.
+ *
+ * \param timer  Timer to initialize
+ * \param expire Function to call on expiry
+ * \param data   Data for the owner of the timer
+ */
+void timer_init(struct timer* timer, void (*expire)(struct timer* timer), void* data);
+
+/**
+ * Arm a timer, moving it if it was armed already.
+ *
+ * \param timer    Timer to arm
+ * \param deadline Timestamp in nanoseconds since boot at which the timer expires
+ */
+void timer_arm(struct timer* timer, uint64_t deadline);
+
+//! Disarm a timer, nothing happens if it is not armed
+void timer_cancel(struct timer* timer);
+
+static inline bool timer_armed(const struct timer* timer) {
+    return timer->heap_index != TIMER_INACTIVE;
+}
+
+//! Earliest deadline of all armed timers, TIMER_NEVER if none is armed
+uint64_t timer_next_deadline(void);
+
+/**
+ * Expire all timers with a deadline at or before now, earliest first.
+ *
+ * \param now Current timestamp in nanoseconds since boot
+ * \returns Number of expired timers
+ */
+size_t timer_expire(uint64_t now);
+
+#endif
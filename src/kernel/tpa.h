@@ -2,9 +2,18 @@
 #define _TPA_H_INCLUDED
 
 #include <allocator.h>
+#include <bitmap.h>
 #include <stdint.h>
 #include <string.h>
 
+/**
+ * Thin Provisioned Array, a sparse map of indices to entries.
+ *
+ * Stored as a radix tree of page sized nodes, growing in height as higher
+ * indices are set. Leaves hold the entries, inner nodes pointers to the next
+ * level. Every node starts with a bitmap of its used slots, which lets next()
+ * skip empty parts of the tree and tells when a node can be freed.
+ */
 template<typename T> class TPA {
     friend class TpaTest;
 
@@ -24,10 +33,18 @@ template<typename T> class TPA {
                 tpa = (TPA<T>*)alloc->alloc(alloc, sizeof(TPA<T>));
             }
 
-            tpa->allocator   = alloc;
-            tpa->entry_size  = sizeof(T);
-            tpa->page_size   = page_size;
-            tpa->first       = 0;
+            tpa->allocator     = alloc;
+            tpa->entry_size    = sizeof(T);
+            tpa->page_size     = page_size;
+            tpa->root          = 0;
+            tpa->height        = 0;
+            tpa->leaves        = 0;
+            tpa->spare         = 0;
+            tpa->generation    = 0;
+            tpa->count         = 0;
+            tpa->nodes         = 0;
+            tpa->leaf_entries  = tpa->slots_per_node(tpa->entry_size);
+            tpa->node_children = tpa->slots_per_node(sizeof(struct tpa_node*));
 
             return tpa;
         }
@@ -36,11 +53,10 @@ template<typename T> class TPA {
          * Deallocate every data in use by the given TPA and the TPA itself
          */
         void destroy() {
-            tpa_page_header* current = this->first;
-            while(current) {
-                struct tpa_page_header* next = current->next;
-                this->allocator->dealloc(this->allocator, current);
-                current = next;
+            this->free_subtree(this->root, this->height);
+
+            if(this->spare) {
+                this->allocator->dealloc(this->allocator, this->spare);
             }
 
             this->allocator->dealloc(this->allocator, this);
@@ -54,12 +70,10 @@ template<typename T> class TPA {
          * \returns pointer to the first byte of the entry
          */
         T* get(size_t idx) {
-            tpa_page_header* page = this->get_page_for_idx(idx);
+            tpa_node* leaf = this->find_leaf(idx);
 
-            if(page) {
-                if(this->entry_exists_in_page(page, idx - page->start_idx)) {
-                    return (T*)((uint64_t)page + this->offset_in_page(idx - page->start_idx) + 8); // 8: skip marker
-                }
+            if(leaf && bitmap_get(this->used_slots(leaf), idx % this->leaf_entries)) {
+                return this->entry(leaf, idx % this->leaf_entries);
             }
 
             return 0;
@@ -68,207 +82,379 @@ template<typename T> class TPA {
         /**
          * Set new data at the given index
          *
-         * \remarks This function might have to allocate a new page and could take some time to complete
+         * \remarks This function might have to allocate new nodes and could take some time to complete
          * \param idx Where to place the new entry
          * \param data Pointer to the first byte of the data to store
          */
         void set(size_t idx, T* data) {
-            tpa_page_header* page = this->get_page_for_idx(idx);
-
             if(!data) {
-                if(page) {
-                    *(this->get_marker(page, idx - page->start_idx)) = 0;
-                    this->clean_page(page);
-                    return;
-                }
+                this->remove(idx);
+                return;
             }
-            else {
-                if(!page) {
-                    page = (tpa_page_header*)this->allocator->alloc(this->allocator, this->page_size);
-                    memset(page, 0, this->page_size);
-                    page->start_idx = (idx / this->entries_per_page()) * this->entries_per_page();
-
-                    tpa_page_header* current = this->first;
-                    while(current && current->next && current->next->start_idx < page->start_idx) {
-                        current = current->next;
-                    }
-
-                    if(current && current->start_idx < page->start_idx) {
-                        tpa_page_header* next = current->next;
-                        page->next = next;
-
-                        current->next = page;
-                        page->prev = current;
 
-                        if(next) {
-                            next->prev = page;
-                        }
-                    }
-                    else {
-                        if(current && current->start_idx > page->start_idx) {
-                            page->next = current;
-                            page->prev = current->prev;
-                            current->prev = page;
-                        }
-
-                        this->first = page;
-
-                    }
-                }
+            tpa_node* leaf = this->make_leaf(idx);
+            uint64_t  slot = idx % this->leaf_entries;
 
-                *(this->get_marker(page, idx - page->start_idx)) = 1;
-                memcpy((void*)((uint64_t)page + this->offset_in_page(idx - page->start_idx) + 8), data, this->entry_size);
+            if(!bitmap_get(this->used_slots(leaf), slot)) {
+                bitmap_set(this->used_slots(leaf), slot);
+                ++leaf->used;
+                ++this->count;
             }
+
+            memcpy(this->entry(leaf, slot), data, this->entry_size);
         }
 
         /**
          * Returns the allocated size of the TPA in bytes
          *
-         * \remarks Has to search through the TPA and might be slow
          * \returns The size of all pages combined of this TPA in bytes
          */
         size_t size() {
-            size_t res = this->page_size; // for the header
-            tpa_page_header* current = this->first;
-            while(current) {
-                res += this->page_size;
-                current = current->next;
-            }
-
-            return res;
+            return this->page_size * (this->nodes + 1); // + 1 for the header
         }
 
         /**
          * Retrieve the highest index currently possible without new allocation
          *
-         * \remarks Has to search through the TPA and might be slow
          * \returns The index after the last entry in the last allocated page or -1
          */
         ssize_t length() {
-            if(!this->first) return -1;
+            if(!this->root) return -1;
+
+            tpa_node* node  = this->root;
+            uint64_t  span  = this->leaves;
+            uint64_t  first = 0;
 
-            tpa_page_header* current = this->first;
-            while(current->next) {
-                current = current->next;
+            for(uint64_t level = this->height; level > 1; --level) {
+                uint64_t slot = bitmap_find_last_set(this->used_slots(node), this->node_children);
+
+                span  /= this->node_children;
+                first += slot * span;
+                node   = this->children(node)[slot];
             }
 
-            return current->start_idx + this->entries_per_page();
+            return (first + 1) * this->leaf_entries;
         }
 
         /**
          * Counts the number of existing entries in the TPA
          *
-         * \remarks Has to search through the TPA and might be slow
          * \returns The number of entries currently set in the TPA
          */
         size_t entries() {
-            size_t res = 0;
-
-            tpa_page_header* current = this->first;
-            while(current) {
-                for(uint64_t i = 0; i < this->entries_per_page(); ++i) {
-                    if(this->entry_exists_in_page(current, i)) {
-                        ++res;
-                    }
-                }
-
-                current = current->next;
-            }
-
-            return res;
+            return this->count;
         }
 
         /**
          * Returns the next non-empty element after cur
          *
-         * \remarks Has to iterate through the pages to get the page to the cur idx
          * \param cur The current index
          * \returns The next non-empty element index after cur. Special case: returns 0 when nothing found, you
          *          are expected to check if the returned value is larger than cur to check if something was found.
          */
         size_t next(size_t cur) {
-            tpa_page_header* page;
+            uint64_t idx = cur + 1;
 
-            // seek to first page where our next entry could be in
-            for(page = this->first; page && page->start_idx + this->entries_per_page() < cur; page = page->next) { }
+            if(!this->root || !idx || idx / this->leaf_entries >= this->leaves) {
+                return 0;
+            }
 
-            while(page) {
-                for (size_t page_idx = (cur - page->start_idx); page_idx < this->entries_per_page(); ++page_idx) {
-                    if(*(this->get_marker(page, page_idx))) {
-                        return page->start_idx + page_idx;
-                    }
-                }
+            tpa_node* node  = this->root;
+            uint64_t  level = this->height;
+            uint64_t  span  = this->leaves;              // leaves below node
+            uint64_t  first = 0;                         // first leaf below node
+            uint64_t  from  = idx % this->leaf_entries;  // first slot of node to look at
 
-                page = page->next;
+            // follow the path to idx as far as it exists
+            while(level > 1) {
+                uint64_t  slot  = (idx / this->leaf_entries - first) / (span / this->node_children);
+                tpa_node* child = this->children(node)[slot];
 
-                if(page) {
-                    cur = page->start_idx;
+                if(!child) {
+                    from = slot + 1;
+                    break;
                 }
+
+                span  /= this->node_children;
+                first += slot * span;
+                node   = child;
+                --level;
             }
 
-            return 0;
+            // continue with the next used slot, going up when a node has none left
+            while(true) {
+                uint64_t slots = level > 1 ? this->node_children : this->leaf_entries;
+                uint64_t slot  = bitmap_find_set_from(this->used_slots(node), from, slots);
+
+                if(slot < slots) {
+                    if(level == 1) {
+                        return first * this->leaf_entries + slot;
+                    }
+
+                    span  /= this->node_children;
+                    first += slot * span;
+                    node   = this->children(node)[slot];
+                    from   = 0;
+                    --level;
+                }
+                else {
+                    if(!node->parent) {
+                        return 0;
+                    }
+
+                    from   = node->parent_slot + 1;
+                    first -= node->parent_slot * span;
+                    span  *= this->node_children;
+                    node   = node->parent;
+                    ++level;
+                }
+            }
         }
 
     private:
-        //! Header of a tpa page. Data follows after this until &tpa_page_header+tpa->page_size
-        struct tpa_page_header {
-            //! Pointer to the next page
-            struct tpa_page_header* next;
-            struct tpa_page_header* prev;
-
-            //! First index in this page
-            uint64_t start_idx;
+        //! Header of a tree node, followed by the bitmap of used slots and the slots until &tpa_node+tpa->page_size
+        struct tpa_node {
+            //! Node pointing to this one, 0 for the root
+            struct tpa_node* parent;
+
+            //! Slot of this node in its parent
+            uint64_t parent_slot;
+
+            //! Number of used slots, the node is freed when this reaches 0
+            uint64_t used;
         };
 
+        //! Number of slots of the given size fitting into a node next to the header and bitmap
+        uint64_t slots_per_node(uint64_t slot_size) {
+            uint64_t space = this->page_size - sizeof(struct tpa_node);
+            uint64_t slots = (space * 8) / (slot_size * 8 + 1);
+
+            while(slots && this->bitmap_bytes(slots) + slots * slot_size > space) {
+                --slots;
+            }
+
+            return slots;
+        }
+
+        //! Size of the bitmap for the given number of slots, rounded up to keep the slots aligned
+        uint64_t bitmap_bytes(uint64_t slots) {
+            return (bitmap_size(slots) + 7) & ~7ULL;
+        }
+
         size_t entries_per_page() {
-            return ((this->page_size - sizeof(struct tpa_page_header)) / (this->entry_size + 8));
+            return this->leaf_entries;
+        }
+
+        size_t children_per_node() {
+            return this->node_children;
         }
 
-        uint64_t offset_in_page(uint64_t idx) {
-            return sizeof(struct tpa_page_header) + ((this->entry_size + 8) * idx);
+        bitmap_t used_slots(tpa_node* node) {
+            return (bitmap_t)(node + 1);
         }
 
-        uint64_t* get_marker(struct tpa_page_header* page, uint64_t idx) {
-            return (uint64_t*)((uint64_t)page + this->offset_in_page(idx));
+        T* entry(tpa_node* leaf, uint64_t slot) {
+            return (T*)((uint64_t)(leaf + 1) + this->bitmap_bytes(this->leaf_entries) + (this->entry_size * slot));
         }
 
-        bool entry_exists_in_page(struct tpa_page_header* page, uint64_t idx) {
-            return *(this->get_marker(page, idx)) != 0;
+        tpa_node** children(tpa_node* node) {
+            return (tpa_node**)((uint64_t)(node + 1) + this->bitmap_bytes(this->node_children));
+        }
+
+        tpa_node* find_leaf(uint64_t idx) {
+            // checking the root first, a zeroed TPA not created yet is valid and empty
+            if(!this->root || idx / this->leaf_entries >= this->leaves) {
+                return 0;
+            }
+
+            uint64_t leaf_idx = idx / this->leaf_entries;
+
+            tpa_node* node = this->root;
+            uint64_t  span = this->leaves;
+
+            for(uint64_t level = this->height; node && level > 1; --level) {
+                span     /= this->node_children;
+                node      = this->children(node)[leaf_idx / span];
+                leaf_idx %= span;
+            }
+
+            return node;
         }
 
-        tpa_page_header* get_page_for_idx(uint64_t idx) {
-            tpa_page_header* current = this->first;
-            while(current) {
-                if(current->start_idx <= idx && current->start_idx + this->entries_per_page() > idx) {
-                    return current;
+        /**
+         * Find the leaf for the given index, adding it and every node above it as needed.
+         *
+         * Allocating might call back into this TPA (the page descriptors of the
+         * memory management are stored in one), so whenever the tree changed
+         * while allocating we start over and keep the node for later.
+         */
+        tpa_node* make_leaf(uint64_t idx) {
+            uint64_t leaf_idx = idx / this->leaf_entries;
+
+            while(true) {
+                uint64_t generation = this->generation;
+
+                if(!this->root || leaf_idx >= this->leaves) {
+                    tpa_node* node = this->alloc_node();
+
+                    if(generation != this->generation) {
+                        this->release_node(node);
+                        continue;
+                    }
+
+                    if(!this->root) {
+                        this->height = 1;
+                        this->leaves = 1;
+
+                        while(leaf_idx >= this->leaves) {
+                            this->leaves *= this->node_children;
+                            ++this->height;
+                        }
+                    }
+                    else {
+                        // the old root becomes the first child of the new one
+                        this->link(node, 0, this->root);
+                        this->leaves *= this->node_children;
+                        ++this->height;
+                    }
+
+                    this->root = node;
+                    ++this->generation;
+                    continue;
                 }
 
-                if(current->start_idx > idx) {
-                    break;
+                tpa_node* node  = this->root;
+                uint64_t  span  = this->leaves;
+                uint64_t  level = this->height;
+
+                for(; level > 1; --level) {
+                    span /= this->node_children;
+
+                    uint64_t  slot  = (leaf_idx / span) % this->node_children;
+                    tpa_node* child = this->children(node)[slot];
+
+                    if(!child) {
+                        child = this->alloc_node();
+
+                        if(generation != this->generation) {
+                            this->release_node(child);
+                            break;
+                        }
+
+                        this->link(node, slot, child);
+                        generation = this->generation;
+                    }
+
+                    node = child;
                 }
 
-                current = current->next;
+                if(level == 1) {
+                    return node;
+                }
             }
-
-            return 0;
         }
 
-        void clean_page(tpa_page_header* page) {
-            for(uint64_t idx = 0; idx < this->entries_per_page(); ++idx) {
-                // if an entry is in use we cannot delete the page
-                if(this->entry_exists_in_page(page, idx)) {
-                    return;
+        void remove(uint64_t idx) {
+            tpa_node* node = this->find_leaf(idx);
+
+            if(!node || !bitmap_get(this->used_slots(node), idx % this->leaf_entries)) {
+                return;
+            }
+
+            uint64_t slot = idx % this->leaf_entries;
+
+            bitmap_clear(this->used_slots(node), slot);
+            --node->used;
+            --this->count;
+
+            // take empty nodes out of the tree first, freeing them might call back into this TPA
+            tpa_node* empty = 0;
+
+            while(node && !node->used) {
+                tpa_node* parent = node->parent;
+
+                if(parent) {
+                    this->unlink(parent, node->parent_slot);
+                }
+                else {
+                    this->root   = 0;
+                    this->height = 0;
+                    this->leaves = 0;
+                    ++this->generation;
                 }
+
+                node->parent = empty;
+                empty        = node;
+                node         = parent;
             }
 
-            if(page->prev) {
-                page->prev->next = page->next;
+            while(empty) {
+                tpa_node* next = empty->parent;
+
+                this->allocator->dealloc(this->allocator, empty);
+                --this->nodes;
+
+                empty = next;
+            }
+        }
+
+        void link(tpa_node* parent, uint64_t slot, tpa_node* child) {
+            this->children(parent)[slot] = child;
+            bitmap_set(this->used_slots(parent), slot);
+            ++parent->used;
+
+            child->parent      = parent;
+            child->parent_slot = slot;
+
+            ++this->generation;
+        }
+
+        void unlink(tpa_node* parent, uint64_t slot) {
+            this->children(parent)[slot] = 0;
+            bitmap_clear(this->used_slots(parent), slot);
+            --parent->used;
+
+            ++this->generation;
+        }
+
+        tpa_node* alloc_node() {
+            tpa_node* node = this->spare;
+
+            if(node) {
+                this->spare = 0;
             }
             else {
-                this->first = page->next;
+                node = (tpa_node*)this->allocator->alloc(this->allocator, this->page_size);
+                ++this->nodes;
             }
 
-            this->allocator->dealloc(this->allocator, page);
+            memset(node, 0, this->page_size);
+            return node;
+        }
+
+        //! Keep a node allocated but not needed anymore for the next alloc_node
+        void release_node(tpa_node* node) {
+            if(!this->spare) {
+                this->spare = node;
+            }
+            else {
+                this->allocator->dealloc(this->allocator, node);
+                --this->nodes;
+            }
+        }
+
+        void free_subtree(tpa_node* node, uint64_t level) {
+            if(!node) {
+                return;
+            }
+
+            if(level > 1) {
+                for(uint64_t slot = 0; slot < this->node_children; ++slot) {
+                    this->free_subtree(this->children(node)[slot], level - 1);
+                }
+            }
+
+            this->allocator->dealloc(this->allocator, node);
         }
 
         //! Allocator for new tpa pages
@@ -277,12 +463,35 @@ template<typename T> class TPA {
         //! Size of each entry
         uint64_t entry_size;
 
-        //! Size of each data page
+        //! Size of each node
         uint64_t page_size;
 
-        //! Pointer to the first data page
-        struct tpa_page_header* first;
+        //! Entries per leaf
+        uint64_t leaf_entries;
+
+        //! Children per inner node
+        uint64_t node_children;
+
+        //! Top of the tree
+        struct tpa_node* root;
+
+        //! Levels of the tree including the leaves, 0 when empty
+        uint64_t height;
+
+        //! Leaves the tree can hold at its current height
+        uint64_t leaves;
+
+        //! Node allocated while the tree changed under us, see make_leaf
+        struct tpa_node* spare;
+
+        //! Incremented on every change of the tree structure
+        uint64_t generation;
+
+        //! Entries set
+        uint64_t count;
 
+        //! Nodes allocated
+        uint64_t nodes;
 };
 
 #endif
@@ -0,0 +1,288 @@
+#include <vrange.h>
+
+//! A free range of pages, node in the treap of its vrange
+struct vrange_node {
+    //! Page number of the first page in this range
+    uint64_t start;
+
+    //! Number of pages in this range
+    uint64_t pages;
+
+    //! Largest number of pages of any range in this subtree
+    uint64_t max_pages;
+
+    //! Heap priority of the treap, keeps it balanced on average
+    uint32_t priority;
+
+    struct vrange_node* left;
+    struct vrange_node* right;
+};
+
+static uint32_t vrange_random_state = 0x1F05BEEF;
+
+static uint32_t vrange_random(void) {
+    // xorshift32, good enough for balancing
+    vrange_random_state ^= vrange_random_state << 13;
+    vrange_random_state ^= vrange_random_state >> 17;
+    vrange_random_state ^= vrange_random_state << 5;
+
+    return vrange_random_state;
+}
+
+static struct vrange_node* vrange_node_new(struct vrange* range, uint64_t start, uint64_t pages) {
+    if(!range->free_nodes) {
+        struct vrange_node* page = (struct vrange_node*)range->alloc_page();
+
+        for(size_t i = 0; i < 4096 / sizeof(struct vrange_node); ++i) {
+            page[i].left      = range->free_nodes;
+            range->free_nodes = &page[i];
+        }
+    }
+
+    struct vrange_node* node = range->free_nodes;
+    range->free_nodes = node->left;
+
+    node->start     = start;
+    node->pages     = pages;
+    node->max_pages = pages;
+    node->priority  = vrange_random();
+    node->left      = 0;
+    node->right     = 0;
+
+    return node;
+}
+
+static void vrange_node_delete(struct vrange* range, struct vrange_node* node) {
+    node->left        = range->free_nodes;
+    range->free_nodes = node;
+}
+
+static void vrange_update(struct vrange_node* node) {
+    node->max_pages = node->pages;
+
+    if(node->left && node->left->max_pages > node->max_pages) {
+        node->max_pages = node->left->max_pages;
+    }
+
+    if(node->right && node->right->max_pages > node->max_pages) {
+        node->max_pages = node->right->max_pages;
+    }
+}
+
+//! Split a treap into the nodes starting before key and those starting at or after key
+static void vrange_split(struct vrange_node* node, uint64_t key, struct vrange_node** before, struct vrange_node** after) {
+    if(!node) {
+        *before = *after = 0;
+        return;
+    }
+
+    if(node->start < key) {
+        vrange_split(node->right, key, &node->right, after);
+        *before = node;
+    }
+    else {
+        vrange_split(node->left, key, before, &node->left);
+        *after = node;
+    }
+
+    vrange_update(node);
+}
+
+//! Merge two treaps, all nodes in a must start before all nodes in b
+static struct vrange_node* vrange_merge(struct vrange_node* a, struct vrange_node* b) {
+    if(!a) return b;
+    if(!b) return a;
+
+    if(a->priority > b->priority) {
+        a->right = vrange_merge(a->right, b);
+        vrange_update(a);
+        return a;
+    }
+    else {
+        b->left = vrange_merge(a, b->left);
+        vrange_update(b);
+        return b;
+    }
+}
+
+static struct vrange_node* vrange_pop_first(struct vrange_node** node) {
+    if(!*node) {
+        return 0;
+    }
+
+    if((*node)->left) {
+        struct vrange_node* ret = vrange_pop_first(&(*node)->left);
+        vrange_update(*node);
+        return ret;
+    }
+
+    struct vrange_node* ret = *node;
+    *node      = ret->right;
+    ret->right = 0;
+    vrange_update(ret);
+
+    return ret;
+}
+
+static struct vrange_node* vrange_pop_last(struct vrange_node** node) {
+    if(!*node) {
+        return 0;
+    }
+
+    if((*node)->right) {
+        struct vrange_node* ret = vrange_pop_last(&(*node)->right);
+        vrange_update(*node);
+        return ret;
+    }
+
+    struct vrange_node* ret = *node;
+    *node     = ret->left;
+    ret->left = 0;
+    vrange_update(ret);
+
+    return ret;
+}
+
+//! Insert a range known not to overlap or touch any other free range
+static void vrange_insert(struct vrange* range, struct vrange_node* node) {
+    struct vrange_node *before, *after;
+    vrange_split(range->root, node->start, &before, &after);
+
+    range->root = vrange_merge(vrange_merge(before, node), after);
+}
+
+void vrange_init(struct vrange* range, uint64_t start, uint64_t end, void* (*alloc_page)(void)) {
+    range->root       = 0;
+    range->free_nodes = 0;
+    range->alloc_page = alloc_page;
+    range->free_pages = 0;
+
+    vrange_free(range, start, ((end - start) >> 12) + 1);
+}
+
+uint64_t vrange_alloc(struct vrange* range, size_t pages) {
+    if(!pages || !range->root || range->root->max_pages < pages) {
+        return 0;
+    }
+
+    // lowest address first: left subtree if it has a range large enough, this node otherwise, right subtree as last resort
+    struct vrange_node* node = range->root;
+    while(true) {
+        if(node->left && node->left->max_pages >= pages) {
+            node = node->left;
+        }
+        else if(node->pages >= pages) {
+            break;
+        }
+        else {
+            node = node->right;
+        }
+    }
+
+    uint64_t start = node->start;
+
+    struct vrange_node *before, *found, *after;
+    vrange_split(range->root, start,     &before, &after);
+    vrange_split(after,       start + 1, &found,  &after);
+
+    range->root = vrange_merge(before, after);
+
+    if(found->pages > pages) {
+        found->start += pages;
+        found->pages -= pages;
+        vrange_update(found);
+        vrange_insert(range, found);
+    }
+    else {
+        vrange_node_delete(range, found);
+    }
+
+    range->free_pages -= pages;
+
+    return start << 12;
+}
+
+bool vrange_reserve(struct vrange* range, uint64_t start, size_t pages) {
+    uint64_t first = start >> 12;
+
+    if(!pages) {
+        return true;
+    }
+
+    // the free range containing the first page is the last one starting at or before it
+    struct vrange_node *before, *after;
+    vrange_split(range->root, first + 1, &before, &after);
+
+    struct vrange_node* node = vrange_pop_last(&before);
+
+    if(!node || node->start + node->pages < first + pages) {
+        if(node) {
+            before = vrange_merge(before, node);
+        }
+
+        range->root = vrange_merge(before, after);
+        return false;
+    }
+
+    range->root = vrange_merge(before, after);
+
+    uint64_t tail_start = first + pages;
+    uint64_t tail_pages = node->start + node->pages - tail_start;
+
+    if(node->start < first) {
+        node->pages = first - node->start;
+        vrange_update(node);
+        vrange_insert(range, node);
+    }
+    else {
+        vrange_node_delete(range, node);
+    }
+
+    if(tail_pages) {
+        vrange_insert(range, vrange_node_new(range, tail_start, tail_pages));
+    }
+
+    range->free_pages -= pages;
+
+    return true;
+}
+
+void vrange_free(struct vrange* range, uint64_t start, size_t pages) {
+    uint64_t first = start >> 12;
+
+    if(!pages) {
+        return;
+    }
+
+    struct vrange_node *before, *after;
+    vrange_split(range->root, first, &before, &after);
+
+    struct vrange_node* node = 0;
+    struct vrange_node* prev = vrange_pop_last(&before);
+    struct vrange_node* next = vrange_pop_first(&after);
+
+    if(prev && prev->start + prev->pages == first) {
+        node = prev;
+        node->pages += pages;
+    }
+    else {
+        if(prev) {
+            before = vrange_merge(before, prev);
+        }
+
+        node = vrange_node_new(range, first, pages);
+    }
+
+    if(next && next->start == first + pages) {
+        node->pages += next->pages;
+        vrange_node_delete(range, next);
+    }
+    else if(next) {
+        after = vrange_merge(next, after);
+    }
+
+    vrange_update(node);
+    range->root = vrange_merge(vrange_merge(before, node), after);
+
+    range->free_pages += pages;
+}
@@ -0,0 +1,66 @@
+#ifndef _VRANGE_H_INCLUDED
+#define _VRANGE_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct vrange_node;
+
+/**
+ * Free ranges of pages in a region of virtual address space. Free ranges are
+ * kept in a treap ordered by address where every node knows the largest free
+ * range below it, making first-fit allocation and freeing O(log n).
+ */
+struct vrange {
+    //! Root of the treap of free ranges
+    struct vrange_node* root;
+
+    //! Unused nodes, refilled with pages from alloc_page
+    struct vrange_node* free_nodes;
+
+    //! Called to get a page for bookkeeping when running out of nodes
+    void* (*alloc_page)(void);
+
+    //! Number of free pages in all ranges
+    uint64_t free_pages;
+};
+
+/**
+ * Initialize a range allocator with the whole region being free.
+ *
+ * \param range      Range allocator to initialize
+ * \param start      First address of the region, page aligned
+ * \param end        Last address of the region (inclusive)
+ * \param alloc_page Function returning a writeable 4 KiB page for bookkeeping
+ */
+void vrange_init(struct vrange* range, uint64_t start, uint64_t end, void* (*alloc_page)(void));
+
+/**
+ * Allocate the lowest free range of the given size.
+ *
+ * \param range Range allocator to allocate from
+ * \param pages Number of pages to allocate
+ * \returns First address of the allocated range, 0 if no range is large enough
+ */
+uint64_t vrange_alloc(struct vrange* range, size_t pages);
+
+/**
+ * Mark a specific range as allocated.
+ *
+ * \param range Range allocator to allocate from
+ * \param start First address of the range, page aligned
+ * \param pages Number of pages in the range
+ * \returns false if the range was not completely free
+ */
+bool vrange_reserve(struct vrange* range, uint64_t start, size_t pages);
+
+/**
+ * Give a range back, merging it with adjacent free ranges.
+ *
+ * \param range Range allocator to give the range back to
+ * \param start First address of the range, page aligned
+ * \param pages Number of pages in the range
+ */
+void vrange_free(struct vrange* range, uint64_t start, size_t pages);
+
+#endif
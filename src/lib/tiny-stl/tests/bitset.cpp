@@ -57,3 +57,55 @@ TYPED_TEST(BitsetTest, Simple) {
     EXPECT_TRUE(foo.all());
     EXPECT_FALSE(foo.none());
 }
+
+// word-wide operations only tiny-stl has, checked against bit-by-bit results
+TEST(TinyBitset, FindFirst) {
+    std::mt19937 rng;
+    tinystl_std::bitset<200> foo {};
+
+    EXPECT_EQ(foo.find_first_set(),   200);
+    EXPECT_EQ(foo.find_first_unset(), 0);
+
+    for(size_t i = 0; i < 200; ++i) {
+        foo.set(i, rng() % 4 == 0);
+    }
+
+    for(size_t from = 0; from <= 200; ++from) {
+        size_t set = from, unset = from;
+        for(; set   < 200 && !foo.test(set);  ++set);
+        for(; unset < 200 &&  foo.test(unset); ++unset);
+
+        EXPECT_EQ(foo.find_first_set(from),   set)   << "from " << from;
+        EXPECT_EQ(foo.find_first_unset(from), unset) << "from " << from;
+    }
+
+    foo.set();
+    EXPECT_EQ(foo.find_first_unset(), 200) << "bits after the last one are not found";
+}
+
+TEST(TinyBitset, Ranges) {
+    tinystl_std::bitset<200> foo {};
+
+    foo.set_range(3, 130);
+    for(size_t i = 0; i < 200; ++i) {
+        EXPECT_EQ(foo.test(i), i >= 3 && i < 133) << "bit " << i;
+    }
+
+    EXPECT_EQ(foo.count(), 130);
+
+    foo.reset_range(60, 10);
+    EXPECT_EQ(foo.count(), 120);
+    EXPECT_EQ(foo.find_first_unset(3), 60);
+    EXPECT_EQ(foo.find_first_set(60),  70);
+
+    foo.set_range(64, 64);
+    EXPECT_EQ(foo.find_first_unset(64), 133) << "whole word set";
+
+    foo.flip();
+    EXPECT_EQ(foo.count(), 200 - 126) << "bits after the last one stay clear";
+    EXPECT_FALSE(foo.all());
+
+    foo.set();
+    EXPECT_EQ(foo.count(), 200);
+    EXPECT_TRUE(foo.all());
+}
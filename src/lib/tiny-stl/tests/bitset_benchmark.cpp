@@ -0,0 +1,125 @@
+#include <chrono>
+#include <random>
+
+#include <gtest/gtest.h>
+
+#define NAMESPACE_FOR_TESTING
+#include "../include/std/bitset"
+
+//! One bit per byte of a 4 KiB page, like a slot bitmap of a page full of tiny objects
+static const size_t bits   = 4096 * 8;
+static const size_t rounds = 1000;
+
+using bitmap_t = tinystl_std::bitset<bits>;
+
+//! Mostly used bitmap with the only run of n free bits near its end
+static void fill(bitmap_t& bitmap, size_t n) {
+    std::mt19937 rng;
+
+    bitmap.set();
+
+    // lots of short holes that are too small
+    for(size_t i = 0; i < bits - 1024; i += 1 + rng() % 16) {
+        bitmap.reset(i);
+    }
+
+    bitmap.reset_range(bits - 512, n);
+}
+
+static size_t find_run_bitwise(const bitmap_t& bitmap, size_t n) {
+    size_t run = 0;
+
+    for(size_t i = 0; i < bits; ++i) {
+        run = bitmap.test(i) ? 0 : run + 1;
+
+        if(run == n) {
+            return i + 1 - n;
+        }
+    }
+
+    return bits;
+}
+
+static size_t find_run_words(const bitmap_t& bitmap, size_t n) {
+    for(size_t start = bitmap.find_first_unset(); start + n <= bits;) {
+        size_t end = bitmap.find_first_set(start);
+
+        if(end - start >= n) {
+            return start;
+        }
+
+        start = bitmap.find_first_unset(end);
+    }
+
+    return bits;
+}
+
+template<class F>
+static size_t measure(F f) {
+    auto start = std::chrono::steady_clock::now();
+
+    for(size_t i = 0; i < rounds; ++i) {
+        f();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / rounds;
+}
+
+TEST(BitsetBenchmark, FindRun) {
+    bitmap_t bitmap;
+    fill(bitmap, 32);
+
+    volatile size_t result;
+
+    size_t bitwise = measure([&] { result = find_run_bitwise(bitmap, 32); });
+    size_t words   = measure([&] { result = find_run_words(bitmap, 32); });
+
+    EXPECT_EQ(find_run_words(bitmap, 32), bits - 512);
+    EXPECT_EQ(find_run_bitwise(bitmap, 32), find_run_words(bitmap, 32));
+
+    printf("run of 32 in %zu bits: %zu ns bitwise, %zu ns word-wise\n", bits, bitwise, words);
+    RecordProperty("ns_bitwise", bitwise);
+    RecordProperty("ns_words",   words);
+}
+
+TEST(BitsetBenchmark, FindFirstUnset) {
+    bitmap_t bitmap;
+    bitmap.set();
+    bitmap.reset(bits - 1);
+
+    volatile size_t result;
+
+    size_t bitwise = measure([&] {
+        size_t i = 0;
+        for(; i < bits && bitmap.test(i); ++i);
+        result = i;
+    });
+    size_t words = measure([&] { result = bitmap.find_first_unset(); });
+
+    EXPECT_EQ(bitmap.find_first_unset(), bits - 1);
+
+    printf("last unset of %zu bits: %zu ns bitwise, %zu ns word-wise\n", bits, bitwise, words);
+    RecordProperty("ns_bitwise", bitwise);
+    RecordProperty("ns_words",   words);
+}
+
+TEST(BitsetBenchmark, Count) {
+    bitmap_t bitmap;
+    fill(bitmap, 32);
+
+    volatile size_t result;
+
+    size_t bitwise = measure([&] {
+        size_t ret = 0;
+        for(size_t i = 0; i < bits; ++i) {
+            ret += bitmap.test(i);
+        }
+        result = ret;
+    });
+    size_t words = measure([&] { result = bitmap.count(); });
+
+    printf("count of %zu bits: %zu ns bitwise, %zu ns word-wise\n", bits, bitwise, words);
+    RecordProperty("ns_bitwise", bitwise);
+    RecordProperty("ns_words",   words);
+}
@@ -0,0 +1,67 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <sys/syscalls.h>
+
+#include <gtest/gtest.h>
+
+//! Number of times each side yields to the other one
+static const uint64_t rounds = 10000;
+
+static uint64_t now(void) {
+    uint64_t ns;
+    sc_do_clock_read(&ns);
+    return ns;
+}
+
+static void yield_rounds(void) {
+    for(uint64_t i = 0; i < rounds; ++i) {
+        sc_do_scheduler_sleep(0);
+    }
+}
+
+/* Ping-pong between two runnable tasks via yield, every yield is a context
+ * switch. Run under QEMU with and without PCID support (e.g. `-cpu max` vs.
+ * `-cpu qemu64`) to compare the cost of switching address spaces, the kernel
+ * logs if PCID is in use. */
+static uint64_t measure_switch(bool share_memory) {
+    pid_t pid;
+
+    if(share_memory) {
+        pthread_t thread;
+        pid = pthread_create(&thread, nullptr, [](void*) -> void* { yield_rounds(); return nullptr; }, nullptr) ? -1 : thread;
+    }
+    else {
+        sc_do_scheduler_clone(false, 0, 0, &pid);
+
+        if(pid == 0) {
+            yield_rounds();
+            sc_do_scheduler_exit(0);
+        }
+    }
+
+    EXPECT_GT(pid, 0);
+
+    uint64_t start = now();
+    yield_rounds();
+    uint64_t end   = now();
+
+    return (end - start) / (2 * rounds);
+}
+
+TEST(ContextSwitch, Processes) {
+    uint64_t ns = measure_switch(false);
+    printf("context switch between processes: %llu ns\n", (unsigned long long)ns);
+    RecordProperty("ns_per_switch", std::to_string(ns));
+
+    EXPECT_GT(ns, 0);
+}
+
+TEST(ContextSwitch, Threads) {
+    uint64_t ns = measure_switch(true);
+    printf("context switch between threads: %llu ns\n", (unsigned long long)ns);
+    RecordProperty("ns_per_switch", std::to_string(ns));
+
+    EXPECT_GT(ns, 0);
+}
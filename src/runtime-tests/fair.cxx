@@ -0,0 +1,90 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/syscalls.h>
+
+#include <gtest/gtest.h>
+
+//! Time every thread keeps its CPU busy
+static const uint64_t spin_ns = 200000000;
+
+//! Nice value of the batch threads competing with the default ones
+static const int8_t batch_nice = 10;
+
+static volatile uint64_t finished;
+static volatile uint64_t runtime_default;
+static volatile uint64_t runtime_batch;
+
+//! Start time of the test, for the spinning threads
+static uint64_t spin_start;
+
+static uint64_t now(void) {
+    uint64_t ns;
+    sc_do_clock_read(&ns);
+    return ns;
+}
+
+static void spin(uint64_t start, bool batch) {
+    uint64_t error;
+
+    if(batch) {
+        sc_do_scheduler_set_nice(-1, batch_nice, &error);
+    }
+
+    while(now() - start < spin_ns) { }
+
+    uint64_t runtime, vruntime;
+    sc_do_scheduler_process_stats(-1, &runtime, &vruntime, &error);
+
+    __atomic_fetch_add(batch ? &runtime_batch : &runtime_default, runtime, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+}
+
+TEST(Fair, InvalidNice) {
+    uint64_t error;
+
+    sc_do_scheduler_set_nice(-1, 20, &error);
+    EXPECT_EQ(error, EINVAL);
+
+    sc_do_scheduler_set_nice(-1, -21, &error);
+    EXPECT_EQ(error, EINVAL);
+
+    sc_do_scheduler_set_nice(-1, 0, &error);
+    EXPECT_EQ(error, 0);
+}
+
+/* Two busy threads per CPU, one at the default nice value and one at
+ * batch_nice. Weights differ by about 10x, so the default ones should get
+ * most of the CPU time while the batch ones still make progress. */
+TEST(Fair, NiceShares) {
+    uint64_t idle, entries, cpus;
+    sc_do_scheduler_idle_stats(&idle, &entries, &cpus);
+    ASSERT_GT(cpus, 0);
+
+    finished        = 0;
+    runtime_default = 0;
+    runtime_batch   = 0;
+
+    spin_start = now();
+
+    for(uint64_t i = 0; i < 2 * cpus; ++i) {
+        pthread_t thread;
+        ASSERT_EQ(pthread_create(&thread, nullptr, [](void* batch) -> void* { spin(spin_start, batch); return nullptr; }, (void*)(i % 2)), 0);
+    }
+
+    while(__atomic_load_n(&finished, __ATOMIC_SEQ_CST) < 2 * cpus) {
+        sc_do_scheduler_sleep(10000000);
+    }
+
+    EXPECT_GT(runtime_default, runtime_batch);
+    EXPECT_GT(runtime_batch, 0) << "batch threads are not starved";
+
+    uint64_t ratio = runtime_default / (runtime_batch ? runtime_batch : 1);
+
+    printf("%llu CPUs, nice 0 vs. nice %d: %llu ns vs. %llu ns, ratio %llu\n",
+           (unsigned long long)cpus, batch_nice, (unsigned long long)runtime_default,
+           (unsigned long long)runtime_batch, (unsigned long long)ratio);
+    RecordProperty("runtime_ratio", std::to_string(ratio));
+}
@@ -0,0 +1,146 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/syscalls.h>
+
+#include <gtest/gtest.h>
+
+//! Threads besides the main thread competing for the same mutex
+static const uint64_t threads = 4;
+
+//! Number of times each thread takes the lock
+static const uint64_t rounds  = 100000;
+
+static pthread_mutex_t   mutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t    condvar = PTHREAD_COND_INITIALIZER;
+
+static volatile uint64_t counter;
+static volatile uint64_t finished;
+static volatile bool     ready;
+
+static uint64_t now(void) {
+    uint64_t ns;
+    sc_do_clock_read(&ns);
+    return ns;
+}
+
+static void wait_for_threads(uint64_t count) {
+    while(__atomic_load_n(&finished, __ATOMIC_SEQ_CST) < count) {
+        sc_do_scheduler_sleep(0);
+    }
+}
+
+static void hammer(void) {
+    for(uint64_t i = 0; i < rounds; ++i) {
+        pthread_mutex_lock(&mutex);
+        counter = counter + 1;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Nobody else wants the lock, so locking and unlocking never enter the
+ * kernel. Compare with the kernel mutex, which needs a syscall for both. */
+TEST(Futex, Uncontended) {
+    uint64_t start = now();
+
+    for(uint64_t i = 0; i < rounds; ++i) {
+        pthread_mutex_lock(&mutex);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    uint64_t ns = (now() - start) / rounds;
+
+    uint64_t kernel_mutex, error;
+    sc_do_locking_create_mutex(&kernel_mutex, &error);
+    ASSERT_EQ(error, 0);
+
+    start = now();
+
+    for(uint64_t i = 0; i < rounds; ++i) {
+        sc_do_locking_lock_mutex(kernel_mutex, false, &error);
+        sc_do_locking_unlock_mutex(kernel_mutex, &error);
+    }
+
+    uint64_t kernel_ns = (now() - start) / rounds;
+
+    sc_do_locking_destroy_mutex(kernel_mutex, &error);
+
+    printf("uncontended lock/unlock: %llu ns, kernel mutex: %llu ns\n", (unsigned long long)ns, (unsigned long long)kernel_ns);
+    RecordProperty("ns_per_lock", std::to_string(ns));
+    RecordProperty("kernel_ns_per_lock", std::to_string(kernel_ns));
+}
+
+/* Only lock attempts finding the mutex taken wait in the kernel, and only
+ * unlocks of a mutex somebody waits for wake them there. */
+TEST(Futex, Contended) {
+    counter  = 0;
+    finished = 0;
+
+    uint64_t start = now();
+
+    for(uint64_t i = 0; i < threads; ++i) {
+        pthread_t thread;
+        ASSERT_EQ(pthread_create(&thread, nullptr, [](void*) -> void* { hammer(); return nullptr; }, nullptr), 0);
+    }
+
+    hammer();
+    wait_for_threads(threads + 1);
+
+    uint64_t ns = (now() - start) / ((threads + 1) * rounds);
+
+    EXPECT_EQ(counter, (threads + 1) * rounds) << "no update lost";
+    EXPECT_EQ(pthread_mutex_destroy(&mutex), 0) << "unlocked at the end";
+
+    printf("contended lock/unlock with %llu threads: %llu ns\n", (unsigned long long)threads + 1, (unsigned long long)ns);
+    RecordProperty("contended_ns_per_lock", std::to_string(ns));
+}
+
+TEST(Futex, CondvarBroadcast) {
+    finished = 0;
+    ready    = false;
+
+    for(uint64_t i = 0; i < threads; ++i) {
+        pthread_t thread;
+        int       error = pthread_create(&thread, nullptr, [](void*) -> void* {
+            pthread_mutex_lock(&mutex);
+
+            while(!ready) {
+                pthread_cond_wait(&condvar, &mutex);
+            }
+
+            pthread_mutex_unlock(&mutex);
+
+            __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+            return nullptr;
+        }, nullptr);
+
+        ASSERT_EQ(error, 0);
+    }
+
+    pthread_mutex_lock(&mutex);
+    ready = true;
+    pthread_cond_broadcast(&condvar);
+    pthread_mutex_unlock(&mutex);
+
+    wait_for_threads(threads);
+    EXPECT_EQ(finished, threads);
+}
+
+/* The futex mutex would deadlock relocking itself, so recursive mutexes are
+ * refused instead of being handed out as default ones. */
+TEST(Futex, RecursiveUnsupported) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+
+    EXPECT_EQ(pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE), ENOTSUP);
+    EXPECT_EQ(pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_DEFAULT),   0);
+
+    pthread_mutex_t mutex;
+    EXPECT_EQ(pthread_mutex_init(&mutex, &attr), 0);
+
+    pthread_mutexattr_destroy(&attr);
+}
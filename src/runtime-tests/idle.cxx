@@ -0,0 +1,40 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <sys/syscalls.h>
+
+#include <gtest/gtest.h>
+
+//! Time to sleep, other processes are mostly idle as well in the meantime
+static const uint64_t sleep_ns = 100 * 1000 * 1000;
+
+static uint64_t now(void) {
+    uint64_t ns;
+    sc_do_clock_read(&ns);
+    return ns;
+}
+
+/* While everything sleeps the CPU should be halted instead of spinning, run
+ * this with nothing else busy and watch the host CPU usage of QEMU. */
+TEST(Idle, Residency) {
+    uint64_t idle_before, entries_before, cpus;
+    sc_do_scheduler_idle_stats(&idle_before, &entries_before, &cpus);
+
+    uint64_t start = now();
+    sc_do_scheduler_sleep(sleep_ns);
+    uint64_t end   = now();
+
+    uint64_t idle_after, entries_after;
+    sc_do_scheduler_idle_stats(&idle_after, &entries_after, &cpus);
+
+    uint64_t idle    = idle_after    - idle_before;
+    uint64_t entries = entries_after - entries_before;
+
+    EXPECT_GE(end - start, sleep_ns)    << "slept long enough";
+    EXPECT_GT(entries,     0)           << "went idle while sleeping";
+    EXPECT_LE(idle,        (end - start) * cpus) << "every CPU idle at most while sleeping";
+
+    uint64_t percent = idle * 100 / ((end - start) * cpus);
+    printf("idle for %llu of %llu ns on %llu CPUs (%llu%%), %llu times\n", (unsigned long long)idle, (unsigned long long)(end - start), (unsigned long long)cpus, (unsigned long long)percent, (unsigned long long)entries);
+    RecordProperty("idle_percent", std::to_string(percent));
+}
@@ -0,0 +1,97 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/syscalls.h>
+
+#include <gtest/gtest.h>
+
+//! Messages sent back and forth
+static const uint64_t rounds = 1000;
+
+//! Size of our messages, the user data is a sequence number
+static const size_t message_size = sizeof(Message) + sizeof(uint64_t);
+
+static uint64_t now(void) {
+    uint64_t ns;
+    sc_do_clock_read(&ns);
+    return ns;
+}
+
+static void send(pid_t to, uint64_t sequence) {
+    uint8_t  buffer[message_size];
+    Message* msg = (Message*)buffer;
+    memset(buffer, 0, sizeof(buffer));
+
+    msg->size      = message_size;
+    msg->user_size = sizeof(sequence);
+    msg->type      = MT_UserDefined;
+    memcpy(msg->user_data.raw, &sequence, sizeof(sequence));
+
+    uint64_t error;
+    sc_do_ipc_mq_send(0, to, msg, &error);
+}
+
+/**
+ * Block until the next message arrives on our queue, counting how many polls
+ * that took. Returns its sequence number, -1 for messages not sent by us.
+ */
+static uint64_t receive(uint64_t* polls) {
+    uint8_t  buffer[message_size + 64];
+    Message* msg = (Message*)buffer;
+    uint64_t error;
+
+    do {
+        msg->size = sizeof(buffer);
+        sc_do_ipc_mq_poll(0, true, msg, &error);
+        ++*polls;
+    } while(error == EAGAIN);
+
+    if(error || msg->type != MT_UserDefined) {
+        return (uint64_t)-1;
+    }
+
+    uint64_t sequence;
+    memcpy(&sequence, msg->user_data.raw, sizeof(sequence));
+    return sequence;
+}
+
+/* Two threads sending a message back and forth, each blocking in mq_poll
+ * until the other one answered. A blocked poll returns with the message, so
+ * every receive is a single syscall. */
+TEST(IpcRoundtrip, BlockingPoll) {
+    pid_t parent;
+    sc_do_scheduler_get_pid(false, &parent);
+
+    pthread_t child;
+    int       error = pthread_create(&child, nullptr, [](void* parent) -> void* {
+        uint64_t polls = 0;
+
+        for(uint64_t i = 0; i < rounds; ++i) {
+            send((pid_t)(uint64_t)parent, receive(&polls) + 1);
+        }
+
+        return nullptr;
+    }, (void*)(uint64_t)parent);
+
+    ASSERT_EQ(error, 0);
+
+    uint64_t polls = 0;
+    uint64_t start = now();
+
+    for(uint64_t i = 0; i < rounds; ++i) {
+        send(child, i * 2);
+
+        EXPECT_EQ(receive(&polls), i * 2 + 1);
+    }
+
+    uint64_t ns = (now() - start) / rounds;
+
+    EXPECT_EQ(polls, rounds) << "one poll per message";
+
+    printf("message round trip between two threads: %llu ns, %llu polls for %llu messages\n",
+           (unsigned long long)ns, (unsigned long long)polls, (unsigned long long)rounds);
+    RecordProperty("ns_per_roundtrip", std::to_string(ns));
+}
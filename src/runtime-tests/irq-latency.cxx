@@ -0,0 +1,198 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/syscalls.h>
+#include <sys/io.h>
+
+#include <gtest/gtest.h>
+
+//! COM1, raises IRQ 4 whenever its transmitter gets empty
+static const uint16_t uart_port = 0x3F8;
+static const uint8_t  uart_irq  = 4;
+
+//! Interrupts measured per test
+static const uint64_t rounds = 200;
+
+static volatile bool     stop;
+static volatile uint64_t finished;
+
+static uint64_t now(void) {
+    uint64_t ns;
+    sc_do_clock_read(&ns);
+    return ns;
+}
+
+//! Keep every CPU busy, so a woken process has to take the CPU from someone
+static void start_load(uint64_t threads) {
+    stop     = false;
+    finished = 0;
+
+    for(uint64_t i = 0; i < threads; ++i) {
+        pthread_t thread;
+        int       error = pthread_create(&thread, nullptr, [](void*) -> void* {
+            while(!stop) { }
+
+            __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+            return nullptr;
+        }, nullptr);
+
+        ASSERT_EQ(error, 0);
+    }
+}
+
+static void stop_load(uint64_t threads) {
+    stop = true;
+
+    while(__atomic_load_n(&finished, __ATOMIC_SEQ_CST) < threads) {
+        sc_do_scheduler_sleep(0);
+    }
+}
+
+/* Time from the kernel receiving the interrupt until this process got the
+ * message for it, the part a driver waiting for its device cannot hide. The
+ * UART runs in loopback mode while measuring, so nothing shows up in the log. */
+static void measure(uint64_t* avg, uint64_t* max) {
+    uint64_t error;
+    sc_do_hardware_ioperm(uart_port, 8, true, &error);
+    ASSERT_EQ(error, 0);
+
+    sc_do_hardware_interrupt_notify(uart_irq, true, 0, &error);
+    ASSERT_EQ(error, 0);
+
+    uint8_t  buffer[256];
+    Message* msg = (Message*)buffer;
+
+    uint8_t mcr = inb(uart_port + 4);
+    outb(uart_port + 4, mcr | 0x10); // loopback
+    outb(uart_port + 1, 0x02);       // interrupt on transmitter empty
+
+    uint64_t sum = 0;
+    *max         = 0;
+
+    for(uint64_t i = 0; i < rounds; ++i) {
+        // drop interrupts of earlier writes and messages of exited threads
+        do {
+            msg->size = sizeof(buffer);
+            sc_do_ipc_mq_poll(0, false, msg, &error);
+        } while(error != EAGAIN);
+
+        outb(uart_port, 0);
+
+        do {
+            msg->size = sizeof(buffer);
+            sc_do_ipc_mq_poll(0, true, msg, &error);
+        } while(error == EAGAIN || (error == 0 && msg->type != MT_HardwareInterrupt));
+
+        ASSERT_EQ(error, 0);
+
+        uint64_t latency = now() - msg->user_data.HardwareInterrupt.timestamp_ns;
+        sum += latency;
+
+        if(latency > *max) {
+            *max = latency;
+        }
+
+        inb(uart_port); // loopback received the byte
+    }
+
+    outb(uart_port + 1, 0);
+    outb(uart_port + 4, mcr);
+
+    sc_do_hardware_interrupt_notify(uart_irq, false, 0, &error);
+    sc_do_hardware_ioperm(uart_port, 8, false, &error);
+
+    *avg = sum / rounds;
+}
+
+static uint64_t cpu_count(void) {
+    uint64_t idle, entries, cpus;
+    sc_do_scheduler_idle_stats(&idle, &entries, &cpus);
+    return cpus;
+}
+
+TEST(IrqLatency, InvalidPriority) {
+    uint64_t error;
+    sc_do_scheduler_set_realtime(-1, 64, &error);
+    EXPECT_EQ(error, EINVAL);
+}
+
+TEST(IrqLatency, Fair) {
+    uint64_t cpus = cpu_count();
+    start_load(cpus);
+
+    uint64_t avg, max;
+    measure(&avg, &max);
+
+    stop_load(cpus);
+
+    printf("IRQ to userspace with %llu busy threads, fair class: avg %llu ns, max %llu ns\n",
+           (unsigned long long)cpus, (unsigned long long)avg, (unsigned long long)max);
+    RecordProperty("fair_avg_ns", std::to_string(avg));
+    RecordProperty("fair_max_ns", std::to_string(max));
+}
+
+/* Waking a real-time process preempts whatever runs on its CPU, instead of
+ * waiting for the end of the time slice there. */
+TEST(IrqLatency, RealTime) {
+    uint64_t cpus = cpu_count();
+    start_load(cpus);
+
+    uint64_t error;
+    sc_do_scheduler_set_realtime(-1, 32, &error);
+    ASSERT_EQ(error, 0);
+
+    uint64_t avg, max;
+    measure(&avg, &max);
+
+    sc_do_scheduler_set_realtime(-1, 0, &error);
+    EXPECT_EQ(error, 0);
+
+    stop_load(cpus);
+
+    printf("IRQ to userspace with %llu busy threads, real-time class: avg %llu ns, max %llu ns\n",
+           (unsigned long long)cpus, (unsigned long long)avg, (unsigned long long)max);
+    RecordProperty("realtime_avg_ns", std::to_string(avg));
+    RecordProperty("realtime_max_ns", std::to_string(max));
+}
+
+//! Real-time busy loop, long enough to starve everything else without the real-time budget
+static const uint64_t hog_ns = 3ULL * 1000 * 1000 * 1000;
+
+/* Real-time processes spinning on every CPU still leave fair processes a bit
+ * of every period, so a short sleep ends long before they stop spinning. How
+ * long it took is only reported, it depends on the host running QEMU. */
+TEST(IrqLatency, RealTimeThrottled) {
+    uint64_t cpus = cpu_count();
+    finished      = 0;
+
+    for(uint64_t i = 0; i < cpus; ++i) {
+        pthread_t thread;
+        ASSERT_EQ(pthread_create(&thread, nullptr, [](void*) -> void* {
+            uint64_t start = now();
+            while(now() - start < hog_ns) { }
+
+            __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+            return nullptr;
+        }, nullptr), 0);
+
+        uint64_t error;
+        sc_do_scheduler_set_realtime(thread, 16, &error);
+        ASSERT_EQ(error, 0);
+    }
+
+    uint64_t start = now();
+    sc_do_scheduler_sleep(1000 * 1000);
+    uint64_t slept = now() - start;
+
+    while(__atomic_load_n(&finished, __ATOMIC_SEQ_CST) < cpus) {
+        sc_do_scheduler_sleep(0);
+    }
+
+    printf("1 ms sleep with %llu real-time threads spinning took %llu ns\n",
+           (unsigned long long)cpus, (unsigned long long)slept);
+    RecordProperty("throttled_sleep_ns", std::to_string(slept));
+
+    EXPECT_EQ(finished, cpus) << "every real-time thread finished";
+}
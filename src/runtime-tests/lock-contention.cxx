@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <sys/syscalls.h>
+
+#include <gtest/gtest.h>
+
+//! Threads besides the main thread competing for the same object
+static const uint64_t threads = 4;
+
+//! Number of times each thread takes the lock
+static const uint64_t rounds  = 1000;
+
+static volatile uint64_t counter;
+static volatile uint64_t finished;
+static volatile uint64_t woken;
+
+static uint64_t now(void) {
+    uint64_t ns;
+    sc_do_clock_read(&ns);
+    return ns;
+}
+
+static void wait_for_threads(uint64_t count) {
+    while(__atomic_load_n(&finished, __ATOMIC_SEQ_CST) < count) {
+        sc_do_scheduler_sleep(0);
+    }
+}
+
+static void hammer(uint64_t mutex) {
+    uint64_t error;
+
+    for(uint64_t i = 0; i < rounds; ++i) {
+        sc_do_locking_lock_mutex(mutex, false, &error);
+
+        uint64_t value = counter;
+
+        // give up the CPU while holding the lock every now and then, so others queue up on it
+        if(!(i % 8)) {
+            sc_do_scheduler_sleep(0);
+        }
+
+        counter = value + 1;
+
+        sc_do_locking_unlock_mutex(mutex, &error);
+    }
+
+    __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Every unlock of a contended mutex hands it to the next waiter. With wait
+ * queues in the mutex this costs the same regardless of how many processes
+ * exist, compare the numbers with more threads or unrelated processes running. */
+TEST(LockContention, Mutex) {
+    uint64_t mutex, error;
+    sc_do_locking_create_mutex(&mutex, &error);
+    ASSERT_EQ(error, 0);
+
+    counter  = 0;
+    finished = 0;
+
+    uint64_t start = now();
+
+    for(uint64_t i = 0; i < threads; ++i) {
+        pthread_t thread;
+        ASSERT_EQ(pthread_create(&thread, nullptr, [](void* mutex) -> void* { hammer((uint64_t)mutex); return nullptr; }, (void*)mutex), 0);
+    }
+
+    hammer(mutex);
+    wait_for_threads(threads + 1);
+
+    uint64_t ns = (now() - start) / ((threads + 1) * rounds);
+
+    EXPECT_EQ(counter, (threads + 1) * rounds) << "no update lost";
+
+    printf("contended mutex with %llu threads: %llu ns per lock/unlock\n", (unsigned long long)threads + 1, (unsigned long long)ns);
+    RecordProperty("ns_per_lock", std::to_string(ns));
+
+    sc_do_locking_destroy_mutex(mutex, &error);
+    EXPECT_EQ(error, 0);
+}
+
+TEST(LockContention, CondvarBroadcast) {
+    uint64_t condvar, error;
+    sc_do_locking_create_condvar(&condvar, &error);
+    ASSERT_EQ(error, 0);
+
+    woken    = 0;
+    finished = 0;
+
+    for(uint64_t i = 0; i < threads; ++i) {
+        pthread_t thread;
+        ASSERT_EQ(pthread_create(&thread, nullptr, [](void* condvar) -> void* {
+            uint64_t error;
+
+            __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+            sc_do_locking_wait_condvar((uint64_t)condvar, 0, 0, &error);
+            __atomic_fetch_add(&woken, 1, __ATOMIC_SEQ_CST);
+            return nullptr;
+        }, (void*)condvar), 0);
+    }
+
+    wait_for_threads(threads);
+
+    // a thread might have been preempted between counting itself and waiting, signal until all are through
+    uint64_t start = now();
+
+    while(__atomic_load_n(&woken, __ATOMIC_SEQ_CST) < threads) {
+        sc_do_locking_signal_condvar(condvar, threads, &error);
+        sc_do_scheduler_sleep(0);
+    }
+
+    uint64_t ns = now() - start;
+
+    printf("condvar broadcast to %llu threads: %llu ns until all ran\n", (unsigned long long)threads, (unsigned long long)ns);
+    RecordProperty("ns_broadcast", std::to_string(ns));
+
+    sc_do_locking_destroy_condvar(condvar, &error);
+    EXPECT_EQ(error, 0) << "no waiters left";
+}
@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <sys/syscalls.h>
+
+#include <gtest/gtest.h>
+
+//! Mutexes existing while the thread exits, none of them held by it
+static const uint64_t idle_mutexes = 4000;
+
+//! Mutexes the exiting thread holds
+static const uint64_t held_mutexes = 16;
+
+static uint64_t          mutexes[idle_mutexes + held_mutexes];
+static volatile uint64_t locked;
+static volatile uint64_t exit_ns;
+
+static uint64_t now(void) {
+    uint64_t ns;
+    sc_do_clock_read(&ns);
+    return ns;
+}
+
+/* A thread exits while holding a few mutexes, with thousands of others
+ * existing. Cleanup only walks the mutexes the thread held, so the time until
+ * a waiter gets its mutex should not grow with the number of mutexes. */
+TEST(MutexExit, UnlockOnExit) {
+    uint64_t error;
+
+    for(uint64_t i = 0; i < idle_mutexes + held_mutexes; ++i) {
+        sc_do_locking_create_mutex(&mutexes[i], &error);
+        ASSERT_EQ(error, 0);
+    }
+
+    uint64_t* held = mutexes + idle_mutexes;
+    locked         = 0;
+
+    pthread_t thread;
+    ASSERT_EQ(pthread_create(&thread, nullptr, [](void*) -> void* {
+        uint64_t  error;
+        uint64_t* held = mutexes + idle_mutexes;
+
+        for(uint64_t i = 0; i < held_mutexes; ++i) {
+            sc_do_locking_lock_mutex(held[i], false, &error);
+        }
+
+        __atomic_store_n(&locked, 1, __ATOMIC_SEQ_CST);
+
+        // give the parent time to queue up on the mutex
+        sc_do_scheduler_sleep(10000000);
+
+        // exits holding all of them
+        exit_ns = now();
+        return nullptr;
+    }, nullptr), 0);
+
+    while(!__atomic_load_n(&locked, __ATOMIC_SEQ_CST)) {
+        sc_do_scheduler_sleep(0);
+    }
+
+    // blocks until the kernel unlocked it for the exited thread
+    sc_do_locking_lock_mutex(held[held_mutexes - 1], false, &error);
+    ASSERT_EQ(error, 0);
+
+    uint64_t ns = now() - exit_ns;
+
+    sc_do_locking_unlock_mutex(held[held_mutexes - 1], &error);
+
+    for(uint64_t i = 0; i < held_mutexes; ++i) {
+        sc_do_locking_lock_mutex(held[i], true, &error);
+        EXPECT_EQ(error, 0) << "mutex " << i << " released on exit";
+
+        sc_do_locking_unlock_mutex(held[i], &error);
+    }
+
+    for(uint64_t i = 0; i < idle_mutexes + held_mutexes; ++i) {
+        sc_do_locking_destroy_mutex(mutexes[i], &error);
+        EXPECT_EQ(error, 0);
+    }
+
+    printf("thread holding %llu of %llu mutexes exited, waiter got its mutex after %llu ns\n",
+           (unsigned long long)held_mutexes, (unsigned long long)(idle_mutexes + held_mutexes),
+           (unsigned long long)ns);
+    RecordProperty("exit_unlock_ns", std::to_string(ns));
+}
@@ -0,0 +1,105 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <sys/syscalls.h>
+
+#include <gtest/gtest.h>
+
+//! More threads than a fixed table of 4096 processes could ever have held
+static const uint64_t total = 5000;
+
+//! Threads alive at the same time
+static const uint64_t batch = 64;
+
+static volatile uint64_t finished;
+
+static uint64_t now(void) {
+    uint64_t ns;
+    sc_do_clock_read(&ns);
+    return ns;
+}
+
+/* Exited processes are freed, so their memory and PIDs are available again
+ * and starting threads over and over never runs out of them. */
+TEST(ProcessTable, StartAndExit) {
+    finished = 0;
+
+    pid_t    highest = 0;
+    uint64_t start   = now();
+
+    for(uint64_t started = 0; started < total; started += batch) {
+        for(uint64_t i = 0; i < batch; ++i) {
+            pthread_t thread;
+            ASSERT_EQ(pthread_create(&thread, nullptr, [](void*) -> void* { __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST); return nullptr; }, nullptr), 0);
+
+            if((pid_t)thread > highest) {
+                highest = thread;
+            }
+        }
+
+        while(__atomic_load_n(&finished, __ATOMIC_SEQ_CST) < started + batch) {
+            sc_do_scheduler_sleep(0);
+        }
+    }
+
+    uint64_t ns = (now() - start) / total;
+
+    printf("%llu threads started and exited, highest PID %lld: %llu ns per thread\n",
+           (unsigned long long)total, (long long)highest, (unsigned long long)ns);
+    RecordProperty("ns_per_thread", std::to_string(ns));
+}
+
+static uint64_t          exit_mutex;
+static volatile uint64_t locked;
+static volatile uint64_t stack_address;
+static volatile uint8_t  stack_stale;
+
+//! Uses a bit of stack and exits holding exit_mutex, which the kernel unlocks after freeing the stack
+static void* use_stack(void*) {
+    uint64_t error;
+    sc_do_locking_lock_mutex(exit_mutex, false, &error);
+
+    volatile uint8_t buffer[8192];
+    stack_address = (uint64_t)buffer;
+    stack_stale   = buffer[0];
+    buffer[0]     = 0x55;
+
+    __atomic_store_n(&locked, 1, __ATOMIC_SEQ_CST);
+    return nullptr;
+}
+
+/* The stack region of an exited thread is unmapped and given to the next
+ * thread, which finds it empty. */
+TEST(ProcessTable, ThreadStackReuse) {
+    uint64_t error;
+    sc_do_locking_create_mutex(&exit_mutex, &error);
+    ASSERT_EQ(error, 0);
+
+    uint64_t addresses[2];
+    uint8_t  stale[2];
+
+    for(int i = 0; i < 2; ++i) {
+        locked = 0;
+
+        pthread_t thread;
+        ASSERT_EQ(pthread_create(&thread, nullptr, use_stack, nullptr), 0);
+
+        while(!__atomic_load_n(&locked, __ATOMIC_SEQ_CST)) {
+            sc_do_scheduler_sleep(0);
+        }
+
+        // blocks until the thread exited
+        sc_do_locking_lock_mutex(exit_mutex, false, &error);
+        ASSERT_EQ(error, 0);
+        sc_do_locking_unlock_mutex(exit_mutex, &error);
+
+        addresses[i] = stack_address;
+        stale[i]     = stack_stale;
+    }
+
+    sc_do_locking_destroy_mutex(exit_mutex, &error);
+
+    EXPECT_EQ(addresses[0], addresses[1]) << "stack region reused";
+    EXPECT_EQ(stale[1], 0) << "reused stack region starts empty";
+}
@@ -0,0 +1,176 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <sys/syscalls.h>
+
+#include <gtest/gtest.h>
+
+//! Consumers waiting for items at the same time
+static const uint64_t consumers = 16;
+
+//! Items produced per broadcast, fewer than consumers so most go back to waiting
+static const uint64_t batch = 4;
+
+//! Items produced in total
+static const uint64_t items = 4000;
+
+static volatile uint64_t available;
+static volatile uint64_t consumed;
+static volatile uint64_t finished;
+static volatile bool     done;
+
+static uint64_t now(void) {
+    uint64_t ns;
+    sc_do_clock_read(&ns);
+    return ns;
+}
+
+static void wait_for_consumers(void) {
+    while(__atomic_load_n(&finished, __ATOMIC_SEQ_CST) < consumers) {
+        sc_do_scheduler_sleep(0);
+    }
+}
+
+static void reset(void) {
+    available = 0;
+    consumed  = 0;
+    finished  = 0;
+    done      = false;
+}
+
+static pthread_mutex_t mutex   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  condvar = PTHREAD_COND_INITIALIZER;
+
+static void consume(void) {
+    pthread_mutex_lock(&mutex);
+
+    while(true) {
+        while(!available && !done) {
+            pthread_cond_wait(&condvar, &mutex);
+        }
+
+        if(!available) {
+            break;
+        }
+
+        --available;
+        ++consumed;
+    }
+
+    pthread_mutex_unlock(&mutex);
+    __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Broadcasts move the waiters over to the mutex instead of waking them all
+ * at once, so they take it one after another instead of all but one of
+ * them going straight back to sleep. */
+TEST(ProducerConsumer, Pthread) {
+    reset();
+
+    for(uint64_t i = 0; i < consumers; ++i) {
+        pthread_t thread;
+        ASSERT_EQ(pthread_create(&thread, nullptr, [](void*) -> void* { consume(); return nullptr; }, nullptr), 0);
+    }
+
+    uint64_t start = now();
+
+    for(uint64_t produced = 0; produced < items; produced += batch) {
+        pthread_mutex_lock(&mutex);
+        available += batch;
+        pthread_cond_broadcast(&condvar);
+        pthread_mutex_unlock(&mutex);
+
+        // let the consumers catch up, the queue is unbounded otherwise
+        while(__atomic_load_n(&available, __ATOMIC_SEQ_CST)) {
+            sc_do_scheduler_sleep(0);
+        }
+    }
+
+    uint64_t ns = (now() - start) / items;
+
+    pthread_mutex_lock(&mutex);
+    done = true;
+    pthread_cond_broadcast(&condvar);
+    pthread_mutex_unlock(&mutex);
+
+    wait_for_consumers();
+    EXPECT_EQ(consumed, items);
+
+    printf("pthread producer/consumer with %llu consumers: %llu ns per item\n", (unsigned long long)consumers, (unsigned long long)ns);
+    RecordProperty("pthread_ns_per_item", std::to_string(ns));
+}
+
+static void consume_kernel(uint64_t kernel_mutex, uint64_t kernel_condvar) {
+    uint64_t error;
+    sc_do_locking_lock_mutex(kernel_mutex, false, &error);
+
+    while(true) {
+        // a signaled waiter holds the mutex again when it continues
+        while(!available && !done) {
+            sc_do_locking_wait_condvar(kernel_condvar, 0, kernel_mutex, &error);
+        }
+
+        if(!available) {
+            break;
+        }
+
+        --available;
+        ++consumed;
+    }
+
+    sc_do_locking_unlock_mutex(kernel_mutex, &error);
+    __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Same with the kernel condvar, which hands the mutex to signaled waiters
+ * or queues them up on it. */
+TEST(ProducerConsumer, Kernel) {
+    uint64_t kernel_mutex, kernel_condvar, error;
+    sc_do_locking_create_mutex(&kernel_mutex, &error);
+    ASSERT_EQ(error, 0);
+    sc_do_locking_create_condvar(&kernel_condvar, &error);
+    ASSERT_EQ(error, 0);
+
+    reset();
+
+    // stays valid until the consumers are done
+    uint64_t handles[2] = { kernel_mutex, kernel_condvar };
+
+    for(uint64_t i = 0; i < consumers; ++i) {
+        pthread_t thread;
+        ASSERT_EQ(pthread_create(&thread, nullptr, [](void* handles) -> void* {
+            consume_kernel(((uint64_t*)handles)[0], ((uint64_t*)handles)[1]);
+            return nullptr;
+        }, handles), 0);
+    }
+
+    uint64_t start = now();
+
+    for(uint64_t produced = 0; produced < items; produced += batch) {
+        sc_do_locking_lock_mutex(kernel_mutex, false, &error);
+        available += batch;
+        sc_do_locking_signal_condvar(kernel_condvar, consumers, &error);
+        sc_do_locking_unlock_mutex(kernel_mutex, &error);
+
+        while(__atomic_load_n(&available, __ATOMIC_SEQ_CST)) {
+            sc_do_scheduler_sleep(0);
+        }
+    }
+
+    uint64_t ns = (now() - start) / items;
+
+    sc_do_locking_lock_mutex(kernel_mutex, false, &error);
+    done = true;
+    sc_do_locking_signal_condvar(kernel_condvar, consumers, &error);
+    sc_do_locking_unlock_mutex(kernel_mutex, &error);
+
+    wait_for_consumers();
+    EXPECT_EQ(consumed, items);
+
+    printf("kernel condvar producer/consumer with %llu consumers: %llu ns per item\n", (unsigned long long)consumers, (unsigned long long)ns);
+    RecordProperty("kernel_ns_per_item", std::to_string(ns));
+
+    sc_do_locking_destroy_condvar(kernel_condvar, &error);
+    sc_do_locking_destroy_mutex(kernel_mutex, &error);
+}
@@ -0,0 +1,200 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <sys/syscalls.h>
+
+#include <gtest/gtest.h>
+
+//! Lock operations per thread
+static const uint64_t rounds = 2000;
+
+//! One in this many operations writes
+static const uint64_t write_every = 64;
+
+//! Entries of the shared state readers look at
+static const uint64_t entries = 64;
+
+static volatile uint64_t shared_state[entries];
+static volatile uint64_t finished;
+static volatile uint64_t torn;
+
+static uint64_t now(void) {
+    uint64_t ns;
+    sc_do_clock_read(&ns);
+    return ns;
+}
+
+static void wait_for_threads(uint64_t count) {
+    while(__atomic_load_n(&finished, __ATOMIC_SEQ_CST) < count) {
+        sc_do_scheduler_sleep(0);
+    }
+}
+
+//! Readers check all entries are equal, writers increment all of them
+static void access_state(bool write) {
+    if(write) {
+        for(uint64_t i = 0; i < entries; ++i) {
+            ++shared_state[i];
+        }
+    }
+    else {
+        for(uint64_t i = 1; i < entries; ++i) {
+            if(shared_state[i] != shared_state[0]) {
+                __atomic_fetch_add(&torn, 1, __ATOMIC_SEQ_CST);
+            }
+        }
+    }
+}
+
+static void read_mostly_rwlock(pthread_rwlock_t* rwlock) {
+    for(uint64_t i = 0; i < rounds; ++i) {
+        bool write = !(i % write_every);
+
+        if(write) {
+            pthread_rwlock_wrlock(rwlock);
+        }
+        else {
+            pthread_rwlock_rdlock(rwlock);
+        }
+
+        access_state(write);
+        pthread_rwlock_unlock(rwlock);
+    }
+
+    __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+}
+
+static void read_mostly_mutex(uint64_t mutex) {
+    uint64_t error;
+
+    for(uint64_t i = 0; i < rounds; ++i) {
+        sc_do_locking_lock_mutex(mutex, false, &error);
+        access_state(!(i % write_every));
+        sc_do_locking_unlock_mutex(mutex, &error);
+    }
+
+    __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+}
+
+//! Run threads doing read-mostly work at the same time, returns ns per operation
+static uint64_t measure(uint64_t threads, bool use_rwlock) {
+    pthread_rwlock_t rwlock;
+    EXPECT_EQ(pthread_rwlock_init(&rwlock, 0), 0);
+
+    uint64_t mutex, error;
+    sc_do_locking_create_mutex(&mutex, &error);
+    EXPECT_EQ(error, 0);
+
+    finished = 0;
+    torn     = 0;
+
+    uint64_t start = now();
+
+    for(uint64_t i = 0; i < threads; ++i) {
+        pthread_t thread;
+        int       created = use_rwlock ? pthread_create(&thread, nullptr, [](void* rwlock) -> void* { read_mostly_rwlock((pthread_rwlock_t*)rwlock); return nullptr; }, &rwlock)
+                                       : pthread_create(&thread, nullptr, [](void* mutex) -> void* { read_mostly_mutex((uint64_t)mutex); return nullptr; }, (void*)mutex);
+
+        EXPECT_EQ(created, 0);
+    }
+
+    wait_for_threads(threads);
+
+    uint64_t ns = (now() - start) / (threads * rounds);
+
+    EXPECT_EQ(torn, 0) << "readers never see a write in progress";
+    EXPECT_EQ(pthread_rwlock_destroy(&rwlock), 0) << "unlocked at the end";
+
+    sc_do_locking_destroy_mutex(mutex, &error);
+    return ns;
+}
+
+/* Readers share the lock, only writers need it for themselves. With a mutex
+ * every reader waits for every other one instead. */
+TEST(RWLock, ReadMostlyScaling) {
+    for(uint64_t threads = 1; threads <= 8; threads *= 2) {
+        uint64_t rwlock_ns = measure(threads, true);
+        uint64_t mutex_ns  = measure(threads, false);
+
+        printf("%llu threads, 1 in %llu writing: rwlock %llu ns, mutex %llu ns per operation\n",
+               (unsigned long long)threads, (unsigned long long)write_every,
+               (unsigned long long)rwlock_ns, (unsigned long long)mutex_ns);
+        RecordProperty("rwlock_ns_" + std::to_string(threads), std::to_string(rwlock_ns));
+        RecordProperty("mutex_ns_" + std::to_string(threads), std::to_string(mutex_ns));
+    }
+}
+
+TEST(RWLock, WriterExcludesReaders) {
+    pthread_rwlock_t rwlock;
+    ASSERT_EQ(pthread_rwlock_init(&rwlock, 0), 0);
+
+    EXPECT_EQ(pthread_rwlock_rdlock(&rwlock), 0);
+    EXPECT_EQ(pthread_rwlock_tryrdlock(&rwlock), 0) << "readers share the lock";
+    EXPECT_EQ(pthread_rwlock_trywrlock(&rwlock), EBUSY);
+    EXPECT_EQ(pthread_rwlock_unlock(&rwlock), 0);
+    EXPECT_EQ(pthread_rwlock_unlock(&rwlock), 0);
+
+    EXPECT_EQ(pthread_rwlock_wrlock(&rwlock), 0);
+    EXPECT_EQ(pthread_rwlock_tryrdlock(&rwlock), EDEADLK) << "already held for writing";
+    EXPECT_EQ(pthread_rwlock_unlock(&rwlock), 0);
+    EXPECT_EQ(pthread_rwlock_unlock(&rwlock), EPERM) << "not locked anymore";
+
+    EXPECT_EQ(pthread_rwlock_destroy(&rwlock), 0);
+}
+
+static pthread_rwlock_t holder_rwlock;
+static volatile uint64_t holder_done;
+
+/* Read locks belong to the processes holding them: others cannot release
+ * them, and they are released when their holder exits. */
+TEST(RWLock, HolderTracking) {
+    ASSERT_EQ(pthread_rwlock_init(&holder_rwlock, 0), 0);
+
+    holder_done = 0;
+
+    pthread_t thread;
+    ASSERT_EQ(pthread_create(&thread, nullptr, [](void*) -> void* {
+        EXPECT_EQ(pthread_rwlock_rdlock(&holder_rwlock), 0);
+        __atomic_store_n(&holder_done, 1, __ATOMIC_SEQ_CST);
+        return nullptr;
+    }, nullptr), 0);
+
+    while(!__atomic_load_n(&holder_done, __ATOMIC_SEQ_CST)) {
+        sc_do_scheduler_sleep(0);
+    }
+
+    EXPECT_EQ(pthread_rwlock_unlock(&holder_rwlock), EPERM) << "read lock held by another thread";
+
+    // blocks until the thread exited
+    EXPECT_EQ(pthread_rwlock_wrlock(&holder_rwlock), 0) << "read lock released on exit";
+    EXPECT_EQ(pthread_rwlock_unlock(&holder_rwlock), 0);
+
+    EXPECT_EQ(pthread_rwlock_destroy(&holder_rwlock), 0);
+}
+
+TEST(Semaphore, Counting) {
+    sem_t sem;
+    ASSERT_EQ(sem_init(&sem, 0, 2), 0);
+
+    EXPECT_EQ(sem_trywait(&sem), 0);
+    EXPECT_EQ(sem_trywait(&sem), 0);
+    EXPECT_EQ(sem_trywait(&sem), -1);
+    EXPECT_EQ(errno, EAGAIN);
+
+    finished = 0;
+
+    pthread_t thread;
+    ASSERT_EQ(pthread_create(&thread, nullptr, [](void* sem) -> void* {
+        sem_post((sem_t*)sem);
+        __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+        return nullptr;
+    }, &sem), 0);
+
+    EXPECT_EQ(sem_wait(&sem), 0) << "woken by the post of the other thread";
+
+    wait_for_threads(1);
+    EXPECT_EQ(sem_destroy(&sem), 0);
+}
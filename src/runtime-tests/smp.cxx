@@ -0,0 +1,122 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/syscalls.h>
+
+#include <gtest/gtest.h>
+
+//! Loop iterations of one piece of work, some tens of milliseconds under QEMU
+static const uint64_t iterations = 20 * 1000 * 1000;
+
+static volatile uint64_t finished;
+
+static uint64_t now(void) {
+    uint64_t ns;
+    sc_do_clock_read(&ns);
+    return ns;
+}
+
+static uint64_t cpus(void) {
+    uint64_t idle_ns, entries, cpus;
+    sc_do_scheduler_idle_stats(&idle_ns, &entries, &cpus);
+    return cpus;
+}
+
+static void work(void) {
+    for(volatile uint64_t i = 0; i < iterations; ++i) { }
+}
+
+//! Block until a child process exited, the kernel sends us SIGCHLD for that
+static void wait_child(void) {
+    uint8_t  buffer[sizeof(Message) + 64];
+    Message* msg = (Message*)buffer;
+    uint64_t error;
+
+    do {
+        msg->size = sizeof(buffer);
+        sc_do_ipc_mq_poll(0, true, msg, &error);
+    } while(error == EAGAIN || (!error && msg->type != MT_Signal));
+}
+
+/* One piece of work per CPU, done by threads or by forked processes. With the
+ * application processors running them in parallel this takes about as long as
+ * a single piece of work. Run with QEMU_CPUS > 1, see helper_targets.cmake.
+ * Returns the speedup over doing all of it alone in percent, only reported as
+ * it depends on the host running QEMU; finished counts the workers done. */
+static uint64_t measure_speedup(bool share_memory) {
+    uint64_t workers = cpus();
+
+    uint64_t start = now();
+    work();
+    uint64_t single = now() - start;
+
+    finished = 0;
+    start    = now();
+
+    for(uint64_t i = 0; i < workers; ++i) {
+        pid_t pid;
+
+        if(share_memory) {
+            pthread_t thread;
+            pid = pthread_create(&thread, nullptr, [](void*) -> void* {
+                work();
+                __atomic_fetch_add(&finished, 1, __ATOMIC_SEQ_CST);
+                return nullptr;
+            }, nullptr) ? -1 : thread;
+        }
+        else {
+            sc_do_scheduler_clone(false, 0, 0, &pid);
+
+            if(pid == 0) {
+                work();
+                sc_do_scheduler_exit(0);
+            }
+        }
+
+        EXPECT_GT(pid, 0);
+    }
+
+    if(share_memory) {
+        while(__atomic_load_n(&finished, __ATOMIC_SEQ_CST) < workers) {
+            sc_do_scheduler_sleep(0);
+        }
+    }
+    else {
+        for(uint64_t i = 0; i < workers; ++i) {
+            wait_child();
+            ++finished;
+        }
+    }
+
+    uint64_t parallel = now() - start;
+
+    return single * workers * 100 / parallel;
+}
+
+TEST(Smp, CpusRunning) {
+    uint64_t count = cpus();
+    printf("%llu CPUs running\n", (unsigned long long)count);
+    RecordProperty("cpus", std::to_string(count));
+
+    EXPECT_GT(count, 1) << "application processors started";
+}
+
+TEST(Smp, Threads) {
+    uint64_t speedup = measure_speedup(true);
+    printf("%llu threads on %llu CPUs: speedup %llu%%\n", (unsigned long long)cpus(), (unsigned long long)cpus(), (unsigned long long)speedup);
+    RecordProperty("speedup_percent", std::to_string(speedup));
+
+    EXPECT_GT(cpus(), 1) << "application processors started";
+    EXPECT_EQ(finished, cpus()) << "every thread finished";
+}
+
+TEST(Smp, Processes) {
+    uint64_t speedup = measure_speedup(false);
+    printf("%llu processes on %llu CPUs: speedup %llu%%\n", (unsigned long long)cpus(), (unsigned long long)cpus(), (unsigned long long)speedup);
+    RecordProperty("speedup_percent", std::to_string(speedup));
+
+    EXPECT_GT(cpus(), 1) << "application processors started";
+    EXPECT_EQ(finished, cpus()) << "every process finished";
+}
@@ -0,0 +1,37 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <sys/syscalls.h>
+
+#include <gtest/gtest.h>
+
+//! Syscalls made per measurement
+static const uint64_t rounds = 100000;
+
+static uint64_t now(void) {
+    uint64_t ns;
+    sc_do_clock_read(&ns);
+    return ns;
+}
+
+/* get_pid does nearly nothing in the kernel, so this is mostly the cost of
+ * entering and leaving it. It neither blocks nor switches processes and
+ * returns with sysretq. */
+TEST(SyscallLatency, GetPid) {
+    pid_t expected;
+    sc_do_scheduler_get_pid(false, &expected);
+
+    uint64_t start = now();
+
+    for(uint64_t i = 0; i < rounds; ++i) {
+        pid_t pid;
+        sc_do_scheduler_get_pid(false, &pid);
+        ASSERT_EQ(pid, expected);
+    }
+
+    uint64_t ns = (now() - start) / rounds;
+
+    printf("null syscall (get_pid): %llu ns\n", (unsigned long long)ns);
+    RecordProperty("ns_per_syscall", std::to_string(ns));
+}
+
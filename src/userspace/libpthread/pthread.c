@@ -1,8 +1,64 @@
 #include <pthread.h>
 #include <errno.h>
+#include <stdbool.h>
+
+#include <sys/syscalls.h>
+
+//! Maximum number of threads being started at the same time
+#define PTHREAD_START_SLOTS 64
+
+/* Function and argument of a thread being started. Clone only passes one
+ * argument, so the new thread gets a slot and gives it back once it copied
+ * both out. No malloc here, as the new thread would free concurrently. */
+static struct __pthread_start {
+    void*(*start)(void*);
+    void*  arg;
+
+    volatile bool used;
+} __pthread_starts[PTHREAD_START_SLOTS];
+
+static void __attribute__((noreturn)) __pthread_entry(struct __pthread_start* slot) {
+    void*(*start)(void*) = slot->start;
+    void*  arg           = slot->arg;
+
+    __atomic_store_n(&slot->used, false, __ATOMIC_RELEASE);
+
+    start(arg);
+    sc_do_scheduler_exit(0);
+
+    while(1) { }
+}
 
 int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void*(*start)(void*), void* arg) {
-    return EINVAL;
+    struct __pthread_start* slot = 0;
+
+    for(int i = 0; i < PTHREAD_START_SLOTS && !slot; ++i) {
+        bool unused = false;
+
+        if(__atomic_compare_exchange_n(&__pthread_starts[i].used, &unused, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            slot = &__pthread_starts[i];
+        }
+    }
+
+    if(!slot) {
+        return EAGAIN;
+    }
+
+    slot->start = start;
+    slot->arg   = arg;
+
+    pid_t pid;
+    sc_do_scheduler_clone(true, (void*)__pthread_entry, slot, &pid);
+
+    if(pid < 0) {
+        __atomic_store_n(&slot->used, false, __ATOMIC_RELEASE);
+
+        // out of stack regions or processes is a temporary lack of resources
+        return pid == -ENOMEM ? EAGAIN : -pid;
+    }
+
+    *thread = pid;
+    return 0;
 }
 
 int pthread_cancel(pthread_t thread) {
@@ -20,11 +76,7 @@ int pthread_equal(pthread_t a, pthread_t b) {
 int pthread_once(pthread_once_t* once_control, void(*f)(void)) {
     int e;
 
-    if(!once_control->exec_mutex) {
-        if((e = pthread_mutex_init(&once_control->exec_mutex, 0))) {
-            return e;
-        }
-    }
+    // a zeroed mutex is unlocked, nothing to initialize
     if((e = pthread_mutex_lock(&once_control->exec_mutex))) {
         return e;
     }
@@ -1,69 +1,97 @@
 #include <pthread.h>
 #include <errno.h>
+#include <stdint.h>
 
 #include <sys/syscalls.h>
 
-int pthread_cond_init (pthread_cond_t *condvar, const pthread_condattr_t *attributes) {
-    // XXX: do something with the attributes
+/* Condvars are a futex word in user space. The lowest bit is set while
+ * processes may be waiting, the next 19 bits are a sequence number
+ * incremented on every signal and the upper bits hold the address of the
+ * mutex the waiters use. Broadcasts wake one waiter and move the others
+ * over to the mutex, instead of waking all of them to fight for it.
+ * Signals without anybody waiting don't enter the kernel. */
 
-    uint64_t e = 0;
-    sc_do_locking_create_condvar(condvar, &e);
-    return e;
+#define COND_WAITERS     0x00001ULL
+#define COND_SEQUENCE    0xFFFFEULL
+#define COND_MUTEX_SHIFT 17
+
+// see pthread_mutex.c
+int __pthread_mutex_lock_contended(pthread_mutex_t *mutex);
+
+//! Condvar value after a signal, the sequence number wraps without touching the mutex
+static pthread_cond_t __pthread_cond_signaled(pthread_cond_t c) {
+    return (c & ~COND_SEQUENCE) | ((c + 2) & COND_SEQUENCE);
 }
 
-int pthread_cond_destroy (pthread_cond_t *condvar) {
-    uint64_t e = 0;
-    sc_do_locking_destroy_condvar(*condvar, &e);
-    return e;
+//! Mutex stored in the condvar value, mutexes are 8 byte aligned user space addresses
+static pthread_mutex_t* __pthread_cond_mutex(pthread_cond_t c) {
+    return (pthread_mutex_t*)((c & ~(COND_SEQUENCE | COND_WAITERS)) >> COND_MUTEX_SHIFT);
 }
 
-static int __pthread_ensure_condvar(pthread_cond_t* condvar) {
-    if(!*condvar) {
-        return pthread_cond_init(condvar, 0);
-    }
+int pthread_cond_init (pthread_cond_t *condvar, const pthread_condattr_t *attributes) {
+    // XXX: do something with the attributes
+
+    __atomic_store_n(condvar, 0, __ATOMIC_RELEASE);
+    return 0;
+}
 
+int pthread_cond_destroy (pthread_cond_t *condvar) {
     return 0;
 }
 
 int pthread_cond_signal (pthread_cond_t *condvar) {
-    uint64_t e = 0;
+    pthread_cond_t c = __atomic_load_n(condvar, __ATOMIC_RELAXED);
 
-    if((e = __pthread_ensure_condvar(condvar))) {
-        return e;
+    // the waiters bit stays set, others may still wait
+    while(!__atomic_compare_exchange_n(condvar, &c, __pthread_cond_signaled(c), false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) { }
+
+    if(!(c & COND_WAITERS)) {
+        return 0;
     }
 
-    sc_do_locking_signal_condvar(*condvar, 1, &e); // XXX: check if amount = 1 is correct with POSIX.1c
+    uint64_t woken, e = 0;
+    sc_do_locking_futex_wake(condvar, 1, &woken, &e);
     return e;
 }
 
 int pthread_cond_broadcast (pthread_cond_t *condvar) {
-    uint64_t e = 0;
+    pthread_cond_t c = __atomic_load_n(condvar, __ATOMIC_RELAXED);
 
-    if((e = __pthread_ensure_condvar(condvar))) {
-        return e;
+    // wakes everybody, so nobody is waiting anymore
+    while(!__atomic_compare_exchange_n(condvar, &c, __pthread_cond_signaled(c) & ~COND_WAITERS, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) { }
+
+    if(!(c & COND_WAITERS)) {
+        return 0;
     }
 
-    sc_do_locking_signal_condvar(*condvar, 0, &e);
+    uint64_t moved, e = 0;
+    sc_do_locking_futex_requeue(condvar, UINT64_MAX, __pthread_cond_mutex(c), &moved, &e);
     return e;
 }
 
 int pthread_cond_wait (pthread_cond_t *cond, pthread_mutex_t *mutex) {
-    uint64_t e = 0;
+    uint64_t       e   = 0;
+    pthread_cond_t c   = __atomic_load_n(cond, __ATOMIC_RELAXED);
+    pthread_cond_t seq;
+
+    do {
+        seq = (c & COND_SEQUENCE) | COND_WAITERS | ((uint64_t)mutex << COND_MUTEX_SHIFT);
+    } while(!__atomic_compare_exchange_n(cond, &c, seq, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
 
     if((e = pthread_mutex_unlock(mutex))) {
         return e;
     }
 
-    if((e = __pthread_ensure_condvar(cond))) {
-        return e;
-    }
+    // EAGAIN when signaled between unlocking and waiting
+    sc_do_locking_futex_wait(cond, seq, &e);
+
+    uint64_t lock_error = __pthread_mutex_lock_contended(mutex);
 
-    sc_do_locking_wait_condvar(*cond, 0, &e);
-    if(e) {
+    if(e && e != EAGAIN) {
         return e;
     }
 
-    return pthread_mutex_lock(mutex);
+    return lock_error;
 }
 
 int pthread_cond_timedwait (pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime) {
@@ -1,55 +1,79 @@
 #include <pthread.h>
 #include <errno.h>
+#include <stdbool.h>
 
 #include <sys/syscalls.h>
 
+/* Mutexes are a futex word in user space: 0 when unlocked, 1 when locked
+ * and 2 when locked with processes possibly waiting. Locking and unlocking
+ * only enter the kernel when they have to wait or wake somebody. */
+
 int pthread_mutex_init (pthread_mutex_t *mutex, const pthread_mutexattr_t *attr) {
-    // XXX: do something with the attributes
+    if(attr && attr->type != PTHREAD_MUTEX_DEFAULT) {
+        return ENOTSUP;
+    }
 
-    uint64_t e = 0;
-    sc_do_locking_create_mutex(mutex, &e);
-    return e;
+    __atomic_store_n(mutex, 0, __ATOMIC_RELEASE);
+    return 0;
 }
 
 int pthread_mutex_destroy (pthread_mutex_t *mutex) {
-    uint64_t e = 0;
-    sc_do_locking_destroy_mutex(*mutex, &e);
-    return e;
+    if(__atomic_load_n(mutex, __ATOMIC_ACQUIRE)) {
+        return EBUSY;
+    }
+
+    return 0;
 }
 
-static int __pthread_ensure_mutex(pthread_mutex_t* mutex) {
-    if(!*mutex) {
-        return pthread_mutex_init(mutex, 0);
+/* Lock the mutex, marking it contended so the unlock wakes the next waiter.
+ * pthread_cond_wait uses this directly, as other waiters may have been
+ * moved over to the mutex. */
+int __pthread_mutex_lock_contended(pthread_mutex_t *mutex) {
+    pthread_mutex_t c = __atomic_exchange_n(mutex, 2, __ATOMIC_ACQUIRE);
+
+    while(c) {
+        uint64_t e = 0;
+        sc_do_locking_futex_wait(mutex, 2, &e);
+
+        if(e && e != EAGAIN) {
+            return e;
+        }
+
+        c = __atomic_exchange_n(mutex, 2, __ATOMIC_ACQUIRE);
     }
 
     return 0;
 }
 
 int pthread_mutex_lock (pthread_mutex_t *mutex) {
-    uint64_t e = 0;
-    if((e = __pthread_ensure_mutex(mutex))) {
-        return e;
+    pthread_mutex_t c = 0;
+
+    if(__atomic_compare_exchange_n(mutex, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
     }
 
-    e = 0;
-    sc_do_locking_lock_mutex(*mutex, 0, &e);
-    return e;
+    return __pthread_mutex_lock_contended(mutex);
 }
 
 int pthread_mutex_trylock (pthread_mutex_t *mutex) {
-    uint64_t e = 0;
-    if((e = __pthread_ensure_mutex(mutex))) {
-        return e;
+    pthread_mutex_t c = 0;
+
+    if(!__atomic_compare_exchange_n(mutex, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return EBUSY;
     }
 
-    e = 0;
-    sc_do_locking_lock_mutex(*mutex, 1, &e);
-    return e;
+    return 0;
 }
 
 int pthread_mutex_unlock (pthread_mutex_t *mutex) {
-    uint64_t e = 0;
-    sc_do_locking_unlock_mutex(*mutex, &e);
+    if(__atomic_fetch_sub(mutex, 1, __ATOMIC_RELEASE) == 1) {
+        return 0;
+    }
+
+    __atomic_store_n(mutex, 0, __ATOMIC_RELEASE);
+
+    uint64_t woken, e = 0;
+    sc_do_locking_futex_wake(mutex, 1, &woken, &e);
     return e;
 }
 
@@ -63,10 +87,12 @@ int pthread_mutexattr_destroy(pthread_mutexattr_t *attr) {
 }
 
 int pthread_mutexattr_settype(pthread_mutexattr_t *attr, int type) {
-    if(
-        type != PTHREAD_MUTEX_DEFAULT &&
-        type != PTHREAD_MUTEX_RECURSIVE
-    ) {
+    // the futex word has no room for an owner and lock count
+    if(type == PTHREAD_MUTEX_RECURSIVE) {
+        return ENOTSUP;
+    }
+
+    if(type != PTHREAD_MUTEX_DEFAULT) {
         return EINVAL;
     }
 
@@ -0,0 +1,84 @@
+#include <pthread.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#include <sys/syscalls.h>
+
+int pthread_rwlock_init (pthread_rwlock_t *rwlock, const pthread_rwlockattr_t *attr) {
+    // XXX: do something with the attributes
+
+    uint64_t e = 0;
+    sc_do_locking_create_rwlock(rwlock, &e);
+    return e;
+}
+
+int pthread_rwlock_destroy (pthread_rwlock_t *rwlock) {
+    uint64_t e = 0;
+    sc_do_locking_destroy_rwlock(*rwlock, &e);
+    return e;
+}
+
+/* Statically initialized rwlocks get their kernel object on first use. Racing
+ * threads may each create one, only the first one is published and the
+ * others are destroyed again. */
+static int __pthread_ensure_rwlock(pthread_rwlock_t* rwlock) {
+    if(__atomic_load_n(rwlock, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    pthread_rwlock_t created;
+    int e = pthread_rwlock_init(&created, 0);
+
+    if(e) {
+        return e;
+    }
+
+    pthread_rwlock_t expected = 0;
+
+    if(!__atomic_compare_exchange_n(rwlock, &expected, created, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        pthread_rwlock_destroy(&created);
+    }
+
+    return 0;
+}
+
+static int __pthread_rwlock_lock(pthread_rwlock_t *rwlock, bool write, bool trylock) {
+    uint64_t e = 0;
+    if((e = __pthread_ensure_rwlock(rwlock))) {
+        return e;
+    }
+
+    e = 0;
+    sc_do_locking_lock_rwlock(*rwlock, write, trylock, &e);
+    return e;
+}
+
+int pthread_rwlock_rdlock (pthread_rwlock_t *rwlock) {
+    return __pthread_rwlock_lock(rwlock, false, false);
+}
+
+int pthread_rwlock_tryrdlock (pthread_rwlock_t *rwlock) {
+    return __pthread_rwlock_lock(rwlock, false, true);
+}
+
+int pthread_rwlock_wrlock (pthread_rwlock_t *rwlock) {
+    return __pthread_rwlock_lock(rwlock, true, false);
+}
+
+int pthread_rwlock_trywrlock (pthread_rwlock_t *rwlock) {
+    return __pthread_rwlock_lock(rwlock, true, true);
+}
+
+int pthread_rwlock_unlock (pthread_rwlock_t *rwlock) {
+    uint64_t e = 0;
+    sc_do_locking_unlock_rwlock(*rwlock, &e);
+    return e;
+}
+
+int pthread_rwlockattr_init(pthread_rwlockattr_t *attr) {
+    return 0;
+}
+
+int pthread_rwlockattr_destroy(pthread_rwlockattr_t *attr) {
+    return 0;
+}
@@ -0,0 +1,47 @@
+#include <semaphore.h>
+#include <errno.h>
+
+#include <sys/syscalls.h>
+
+/* Unlike the pthread functions, these return -1 and set errno on error. */
+
+static int __sem_result(uint64_t e) {
+    if(e) {
+        errno = e;
+        return -1;
+    }
+
+    return 0;
+}
+
+int sem_init (sem_t *sem, int pshared, unsigned int value) {
+    // all semaphores are kernel objects, shared between processes anyway
+
+    uint64_t e = 0;
+    sc_do_locking_create_semaphore(value, sem, &e);
+    return __sem_result(e);
+}
+
+int sem_destroy (sem_t *sem) {
+    uint64_t e = 0;
+    sc_do_locking_destroy_semaphore(*sem, &e);
+    return __sem_result(e);
+}
+
+int sem_wait (sem_t *sem) {
+    uint64_t e = 0;
+    sc_do_locking_wait_semaphore(*sem, false, &e);
+    return __sem_result(e);
+}
+
+int sem_trywait (sem_t *sem) {
+    uint64_t e = 0;
+    sc_do_locking_wait_semaphore(*sem, true, &e);
+    return __sem_result(e);
+}
+
+int sem_post (sem_t *sem) {
+    uint64_t e = 0;
+    sc_do_locking_post_semaphore(*sem, &e);
+    return __sem_result(e);
+}